@@ -0,0 +1,290 @@
+#!/bin/bash
+
+# Query plan regression check for the statements in src/schema.c.
+#
+# Builds databases of several sizes, runs EXPLAIN QUERY PLAN for each
+# statement and fails if files_tags or dirs_tags is scanned where an
+# index is expected; then times each statement at every size and flags
+# growth that is worse than linear.
+#
+# usage: ./plancheck.sh [sizes...]
+
+SIZES=${*:-2000 8000 32000}
+ITERATIONS=20
+CC=${CC:-cc}
+
+# statements that are expected to visit every row of files_tags or
+# dirs_tags; anything else must go through an index
+EXPECT_SCAN="\
+BEHOLDDB_DDL_FAST_LOCATE_START \
+BEHOLDDB_DML_TAG_LISTING \
+BEHOLDDB_DML_TAG_LISTING_FROM \
+"
+
+STATEMENTS="\
+BEHOLDDB_DML_LOCATE \
+BEHOLDDB_DDL_FAST_LOCATE_START \
+BEHOLDDB_DML_FAST_LOCATE \
+BEHOLDDB_DDL_FAST_LOCATE_STOP \
+BEHOLDDB_DML_TAG_LISTING \
+BEHOLDDB_DML_TAG_LISTING_FROM \
+BEHOLDDB_DML_PREFIX_TAG_LISTING \
+BEHOLDDB_DML_PREFIX_TAG_LISTING_FROM \
+BEHOLDDB_DML_FILE_TAG_LISTING \
+BEHOLDDB_DML_MARK_INCLUDE \
+BEHOLDDB_DML_MARK_EXCLUDE \
+BEHOLDDB_DML_MARK_DIRS_INCLUDE \
+BEHOLDDB_DML_MARK_DIRS_EXCLUDE \
+BEHOLDDB_DML_UNUSED_TAGS \
+BEHOLDDB_DML_UNIVERSAL_TAGS \
+BEHOLDDB_DML_CREATE_INCLUDE \
+BEHOLDDB_DML_CREATE_EXCLUDE \
+BEHOLDDB_DML_RETAG_REPLACE \
+BEHOLDDB_DML_RETAG_INCLUDE \
+BEHOLDDB_DML_RETAG_EXCLUDE \
+BEHOLDDB_DML_RETAG_CHANGED \
+BEHOLDDB_DML_RETAG_USED \
+BEHOLDDB_DML_RETAG_NOT_UNIVERSAL \
+BEHOLDDB_DML_RETAG_UNUSED_TAGS \
+BEHOLDDB_DML_DELETE_FILE \
+BEHOLDDB_DML_DELETE_UNUSED_TAGS \
+BEHOLDDB_DML_RESET_FILES_TAGS \
+BEHOLDDB_DDL_BATCH \
+BEHOLDDB_DML_BATCH_TOUCH \
+BEHOLDDB_DML_BATCH_USED \
+BEHOLDDB_DML_BATCH_UNUSED \
+BEHOLDDB_DML_BATCH_UNIVERSAL \
+BEHOLDDB_DML_BATCH_NOT_UNIVERSAL \
+BEHOLDDB_DML_MOVE_TAGS \
+BEHOLDDB_DML_MOVE_INCLUDE \
+BEHOLDDB_DML_MOVE_DIRS_INCLUDE \
+BEHOLDDB_DML_MOVE_DELETE \
+BEHOLDDB_DML_MOVE_UNUSED_TAGS \
+BEHOLDDB_DML_MOVE_UNIVERSAL_TAGS \
+BEHOLDDB_DML_MOVE_DELETE_UNUSED_TAGS \
+BEHOLDDB_DML_FSCK_ORPHANS \
+BEHOLDDB_DML_FSCK_UNTRACKED \
+BEHOLDDB_DML_FSCK_DIR \
+BEHOLDDB_DML_FSCK_FILES_TAGS \
+BEHOLDDB_DML_FSCK_DIRS_TAGS \
+BEHOLDDB_DML_FSCK_CLEAR_FILES_TAGS \
+BEHOLDDB_DML_FSCK_CLEAR_DIRS_TAGS \
+BEHOLDDB_DML_FSCK_COUNTERS \
+BEHOLDDB_DML_FSCK_SUMMARY \
+BEHOLDDB_DML_FSCK_UNUSED_TAGS \
+BEHOLDDB_DML_FSCK_WEAK \
+BEHOLDDB_DML_FSCK_STRONG \
+BEHOLDDB_DML_RECONCILE_UNUSED \
+BEHOLDDB_DML_RECONCILE_NOT_UNIVERSAL \
+"
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# print the statements straight from schema.c so the check never
+# drifts from what the daemon runs
+dump_schema()
+{
+	{
+		echo '#include <stdio.h>'
+		echo '#include <sqlite3.h>'
+		echo '#include "schema.h"'
+		echo 'int beholddb_exec(sqlite3 *db, const char *sql) { return 0; }'
+		echo 'int main(int argc, char **argv)'
+		echo '{'
+		for name in BEHOLDDB_DDL_CREATE_TABLES BEHOLDDB_DDL_CREATE_INDEXES \
+			BEHOLDDB_DDL_CREATE_TRIGGERS BEHOLDDB_DDL_FILES_TAGS BEHOLDDB_DDL_DIRS_TAGS $STATEMENTS; do
+			echo "	printf(\"%s\\t%s\\n\", \"$name\", $name);"
+		done
+		echo '	return 0;'
+		echo '}'
+	} > "$TMP/dump.c"
+	$CC -std=gnu99 -fms-extensions -Isrc -o "$TMP/dump" "$TMP/dump.c" src/schema.c -lsqlite3 &&
+	"$TMP/dump" > "$TMP/schema.tsv"
+}
+
+statement()
+{
+	awk -F '\t' -v name="$1" '$1 == name { print $2 }' "$TMP/schema.tsv"
+}
+
+# files get 1-4 tags each, popular tags (low ids) much more often;
+# every 20th file is a directory carrying the tags of its contents
+generate()
+{
+	local FILES=$1 TAGS=$(( 50 + $1 / 100 ))
+
+	sqlite3 "$TMP/db-$FILES" <<-EOF
+		$(statement BEHOLDDB_DDL_CREATE_TABLES)
+		$(statement BEHOLDDB_DDL_CREATE_INDEXES)
+		$(statement BEHOLDDB_DDL_CREATE_TRIGGERS)
+		begin;
+		with recursive n(i) as ( select 1 union all select i + 1 from n where i < $TAGS )
+		insert into tags ( id, name ) select i, 'tag' || i from n;
+		with recursive n(i) as ( select 1 union all select i + 1 from n where i < $FILES )
+		insert into files ( id, type, name ) select i, i % 20 = 0, 'f' || i from n;
+		with k(j) as ( values (1), (2), (3), (4) )
+		insert into files_tags ( id_file, id_tag )
+		select f.id, 1 + abs(random()) % (1 + abs(random()) % $TAGS) from files f join k where j <= 1 + f.id % 4;
+		insert into dirs_tags ( id_file, id_tag )
+		select ft.id_file, ft.id_tag from files_tags ft join files f on f.id = ft.id_file where f.type;
+		commit;
+		analyze;
+	EOF
+}
+
+# temp tables as beholddb sets them up for %tag1%tag2%-tag3
+setup()
+{
+	echo "$(statement BEHOLDDB_DDL_FILES_TAGS)"
+	echo "$(statement BEHOLDDB_DDL_DIRS_TAGS)"
+	echo "insert into include select id, name from tags where id in ( 1, 2 );"
+	echo "insert into exclude select id, name from tags where id = 3;"
+	echo "insert into dirs_include select id, name from tags where id = 1;"
+	echo "insert into dirs_exclude select id, name from tags where id = 3;"
+	echo ".parameter set ?1 'f42'"
+	echo ".parameter set ?2 0"
+	echo ".parameter set ?3 'tag1*'"
+}
+
+# statements that work on what another statement leaves behind; moves
+# read from the database itself attached as the source
+prepare()
+{
+	case "$1" in
+	BEHOLDDB_DML_FAST_LOCATE|BEHOLDDB_DDL_FAST_LOCATE_STOP)
+		echo "$(statement BEHOLDDB_DDL_FAST_LOCATE_START);" ;;
+	BEHOLDDB_DML_MOVE_*)
+		echo "attach database '$2' as src;" ;;
+	BEHOLDDB_DML_BATCH_*)
+		echo "$(statement BEHOLDDB_DDL_BATCH)" ;;
+	BEHOLDDB_DML_FSCK_*)
+		# what the sqlitefs module would list, without the module
+		echo "create temp table fsck_entries ( name text primary key, type integer not null );"
+		echo "insert into fsck_entries select name, type from files;" ;;
+	esac
+}
+
+# a statement string may hold several statements; ddl is run, the
+# rest is explained
+explain()
+{
+	local SQL
+
+	statement "$1" | tr ';' '\n' | while read -r SQL; do
+		[ -z "$SQL" ] && continue
+		case "$SQL" in
+		create*|drop*)
+			echo "$SQL;" ;;
+		*)
+			echo "explain query plan $SQL;" ;;
+		esac
+	done
+}
+
+check_plans()
+{
+	local DB=$1 FAILED=0 PLAN name
+
+	for name in $STATEMENTS; do
+		PLAN=$( { setup; prepare $name "$DB"; explain $name; } | sqlite3 "$DB" 2>&1 )
+		if echo "$PLAN" | grep -qi 'error'; then
+			echo "$name: FAILED"
+			echo "$PLAN" | sed 's/^/	/'
+			FAILED=1
+			continue
+		fi
+		case " $EXPECT_SCAN " in
+		*" $name "*)
+			echo "$name: scan expected" ;;
+		*)
+			# indexed lookups show up as SEARCH; a SCAN, even of a
+			# covering index, visits every row
+			if echo "$PLAN" | grep -Eq 'SCAN (files_tags|dirs_tags|ft|dt)( |$)'; then
+				echo "$name: FAILED, unexpected scan"
+				echo "$PLAN" | sed 's/^/	/'
+				FAILED=1
+			else
+				echo "$name: ok"
+			fi ;;
+		esac
+	done
+	return $FAILED
+}
+
+# total milliseconds of $ITERATIONS runs of a statement, rolled back
+timing()
+{
+	local DB=$1 name=$2 SQL i
+
+	SQL=$(statement $name)
+	{
+		setup
+		prepare $name "$DB"
+		case "$name" in
+		*_DDL_*) ;;
+		*)
+			echo "begin;"
+			echo ".timer on"
+			for (( i = 0; i < $ITERATIONS; ++i )); do
+				echo "$SQL;"
+			done
+			echo ".timer off"
+			echo "rollback;" ;;
+		esac
+	} | sqlite3 "$DB" 2>/dev/null |
+		awk '/^Run Time:/ { ms += $4 * 1000 } END { printf "%.1f\n", ms }'
+}
+
+check_growth()
+{
+	local FAILED=0 name size prev_size prev_time time ratio
+
+	printf "%-36s" "statement (ms per $ITERATIONS runs)"
+	for size in $SIZES; do
+		printf "%10s" $size
+	done
+	echo
+
+	for name in $STATEMENTS; do
+		case "$name" in
+		*_DDL_*) continue ;;
+		esac
+
+		local FLAG=""
+
+		printf "%-36s" $name
+		prev_size=
+		for size in $SIZES; do
+			time=$(timing "$TMP/db-$size" $name)
+			printf "%10s" $time
+			# ignore noise below 5 ms; allow twice the linear growth
+			if [ -n "$prev_size" ] && awk -v t=$time -v p=$prev_time -v s=$size -v q=$prev_size \
+				'BEGIN { exit !(t > 5 && t > 2 * p * s / q) }'; then
+				FLAG=" SUPERLINEAR"
+			fi
+			prev_size=$size
+			prev_time=$time
+		done
+		echo "$FLAG"
+		[ -n "$FLAG" ] && FAILED=1
+	done
+	return $FAILED
+}
+
+dump_schema || exit 2
+
+for size in $SIZES; do
+	generate $size || exit 2
+done
+
+RESULT=0
+
+echo "query plans:"
+check_plans "$TMP/db-${SIZES##* }" || RESULT=1
+
+echo
+echo "timing:"
+check_growth || RESULT=1
+
+exit $RESULT
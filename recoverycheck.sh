@@ -0,0 +1,97 @@
+#!/bin/bash
+
+# Crash recovery check for renames between directories.
+#
+# Tags a file, records the intent of moving it to another directory,
+# crashes at a chosen point of the rename and mounts again; recovery
+# must leave the file with its tags under whichever name it has.
+#
+# usage: ./recoverycheck.sh
+
+CC=${CC:-cc}
+SOURCES="beholddb.c schema.c version.c log.c stats.c profile.c fs.c common.c dirstream.c tagexpr.c"
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# each step runs in a process of its own, as a mount would
+build()
+{
+	cat > "$TMP/step.c" <<-'EOF'
+		#include <stdio.h>
+		#include <stdlib.h>
+		#include <string.h>
+		#include <unistd.h>
+		#include "beholddb.h"
+
+		extern char beholddb_tagchar;
+
+		static beholddb_path *parse(const char *path)
+		{
+			beholddb_path *bpath;
+
+			if (beholddb_parse_path(path, &bpath))
+				exit(2);
+			return bpath;
+		}
+
+		int main(int argc, char **argv)
+		{
+			int64_t intent;
+
+			beholddb_tagchar = '%';
+			if (chdir(argv[1]))
+				return 2;
+			if (!strcmp(argv[2], "setup"))
+			{
+				beholddb_create_file(parse("/a"), 1);
+				beholddb_create_file(parse("/c"), 1);
+				return beholddb_create_file(parse("/a/%t/f"), 0);
+			}
+			if (!strcmp(argv[2], "crash"))
+			{
+				// what beholdfs_rename does, up to a crash after rename(2)
+				beholddb_free_path(parse("/a/f"));
+				beholddb_free_path(parse("/c/f"));
+				beholddb_intent_begin("/a/f", "/c/f", &intent);
+				if (!strcmp(argv[3], "after") && rename("a/f", "c/f"))
+					return 2;
+				_exit(0);
+			}
+			if (!strcmp(argv[2], "recover"))
+				return beholddb_recover();
+			return 2;
+		}
+	EOF
+	(cd src && $CC -std=gnu99 -fms-extensions -w -I. -o "$TMP/step" "$TMP/step.c" $SOURCES -lsqlite3 -lpthread)
+}
+
+tags()
+{
+	sqlite3 "$TMP/root/$1/.beholdfs" \
+		"select f.name, t.name from files f join files_tags ft on ft.id_file = f.id join tags t on t.id = ft.id_tag order by 1, 2"
+}
+
+# crash at $1 (before or after rename(2)); the file must end up in $2
+check()
+{
+	rm -rf "$TMP/root"
+	mkdir -p "$TMP/root/a" "$TMP/root/c"
+	touch "$TMP/root/a/f"
+	"$TMP/step" "$TMP/root" setup &&
+	"$TMP/step" "$TMP/root" crash "$1" &&
+	"$TMP/step" "$TMP/root" recover || { echo "crash $1 rename: step failed"; return 1; }
+
+	local found=$(tags "$2")
+	if [ "$found" != "f|t" ]; then
+		echo "crash $1 rename: expected f|t in $2, found '$found'"
+		return 1
+	fi
+	echo "crash $1 rename: ok"
+}
+
+build || exit 1
+failed=0
+check before a || failed=1
+check after c || failed=1
+exit $failed
@@ -18,6 +18,9 @@
 */
 
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,13 +28,25 @@
 #include <syslog.h>
 
 #include "beholddb.h"
+#include "common.h"
 #include "fs.h"
+#include "log.h"
+#include "profile.h"
 #include "schema.h"
+#include "stats.h"
+#include "version.h"
 
 struct beholddb_dir
 {
 	sqlite3 *db;
 	sqlite3_stmt *stmt;
+	int listing;
+	int deep;
+	// a tag listing restarts from one of these
+	const char *listing_sql;
+	const char *listing_from_sql;
+	// only the tags that begin with it are listed
+	char *prefix;
 };
 
 typedef struct beholddb_dir beholddb_dir;
@@ -39,6 +54,34 @@ typedef struct beholddb_dir beholddb_dir;
 char beholddb_tagchar;
 int beholddb_new_locate;
 static const char BEHOLDDB_NAME[] = ".beholdfs";
+static const char BEHOLDDB_INTENT_NAME[] = "./.beholdfs-intent";
+static const char BEHOLDDB_RULES_NAME[] = "./.beholdfs-rules";
+
+// the closure of the tag implication rules, sorted by the implied tag,
+// as views are parsed against it
+typedef struct beholddb_implied
+{
+	char *implies;
+	char *tag;
+} beholddb_implied;
+
+static pthread_rwlock_t beholddb_rules_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t beholddb_rules_mutex = PTHREAD_MUTEX_INITIALIZER;
+static beholddb_implied *beholddb_rules;
+static int beholddb_rules_count;
+
+// number of ancestors updated by the current create/delete
+static __thread int beholddb_propagated;
+
+// the intent of the rename in progress on this thread, if any
+static __thread int64_t beholddb_intent;
+
+// set while recovery replays the marks of a move: a crash may have left
+// any ancestor behind, so the whole chain is visited
+static __thread int beholddb_replaying;
+
+// set while recovery replays the intents, before any operation runs
+static int beholddb_recovering;
 
 
 static void beholddb_insert_tag(beholddb_tag_list_item **phead, const char *name)
@@ -63,9 +106,130 @@ static void beholddb_free_tag_list(beholddb_tag_list *list)
 		beholddb_delete_tag(phead);
 }
 
+// a group that has no alternatives after all, %(a)%-(b|c), is plain tags
+static int beholddb_plain_group(beholddb_path *bpath, tagexpr *group)
+{
+	if (TAGEXPR_OR == group->op || group->pattern)
+		return 0;
+	for (tagexpr *child = group->child; child; child = child->next)
+		if (TAGEXPR_TAG != child->op || child->pattern)
+			return 0;
+
+	for (tagexpr *tag = group->child ? group->child : group; tag; tag = tag->next)
+	{
+		beholddb_insert_tag(tag->negate ? &bpath->exclude.head : &bpath->include.head, tag->name);
+		tag->name = NULL;
+	}
+	tagexpr_free(group);
+	return 1;
+}
+
+// the first of the tags that imply name, if any
+static const beholddb_implied *beholddb_find_implied(const char *name)
+{
+	int low = 0, high = beholddb_rules_count;
+
+	while (low < high)
+	{
+		int middle = (low + high) / 2;
+
+		if (strcmp(beholddb_rules[middle].implies, name) < 0)
+			low = middle + 1; else
+			high = middle;
+	}
+	return low < beholddb_rules_count && !strcmp(beholddb_rules[low].implies, name) ?
+		&beholddb_rules[low] : NULL;
+}
+
+static int beholddb_list_implied(const beholddb_tag_list *list)
+{
+	for (beholddb_tag_list_item *item = list->head; item; item = item->next)
+		if (beholddb_find_implied(item->name))
+			return 1;
+	return 0;
+}
+
+// a tag that others imply stands for any of them, %animal for
+// %(animal|cat|dog); the closure has them all, so one level does
+static void beholddb_imply(tagexpr *expr)
+{
+	for (; expr; expr = expr->next)
+	{
+		const beholddb_implied *implied;
+
+		if (TAGEXPR_TAG != expr->op)
+		{
+			beholddb_imply(expr->child);
+			continue;
+		}
+		if (expr->pattern || !(implied = beholddb_find_implied(expr->name)))
+			continue;
+
+		tagexpr *tags = tagexpr_new(TAGEXPR_TAG, 0, expr->name, strlen(expr->name), NULL);
+		tagexpr **ptail = &tags->next;
+
+		for (const beholddb_implied *end = beholddb_rules + beholddb_rules_count;
+			implied < end && !strcmp(implied->implies, expr->name); ++implied)
+		{
+			*ptail = tagexpr_new(TAGEXPR_TAG, 0, implied->tag, strlen(implied->tag), NULL);
+			ptail = &(*ptail)->next;
+		}
+		free(expr->name);
+		expr->name = NULL;
+		expr->op = TAGEXPR_OR;
+		expr->child = tags;
+	}
+}
+
+static void beholddb_set_groups(beholddb_path *bpath, tagexpr *groups)
+{
+	tagexpr *operands = NULL, **ptail = &operands;
+
+	for (tagexpr *group = groups, *next; group; group = next)
+	{
+		next = group->next;
+		group->next = NULL;
+		group = tagexpr_normalize(group);
+		if (!beholddb_plain_group(bpath, group))
+		{
+			*ptail = group;
+			ptail = &group->next;
+		}
+	}
+
+	pthread_rwlock_rdlock(&beholddb_rules_lock);
+
+	// plain tags that no rule implies are a view of their own
+	if (!operands && !(beholddb_rules_count &&
+		(beholddb_list_implied(&bpath->include) || beholddb_list_implied(&bpath->exclude))))
+	{
+		pthread_rwlock_unlock(&beholddb_rules_lock);
+		return;
+	}
+	bpath->implied = !operands;
+
+	for (beholddb_tag_list_item *item = bpath->include.head; item; item = item->next)
+	{
+		*ptail = tagexpr_new(TAGEXPR_TAG, 0, item->name, strlen(item->name), NULL);
+		ptail = &(*ptail)->next;
+	}
+	for (beholddb_tag_list_item *item = bpath->exclude.head; item; item = item->next)
+	{
+		*ptail = tagexpr_new(TAGEXPR_TAG, 1, item->name, strlen(item->name), NULL);
+		ptail = &(*ptail)->next;
+	}
+	beholddb_imply(operands);
+	pthread_rwlock_unlock(&beholddb_rules_lock);
+	bpath->expr = tagexpr_normalize(tagexpr_new(TAGEXPR_AND, 0, NULL, 0, operands));
+}
+
+static int beholddb_check_directory(const char *dir, int write);
+static int beholddb_check_file(const beholddb_path *bpath, int write);
+static int beholddb_open_metadata_read(const char *dir, sqlite3 **pdb);
+
 int beholddb_parse_path(const char *path, beholddb_path **pbpath)
 {
-	syslog(LOG_DEBUG, "beholddb_parse_path(path=%s)", path);
+	log_debug("beholddb_parse_path(path=%s)", path);
 
 	int pathlen = strlen(path);
 	beholddb_path *bpath = (beholddb_path*)malloc(sizeof(beholddb_path));
@@ -75,13 +239,21 @@ int beholddb_parse_path(const char *path, beholddb_path **pbpath)
 	bpath->basename = NULL;
 	bpath->include.head = bpath->exclude.head = NULL;
 	bpath->listing = 0;
+	bpath->deep = NULL;
+	bpath->expr = NULL;
+	bpath->implied = 0;
+	bpath->prefix = NULL;
+
+	const char *view = NULL;
+	int viewlen = 0;
+	tagexpr *groups = NULL, **pgroups = &groups;
 
 	*pathptr++ = '.';
 	while (*path)
 	{
 		if ('/' != *path++)
 		{
-			syslog(LOG_DEBUG, "beholddb_parse_path: path is relative");
+			log_debug("beholddb_parse_path: path is relative");
 			beholddb_free_path(bpath);
 			*pbpath = NULL;
 			return BEHOLDDB_ERROR;
@@ -89,6 +261,23 @@ int beholddb_parse_path(const char *path, beholddb_path **pbpath)
 		switch (*path)
 		{
 		default:
+			if (bpath->deep)
+			{
+				// entries of a deep view are named by the view, tag
+				// character or not; the view itself stays in the real
+				// path, so that nothing real is found there
+				if (view)
+				{
+					*pathptr++ = '/';
+					memcpy(pathptr, view, viewlen);
+					pathptr += viewlen;
+					view = NULL;
+				}
+				*pathptr++ = '/';
+				bpath->basename = pathptr;
+				while (*path && '/' != *path)
+					*pathptr++ = *path++;
+			} else
 			if (beholddb_tagchar != *path)
 			{
 				*pathptr++ = '/';
@@ -96,38 +285,89 @@ int beholddb_parse_path(const char *path, beholddb_path **pbpath)
 				while (*path && '/' != *path)
 					*pathptr++ = *path++;
 			} else
-			do
 			{
-				// skip hash sign
-				++path;
-
-				// handle hash directory
-				while ('/' == *path)
-					++path;
-
-				// handle empty tag
-				if (!*path)
+				if (beholddb_tagchar == path[1])
 				{
-					bpath->listing = 1;
-					break;
+					bpath->deep = pathptr;
+					view = path;
+					viewlen = strcspn(path, "/");
+
+					// no tags, every file below; %%% lists every tag
+					if (!*(path += 2) || '/' == *path)
+						break;
+					if (beholddb_tagchar != *path)
+						--path;
 				}
-
-				// handle tag type
-				beholddb_tag_list *list = '-' == *path ? ++path, &bpath->exclude : &bpath->include;
-				const char *tag = path;
-
-				// handle tag name
-				while (*path && '/' != *path && beholddb_tagchar != *path)
+				do
+				{
+					// skip hash sign
 					++path;
 
-				// add new tag to the list
-				char *name = (char*)malloc(path - tag + 1);
-
-				memcpy(name, tag, path - tag);
-				name[path - tag] = 0;
-				beholddb_insert_tag(&list->head, name);
-
-			} while (beholddb_tagchar == *path);
+					// handle hash directory
+					while ('/' == *path)
+						++path;
+
+					// handle empty tag
+					if (!*path)
+					{
+						bpath->listing = 1;
+						break;
+					}
+
+					// handle listing of the tags with a prefix
+					if ('=' == *path)
+					{
+						const char *prefix = ++path;
+
+						while (*path && '/' != *path && beholddb_tagchar != *path)
+							++path;
+						free(bpath->prefix);
+						bpath->prefix = strndup(prefix, path - prefix);
+						bpath->listing = 1;
+						continue;
+					}
+
+					// handle tag type
+					beholddb_tag_list *list = '-' == *path ? ++path, &bpath->exclude : &bpath->include;
+					const char *tag = path;
+					tagexpr *group;
+
+					// handle group; one that does not parse is a tag name
+					if (!tagexpr_parse(&tag, beholddb_tagchar, &group))
+					{
+						if (!*tag || '/' == *tag || beholddb_tagchar == *tag)
+						{
+							group->negate ^= list == &bpath->exclude;
+							*pgroups = group;
+							pgroups = &group->next;
+							path = tag;
+							continue;
+						}
+						tagexpr_free(group);
+						tag = path;
+					}
+
+					// handle tag name
+					while (*path && '/' != *path && beholddb_tagchar != *path)
+						++path;
+
+					// a pattern stands for any of the tags it matches
+					if (memchr(tag, '*', path - tag) || memchr(tag, '?', path - tag))
+					{
+						*pgroups = tagexpr_new(TAGEXPR_TAG, list == &bpath->exclude, tag, path - tag, NULL);
+						pgroups = &(*pgroups)->next;
+						continue;
+					}
+
+					// add new tag to the list
+					char *name = (char*)malloc(path - tag + 1);
+
+					memcpy(name, tag, path - tag);
+					name[path - tag] = 0;
+					beholddb_insert_tag(&list->head, name);
+
+				} while (beholddb_tagchar == *path);
+			}
 
 		case '/':
 			; // remove redundant slashes
@@ -139,17 +379,33 @@ int beholddb_parse_path(const char *path, beholddb_path **pbpath)
 	// null terminate path
 	*pathptr++ = 0;
 
-	syslog(LOG_DEBUG, "beholddb_parse_path: realpath=%s", bpath->realpath);
+	beholddb_set_groups(bpath, groups);
+
+	// every operation parses its paths first, so this is the first access
+	// to the directory since mount, before the operation changes it
+	if (!bpath->deep)
+	{
+		if (bpath->basename)
+			beholddb_check_file(bpath, 0); else
+			beholddb_check_directory(bpath->realpath, 0);
+	}
+
+	log_debug("beholddb_parse_path: realpath=%s", bpath->realpath);
 	*pbpath = bpath;
 	return BEHOLDDB_OK;
 }
 
 int beholddb_free_path(beholddb_path *bpath)
 {
-	syslog(LOG_DEBUG, "beholddb_free_path(realpath=%s)", bpath->realpath);
+	if (!bpath)
+		return BEHOLDDB_OK;
+
+	log_debug("beholddb_free_path(realpath=%s)", bpath->realpath);
 
 	beholddb_free_tag_list(&bpath->include);
 	beholddb_free_tag_list(&bpath->exclude);
+	tagexpr_free(bpath->expr);
+	free(bpath->prefix);
 
 	free((char*)bpath->realpath);
 	free(bpath);
@@ -164,13 +420,13 @@ static int beholddb_get_name(const beholddb_path *bpath, char **pdb_name)
 	}
 
 	int pathlen = bpath->basename - bpath->realpath;
-	syslog(LOG_DEBUG, "beholddb_get_name: realpath=%p, basename=%p, pathlen=%d", bpath->realpath, bpath->basename, pathlen);
+	log_debug("beholddb_get_name: realpath=%p, basename=%p, pathlen=%d", bpath->realpath, bpath->basename, pathlen);
 
 	*pdb_name = (char*)malloc(pathlen + sizeof(BEHOLDDB_NAME));
 	memcpy(*pdb_name, bpath->realpath, pathlen);
 	memcpy(*pdb_name + pathlen, BEHOLDDB_NAME, sizeof(BEHOLDDB_NAME));
 
-	syslog(LOG_DEBUG, "beholddb_get_name: db_name=%s", *pdb_name);
+	log_debug("beholddb_get_name: db_name=%s", *pdb_name);
 	return BEHOLDDB_OK;
 }
 
@@ -178,7 +434,7 @@ int beholddb_exec(sqlite3 *db, const char *sql)
 {
 	char *err;
 	int rc = sqlite3_exec(db, sql, NULL, NULL, &err);
-	syslog(LOG_DEBUG, "beholddb_exec: sql=%s, rc=%d, err=%s", sql, rc, err ? err : "ok");
+	log_debug("beholddb_exec: sql=%s, rc=%d, err=%s", sql, rc, err ? err : "ok");
 	sqlite3_free(err);
 	return rc;
 }
@@ -187,53 +443,249 @@ static int beholddb_init(sqlite3 *db)
 {
 	//sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_FKEY, 1, NULL);
 	beholddb_exec(db, "pragma foreign_keys = on;");
+	// a journal that comes and goes would change the directory it lives
+	// in at every commit and void its stamp
+	beholddb_exec(db, "pragma journal_mode = persist;");
 	sqlite3_extended_result_codes(db, 1);
-	syslog(LOG_DEBUG, "beholddb_init: ok");
+	profile_attach(db);
+	log_debug("beholddb_init: ok");
 	return SQLITE_OK; // TODO: handle errors
 }
 
 static int beholddb_create_tables(sqlite3 *db)
 {
-	return beholddb_exec(db,
-		"create table if not exists files "
-		"("
-			"id integer primary key,"
-			"type integer not null,"
-			"name text unique on conflict ignore"
-		");"
-		"create table if not exists tags"
-		"("
-			"id integer primary key,"
-			"name text unique on conflict ignore"
-		");"
-		"create table if not exists files_tags"
-		"("
-			//"id integer primary key,"
-			"id_file integer not null references files(id) on delete cascade,"
-			"id_tag integer not null references tags(id),"// on delete cascade,"
-			"unique ( id_file, id_tag ) on conflict ignore"
-		");"
-		"create table if not exists dirs_tags"
-		"("
-			//"id integer primary key,"
-			"id_file integer not null references files(id) on delete cascade,"
-			"id_tag integer not null references tags(id),"// on delete cascade,"
-			"unique ( id_file, id_tag ) on conflict ignore"
-		");"
-		"create view if not exists strong_tags as "
-			"select dt.*, 1 type from dirs_tags dt "
-			"union "
-			"select ft.*, 0 type from files_tags ft "
-			"join files f on f.id = ft.id_file "
-			"where not f.type;");
+	int rc;
+
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_CREATE_TABLES)) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_CREATE_INDEXES)) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_CREATE_TRIGGERS));
+
+	return rc;
+}
+
+// with -o central, the metadata of every directory lives in one database
+// at the root, and the statements written for a directory database run
+// against temp views of the directory entered last (see
+// BEHOLDDB_DDL_CENTRAL_VIEWS); operations nest, and would wait on each
+// other's locks, so each thread keeps one connection that they share
+// along with its transaction
+int beholddb_central;
+static const char BEHOLDDB_CENTRAL_NAME[] = "./.beholdfs-central";
+
+#define BEHOLDDB_CENTRAL_BUSY_TIMEOUT	5000
+
+typedef struct beholddb_central_conn
+{
+	sqlite3 *db;
+	int depth;		// directories entered
+	int savepoints;		// transactions begun inside another
+} beholddb_central_conn;
+
+static pthread_once_t beholddb_central_once = PTHREAD_ONCE_INIT;
+static pthread_key_t beholddb_central_key;
+static __thread beholddb_central_conn *beholddb_central_self;
+
+// the header change counter is not kept up to date in wal mode, but every
+// write goes through this process while it is mounted
+static int64_t beholddb_central_generation;
+
+// with -o index, the plain files of the whole tree and their own tags
+// are kept in one more database at the root, for deep views (%%tag); a
+// directory database attaches it as idx to write it in the transaction
+// that changes the directory. It is in wal mode, so that the commit does
+// not leave a super-journal in the directory and void its stamp; the
+// commit is then atomic in each database but not across both, and a
+// crash may leave the index behind the directories: it is built again
+// at the next mount (see beholddb_index_init)
+int beholddb_index;
+static const char BEHOLDDB_INDEX_NAME[] = "./.beholdfs-index";
+static int64_t beholddb_index_generation;
+
+#define BEHOLDDB_INDEX_BUSY_TIMEOUT	5000
+
+static void beholddb_central_release(void *arg)
+{
+	beholddb_central_conn *conn = (beholddb_central_conn*)arg;
+
+	sqlite3_close(conn->db);
+	free(conn);
+}
+
+static void beholddb_central_create_key()
+{
+	pthread_key_create(&beholddb_central_key, beholddb_central_release);
+}
+
+// open (and create) the central database in the current directory
+int beholddb_open_central(sqlite3 **pdb)
+{
+	int rc, persist = 1;
+
+	if ((rc = sqlite3_open_v2(BEHOLDDB_CENTRAL_NAME, pdb,
+		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)))
+		return rc;
+
+	// readers must not hold up writers across the tree; the wal is kept,
+	// so that the root directory does not change at every open
+	beholddb_init(*pdb);
+	sqlite3_file_control(*pdb, "main", SQLITE_FCNTL_PERSIST_WAL, &persist);
+	(rc = sqlite3_busy_timeout(*pdb, BEHOLDDB_CENTRAL_BUSY_TIMEOUT)) ||
+	(rc = beholddb_exec(*pdb, "pragma journal_mode = wal;")) ||
+	(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CENTRAL_CREATE_TABLES)) ||
+	(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CENTRAL_CREATE_INDEXES)) ||
+	(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CENTRAL_CREATE_TRIGGERS)) ||
+	(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_FILES_TAGS)) ||
+	(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_DIRS_TAGS)) ||
+	(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CENTRAL_VIEWS));
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_open_central: %s", sqlite3_errmsg(*pdb));
+	return rc;
+}
+
+// id of a directory given by its real path ("." or "./a/b"), created
+// along with its parents if asked to; 0 if there is none
+static int beholddb_central_lookup(sqlite3 *db, const char *dir, int create, sqlite3_int64 *pid)
+{
+	int rc;
+	sqlite3_stmt *lookup = NULL, *mkdir = NULL;
+	sqlite3_int64 id = 1;
+
+	(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_CENTRAL_LOOKUP, -1, &lookup, NULL)) ||
+	create && (rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_CENTRAL_MKDIR, -1, &mkdir, NULL));
+
+	for (const char *name = dir; !rc && id && (name = strchr(name, '/')); name += strcspn(name, "/"))
+	{
+		sqlite3_int64 parent = id;
+		int len = strcspn(++name, "/");
+
+		(rc = sqlite3_reset(lookup)) ||
+		(rc = sqlite3_bind_int64(lookup, 1, parent)) ||
+		(rc = sqlite3_bind_text(lookup, 2, name, len, SQLITE_STATIC));
+		if (rc)
+			break;
+
+		rc = sqlite3_step(lookup);
+		if (SQLITE_ROW == rc)
+		{
+			id = sqlite3_column_int64(lookup, 0);
+			rc = SQLITE_OK;
+		} else
+		if (SQLITE_DONE == rc && !mkdir)
+		{
+			id = 0;
+			rc = SQLITE_OK;
+		} else
+		if (SQLITE_DONE == rc)
+		{
+			(rc = sqlite3_reset(mkdir)) ||
+			(rc = sqlite3_bind_int64(mkdir, 1, parent)) ||
+			(rc = sqlite3_bind_text(mkdir, 2, name, len, SQLITE_STATIC)) ||
+			SQLITE_DONE != (rc = sqlite3_step(mkdir)) ||
+			(rc = SQLITE_OK);
+			id = sqlite3_last_insert_rowid(db);
+		}
+	}
+
+	sqlite3_finalize(lookup);
+	sqlite3_finalize(mkdir);
+	*pid = id;
+	return rc;
+}
+
+// put a directory on top of the levels the views show, for tools to
+// work on the central database; SQLITE_CANTOPEN if there is none and it
+// is not to be created, as when there is no directory database
+int beholddb_central_enter(sqlite3 *db, const char *dir, int create)
+{
+	int rc;
+	sqlite3_int64 id;
+	sqlite3_stmt *stmt = NULL;
+
+	(rc = beholddb_central_lookup(db, dir, create, &id)) ||
+	!id && (rc = SQLITE_CANTOPEN) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_CENTRAL_CLEAR)) ||
+	(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_CENTRAL_ENTER, -1, &stmt, NULL)) ||
+	(rc = sqlite3_bind_int64(stmt, 1, id)) ||
+	SQLITE_DONE != (rc = sqlite3_step(stmt)) ||
+	(rc = SQLITE_OK);
+
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+int beholddb_central_leave(sqlite3 *db)
+{
+	int rc;
+
+	(rc = beholddb_exec(db, BEHOLDDB_DML_CENTRAL_LEAVE)) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_CENTRAL_CLEAR));
+	return rc;
+}
+
+// enter the directory of bpath on the connection of this thread
+static int beholddb_central_open(const beholddb_path *bpath, int create, sqlite3 **pdb)
+{
+	int rc;
+	beholddb_central_conn *conn = beholddb_central_self;
+
+	*pdb = NULL;
+	if (!conn)
+	{
+		pthread_once(&beholddb_central_once, beholddb_central_create_key);
+		conn = (beholddb_central_conn*)calloc(1, sizeof(beholddb_central_conn));
+		if ((rc = beholddb_open_central(&conn->db)))
+		{
+			sqlite3_close(conn->db);
+			free(conn);
+			return rc;
+		}
+		pthread_setspecific(beholddb_central_key, conn);
+		beholddb_central_self = conn;
+	}
+
+	char *dir = strndup(bpath->realpath, bpath->basename - bpath->realpath - 1);
+
+	if (!conn->depth)
+		beholddb_exec(conn->db, BEHOLDDB_DML_CENTRAL_RESET);
+	rc = beholddb_central_enter(conn->db, dir, create);
+	free(dir);
+	if (rc)
+		return rc;
+
+	++conn->depth;
+	*pdb = conn->db;
+	return SQLITE_OK;
+}
+
+// what beholddb_open_read and beholddb_open_write opened; the connection
+// of the thread is only left
+static void beholddb_close(sqlite3 *db)
+{
+	beholddb_central_conn *conn = beholddb_central_self;
+
+	if (!conn || !db || db != conn->db)
+	{
+		sqlite3_close(db);
+		return;
+	}
+
+	beholddb_central_leave(db);
+	if (!--conn->depth && !sqlite3_get_autocommit(db))
+	{
+		syslog(LOG_ERR, "beholddb_close: transaction left open");
+		beholddb_exec(db, "rollback;");
+		conn->savepoints = 0;
+	}
 }
 
 static int beholddb_open_read(const beholddb_path *bpath, sqlite3 **pdb)
 {
-	syslog(LOG_DEBUG, "beholddb_open_read(path=%s)", bpath->realpath);
+	log_debug("beholddb_open_read(path=%s)", bpath->realpath);
 
 	int rc;
 	char *db_name;
+	uint64_t start = stats_now();
 
 	// get name of metadata file
 	if ((rc = beholddb_get_name(bpath, &db_name)))
@@ -242,6 +694,13 @@ static int beholddb_open_read(const beholddb_path *bpath, sqlite3 **pdb)
 		*pdb = NULL;
 		return BEHOLDDB_OK; // if in root directory, assume success?
 	}
+	if (beholddb_central)
+	{
+		free(db_name);
+		rc = beholddb_central_open(bpath, 0, pdb);
+		stats_record(STATS_DB_OPEN, start, -rc);
+		return rc;
+	}
 
 	// open and initialize the database
 	if ((rc = sqlite3_open_v2(db_name, pdb, SQLITE_OPEN_READONLY, NULL)) ||
@@ -253,15 +712,17 @@ static int beholddb_open_read(const beholddb_path *bpath, sqlite3 **pdb)
 	}
 
 	free(db_name);
+	stats_record(STATS_DB_OPEN, start, -rc);
 	return rc;
 }
 
 static int beholddb_open_write(const beholddb_path *bpath, sqlite3 **pdb)
 {
-	syslog(LOG_DEBUG, "beholddb_open_write(path=%s)", bpath->realpath);
+	log_debug("beholddb_open_write(path=%s)", bpath->realpath);
 
 	int rc;
 	char *db_name;
+	uint64_t start = stats_now();
 
 	// get name of metadata file
 	if ((rc = beholddb_get_name(bpath, &db_name)))
@@ -270,6 +731,13 @@ static int beholddb_open_write(const beholddb_path *bpath, sqlite3 **pdb)
 		*pdb = NULL;
 		return BEHOLDDB_OK; // if in root directory, assume success?
 	}
+	if (beholddb_central)
+	{
+		free(db_name);
+		rc = beholddb_central_open(bpath, 1, pdb);
+		stats_record(STATS_DB_OPEN, start, -rc);
+		return rc;
+	}
 
 	// open the database
 	;
@@ -281,7 +749,9 @@ static int beholddb_open_write(const beholddb_path *bpath, sqlite3 **pdb)
 		sqlite3_close(*pdb);
 		(rc = sqlite3_open_v2(db_name, pdb, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL));
 	}
-	if (rc || (rc = beholddb_init(*pdb)) || (rc = beholddb_create_tables(*pdb)))
+	if (rc || (rc = beholddb_init(*pdb)) ||
+		(rc = beholddb_init_version(*pdb)) ||
+		(rc = beholddb_create_tables(*pdb)))
 	{
 		syslog(LOG_ERR, "beholddb_open_write error: rc=%d", rc);
 		sqlite3_close(*pdb);
@@ -289,24 +759,95 @@ static int beholddb_open_write(const beholddb_path *bpath, sqlite3 **pdb)
 	}
 
 	free(db_name);
+	stats_record(STATS_DB_OPEN, start, -rc);
+	return rc;
+}
+
+// listings outlive the operation that opens them, so they get their own
+// connection rather than the one of the thread
+static int beholddb_open_listing(const beholddb_path *bpath, sqlite3 **pdb)
+{
+	if (!beholddb_central || !bpath->basename)
+		return beholddb_open_read(bpath, pdb);
+
+	int rc;
+	char *dir = strndup(bpath->realpath, bpath->basename - bpath->realpath - 1);
+
+	(rc = beholddb_open_central(pdb)) ||
+	(rc = beholddb_central_enter(*pdb, dir, 0));
+
+	free(dir);
+	if (rc)
+	{
+		sqlite3_close(*pdb);
+		*pdb = NULL;
+	}
 	return rc;
 }
 
+// on the connection of a thread in central mode, a transaction begun
+// inside another is a savepoint of it
+static int beholddb_nested_transaction(sqlite3 *db)
+{
+	beholddb_central_conn *conn = beholddb_central_self;
+
+	return conn && db == conn->db && conn->savepoints;
+}
+
 static int beholddb_begin_transaction(sqlite3 *db)
 {
-	return beholddb_exec(db, "begin transaction;");
+	beholddb_central_conn *conn = beholddb_central_self;
+
+	if (!conn || db != conn->db)
+		return beholddb_exec(db, "begin transaction;");
+	if (!sqlite3_get_autocommit(db))
+	{
+		++conn->savepoints;
+		return beholddb_exec(db, "savepoint beholddb;");
+	}
+	// take the write lock up front: a deferred transaction that has read
+	// cannot wait for another writer in wal mode
+	return beholddb_exec(db, "begin immediate transaction;");
 }
 
 static int beholddb_commit(sqlite3 *db)
 {
-	return beholddb_exec(db, "commit;");
+	if (beholddb_nested_transaction(db))
+	{
+		--beholddb_central_self->savepoints;
+		return beholddb_exec(db, "release beholddb;");
+	}
+
+	uint64_t start = stats_now();
+	int rc = beholddb_exec(db, "commit;");
+
+	if (beholddb_central && !rc)
+		__sync_add_and_fetch(&beholddb_central_generation, 1); else
+	if (!rc && sqlite3_db_filename(db, "idx"))
+		__sync_add_and_fetch(&beholddb_index_generation, 1);
+	stats_record(STATS_DB_COMMIT, start, -rc);
+	return rc;
 }
 
 static int beholddb_rollback(sqlite3 *db)
 {
+	if (beholddb_nested_transaction(db))
+	{
+		--beholddb_central_self->savepoints;
+		return beholddb_exec(db, "rollback to beholddb; release beholddb;");
+	}
 	return beholddb_exec(db, "rollback;");
 }
 
+static int beholddb_step(sqlite3_stmt *stmt)
+{
+	uint64_t start = stats_now();
+	int rc = sqlite3_step(stmt);
+
+	stats_record(STATS_DB_STEP, start, SQLITE_ROW == rc || SQLITE_DONE == rc ? 0 : -rc);
+	return rc;
+}
+
 static int beholddb_exec_bind_text(sqlite3 *db, const char *sql, const char *text)
 {
 	sqlite3_stmt *stmt;
@@ -317,11 +858,37 @@ static int beholddb_exec_bind_text(sqlite3 *db, const char *sql, const char *tex
 	SQLITE_DONE != (rc = sqlite3_step(stmt)) ||
 	(rc = SQLITE_OK);
 
-	syslog(LOG_DEBUG, "beholddb_exec_bind_text: sql=%s, text=%s, rc=%d, err=%s", sql, text, rc, sqlite3_errmsg(db));
+	log_debug("beholddb_exec_bind_text: sql=%s, text=%s, rc=%d, err=%s", sql, text, rc, sqlite3_errmsg(db));
 	sqlite3_finalize(stmt);
 	return rc;
 }
 
+// run every statement of sql, each one bound to as many of texts as it
+// takes (?1, ?2, ...)
+int beholddb_exec_bind_texts(sqlite3 *db, const char *sql, int count, const char **texts)
+{
+	int rc = SQLITE_OK;
+	sqlite3_stmt *stmt;
+
+	while (!rc && *sql)
+	{
+		if ((rc = sqlite3_prepare_v2(db, sql, -1, &stmt, &sql)) || !stmt)
+			break;
+
+		int params = sqlite3_bind_parameter_count(stmt);
+
+		for (int i = 0; !rc && i < params && i < count; ++i)
+			rc = sqlite3_bind_text(stmt, i + 1, texts[i], -1, SQLITE_STATIC);
+		rc ||
+		SQLITE_DONE != (rc = beholddb_step(stmt)) ||
+		(rc = SQLITE_OK);
+		sqlite3_finalize(stmt);
+	}
+
+	log_debug("beholddb_exec_bind_texts: count=%d, rc=%d, err=%s", count, rc, sqlite3_errmsg(db));
+	return rc;
+}
+
 static int beholddb_set_tags_worker(sqlite3 *db, const char *sql, const beholddb_tag_list *list)
 {
 	if (!list || !list->head)
@@ -330,7 +897,7 @@ static int beholddb_set_tags_worker(sqlite3 *db, const char *sql, const beholddb
 	int rc;
 	sqlite3_stmt *stmt;
 
-	syslog(LOG_DEBUG, "beholddb_set_tags(%s, list=%p)", sql, list);
+	log_debug("beholddb_set_tags(%s, list=%p)", sql, list);
 	if (!(rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)))
 	{
 		for (beholddb_tag_list_item *item = list->head; !rc && item; item = item->next)
@@ -344,7 +911,7 @@ static int beholddb_set_tags_worker(sqlite3 *db, const char *sql, const beholddb
 
 	if (rc)
 		syslog(LOG_ERR, "beholddb_set_tags(%s): error %d", sql, rc); else
-		syslog(LOG_DEBUG, "beholddb_set_tags(%s): ok", sql);
+		log_debug("beholddb_set_tags(%s): ok", sql);
 	sqlite3_finalize(stmt);
 	return rc; // TODO: handle errors
 }
@@ -357,34 +924,11 @@ static int beholddb_create_tags(sqlite3 *db, const beholddb_tag_list *list)
 		list);
 }
 
-static const char *BEHOLDDB_DDL_FILES_TAGS =
-	"create temp table if not exists include"
-	"("
-		"id integer primary key on conflict ignore,"
-		"name text"
-	");"
-	"create temp table if not exists exclude"
-	"("
-		"id integer primary key on conflict ignore,"
-		"name text"
-	");";
-
-static const char *BEHOLDDB_DDL_DIRS_TAGS =
-	"create temp table if not exists dirs_include"
-	"("
-		"id integer primary key on conflict ignore,"
-		"name text"
-	");"
-	"create temp table if not exists dirs_exclude"
-	"("
-		"id integer primary key on conflict ignore,"
-		"name text"
-	");";
-
 static int beholddb_set_files_tags(sqlite3 *db,
 	const beholddb_tag_list *include, const beholddb_tag_list *exclude)
 {
 	int rc;
+	uint64_t start = stats_now();
 
 	(rc = beholddb_exec(db, BEHOLDDB_DDL_FILES_TAGS)) ||
 	(rc = beholddb_set_tags_worker(db,
@@ -399,6 +943,7 @@ static int beholddb_set_files_tags(sqlite3 *db,
 		"where name = ?",
 		exclude));
 
+	stats_record(STATS_DB_BIND, start, -rc);
 	return rc;
 }
 
@@ -406,6 +951,7 @@ static int beholddb_set_dirs_tags(sqlite3 *db,
 	const beholddb_tag_list *include, const beholddb_tag_list *exclude)
 {
 	int rc;
+	uint64_t start = stats_now();
 
 	(rc = beholddb_exec(db, BEHOLDDB_DDL_DIRS_TAGS)) ||
 	(rc = beholddb_set_tags_worker(db,
@@ -419,6 +965,7 @@ static int beholddb_set_dirs_tags(sqlite3 *db,
 		"where name = ?",
 		exclude));
 
+	stats_record(STATS_DB_BIND, start, -rc);
 	return rc;
 }
 
@@ -474,6 +1021,26 @@ static int beholddb_get_dirs_tags(sqlite3 *db, beholddb_tag_list_set *tags)
 	return rc; // TODO: fix error handling
 }
 
+// returns SQLITE_ROW if the file is known
+static int beholddb_get_file_type(sqlite3 *db, const char *file, int *type)
+{
+	int rc;
+	sqlite3_stmt *stmt;
+
+	*type = 0;
+	(rc = sqlite3_prepare_v2(db,
+		"select type from files "
+		"where name = ?",
+		-1, &stmt, NULL)) ||
+	(rc = sqlite3_bind_text(stmt, 1, file, -1, SQLITE_STATIC)) ||
+	(rc = sqlite3_step(stmt));
+
+	if (SQLITE_ROW == rc)
+		*type = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
 static int beholddb_get_file_tags(sqlite3 *db, const char *file,
 	beholddb_tag_list *files_tags, beholddb_tag_list *dirs_tags,
 	int *type)
@@ -498,22 +1065,7 @@ static int beholddb_get_file_tags(sqlite3 *db, const char *file,
 	sqlite3_free(sql);
 
 	if (type)
-	{
-		int rc;
-		sqlite3_stmt *stmt;
-		const char *sql =
-			"select type from files "
-			"where name = ?";
-		if (!(rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)))
-		{
-			(rc = sqlite3_bind_text(stmt, 1, file, -1, SQLITE_STATIC)) ||
-			(rc = sqlite3_step(stmt));
-			if (SQLITE_ROW == rc)
-				*type = sqlite3_column_int(stmt, 1); else
-				*type = 0;
-		}
-		sqlite3_finalize(stmt);
-	}
+		beholddb_get_file_type(db, file, type);
 
 	beholddb_get_tags_worker(db, "select name from v_files_tags", files_tags);
 	beholddb_get_tags_worker(db, "select name from v_dirs_tags", dirs_tags);
@@ -525,16 +1077,89 @@ static int beholddb_get_file_tags(sqlite3 *db, const char *file,
 	return SQLITE_OK; // TODO: handle errors
 }
 
+static int beholddb_bind_names(sqlite3_stmt *stmt, const char **names, int count, int first)
+{
+	int rc = SQLITE_OK;
+
+	for (int i = 0; !rc && i < count; ++i)
+		rc = sqlite3_bind_text(stmt, first + i, names[i], -1, SQLITE_TRANSIENT);
+	return rc;
+}
+
+// the files an expression selects go to expression_files, the tags it
+// names to expression_tags
+static int beholddb_set_expression(sqlite3 *db, const tagexpr *expr, const tagexpr_dialect *dialect)
+{
+	int rc;
+	int count = 0;
+	char *plan = NULL;
+	char *sql = NULL;
+	const char **names = NULL;
+	sqlite3_stmt *stmt = NULL;
+	uint64_t start = stats_now();
+
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_EXPRESSION)) ||
+	(rc = tagexpr_compile(expr, dialect, 0, 1, &plan, &names, &count)) ||
+	(rc = sqlite3_prepare_v2(db,
+		sql = sqlite3_mprintf("%s%s", BEHOLDDB_DML_EXPRESSION_FILES, plan),
+		-1, &stmt, NULL)) ||
+	(rc = beholddb_bind_names(stmt, names, count, 1)) ||
+	SQLITE_DONE != (rc = beholddb_step(stmt)) ||
+	(rc = SQLITE_OK);
+
+	for (int i = 0; !rc && i < count; ++i)
+		rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_EXPRESSION_TAG, names[i]);
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_set_expression(%s): error %d", expr->key, rc);
+	sqlite3_finalize(stmt);
+	sqlite3_free(sql);
+	free(plan);
+	free(names);
+	stats_record(STATS_DB_BIND, start, -rc);
+	return rc;
+}
+
+// a statement ending in "and " completed with the test of the file f
+// for an expression, its tags bound from the parameter first on
+static int beholddb_prepare_expression(sqlite3 *db, const char *sql,
+	const tagexpr *expr, const tagexpr_dialect *dialect, int first, sqlite3_stmt **pstmt)
+{
+	int rc;
+	int count = 0;
+	char *test = NULL;
+	char *full = NULL;
+	const char **names = NULL;
+
+	*pstmt = NULL;
+	(rc = tagexpr_compile(expr, dialect, 1, first, &test, &names, &count)) ||
+	(rc = sqlite3_prepare_v2(db,
+		full = sqlite3_mprintf("%s( %s )", sql, test),
+		-1, pstmt, NULL)) ||
+	(rc = beholddb_bind_names(*pstmt, names, count, first));
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_prepare_expression(%s): error %d", expr->key, rc);
+	sqlite3_free(full);
+	free(test);
+	free(names);
+	return rc;
+}
+
 static int beholddb_readdir_worker(sqlite3_stmt *stmt, const char *name);
 
 static int beholddb_locate_file_worker(sqlite3 *db, const beholddb_path *bpath)
 {
 	int rc;
-	sqlite3_stmt *stmt;
+	sqlite3_stmt *stmt = NULL;
 
-	(rc = beholddb_set_files_tags(db, &bpath->include, &bpath->exclude)) ||
-	(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_LOCATE, -1, &stmt, NULL)) ||
-	(rc = beholddb_readdir_worker(stmt, bpath->basename));
+	if (bpath->expr)
+		(rc = beholddb_prepare_expression(db, BEHOLDDB_DML_EXPRESSION_LOCATE,
+			bpath->expr, &BEHOLDDB_DIALECT_DIR, 2, &stmt)) ||
+		(rc = beholddb_readdir_worker(stmt, bpath->basename)); else
+		(rc = beholddb_set_files_tags(db, &bpath->include, &bpath->exclude)) ||
+		(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_LOCATE, -1, &stmt, NULL)) ||
+		(rc = beholddb_readdir_worker(stmt, bpath->basename));
 
 	sqlite3_finalize(stmt);
 	return rc;
@@ -542,7 +1167,12 @@ static int beholddb_locate_file_worker(sqlite3 *db, const beholddb_path *bpath)
 
 int beholddb_locate_file(const beholddb_path *bpath)
 {
-	syslog(LOG_DEBUG, "beholddb_locate_file(realpath=%s)", bpath->realpath);
+	log_debug("beholddb_locate_file(realpath=%s)", bpath->realpath);
+
+	// a deep view is there if its directory is; its entries are not
+	// files (see beholddb_get_deep_target)
+	if (bpath->deep)
+		return *bpath->deep ? BEHOLDDB_ERROR : BEHOLDDB_OK;
 
 	if (!bpath->basename)
 	{
@@ -554,7 +1184,7 @@ int beholddb_locate_file(const beholddb_path *bpath)
 		return BEHOLDDB_OK;
 
 	// quick optimization
-	if (!bpath->include.head && !bpath->exclude.head)
+	if (!bpath->include.head && !bpath->exclude.head && !bpath->expr)
 		return 0;
 
 	int rc;
@@ -563,7 +1193,7 @@ int beholddb_locate_file(const beholddb_path *bpath)
 	(rc = beholddb_open_read(bpath, &db)) ||
 	(rc = beholddb_locate_file_worker(db, bpath));
 
-	sqlite3_close(db);
+	beholddb_close(db);
 
 	if (rc)
 		syslog(LOG_ERR, "beholddb_locate_file: error %d", rc);
@@ -574,7 +1204,7 @@ int beholddb_locate_file(const beholddb_path *bpath)
 // return error if not found
 int beholddb_get_file(const char *path, beholddb_path **pbpath)
 {
-	syslog(LOG_DEBUG, "beholddb_get_file(path=%s)", path);
+	log_debug("beholddb_get_file(path=%s)", path);
 
 	int rc;
 
@@ -588,21 +1218,23 @@ int beholddb_get_file(const char *path, beholddb_path **pbpath)
 
 static int beholddb_mark_object(const beholddb_path *bpath, const beholddb_tag_list_set *dirs_tags);
 
-static int beholddb_mark_recursive(sqlite3 *db, const beholddb_path *bpath)
+// mark the directory holding bpath in its parent directory
+static int beholddb_mark_parent(const beholddb_path *bpath,
+	const beholddb_tag_list_set *tags, const beholddb_tag_list_set *dirs_tags)
 {
 	int rc;
 	beholddb_path parent;
-	beholddb_tag_list_set dirs_tags;
 
 	if (!bpath->basename)
 	{
-		syslog(LOG_DEBUG, "beholddb_mark_recursive: in root directory (%s)", bpath->realpath);
+		log_debug("beholddb_mark_parent: in root directory (%s)", bpath->realpath);
 		return BEHOLDDB_OK;
 	}
 
 	int pathlen = bpath->basename - bpath->realpath - 1;
 	char *path = (char*)malloc(pathlen + 1);
 
+	++beholddb_propagated;
 	memcpy(path, bpath->realpath, pathlen);
 	path[pathlen] = 0;
 	parent.realpath = path;
@@ -610,91 +1242,82 @@ static int beholddb_mark_recursive(sqlite3 *db, const beholddb_path *bpath)
 	if (parent.basename)
 		++parent.basename;
 
-	parent.include.head = bpath->include.head;
-	parent.exclude.head = NULL;
-	dirs_tags.include.head = NULL;
-	dirs_tags.exclude.head = bpath->exclude.head;
+	parent.include.head = tags->include.head;
+	parent.exclude.head = tags->exclude.head;
 
-	rc = beholddb_get_tags_worker(db,
-		"select t.name from exclude t "
-		"where not exists "
-			"(select * from files_tags ft "
-			"where ft.id_tag = t.id)",
-		&parent.exclude);
+	rc = beholddb_mark_object(&parent, dirs_tags);
 
-	rc = beholddb_get_tags_worker(db,
-		"select t.name from include t "
-		"where not exists "
-			"(select f.id, t.id from files f "
-			"except "
-			"select st.id_file, st.id_tag from strong_tags st)",
-		&dirs_tags.include);
+	free(path);
+	return rc;
+}
 
-	rc = beholddb_mark_object(&parent, &dirs_tags);
+// what the parent has to learn of a change to the tags of bpath; the
+// include and dirs exclude lists are those of bpath
+static int beholddb_get_marks(sqlite3 *db, const beholddb_path *bpath,
+	beholddb_tag_list_set *tags, beholddb_tag_list_set *dirs_tags)
+{
+	int rc;
 
-	free(path);
-	beholddb_free_tag_list(&parent.exclude);
+	tags->include.head = bpath->include.head;
+	tags->exclude.head = NULL;
+	dirs_tags->include.head = NULL;
+	dirs_tags->exclude.head = bpath->exclude.head;
+
+	(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_UNUSED_TAGS, &tags->exclude)) ||
+	(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_UNIVERSAL_TAGS, &dirs_tags->include));
+
+	return rc;
+}
+
+static int beholddb_mark_recursive(sqlite3 *db, const beholddb_path *bpath)
+{
+	int rc;
+	beholddb_tag_list_set tags;
+	beholddb_tag_list_set dirs_tags;
+
+	if (!bpath->basename)
+	{
+		log_debug("beholddb_mark_recursive: in root directory (%s)", bpath->realpath);
+		return BEHOLDDB_OK;
+	}
+
+	(rc = beholddb_get_marks(db, bpath, &tags, &dirs_tags)) ||
+	(rc = beholddb_mark_parent(bpath, &tags, &dirs_tags));
+
+	beholddb_free_tag_list(&tags.exclude);
 	beholddb_free_tag_list(&dirs_tags.include);
 
-	return BEHOLDDB_OK; // TODO: handle errors
+	return rc;
 }
 
 static int beholddb_mark_worker(sqlite3 *db, const char *file, int *pchanges)
 {
-	int changes = 0;
-
-	syslog(LOG_DEBUG, "beholddb_mark_worker(%s)", file);
-	beholddb_exec_bind_text(db,
-		"insert into files_tags ( id_file, id_tag ) "
-		"select f.id, t.id "
-		"from files f "
-		"join include t "
-		"where f.name = ?",
-		file);
-	changes += sqlite3_changes(db);
-
-	beholddb_exec_bind_text(db,
-		"delete from files_tags "
-		"where id_file = "
-			"( select id from files where name = ? ) "
-		"and id_tag in "
-			"( select id from exclude )",
-		file);
-	changes += sqlite3_changes(db);
-
-	//if (dirs_tags)
-	{
-		beholddb_exec_bind_text(db,
-			"insert into dirs_tags ( id_file, id_tag ) "
-			"select f.id, t.id "
-			"from files f "
-			"join dirs_include t "
-			"where f.name = ?",
-			file);
-		changes += sqlite3_changes(db);
-
-		beholddb_exec_bind_text(db,
-			"delete from dirs_tags "
-			"where id_file = "
-				"( select id from files where name = ? ) "
-			"and id_tag in "
-				"( select id from dirs_exclude )",
-			file);
-		changes += sqlite3_changes(db);
-	}
+	// counted as a whole, counters kept by triggers included: changes
+	// made through the views of the central database only show there
+	int changes = sqlite3_total_changes(db);
+
+	int rc;
+
+	log_debug("beholddb_mark_worker(%s)", file);
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_MARK_INCLUDE, file)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_MARK_EXCLUDE, file)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_MARK_DIRS_INCLUDE, file)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_MARK_DIRS_EXCLUDE, file));
+
+	changes = sqlite3_total_changes(db) - changes;
 	if (pchanges)
 		*pchanges = changes;
-	syslog(LOG_DEBUG, "beholddb_mark_worker: changes=%d", changes);
-	return SQLITE_OK; // TODO: handle errors
+	log_debug("beholddb_mark_worker: changes=%d, rc=%d", changes, rc);
+	return rc;
 }
 
 static int beholddb_mark(sqlite3 *db, const beholddb_path *bpath, const beholddb_tag_list_set *dirs_tags)
 {
-	syslog(LOG_DEBUG, "beholddb_mark(path=%s, dirs=%p)", bpath->realpath, dirs_tags);
+	log_debug("beholddb_mark(path=%s, dirs=%p)", bpath->realpath, dirs_tags);
 
 	if (!bpath->basename)
 	{
-		syslog(LOG_DEBUG, "beholddb_mark: no base name (%s)", bpath->realpath);
+		log_debug("beholddb_mark: no base name (%s)", bpath->realpath);
 		return BEHOLDDB_OK;
 	}
 
@@ -705,209 +1328,2044 @@ static int beholddb_mark(sqlite3 *db, const beholddb_path *bpath, const beholddb
 	(rc = beholddb_set_files_tags(db, &bpath->include, &bpath->exclude)) ||
 	(rc = beholddb_set_dirs_tags(db, &dirs_tags->include, &dirs_tags->exclude)) ||
 	(rc = beholddb_mark_worker(db, bpath->basename, &changes)) ||
-	changes && (rc = beholddb_mark_recursive(db, bpath));
+	(changes || beholddb_replaying) && (rc = beholddb_mark_recursive(db, bpath));
+
+	return rc;
+}
+
+static int beholddb_mark_object(const beholddb_path *bpath, const beholddb_tag_list_set *dirs_tags)
+{
+	log_debug("beholddb_mark_object(path=%s)", bpath->realpath);
+
+	int rc;
+	sqlite3 *db;
+
+	(rc = beholddb_open_write(bpath, &db)) ||
+	(rc = beholddb_mark(db, bpath, dirs_tags));
+
+	beholddb_close(db);
+
+	if (rc)
+		log_debug("beholddb_mark: error (%d)", rc);
+	return rc;
+}
+
+// the state of a directory the metadata was last known to match
+static char *beholddb_get_stamp(const char *dir)
+{
+	struct stat st;
+
+	if (stat(dir, &st))
+		return NULL;
+	return sqlite3_mprintf("%llu %lld.%09ld %lld.%09ld",
+		(unsigned long long)st.st_ino,
+		(long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+		(long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+}
+
+// call in the transaction that brings the metadata in line with the
+// directory, after the directory itself was changed
+int beholddb_stamp_directory(sqlite3 *db, const char *dir)
+{
+	int rc;
+	char *stamp = beholddb_get_stamp(dir);
+
+	rc = stamp ? beholddb_set_param(db, "stamp", stamp) : BEHOLDDB_ERROR;
+	sqlite3_free(stamp);
+	return rc;
+}
+
+static char *beholddb_dirname(const beholddb_path *bpath)
+{
+	int pathlen = bpath->basename - bpath->realpath - 1;
+	char *dir = (char*)malloc(pathlen + 1);
+
+	memcpy(dir, bpath->realpath, pathlen);
+	dir[pathlen] = 0;
+	return dir;
+}
+
+// stamp the directory holding bpath
+static int beholddb_stamp_file(sqlite3 *db, const beholddb_path *bpath)
+{
+	char *dir = beholddb_dirname(bpath);
+	int rc = beholddb_stamp_directory(db, dir);
+
+	free(dir);
+	return rc;
+}
+
+// the same for the source of a move, attached as src
+static int beholddb_stamp_source(sqlite3 *db, const beholddb_path *bpath)
+{
+	char *dir = beholddb_dirname(bpath);
+	char *stamp = beholddb_get_stamp(dir);
+	int rc = stamp ? beholddb_exec_bind_text(db, BEHOLDDB_DML_MOVE_STAMP, stamp) : BEHOLDDB_ERROR;
+
+	sqlite3_free(stamp);
+	free(dir);
+	return rc;
+}
+
+static int beholddb_open_index(sqlite3 **pdb)
+{
+	int rc, persist = 1;
+
+	if ((rc = sqlite3_open_v2(BEHOLDDB_INDEX_NAME, pdb,
+		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)))
+		return rc;
+
+	beholddb_init(*pdb);
+	sqlite3_file_control(*pdb, "main", SQLITE_FCNTL_PERSIST_WAL, &persist);
+	(rc = sqlite3_busy_timeout(*pdb, BEHOLDDB_INDEX_BUSY_TIMEOUT)) ||
+	(rc = beholddb_exec(*pdb, "pragma journal_mode = wal;")) ||
+	(rc = beholddb_exec(*pdb, "pragma synchronous = normal;")) ||
+	(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_INDEX_CREATE));
+
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_open_index: %s", sqlite3_errmsg(*pdb));
+		sqlite3_close(*pdb);
+		*pdb = NULL;
+	}
+	return rc;
+}
+
+// call before the transaction begins, ATTACH cannot run inside one
+static int beholddb_index_attach(sqlite3 *db)
+{
+	if (!beholddb_index || beholddb_central)
+		return BEHOLDDB_OK;
+
+	int rc, persist = 1;
+
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_ATTACH_INDEX, BEHOLDDB_INDEX_NAME)) ||
+	(rc = sqlite3_file_control(db, "idx", SQLITE_FCNTL_PERSIST_WAL, &persist)) ||
+	(rc = sqlite3_busy_timeout(db, BEHOLDDB_INDEX_BUSY_TIMEOUT)) ||
+	(rc = beholddb_exec(db, "pragma idx.synchronous = normal;"));
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_index_attach: error %d", rc);
+	return rc;
+}
+
+// bring the index in line with the file bpath names (?1 and ?2 of sql,
+// other is ?3) in the transaction that changed it; done last, so that
+// the index is locked for as short a time as possible
+static int beholddb_index_file(sqlite3 *db, const char *sql,
+	const beholddb_path *bpath, const char *other)
+{
+	if (!sqlite3_db_filename(db, "idx"))
+		return BEHOLDDB_OK;
+
+	char *dir = beholddb_dirname(bpath);
+	const char *texts[] = { dir, bpath->basename, other };
+	int rc = beholddb_exec_bind_texts(db, sql, other ? 3 : 2, texts);
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_index_file: %s: error %d", bpath->realpath, rc);
+	free(dir);
+	return rc;
+}
+
+// the same for every file of a directory
+static int beholddb_index_dir(sqlite3 *db, const char *dir)
+{
+	if (!sqlite3_db_filename(db, "idx"))
+		return BEHOLDDB_OK;
+
+	int rc = beholddb_exec_bind_texts(db, BEHOLDDB_DML_INDEX_DIR, 1, &dir);
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_index_dir: %s: error %d", dir, rc);
+	return rc;
+}
+
+// the directories below a directory that is renamed keep their files,
+// and so the names of their entries in deep views
+static int beholddb_index_move(const beholddb_path *oldbpath, const beholddb_path *newbpath)
+{
+	if (!beholddb_index || beholddb_central || !oldbpath->basename || !newbpath->basename)
+		return BEHOLDDB_OK;
+
+	int rc;
+	sqlite3 *db;
+	const char *texts[] = { oldbpath->realpath, newbpath->realpath };
+
+	if ((rc = beholddb_open_index(&db)))
+		return rc;
+	if ((rc = beholddb_exec_bind_texts(db, BEHOLDDB_DML_INDEX_MOVE, 2, texts)))
+		syslog(LOG_ERR, "beholddb_index_move: %s: error %d", oldbpath->realpath, rc); else
+		__sync_add_and_fetch(&beholddb_index_generation, 1);
+	sqlite3_close(db);
+	return rc;
+}
+
+static int beholddb_index_build_dir(const char *dir)
+{
+	int rc;
+	sqlite3 *db;
+	char *db_name = sqlite3_mprintf("%s/%s", dir, BEHOLDDB_NAME);
+
+	// read only, but the index is attached with the flags of main
+	(rc = sqlite3_open_v2(db_name, &db, SQLITE_OPEN_READWRITE, NULL)) ||
+	(rc = beholddb_index_attach(db)) ||
+	(rc = beholddb_begin_transaction(db)) ||
+	(rc = beholddb_index_dir(db, dir)) ||
+	(rc = beholddb_commit(db));
+
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_index_build: %s: error %d", dir, rc);
+		beholddb_rollback(db);
+	}
+	sqlite3_close(db);
+	sqlite3_free(db_name);
+	return rc;
+}
+
+static int beholddb_exists(sqlite3 *db, const char *sql);
+
+// an index written by an older version, or left dirty by a mount that
+// did not end cleanly, is dropped along with its wal
+static int beholddb_index_current()
+{
+	int current = 0, dirty = 0;
+	sqlite3 *db;
+
+	if (!sqlite3_open_v2(BEHOLDDB_INDEX_NAME, &db, SQLITE_OPEN_READWRITE, NULL))
+	{
+		current = beholddb_exists(db, BEHOLDDB_DML_INDEX_CURRENT);
+		dirty = current && beholddb_exists(db, BEHOLDDB_DML_INDEX_IS_DIRTY);
+	}
+	sqlite3_close(db);
+	if (!current || dirty)
+	{
+		char *name = (char*)malloc(sizeof(BEHOLDDB_INDEX_NAME) + 4);
+
+		syslog(LOG_NOTICE, dirty ?
+			"beholddb_index_init: rebuilding an index the last mount left dirty" :
+			"beholddb_index_init: rebuilding an outdated index");
+		unlink(BEHOLDDB_INDEX_NAME);
+		unlink(strcat(strcpy(name, BEHOLDDB_INDEX_NAME), "-wal"));
+		unlink(strcat(strcpy(name, BEHOLDDB_INDEX_NAME), "-shm"));
+		free(name);
+	}
+	return current && !dirty;
+}
+
+static int beholddb_index_build()
+{
+	int rc, count = 0, failed = 0;
+	sqlite3 *db, *walk = NULL;
+	sqlite3_stmt *dirs = NULL;
+
+	if ((rc = beholddb_open_index(&db)))
+		return rc;
+	sqlite3_close(db);
+
+	(rc = sqlite3_open_v2(":memory:", &walk, SQLITE_OPEN_READWRITE, NULL)) ||
+	(rc = fs_create_module(walk, ".")) ||
+	(rc = sqlite3_prepare_v2(walk, BEHOLDDB_DML_INDEX_WALK, -1, &dirs, NULL));
+
+	while (!rc && SQLITE_ROW == (rc = sqlite3_step(dirs)))
+	{
+		const char *dir = (const char*)sqlite3_column_text(dirs, 0);
+		char *path = *dir ? sqlite3_mprintf("./%s", dir) : sqlite3_mprintf(".");
+
+		// a directory that cannot be indexed is left out, as one that
+		// cannot be listed
+		failed += !!beholddb_index_build_dir(path);
+		++count;
+		sqlite3_free(path);
+		rc = SQLITE_OK;
+	}
+	if (SQLITE_DONE == rc)
+		rc = SQLITE_OK;
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_index_init: error %d", rc); else
+		syslog(LOG_NOTICE, "beholddb_index_init: indexed %d directories (%d failed)", count, failed);
+	sqlite3_finalize(dirs);
+	sqlite3_close(walk);
+	return rc;
+}
+
+// build the index from the directory databases if there is none, or if
+// the last mount did not end cleanly, and mark it dirty until unmount;
+// called once at mount, before anything attaches it. Changes made to the
+// tree while unmounted are picked up as each directory is reconciled,
+// but tools that write the directory databases directly bypass it:
+// remove the index after running them, or rebuild it with beholdfs-index
+int beholddb_index_init()
+{
+	if (!beholddb_index || beholddb_central)
+		return BEHOLDDB_OK;
+
+	int rc, build;
+	sqlite3 *db;
+
+	// dirty before it is built, so that a build cut short is done again
+	build = access(BEHOLDDB_INDEX_NAME, F_OK) || !beholddb_index_current();
+	if ((rc = beholddb_open_index(&db)))
+		return rc;
+	if ((rc = beholddb_exec(db, BEHOLDDB_DML_INDEX_DIRTY)))
+		syslog(LOG_ERR, "beholddb_index_init: cannot mark the index dirty (%d)", rc);
+	sqlite3_close(db);
+
+	if (!rc && build)
+		rc = beholddb_index_build();
+	return rc;
+}
+
+// every change made while mounted is in the index; called at unmount
+int beholddb_index_free()
+{
+	if (!beholddb_index || beholddb_central)
+		return BEHOLDDB_OK;
+
+	int rc;
+	sqlite3 *db;
+
+	if (!(rc = beholddb_open_index(&db)))
+	{
+		rc = beholddb_exec(db, BEHOLDDB_DML_INDEX_CLEAN);
+		sqlite3_close(db);
+	}
+	if (rc)
+		syslog(LOG_ERR, "beholddb_index_free: error %d", rc);
+	return rc;
+}
+
+// directories checked against their stamps since mount
+#define BEHOLDDB_CHECKED_BUCKETS	4096
+
+// a lookup only compares the stamp; a directory it finds stale, or with
+// no metadata or stamp to compare, is reconciled by the first change
+#define BEHOLDDB_CHECK_NONE	0
+#define BEHOLDDB_CHECK_BUSY	1	// being checked by another thread
+#define BEHOLDDB_CHECK_LOOKED	2	// nothing a lookup can do
+#define BEHOLDDB_CHECK_DONE	3	// matches its stamp
+
+typedef struct beholddb_checked
+{
+	struct beholddb_checked *next;
+	int state;
+	char path[];
+} beholddb_checked;
+
+static beholddb_checked *beholddb_checked_dirs[BEHOLDDB_CHECKED_BUCKETS];
+static pthread_mutex_t beholddb_checked_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t beholddb_checked_cond = PTHREAD_COND_INITIALIZER;
+
+// returns the entry of the directory, marked busy, if it still has to be
+// checked for a lookup (write = 0) or a change (write = 1), or NULL; a
+// check in progress is waited for, so that no thread answers from
+// metadata another one is reconciling
+static beholddb_checked *beholddb_check_begin(const char *dir, int write)
+{
+	unsigned hash = 2166136261u;
+	beholddb_checked *item;
+
+	for (const char *p = dir; *p; ++p)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+	beholddb_checked **pbucket = &beholddb_checked_dirs[hash % BEHOLDDB_CHECKED_BUCKETS];
+
+	pthread_mutex_lock(&beholddb_checked_mutex);
+	for (item = *pbucket; item && strcmp(item->path, dir); item = item->next)
+		;
+	if (!item)
+	{
+		item = (beholddb_checked*)malloc(sizeof(beholddb_checked) + strlen(dir) + 1);
+		item->state = BEHOLDDB_CHECK_NONE;
+		strcpy(item->path, dir);
+		item->next = *pbucket;
+		*pbucket = item;
+	}
+	while (BEHOLDDB_CHECK_BUSY == item->state)
+		pthread_cond_wait(&beholddb_checked_cond, &beholddb_checked_mutex);
+	if (BEHOLDDB_CHECK_DONE == item->state ||
+		BEHOLDDB_CHECK_LOOKED == item->state && !write)
+		item = NULL; else
+		item->state = BEHOLDDB_CHECK_BUSY;
+	pthread_mutex_unlock(&beholddb_checked_mutex);
+	return item;
+}
+
+static void beholddb_check_end(beholddb_checked *item, int state)
+{
+	pthread_mutex_lock(&beholddb_checked_mutex);
+	item->state = state;
+	pthread_cond_broadcast(&beholddb_checked_cond);
+	pthread_mutex_unlock(&beholddb_checked_mutex);
+}
+
+// forget the directories checked
+static void beholddb_check_free()
+{
+	for (int i = 0; i < BEHOLDDB_CHECKED_BUCKETS; ++i)
+		while (beholddb_checked_dirs[i])
+		{
+			beholddb_checked *item = beholddb_checked_dirs[i];
+
+			beholddb_checked_dirs[i] = item->next;
+			free(item);
+		}
+}
+
+// release what the mount kept in memory; called at unmount
+int beholddb_free()
+{
+	beholddb_check_free();
+	return BEHOLDDB_OK;
+}
+
+// diff the files table against a scan of the directory and give the
+// parent directory the tags of the result
+static int beholddb_reconcile(sqlite3 *db, const char *dir)
+{
+	log_debug("beholddb_reconcile(dir=%s)", dir);
+
+	int rc, changes = 0;
+	beholddb_tag_list_set tags, dirs_tags;
+
+	tags.include.head = NULL;
+	tags.exclude.head = NULL;
+	dirs_tags.include.head = NULL;
+	dirs_tags.exclude.head = NULL;
+
+	// total changes, as in beholddb_mark_worker
+	(rc = fs_create_module(db, dir)) ||
+	(rc = beholddb_index_attach(db)) ||
+	(rc = beholddb_begin_transaction(db)) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_FSCK_START)) ||
+	(changes = sqlite3_total_changes(db), rc = beholddb_exec(db, BEHOLDDB_DML_FSCK_ORPHANS)) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_FSCK_UNTRACKED)) ||
+	(changes = sqlite3_total_changes(db) - changes, rc = SQLITE_OK);
+
+	if (!rc && changes)
+	{
+		int pathlen = strlen(dir);
+		char *path = (char*)malloc(pathlen + 3);
+		beholddb_path rpath;
+
+		syslog(LOG_NOTICE, "beholddb_reconcile: %s changed while unmounted (%d changes)", dir, changes);
+
+		// the entry in the parent gets every tag the directory has now
+		memcpy(path, dir, pathlen);
+		path[pathlen++] = '/';
+		rpath.realpath = path;
+		rpath.basename = &path[pathlen];
+		path[pathlen++] = '.';
+		path[pathlen++] = 0;
+
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_RECONCILE_UNUSED, &tags.exclude)) ||
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_RECONCILE_UNUSED, &dirs_tags.exclude)) ||
+		(rc = beholddb_exec(db, BEHOLDDB_DML_FSCK_UNUSED_TAGS)) ||
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_FSCK_WEAK, &tags.include)) ||
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_FSCK_STRONG, &dirs_tags.include)) ||
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_RECONCILE_NOT_UNIVERSAL, &dirs_tags.exclude)) ||
+		(rc = beholddb_mark_parent(&rpath, &tags, &dirs_tags));
+
+		free(path);
+	}
+
+	rc ||
+	(rc = beholddb_index_dir(db, dir)) ||
+	(rc = beholddb_stamp_directory(db, dir)) ||
+	(rc = beholddb_commit(db));
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_reconcile: %s: error %d", dir, rc);
+		beholddb_rollback(db);
+	}
+
+	beholddb_free_tag_list(&tags.include);
+	beholddb_free_tag_list(&tags.exclude);
+	beholddb_free_tag_list(&dirs_tags.include);
+	beholddb_free_tag_list(&dirs_tags.exclude);
+	return rc;
+}
+
+// on the first access after mount, compare the stamp of a directory with
+// the one stored in its metadata: a change reconciles the metadata if the
+// directory changed since it was stamped, a lookup never writes
+static int beholddb_check_directory(const char *dir, int write)
+{
+	// parents first, so that the entry of this directory is there
+	const char *slash = strrchr(dir, '/');
+
+	if (slash)
+	{
+		char *parent = strndup(dir, slash - dir);
+
+		beholddb_check_directory(parent, write);
+		free(parent);
+	}
+
+	beholddb_checked *item;
+
+	// the rows of a file whose rename is being replayed are not orphans
+	if (beholddb_recovering || !(item = beholddb_check_begin(dir, write)))
+		return BEHOLDDB_OK;
+
+	int rc = BEHOLDDB_OK, state = BEHOLDDB_CHECK_LOOKED;
+	sqlite3 *db = NULL;
+	const char *stored = NULL;
+	char *stamp = beholddb_get_stamp(dir);
+
+	if (!stamp)
+		state = BEHOLDDB_CHECK_NONE; else
+	if (write)
+	{
+		if (!(rc = beholddb_open_metadata(dir, &db)) &&
+			!(rc = beholddb_get_param(db, "stamp", &stored)) &&
+			(!stored || strcmp(stored, stamp)))
+			rc = beholddb_reconcile(db, dir);
+		state = BEHOLDDB_CHECK_DONE;
+	} else
+	if (!beholddb_open_metadata_read(dir, &db) && db &&
+		!beholddb_get_param(db, "stamp", &stored) &&
+		stored && !strcmp(stored, stamp))
+		state = BEHOLDDB_CHECK_DONE;
+
+	// a failed reconcile is tried again by the next change
+	beholddb_check_end(item, rc ? BEHOLDDB_CHECK_NONE : state);
+	free((char*)stored);
+	sqlite3_free(stamp);
+	beholddb_close(db);
+	return rc;
+}
+
+static int beholddb_check_file(const beholddb_path *bpath, int write)
+{
+	char *dir = beholddb_dirname(bpath);
+	int rc = beholddb_check_directory(dir, write);
+
+	free(dir);
+	return rc;
+}
+
+// bring the directory of a file about to be renamed up to date, while the
+// old name is still there
+int beholddb_check_path(const beholddb_path *bpath)
+{
+	if (!bpath->basename)
+		return BEHOLDDB_OK;
+	return beholddb_check_file(bpath, 1);
+}
+
+static const char *no_tags[] = { NULL, NULL };
+
+static int beholddb_create_file_with_tags(const beholddb_path *bpath,
+	const beholddb_tag_list *files_tags, const beholddb_tag_list *dirs_tags,
+	int type)
+{
+	log_debug("beholddb_create_file(realpath=%s)", bpath->realpath);
 
+	if (!bpath->basename)
+	{
+		log_debug("beholddb_create_file: no basename (%s)", bpath->realpath);
+		return BEHOLDDB_OK;
+	}
+
+	int rc;
+	sqlite3 *db;
+
+	beholddb_check_file(bpath, 1);
+	if ((rc = beholddb_open_write(bpath, &db)))
+	{
+		log_debug("beholddb_create_file: error opening database (%d)", rc);
+		return rc;
+	}
+
+	beholddb_index_attach(db);
+	beholddb_begin_transaction(db);
+	beholddb_propagated = 0;
+
+	log_debug("beholddb_create_file: checkpoint 1");
+	char *sql = sqlite3_mprintf(
+		"insert into files ( type, name ) "
+		"values ( %d, '%q' )", !!type, bpath->basename);
+	rc = beholddb_exec(db, sql);
+	sqlite3_free(sql);
+
+	log_debug("beholddb_create_file: checkpoint 2");
+	beholddb_create_tags(db, files_tags);
+	if (type)
+		beholddb_create_tags(db, dirs_tags); else
+	{
+		beholddb_create_tags(db, &bpath->include);
+		beholddb_set_files_tags(db, &bpath->include, &bpath->exclude);
+	}
+
+ 	beholddb_set_files_tags(db, files_tags, NULL);
+	beholddb_set_dirs_tags(db, dirs_tags, NULL);
+
+	log_debug("beholddb_create_file: checkpoint 3");
+	beholddb_exec(db, BEHOLDDB_DML_CREATE_INCLUDE);
+
+	int changes;
+
+	log_debug("beholddb_create_file: checkpoint 4");
+	beholddb_mark_worker(db, bpath->basename, &changes);
+	beholddb_exec(db, BEHOLDDB_DML_CREATE_EXCLUDE);
+
+	beholddb_path rpath;
+
+	log_debug("beholddb_create_file: checkpoint 5");
+	memcpy(&rpath, bpath, sizeof(rpath));
+	rpath.include.head = NULL;
+	rpath.exclude.head = NULL;
+	beholddb_get_files_tags(db, &rpath.tags);
+
+	log_debug("beholddb_create_file: checkpoint 6");
+	beholddb_mark_recursive(db, &rpath);
+	stats_value(STATS_DB_PROPAGATE, beholddb_propagated);
+
+	log_debug("beholddb_create_file: checkpoint 7");
+	beholddb_free_tag_list(&rpath.include);
+	beholddb_free_tag_list(&rpath.exclude);
+
+	log_debug("beholddb_create_file: checkpoint 8");
+	beholddb_index_file(db, BEHOLDDB_DML_INDEX_FILE, bpath, NULL);
+	beholddb_stamp_file(db, bpath);
+	beholddb_commit(db);
+	beholddb_close(db);
+
+	return rc; // TODO: error handling
+}
+
+int beholddb_create_file(const beholddb_path *bpath, int type)
+{
+	return beholddb_create_file_with_tags(bpath, NULL, NULL, type);
+}
+
+static int beholddb_delete_file_with_tags(const beholddb_path *bpath,
+	beholddb_tag_list *files_tags, beholddb_tag_list *dirs_tags,
+	int *ptype)
+{
+	log_debug("beholddb_delete_file(realpath=%s)", bpath->realpath);
+
+	if (!bpath->basename)
+	{
+		log_debug("beholddb_delete_file: no base name (%s)", bpath->realpath);
+		return BEHOLDDB_OK;
+	}
+
+	int rc;
+	sqlite3 *db;
+
+	beholddb_check_file(bpath, 1);
+	if ((rc = beholddb_open_write(bpath, &db)))
+	{
+		log_debug("beholddb_delete_file: error opening database (%d)", rc);
+		return rc;
+	}
+
+	beholddb_index_attach(db);
+	beholddb_begin_transaction(db);
+	beholddb_propagated = 0;
+
+	beholddb_get_file_tags(db, bpath->basename, files_tags, dirs_tags, ptype);
+	beholddb_set_files_tags(db, NULL, NULL);
+	beholddb_exec_bind_text(db, BEHOLDDB_DML_DELETE_FILE, bpath->basename);
+	if (beholddb_central)
+		beholddb_exec_bind_text(db, BEHOLDDB_DML_CENTRAL_DELETE_DIR, bpath->basename);
+	beholddb_exec(db, BEHOLDDB_DML_DELETE_UNUSED_TAGS);
+
+	beholddb_path rpath;
+
+	log_debug("beholddb_delete_file: checkpoint 5");
+	memcpy(&rpath, bpath, sizeof(rpath));
+	rpath.include.head = NULL;
+	rpath.exclude.head = NULL;
+	beholddb_get_files_tags(db, &rpath.tags);
+
+	log_debug("beholddb_delete_file: checkpoint 6");
+	beholddb_mark_recursive(db, bpath);
+	stats_value(STATS_DB_PROPAGATE, beholddb_propagated);
+
+	log_debug("beholddb_delete_file: checkpoint 7");
+	beholddb_free_tag_list(&rpath.include);
+	beholddb_free_tag_list(&rpath.exclude);
+
+	log_debug("beholddb_delete_file: checkpoint 8");
+	beholddb_index_file(db, BEHOLDDB_DML_INDEX_REMOVE, bpath, NULL);
+	beholddb_stamp_file(db, bpath);
+	beholddb_commit(db);
+	beholddb_close(db);
+
+	log_debug("beholddb_delete_file: result=%d", rc);
+	return rc; // TODO: error handling
+}
+
+int beholddb_delete_file(const beholddb_path *bpath)
+{
+	return beholddb_delete_file_with_tags(bpath, NULL, NULL, NULL);
+}
+
+int beholddb_same_directory(const beholddb_path *oldbpath, const beholddb_path *newbpath)
+{
+	if (!oldbpath->basename || !newbpath->basename)
+		return 0;
+
+	int pathlen = oldbpath->basename - oldbpath->realpath;
+
+	return pathlen == newbpath->basename - newbpath->realpath &&
+		!memcmp(oldbpath->realpath, newbpath->realpath, pathlen);
+}
+
+static int beholddb_exists(sqlite3 *db, const char *sql)
+{
+	int rc;
+	sqlite3_stmt *stmt;
+
+	(rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) ||
+	(rc = beholddb_step(stmt));
+
+	sqlite3_finalize(stmt);
+	return SQLITE_ROW == rc;
+}
+
+// apply a tag delta to a plain file: include and exclude are reduced to
+// the tags actually added and removed; with replace, every tag of the
+// file not included is removed
+static int beholddb_retag_apply(sqlite3 *db, const beholddb_path *bpath,
+	const beholddb_tag_list_set *tags, int replace)
+{
+	log_debug("beholddb_retag_apply(%s, replace=%d)", bpath->realpath, replace);
+
+	int rc;
+
+	(rc = beholddb_create_tags(db, &tags->include)) ||
+	(rc = beholddb_set_files_tags(db, &tags->include, &tags->exclude)) ||
+	(rc = beholddb_set_dirs_tags(db, NULL, NULL)) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_CREATE_INCLUDE)) ||
+	replace && (rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_RETAG_REPLACE, bpath->basename)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_RETAG_INCLUDE, bpath->basename)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_RETAG_EXCLUDE, bpath->basename)) ||
+	(rc = beholddb_mark_worker(db, bpath->basename, NULL));
+
+	return rc;
+}
+
+// apply a tag delta and visit the parent only if that changes the
+// directory's aggregate tags
+static int beholddb_retag_worker(sqlite3 *db, const beholddb_path *bpath,
+	const beholddb_tag_list_set *tags, int replace)
+{
+	int rc;
+
+	if ((rc = beholddb_retag_apply(db, bpath, tags, replace)))
+		return rc;
+
+	if (beholddb_exists(db, BEHOLDDB_DML_RETAG_CHANGED))
+	{
+		beholddb_path rpath;
+
+		memcpy(&rpath, bpath, sizeof(rpath));
+		rpath.include.head = NULL;
+		rpath.exclude.head = NULL;
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_RETAG_USED, &rpath.include)) ||
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_RETAG_NOT_UNIVERSAL, &rpath.exclude)) ||
+		(rc = beholddb_mark_recursive(db, &rpath));
+
+		beholddb_free_tag_list(&rpath.include);
+		beholddb_free_tag_list(&rpath.exclude);
+
+		// the parent shares the connection in central mode and leaves
+		// the temporary tables empty
+		if (!rc && beholddb_central)
+			rc = beholddb_set_files_tags(db, NULL, &tags->exclude);
+	}
+
+	rc || (rc = beholddb_exec(db, BEHOLDDB_DML_RETAG_UNUSED_TAGS));
+	return rc;
+}
+
+// rename within one directory database: the files row keeps its id and
+// tags, only the tags named in the new path are added or removed, and
+// the parent is visited only if that changes the directory's aggregate
+// tags; returns BEHOLDDB_FILTER if the slow path has to be taken. The
+// directory is checked by the caller before rename(2), as a reconcile
+// after it would take the old name for an orphan
+static int beholddb_rename_in_place(const beholddb_path *oldbpath, const beholddb_path *newbpath)
+{
+	log_debug("beholddb_rename_in_place(old=%s, new=%s)", oldbpath->realpath, newbpath->realpath);
+
+	int rc, type, other;
+	sqlite3 *db;
+
+	if ((rc = beholddb_open_write(newbpath, &db)))
+	{
+		log_debug("beholddb_rename_in_place: error opening database (%d)", rc);
+		return rc;
+	}
+
+	if ((rc = beholddb_index_attach(db)) ||
+		(rc = beholddb_begin_transaction(db)))
+	{
+		beholddb_close(db);
+		return rc;
+	}
+	beholddb_propagated = 0;
+
+	// names are unique and conflicts are ignored, so replacing another
+	// file is left to delete and create
+	if (SQLITE_ROW != beholddb_get_file_type(db, oldbpath->basename, &type) ||
+		strcmp(oldbpath->basename, newbpath->basename) &&
+		SQLITE_ROW == beholddb_get_file_type(db, newbpath->basename, &other))
+	{
+		log_debug("beholddb_rename_in_place: taking the slow path");
+		beholddb_rollback(db);
+		beholddb_close(db);
+		return BEHOLDDB_FILTER;
+	}
+
+	// path tags are not applied to directories
+	int retag = !type && (newbpath->include.head || newbpath->exclude.head);
+	char *sql = sqlite3_mprintf(
+		"update files set name = '%q' "
+		"where name = '%q'", newbpath->basename, oldbpath->basename);
+
+	(rc = beholddb_exec(db, sql)) ||
+	(rc = beholddb_stamp_file(db, newbpath)) ||
+	retag && (rc = beholddb_retag_worker(db, newbpath, &newbpath->tags, 0)) ||
+	(rc = beholddb_index_file(db, BEHOLDDB_DML_INDEX_RENAME, oldbpath, newbpath->basename)) ||
+	retag && (rc = beholddb_index_file(db, BEHOLDDB_DML_INDEX_FILE, newbpath, NULL)) ||
+	(rc = beholddb_commit(db));
+	sqlite3_free(sql);
+
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_rename_in_place: %s: error %d", oldbpath->realpath, rc);
+		beholddb_rollback(db);
+	} else
+	if (retag)
+		stats_value(STATS_DB_PROPAGATE, beholddb_propagated);
+	beholddb_close(db);
+
+	return rc;
+}
+
+// whether the real path of an entry the directory database does not know
+// yet names a directory; its tags are those of its contents, so it cannot
+// be tagged directly
+static int beholddb_untracked_directory(const beholddb_path *bpath)
+{
+	struct stat st;
+
+	if (lstat(bpath->realpath, &st))
+		return 1;
+	return S_ISDIR(st.st_mode);
+}
+
+// change the tags of a file in one transaction; a file the directory
+// database does not know yet is created with the included tags
+int beholddb_tag_file(const beholddb_path *bpath, const beholddb_tag_list_set *tags, int replace)
+{
+	log_debug("beholddb_tag_file(realpath=%s, replace=%d)", bpath->realpath, replace);
+
+	if (!bpath->basename)
+		return BEHOLDDB_ERROR;
+
+	int rc, type;
+	sqlite3 *db;
+
+	if ((rc = beholddb_open_write(bpath, &db)))
+	{
+		log_debug("beholddb_tag_file: error opening database (%d)", rc);
+		return rc;
+	}
+
+	beholddb_index_attach(db);
+	beholddb_begin_transaction(db);
+	beholddb_propagated = 0;
+
+	if (SQLITE_ROW != beholddb_get_file_type(db, bpath->basename, &type))
+	{
+		beholddb_path cpath;
+
+		beholddb_rollback(db);
+		beholddb_close(db);
+
+		if (beholddb_untracked_directory(bpath))
+		{
+			log_debug("beholddb_tag_file: untracked directory or missing file");
+			return BEHOLDDB_ERROR;
+		}
+
+		memcpy(&cpath, bpath, sizeof(cpath));
+		cpath.include.head = tags->include.head;
+		cpath.exclude.head = NULL;
+		return beholddb_create_file(&cpath, 0);
+	}
+
+	// the tags of a directory are those of its contents
+	if (type)
+	{
+		log_debug("beholddb_tag_file: is a directory");
+		beholddb_rollback(db);
+		beholddb_close(db);
+		return BEHOLDDB_ERROR;
+	}
+
+	rc = beholddb_retag_worker(db, bpath, tags, replace);
+	stats_value(STATS_DB_PROPAGATE, beholddb_propagated);
+
+	beholddb_index_file(db, BEHOLDDB_DML_INDEX_FILE, bpath, NULL);
+	beholddb_commit(db);
+	beholddb_close(db);
+	return rc;
+}
+
+typedef struct beholddb_batch_entry
+{
+	const beholddb_path *bpath;
+	int *status;
+} beholddb_batch_entry;
+
+// group by directory, keeping the order of the records within one
+static int beholddb_batch_compare(const void *a, const void *b)
+{
+	const beholddb_batch_entry *ea = (const beholddb_batch_entry*)a;
+	const beholddb_batch_entry *eb = (const beholddb_batch_entry*)b;
+	int la = ea->bpath->basename - ea->bpath->realpath;
+	int lb = eb->bpath->basename - eb->bpath->realpath;
+	int rc = memcmp(ea->bpath->realpath, eb->bpath->realpath, la < lb ? la : lb);
+
+	return rc ? rc : la != lb ? la - lb : ea->status < eb->status ? -1 : ea->status > eb->status;
+}
+
+// all records of one directory in one transaction; the parent is marked
+// once, from the tags any record touched, after the commit
+static int beholddb_tag_batch_dir(beholddb_batch_entry *entries, int count)
+{
+	log_debug("beholddb_tag_batch_dir(%s, count=%d)", entries->bpath->realpath, count);
+
+	int rc, type;
+	sqlite3 *db;
+
+	if ((rc = beholddb_open_write(entries->bpath, &db)))
+	{
+		for (int i = 0; i < count; ++i)
+			*entries[i].status = rc;
+		return rc;
+	}
+
+	if ((rc = beholddb_index_attach(db)) ||
+		(rc = beholddb_begin_transaction(db)))
+	{
+		for (int i = 0; i < count; ++i)
+			*entries[i].status = rc;
+		beholddb_close(db);
+		return rc;
+	}
+	beholddb_propagated = 0;
+
+	beholddb_tag_list_set tags, dirs_tags;
+
+	tags.include.head = NULL;
+	tags.exclude.head = NULL;
+	dirs_tags.include.head = NULL;
+	dirs_tags.exclude.head = NULL;
+
+	// the tags of each record are reset before it is retagged
+	if (!(rc = beholddb_exec(db, BEHOLDDB_DDL_BATCH)) &&
+		!(rc = beholddb_exec(db, BEHOLDDB_DDL_FILES_TAGS)))
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			const beholddb_path *bpath = entries[i].bpath;
+			int *status = entries[i].status;
+
+			if (SQLITE_ROW != beholddb_get_file_type(db, bpath->basename, &type))
+			{
+				if (beholddb_untracked_directory(bpath))
+				{
+					*status = BEHOLDDB_ERROR;
+					continue;
+				}
+				type = -1;
+			} else
+			if (type)
+			{
+				*status = BEHOLDDB_ERROR;
+				continue;
+			}
+
+			char *sql = type < 0 ? sqlite3_mprintf(
+				"insert into files ( type, name ) "
+				"values ( 0, '%q' )", bpath->basename) : NULL;
+
+			if (!(*status = beholddb_exec(db, BEHOLDDB_DML_BATCH_BEGIN)))
+			{
+				sql && (*status = beholddb_exec(db, sql)) ||
+				(*status = beholddb_exec(db, BEHOLDDB_DML_RESET_FILES_TAGS)) ||
+				(*status = beholddb_retag_apply(db, bpath, &bpath->tags, 0)) ||
+				(*status = beholddb_exec(db, BEHOLDDB_DML_BATCH_TOUCH)) ||
+				(*status = beholddb_exec(db, BEHOLDDB_DML_RETAG_UNUSED_TAGS)) ||
+				(*status = beholddb_index_file(db, BEHOLDDB_DML_INDEX_FILE, bpath, NULL));
+
+				if (*status)
+				{
+					syslog(LOG_ERR, "beholddb_tag_batch: %s: error %d", bpath->realpath, *status);
+					beholddb_exec(db, BEHOLDDB_DML_BATCH_UNDO);
+				} else
+					*status = beholddb_exec(db, BEHOLDDB_DML_BATCH_RELEASE);
+			}
+			sqlite3_free(sql);
+		}
+
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_BATCH_USED, &tags.include)) ||
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_BATCH_UNUSED, &tags.exclude)) ||
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_BATCH_UNIVERSAL, &dirs_tags.include)) ||
+		(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_BATCH_NOT_UNIVERSAL, &dirs_tags.exclude)) ||
+		(rc = beholddb_commit(db));
+	}
+
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_tag_batch: %s: commit failed (%d)", entries->bpath->realpath, rc);
+		beholddb_rollback(db);
+		for (int i = 0; i < count; ++i)
+			*entries[i].status = rc;
+	}
+	beholddb_close(db);
+
+	// the records are committed; a parent left stale fails them all, and
+	// tagging them again touches the same tags and marks it anew
+	if (!rc && (rc = beholddb_mark_parent(entries->bpath, &tags, &dirs_tags)))
+	{
+		syslog(LOG_ERR, "beholddb_tag_batch: %s: marking the parent failed (%d)", entries->bpath->realpath, rc);
+		for (int i = 0; i < count; ++i)
+			*entries[i].status = rc;
+	}
+	stats_value(STATS_DB_PROPAGATE, beholddb_propagated);
+
+	beholddb_free_tag_list(&tags.include);
+	beholddb_free_tag_list(&tags.exclude);
+	beholddb_free_tag_list(&dirs_tags.include);
+	beholddb_free_tag_list(&dirs_tags.exclude);
+
+	return rc;
+}
+
+// apply the include and exclude tags of each path to its file; status
+// receives the result of each record
+int beholddb_tag_batch(beholddb_path **bpaths, int count, int *status)
+{
+	beholddb_batch_entry *entries = (beholddb_batch_entry*)malloc(count * sizeof(beholddb_batch_entry));
+	int n = 0;
+
+	if (!entries)
+		return BEHOLDDB_ERROR;
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (bpaths[i]->basename)
+		{
+			entries[n].bpath = bpaths[i];
+			entries[n++].status = &status[i];
+		} else
+			status[i] = BEHOLDDB_ERROR;
+	}
+
+	if (n)
+		qsort(entries, n, sizeof(beholddb_batch_entry), beholddb_batch_compare);
+	for (int i = 0, j; i < n; i = j)
+	{
+		for (j = i + 1; j < n && beholddb_same_directory(entries[i].bpath, entries[j].bpath); ++j)
+			;
+		beholddb_tag_batch_dir(&entries[i], j - i);
+	}
+
+	free(entries);
+	return BEHOLDDB_OK;
+}
+
+// split a list of tags as getxattr returns it, each one prefixed with
+// the tag char; newlines are accepted as well
+int beholddb_parse_tags(const char *value, size_t size, beholddb_tag_list *list)
+{
+	const char *end = value + size;
+
+	list->head = NULL;
+	while (value < end)
+	{
+		const char *tag = value;
+
+		while (value < end && beholddb_tagchar != *value && '\n' != *value && *value)
+		{
+			if ('/' == *value++)
+			{
+				beholddb_free_tag_list(list);
+				return BEHOLDDB_ERROR;
+			}
+		}
+		if (value > tag)
+		{
+			char *name = (char*)malloc(value - tag + 1);
+
+			memcpy(name, tag, value - tag);
+			name[value - tag] = 0;
+			beholddb_insert_tag(&list->head, name);
+		}
+		++value;
+	}
+
+	return BEHOLDDB_OK;
+}
+
+// split whitespace separated tag edits: +tag or tag adds, -tag removes
+int beholddb_parse_delta(const char *value, size_t size, beholddb_tag_list_set *tags)
+{
+	const char *end = value + size;
+
+	tags->include.head = NULL;
+	tags->exclude.head = NULL;
+	while (value < end)
+	{
+		while (value < end && strchr(" \t\r", *value))
+			++value;
+		if (value == end)
+			break;
+
+		beholddb_tag_list *list = '-' == *value ? &tags->exclude : &tags->include;
+		const char *tag;
+
+		if ('-' == *value || '+' == *value)
+			++value;
+		for (tag = value; value < end && !strchr(" \t\r/", *value); ++value)
+			;
+		if (value < end && '/' == *value)
+		{
+			beholddb_free_tag_list(&tags->include);
+			beholddb_free_tag_list(&tags->exclude);
+			return BEHOLDDB_ERROR;
+		}
+		if (value > tag)
+		{
+			char *name = (char*)malloc(value - tag + 1);
+
+			memcpy(name, tag, value - tag);
+			name[value - tag] = 0;
+			beholddb_insert_tag(&list->head, name);
+		}
+	}
+
+	return BEHOLDDB_OK;
+}
+
+int beholddb_free_tags(beholddb_tag_list *list)
+{
+	beholddb_free_tag_list(list);
+	return BEHOLDDB_OK;
+}
+
+// whether one directory is inside the other, so that propagation from
+// one would need the database already locked for the other
+static int beholddb_nested_directories(const beholddb_path *oldbpath, const beholddb_path *newbpath)
+{
+	int oldlen = oldbpath->basename - oldbpath->realpath - 1;
+	int newlen = newbpath->basename - newbpath->realpath - 1;
+	int len = oldlen < newlen ? oldlen : newlen;
+
+	return !memcmp(oldbpath->realpath, newbpath->realpath, len) &&
+		(oldlen == len ? newbpath->realpath : oldbpath->realpath)[len] == '/';
+}
+
+static int beholddb_read_file(const beholddb_path *bpath,
+	beholddb_tag_list *files_tags, beholddb_tag_list *dirs_tags, int *ptype)
+{
+	int rc;
+	sqlite3 *db;
+
+	if (!bpath->basename)
+		return BEHOLDDB_ERROR;
+
+	if (!(rc = beholddb_open_read(bpath, &db)))
+	{
+		if (SQLITE_ROW == beholddb_get_file_type(db, bpath->basename, ptype))
+			beholddb_get_file_tags(db, bpath->basename, files_tags, dirs_tags, NULL); else
+			rc = BEHOLDDB_ERROR;
+	}
+
+	beholddb_close(db);
+	return rc;
+}
+
+#define BEHOLDDB_INTENT_BUSY_TIMEOUT	5000
+
+// call before the transaction begins, like beholddb_index_attach; only a
+// rename with an intent has somewhere to record its marks
+static int beholddb_intent_attach(sqlite3 *db)
+{
+	if (!beholddb_intent || beholddb_central)
+		return BEHOLDDB_OK;
+
+	int rc;
+
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_ATTACH_INTENTS, BEHOLDDB_INTENT_NAME)) ||
+	(rc = sqlite3_busy_timeout(db, BEHOLDDB_INTENT_BUSY_TIMEOUT));
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_intent_attach: error %d", rc);
+	return rc;
+}
+
+// record the marks of one ancestor chain in the attached intent log
+static int beholddb_intent_mark(sqlite3 *db, int chain,
+	const beholddb_tag_list_set *tags, const beholddb_tag_list_set *dirs_tags)
+{
+	if (!sqlite3_db_filename(db, "intent"))
+		return BEHOLDDB_OK;
+
+	const beholddb_tag_list *lists[] =
+		{ &tags->include, &tags->exclude, &dirs_tags->include, &dirs_tags->exclude };
+	int rc = BEHOLDDB_OK;
+
+	for (int list = 0; !rc && list < 4; ++list)
+	{
+		char *sql = sqlite3_mprintf(BEHOLDDB_DML_INTENT_MARK, (long long)beholddb_intent, chain, list);
+
+		for (beholddb_tag_list_item *item = lists[list]->head; !rc && item; item = item->next)
+			rc = beholddb_exec_bind_text(db, sql, item->name);
+		sqlite3_free(sql);
+	}
+	return rc;
+}
+
+// move a file between two directory databases in one transaction: the
+// destination is opened as main and the source attached. The ancestor
+// chains live in other databases and are marked after the commit; the
+// marks are recorded in the intent log in the same transaction, so that
+// recovery replays the move if it was not committed and the marks if it
+// was. Returns BEHOLDDB_FILTER if the slow path has to be taken
+static int beholddb_move_file(const beholddb_path *oldbpath, const beholddb_path *newbpath)
+{
+	log_debug("beholddb_move_file(old=%s, new=%s)", oldbpath->realpath, newbpath->realpath);
+
+	// in central mode both directories are in one database anyway, and
+	// the slow path runs in the transaction of beholddb_rename_file
+	if (!oldbpath->basename || !newbpath->basename ||
+		beholddb_nested_directories(oldbpath, newbpath) || beholddb_central)
+		return BEHOLDDB_FILTER;
+
+	int rc, type, other;
+	sqlite3 *db;
+	char *db_name;
+
+	// bring the source up to date and make sure there is something to
+	// move; the destination name must be free since conflicts are ignored
+	if ((rc = beholddb_open_write(oldbpath, &db)))
+		return rc;
+	rc = beholddb_get_file_type(db, oldbpath->basename, &type);
+	beholddb_close(db);
+	if (SQLITE_ROW != rc)
+		return BEHOLDDB_FILTER;
+
+	if ((rc = beholddb_open_write(newbpath, &db)))
+	{
+		log_debug("beholddb_move_file: error opening database (%d)", rc);
+		return rc;
+	}
+	if (SQLITE_ROW == beholddb_get_file_type(db, newbpath->basename, &other))
+	{
+		beholddb_close(db);
+		return BEHOLDDB_FILTER;
+	}
+
+	beholddb_get_name(oldbpath, &db_name);
+	rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_ATTACH_SOURCE, db_name);
+	free(db_name);
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_move_file: cannot attach source (%d)", rc);
+		beholddb_close(db);
+		return rc;
+	}
+
+	beholddb_path rpath;
+	beholddb_tag_list_set tags, dirs_tags, new_tags, new_dirs_tags;
+	char *sql = sqlite3_mprintf(
+		"insert into main.files ( type, name ) "
+		"values ( %d, '%q' )", type, newbpath->basename);
+
+	memcpy(&rpath, newbpath, sizeof(rpath));
+	rpath.include.head = NULL;
+	rpath.exclude.head = NULL;
+	tags.include.head = NULL;
+	tags.exclude.head = NULL;
+	dirs_tags.include.head = NULL;
+	dirs_tags.exclude.head = NULL;
+	new_tags.exclude.head = NULL;
+	new_dirs_tags.include.head = NULL;
+	beholddb_propagated = 0;
+
+	// the first failure rolls the whole move back; the intent is kept
+	// and recovery replays it
+	(rc = beholddb_index_attach(db)) ||
+	(rc = beholddb_intent_attach(db)) ||
+	(rc = beholddb_begin_transaction(db)) ||
+	(rc = beholddb_exec(db, sql)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_MOVE_TAGS, oldbpath->basename)) ||
+	(rc = beholddb_set_files_tags(db, NULL, NULL)) ||
+	(rc = beholddb_set_dirs_tags(db, NULL, NULL)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_MOVE_INCLUDE, oldbpath->basename)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_MOVE_DIRS_INCLUDE, oldbpath->basename)) ||
+	!type && (
+		(rc = beholddb_create_tags(db, &newbpath->include)) ||
+		(rc = beholddb_set_files_tags(db, &newbpath->include, &newbpath->exclude))) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_CREATE_INCLUDE)) ||
+	(rc = beholddb_mark_worker(db, newbpath->basename, NULL)) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_CREATE_EXCLUDE)) ||
+	(rc = beholddb_get_files_tags(db, &rpath.tags)) ||
+	(rc = beholddb_exec_bind_text(db, BEHOLDDB_DML_MOVE_DELETE, oldbpath->basename)) ||
+	(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_MOVE_UNUSED_TAGS, &tags.exclude)) ||
+	(rc = beholddb_get_tags_worker(db, BEHOLDDB_DML_MOVE_UNIVERSAL_TAGS, &dirs_tags.include)) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_MOVE_DELETE_UNUSED_TAGS)) ||
+	(rc = beholddb_get_marks(db, &rpath, &new_tags, &new_dirs_tags)) ||
+	(rc = beholddb_intent_mark(db, 1, &new_tags, &new_dirs_tags)) ||
+	(rc = beholddb_intent_mark(db, 0, &tags, &dirs_tags)) ||
+	(rc = beholddb_index_file(db, BEHOLDDB_DML_INDEX_REMOVE, oldbpath, NULL)) ||
+	(rc = beholddb_index_file(db, BEHOLDDB_DML_INDEX_FILE, newbpath, NULL)) ||
+	(rc = beholddb_stamp_file(db, newbpath)) ||
+	(rc = beholddb_stamp_source(db, oldbpath)) ||
+	(rc = beholddb_commit(db));
+	sqlite3_free(sql);
+
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_move_file: %s: error %d", oldbpath->realpath, rc);
+		beholddb_rollback(db);
+	}
+	if (sqlite3_db_filename(db, "intent"))
+		beholddb_exec(db, BEHOLDDB_DML_DETACH_INTENTS);
+	beholddb_exec(db, BEHOLDDB_DML_DETACH_SOURCE);
+	beholddb_close(db);
+
+	// a failure here leaves the intent for recovery to replay the marks
+	log_debug("beholddb_move_file: checkpoint 7");
+	if (!rc)
+	{
+		(rc = beholddb_mark_parent(newbpath, &new_tags, &new_dirs_tags)) ||
+		(rc = beholddb_mark_parent(oldbpath, &tags, &dirs_tags));
+		stats_value(STATS_DB_PROPAGATE, beholddb_propagated);
+	}
+
+	beholddb_free_tag_list(&rpath.include);
+	beholddb_free_tag_list(&rpath.exclude);
+	beholddb_free_tag_list(&tags.exclude);
+	beholddb_free_tag_list(&dirs_tags.include);
+	beholddb_free_tag_list(&new_tags.exclude);
+	beholddb_free_tag_list(&new_dirs_tags.include);
+
+	return rc;
+}
+
+static int beholddb_rename_worker(const beholddb_path *oldbpath, const beholddb_path *newbpath)
+{
+	int rc, type;
+	beholddb_tag_list files_tags, dirs_tags;
+
+	if (beholddb_same_directory(oldbpath, newbpath))
+		rc = beholddb_rename_in_place(oldbpath, newbpath); else
+		rc = beholddb_move_file(oldbpath, newbpath);
+	if (BEHOLDDB_FILTER != rc)
+		return rc;
+
+	// create before delete, so that replaying an interrupted rename from
+	// the intent log never loses the tags
+	files_tags.head = NULL;
+	dirs_tags.head = NULL;
+	if (!beholddb_read_file(oldbpath, &files_tags, &dirs_tags, &type))
+		rc = beholddb_create_file_with_tags(newbpath, &files_tags, &dirs_tags, type); else
+		rc = beholddb_create_file(newbpath, 0);
+	rc || (rc = beholddb_delete_file(oldbpath));
+
+	beholddb_free_tag_list(&files_tags);
+	beholddb_free_tag_list(&dirs_tags);
+	return rc;
+}
+
+// in central mode the metadata of a directory is found through its
+// entry in dirs, which has to follow the rename
+static int beholddb_central_move_dir(sqlite3 *db,
+	const beholddb_path *oldbpath, const beholddb_path *newbpath)
+{
+	int rc;
+	sqlite3_int64 from, to;
+	sqlite3_stmt *stmt = NULL;
+	char *olddir = beholddb_dirname(oldbpath);
+	char *newdir = beholddb_dirname(newbpath);
+
+	(rc = beholddb_central_lookup(db, olddir, 0, &from)) ||
+	!from ||
+	(rc = beholddb_central_lookup(db, newdir, 1, &to)) ||
+	(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_CENTRAL_MOVE_DIR, -1, &stmt, NULL)) ||
+	(rc = sqlite3_bind_int64(stmt, 1, to)) ||
+	(rc = sqlite3_bind_text(stmt, 2, newbpath->basename, -1, SQLITE_STATIC)) ||
+	(rc = sqlite3_bind_int64(stmt, 3, from)) ||
+	(rc = sqlite3_bind_text(stmt, 4, oldbpath->basename, -1, SQLITE_STATIC)) ||
+	SQLITE_DONE != (rc = sqlite3_step(stmt)) ||
+	(rc = SQLITE_OK);
+
+	sqlite3_finalize(stmt);
+	free(olddir);
+	free(newdir);
+	return rc;
+}
+
+int beholddb_rename_file(const beholddb_path *oldbpath, const beholddb_path *newbpath)
+{
+	if (!beholddb_central || !oldbpath->basename || !newbpath->basename)
+	{
+		beholddb_index_move(oldbpath, newbpath);
+		return beholddb_rename_worker(oldbpath, newbpath);
+	}
+
+	// everything the rename does goes in one transaction on the
+	// connection of the thread, held open by the destination
+	int rc;
+	sqlite3 *db;
+
+	if ((rc = beholddb_open_write(newbpath, &db)))
+		return rc;
+
+	(rc = beholddb_begin_transaction(db)) ||
+	(rc = beholddb_central_move_dir(db, oldbpath, newbpath)) ||
+	(rc = beholddb_rename_worker(oldbpath, newbpath)) ||
+	(rc = beholddb_commit(db));
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_rename_file: error %d", rc);
+		beholddb_rollback(db);
+	}
+
+	beholddb_close(db);
+	return rc;
+}
+
+static int beholddb_open_intents(sqlite3 **pdb)
+{
+	int rc;
+
+	if ((rc = sqlite3_open_v2(BEHOLDDB_INTENT_NAME, pdb,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) ||
+		(rc = sqlite3_busy_timeout(*pdb, BEHOLDDB_INTENT_BUSY_TIMEOUT)) ||
+		(rc = beholddb_exec(*pdb, "pragma journal_mode = persist;")) ||
+		(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CREATE_INTENTS)))
+	{
+		syslog(LOG_ERR, "beholddb_open_intents: error %d", rc);
+		sqlite3_close(*pdb);
+		*pdb = NULL;
+	}
+	return rc;
+}
+
+// record a rename before it is done on the underlying filesystem
+int beholddb_intent_begin(const char *oldpath, const char *newpath, int64_t *pid)
+{
+	int rc;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+
+	*pid = beholddb_intent = 0;
+	if ((rc = beholddb_open_intents(&db)))
+		return rc;
+
+	(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_INTENT_BEGIN, -1, &stmt, NULL)) ||
+	(rc = sqlite3_bind_text(stmt, 1, oldpath, -1, SQLITE_STATIC)) ||
+	(rc = sqlite3_bind_text(stmt, 2, newpath, -1, SQLITE_STATIC)) ||
+	SQLITE_DONE != (rc = sqlite3_step(stmt)) ||
+	(rc = SQLITE_OK);
+
+	if (!rc)
+		beholddb_intent = *pid = sqlite3_last_insert_rowid(db); else
+		syslog(LOG_ERR, "beholddb_intent_begin: error %d", rc);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return rc;
+}
+
+int beholddb_intent_end(int64_t id)
+{
+	beholddb_intent = 0;
+	if (!id)
+		return BEHOLDDB_OK;
+
+	int rc;
+	sqlite3 *db;
+	char *sql;
+
+	if ((rc = beholddb_open_intents(&db)))
+		return rc;
+
+	sql = sqlite3_mprintf(BEHOLDDB_DML_INTENT_END, (long long)id, (long long)id);
+	rc = beholddb_exec(db, sql);
+	sqlite3_free(sql);
+	sqlite3_close(db);
+	return rc;
+}
+
+typedef struct beholddb_intent_item
+{
+	int64_t id;
+	char *oldpath;
+	char *newpath;
+} beholddb_intent_item;
+
+// give an ancestor chain the marks a committed move recorded
+static int beholddb_replay_marks(sqlite3 *db, int64_t id, int chain, const beholddb_path *bpath)
+{
+	beholddb_tag_list lists[4];
+	int rc = BEHOLDDB_OK, count = 0;
+
+	for (int list = 0; list < 4; ++list)
+	{
+		char *sql = sqlite3_mprintf(BEHOLDDB_DML_INTENT_MARKS, (long long)id, chain, list);
+
+		lists[list].head = NULL;
+		if (!rc)
+			rc = beholddb_get_tags_worker(db, sql, &lists[list]);
+		sqlite3_free(sql);
+		count += !!lists[list].head;
+	}
+
+	if (!rc && count)
+	{
+		beholddb_tag_list_set tags, dirs_tags;
+
+		tags.include = lists[0];
+		tags.exclude = lists[1];
+		dirs_tags.include = lists[2];
+		dirs_tags.exclude = lists[3];
+		beholddb_replaying = 1;
+		rc = beholddb_mark_parent(bpath, &tags, &dirs_tags);
+		beholddb_replaying = 0;
+	}
+
+	for (int list = 0; list < 4; ++list)
+		beholddb_free_tag_list(&lists[list]);
+	return rc;
+}
+
+static int beholddb_recover_rename(sqlite3 *db, int64_t id, const char *oldpath, const char *newpath)
+{
+	beholddb_path *oldbpath, *newbpath;
+	struct stat st;
+	int type;
+
+	if (beholddb_parse_path(oldpath, &oldbpath))
+		return BEHOLDDB_ERROR;
+	if (beholddb_parse_path(newpath, &newbpath))
+	{
+		beholddb_free_path(oldbpath);
+		return BEHOLDDB_ERROR;
+	}
+
+	// the rename happened if only the new name exists; the metadata
+	// still has to be moved if the source directory knows the old name
+	if (lstat(oldbpath->realpath, &st) && !lstat(newbpath->realpath, &st) &&
+		!beholddb_read_file(oldbpath, NULL, NULL, &type))
+	{
+		syslog(LOG_NOTICE, "beholddb_recover: replaying rename %s -> %s", oldpath, newpath);
+		beholddb_intent = id;
+		beholddb_rename_file(oldbpath, newbpath);
+		beholddb_intent = 0;
+	} else
+	{
+		// the move was committed, its marks may not all have been made;
+		// none were recorded if it was not
+		beholddb_replay_marks(db, id, 1, newbpath);
+		beholddb_replay_marks(db, id, 0, oldbpath);
+	}
+
+	beholddb_free_path(oldbpath);
+	beholddb_free_path(newbpath);
+	return BEHOLDDB_OK;
+}
+
+// replay renames interrupted by a crash; called once at mount
+int beholddb_recover()
+{
+	int rc, count = 0, size = 16;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	beholddb_intent_item *intents;
+
+	if (access(BEHOLDDB_INTENT_NAME, F_OK))
+		return BEHOLDDB_OK;
+
+	if ((rc = beholddb_open_intents(&db)))
+		return rc;
+
+	// read them all first: a replayed move records its marks in the log
+	// and cannot commit while the list is being read
+	intents = (beholddb_intent_item*)malloc(size * sizeof(beholddb_intent_item));
+	if (!(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_INTENT_LIST, -1, &stmt, NULL)))
+	{
+		while (SQLITE_ROW == (rc = sqlite3_step(stmt)))
+		{
+			if (count == size)
+				intents = (beholddb_intent_item*)realloc(intents, (size *= 2) * sizeof(beholddb_intent_item));
+			intents[count].id = sqlite3_column_int64(stmt, 0);
+			intents[count].oldpath = strdup((const char*)sqlite3_column_text(stmt, 1));
+			intents[count].newpath = strdup((const char*)sqlite3_column_text(stmt, 2));
+			++count;
+		}
+		if (SQLITE_DONE == rc)
+			rc = SQLITE_OK;
+	}
+	sqlite3_finalize(stmt);
+
+	beholddb_recovering = 1;
+	for (int i = 0; i < count; ++i)
+	{
+		if (!rc)
+			beholddb_recover_rename(db, intents[i].id, intents[i].oldpath, intents[i].newpath);
+		free(intents[i].oldpath);
+		free(intents[i].newpath);
+	}
+	beholddb_recovering = 0;
+	free(intents);
+
+	if (!rc)
+		rc = beholddb_exec(db, BEHOLDDB_DML_INTENT_CLEAR);
+	if (rc)
+		syslog(LOG_ERR, "beholddb_recover: error %d", rc);
+	sqlite3_close(db);
+	return rc;
+}
+
+static int beholddb_open_rules(sqlite3 **pdb)
+{
+	int rc;
+
+	if ((rc = sqlite3_open_v2(BEHOLDDB_RULES_NAME, pdb,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) ||
+		(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CREATE_RULES)))
+	{
+		syslog(LOG_ERR, "beholddb_open_rules: error %d", rc);
+		sqlite3_close(*pdb);
+		*pdb = NULL;
+	}
+	return rc;
+}
+
+// replace the closure the views are parsed against with the one stored
+static int beholddb_load_rules(sqlite3 *db)
+{
+	int rc, count = 0, size = 16;
+	sqlite3_stmt *stmt;
+	beholddb_implied *rules = (beholddb_implied*)malloc(size * sizeof(beholddb_implied));
+
+	if (!(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_RULE_CLOSURE, -1, &stmt, NULL)))
+	{
+		while (SQLITE_ROW == (rc = sqlite3_step(stmt)))
+		{
+			if (count == size)
+				rules = (beholddb_implied*)realloc(rules, (size *= 2) * sizeof(beholddb_implied));
+			rules[count].implies = strdup((const char*)sqlite3_column_text(stmt, 0));
+			rules[count].tag = strdup((const char*)sqlite3_column_text(stmt, 1));
+			++count;
+		}
+		if (SQLITE_DONE == rc)
+			rc = SQLITE_OK;
+	}
+	sqlite3_finalize(stmt);
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_load_rules: error %d", rc); else
+	{
+		beholddb_implied *old = beholddb_rules;
+		int oldcount = beholddb_rules_count;
+
+		pthread_rwlock_wrlock(&beholddb_rules_lock);
+		beholddb_rules = rules;
+		beholddb_rules_count = count;
+		pthread_rwlock_unlock(&beholddb_rules_lock);
+		rules = old;
+		count = oldcount;
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		free(rules[i].implies);
+		free(rules[i].tag);
+	}
+	free(rules);
+	return rc;
+}
+
+// read the tag implication rules; called once at mount
+int beholddb_rules_init()
+{
+	int rc;
+	sqlite3 *db;
+
+	if (access(BEHOLDDB_RULES_NAME, F_OK))
+		return BEHOLDDB_OK;
+	if ((rc = beholddb_open_rules(&db)))
+		return rc;
+
+	if (!(rc = beholddb_load_rules(db)))
+		syslog(LOG_NOTICE, "beholddb_rules_init: %d implied tags", beholddb_rules_count);
+	sqlite3_close(db);
+	return rc;
+}
+
+// tag implies another, cat < animal, or is another name of it; the
+// closure is brought up to date in the same transaction
+int beholddb_set_rule(const char *tag, const char *implies, int alias, int remove)
+{
+	log_debug("beholddb_set_rule(tag=%s, implies=%s, alias=%d, remove=%d)", tag, implies, alias, remove);
+
+	int rc;
+	sqlite3 *db;
+	const char *texts[] = { tag, implies, alias ? "1" : "0" };
+
+	if (!*tag || !*implies || !strcmp(tag, implies) ||
+		strpbrk(tag, "/*?") || strchr(tag, beholddb_tagchar) ||
+		strpbrk(implies, "/*?") || strchr(implies, beholddb_tagchar))
+		return BEHOLDDB_ERROR;
+	if ((rc = beholddb_open_rules(&db)))
+		return rc;
+
+	// the closure is loaded in the order the rules are changed
+	pthread_mutex_lock(&beholddb_rules_mutex);
+	(rc = beholddb_exec(db, "begin immediate transaction;")) ||
+	(rc = beholddb_exec_bind_texts(db,
+		remove ? BEHOLDDB_DML_RULE_REMOVE : BEHOLDDB_DML_RULE_ADD, 3, texts)) ||
+	(rc = beholddb_exec(db, "commit;")) ||
+	(rc = beholddb_load_rules(db));
+
+	if (rc)
+	{
+		syslog(LOG_ERR, "beholddb_set_rule: error %d", rc);
+		if (!sqlite3_get_autocommit(db))
+			beholddb_exec(db, "rollback;");
+	}
+	pthread_mutex_unlock(&beholddb_rules_mutex);
+	sqlite3_close(db);
 	return rc;
 }
 
-static int beholddb_mark_object(const beholddb_path *bpath, const beholddb_tag_list_set *dirs_tags)
+// the rules one per line, as they are written to %.rules
+int beholddb_format_rules(char **pdata, size_t *psize)
 {
-	syslog(LOG_DEBUG, "beholddb_mark_object(path=%s)", bpath->realpath);
-
 	int rc;
 	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	FILE *out;
 
-	(rc = beholddb_open_write(bpath, &db)) ||
-	(rc = beholddb_mark(db, bpath, dirs_tags));
+	*pdata = NULL;
+	*psize = 0;
+	if (access(BEHOLDDB_RULES_NAME, F_OK))
+		return BEHOLDDB_OK;
+	if ((rc = beholddb_open_rules(&db)))
+		return rc;
+	if (!(out = open_memstream(pdata, psize)))
+	{
+		sqlite3_close(db);
+		return BEHOLDDB_ERROR;
+	}
 
-	sqlite3_close(db);
+	if (!(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_RULE_LIST, -1, &stmt, NULL)))
+	{
+		while (SQLITE_ROW == (rc = sqlite3_step(stmt)))
+			fprintf(out, "%s %c %s\n",
+				(const char*)sqlite3_column_text(stmt, 0),
+				sqlite3_column_int(stmt, 2) ? '=' : '<',
+				(const char*)sqlite3_column_text(stmt, 1));
+		if (SQLITE_DONE == rc)
+			rc = SQLITE_OK;
+	}
+	sqlite3_finalize(stmt);
+	fclose(out);
 
 	if (rc)
-		syslog(LOG_DEBUG, "beholddb_mark: error (%d)", rc);
+	{
+		syslog(LOG_ERR, "beholddb_format_rules: error %d", rc);
+		free(*pdata);
+		*pdata = NULL;
+		*psize = 0;
+	}
+	sqlite3_close(db);
 	return rc;
 }
 
-static const char *no_tags[] = { NULL, NULL };
+static int beholddb_open_directory(const char *dir, int write, sqlite3 **pdb)
+{
+	int pathlen = strlen(dir);
+	char *path = (char*)malloc(pathlen + 3);
+	beholddb_path db_path;
+	int rc;
 
-static int beholddb_create_file_with_tags(const beholddb_path *bpath,
-	const beholddb_tag_list *files_tags, const beholddb_tag_list *dirs_tags,
-	int type)
+	memcpy(path, dir, pathlen);
+	path[pathlen++] = '/';
+	db_path.realpath = path;
+	db_path.basename = &path[pathlen];
+	path[pathlen++] = '.';
+	path[pathlen++] = 0;
+
+	rc = write ?
+		beholddb_open_write(&db_path, pdb) :
+		beholddb_open_read(&db_path, pdb);
+	free(path);
+	return rc;
+}
+
+// open (and create) the metadata of a directory given by its real path,
+// for tools working on the tree directly
+int beholddb_open_metadata(const char *dir, sqlite3 **pdb)
 {
-	syslog(LOG_DEBUG, "beholddb_create_file(realpath=%s)", bpath->realpath);
+	return beholddb_open_directory(dir, 1, pdb);
+}
 
-	if (!bpath->basename)
+// open the metadata of a directory for reading only; *pdb is NULL if the
+// directory has none
+static int beholddb_open_metadata_read(const char *dir, sqlite3 **pdb)
+{
+	*pdb = NULL;
+	if (!beholddb_central)
 	{
-		syslog(LOG_DEBUG, "beholddb_create_file: no basename (%s)", bpath->realpath);
-		return BEHOLDDB_OK;
+		char *db_name = sqlite3_mprintf("%s/%s", dir, BEHOLDDB_NAME);
+		int missing = access(db_name, F_OK);
+
+		sqlite3_free(db_name);
+		if (missing)
+			return BEHOLDDB_OK;
 	}
+	return beholddb_open_directory(dir, 0, pdb);
+}
 
+// the connection a deep view is answered on, with the tags of the view
+// in place; in central mode *pid is the directory searched
+static int beholddb_open_deep(const beholddb_path *bpath, sqlite3 **pdb, sqlite3_int64 *pid)
+{
 	int rc;
-	sqlite3 *db;
 
-	if ((rc = beholddb_open_write(bpath, &db)))
+	*pdb = NULL;
+	*pid = 0;
+	if (beholddb_central)
 	{
-		syslog(LOG_DEBUG, "beholddb_create_file: error opening database (%d)", rc);
-		return rc;
-	}
+		char *root = strndup(bpath->realpath, bpath->deep - bpath->realpath);
 
-	beholddb_begin_transaction(db);
+		(rc = beholddb_open_central(pdb)) ||
+		(rc = beholddb_central_lookup(*pdb, root, 0, pid)) ||
+		!*pid && (rc = SQLITE_CANTOPEN);
+		free(root);
+	} else
+	if (!beholddb_index)
+	{
+		log_debug("beholddb_open_deep: mounted without an index");
+		return BEHOLDDB_ERROR;
+	} else
+		rc = beholddb_open_index(pdb);
 
-	syslog(LOG_DEBUG, "beholddb_create_file: checkpoint 1");
-	char *sql = sqlite3_mprintf(
-		"insert into files ( type, name ) "
-		"values ( %d, '%q' )", !!type, bpath->basename);
-	rc = beholddb_exec(db, sql);
-	sqlite3_free(sql);
+	// an expression is set up by the statement it is needed for
+	rc || bpath->expr ||
+	(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_DEEP)) ||
+	(rc = beholddb_set_tags_worker(*pdb, BEHOLDDB_DML_DEEP_INCLUDE, &bpath->include)) ||
+	(rc = beholddb_set_tags_worker(*pdb, BEHOLDDB_DML_DEEP_EXCLUDE, &bpath->exclude));
 
-	syslog(LOG_DEBUG, "beholddb_create_file: checkpoint 2");
-	beholddb_create_tags(db, files_tags);
-	if (type)
-		beholddb_create_tags(db, dirs_tags); else
+	if (rc)
 	{
-		beholddb_create_tags(db, &bpath->include);
-		beholddb_set_files_tags(db, &bpath->include, &bpath->exclude);
+		syslog(LOG_ERR, "beholddb_open_deep: %s: error %d", bpath->realpath, rc);
+		sqlite3_close(*pdb);
+		*pdb = NULL;
 	}
+	return rc;
+}
 
- 	beholddb_set_files_tags(db, files_tags, NULL);
-	beholddb_set_dirs_tags(db, dirs_tags, NULL);
-
-	syslog(LOG_DEBUG, "beholddb_create_file: checkpoint 3");
-	beholddb_exec(db,
-		"delete from include "
-		"where id in "
-		"(select id from exclude);"
-
-		"insert into exclude "
-		"select id, name from tags "
-		"except "
-		"select id, name from include;");
-
-	int changes;
-
-	syslog(LOG_DEBUG, "beholddb_create_file: checkpoint 4");
-	beholddb_mark_worker(db, bpath->basename, &changes);
-
-	beholddb_path rpath;
-
-	syslog(LOG_DEBUG, "beholddb_create_file: checkpoint 5");
-	memcpy(&rpath, bpath, sizeof(rpath));
-	rpath.include.head = NULL;
-	rpath.exclude.head = NULL;
-	beholddb_get_files_tags(db, &rpath.tags);
+// ?1 of the deep statements: the directory, by id or by path; listings
+// outlive the path
+static int beholddb_bind_deep(sqlite3_stmt *stmt, const beholddb_path *bpath, sqlite3_int64 id)
+{
+	if (beholddb_central)
+		return sqlite3_bind_int64(stmt, 1, id);
+	return sqlite3_bind_text(stmt, 1, bpath->realpath, bpath->deep - bpath->realpath, SQLITE_TRANSIENT);
+}
 
-	syslog(LOG_DEBUG, "beholddb_create_file: checkpoint 6");
-	beholddb_mark_recursive(db, &rpath);
+// the files of a deep view with alternatives; in central mode the plan
+// only looks at the directories below the one with the id
+static int beholddb_set_deep_expression(sqlite3 *db, const beholddb_path *bpath, sqlite3_int64 id)
+{
+	if (!beholddb_central)
+		return beholddb_set_expression(db, bpath->expr, &BEHOLDDB_DIALECT_INDEX);
 
-	syslog(LOG_DEBUG, "beholddb_create_file: checkpoint 7");
-	beholddb_free_tag_list(&rpath.include);
-	beholddb_free_tag_list(&rpath.exclude);
+	int rc;
+	sqlite3_stmt *stmt = NULL;
 
-	syslog(LOG_DEBUG, "beholddb_create_file: checkpoint 8");
-	beholddb_commit(db);
-	sqlite3_close(db);
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_EXPRESSION_BELOW)) ||
+	(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_EXPRESSION_BELOW, -1, &stmt, NULL)) ||
+	(rc = sqlite3_bind_int64(stmt, 1, id)) ||
+	SQLITE_DONE != (rc = beholddb_step(stmt)) ||
+	(rc = SQLITE_OK);
 
-	return rc; // TODO: error handling
+	sqlite3_finalize(stmt);
+	return rc ? rc : beholddb_set_expression(db, bpath->expr, &BEHOLDDB_DIALECT_CENTRAL);
 }
 
-int beholddb_create_file(const beholddb_path *bpath, int type)
+static const char *beholddb_deep_listing(const beholddb_path *bpath)
 {
-	return beholddb_create_file_with_tags(bpath, NULL, NULL, type);
+	// %%tag% lists the other tags of the files in the view
+	if (bpath->expr)
+		return bpath->listing ?
+			beholddb_central ? BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_TAG_LISTING : BEHOLDDB_DML_DEEP_EXPRESSION_TAG_LISTING :
+			beholddb_central ? BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_LISTING : BEHOLDDB_DML_DEEP_EXPRESSION_LISTING;
+	return bpath->listing ?
+		beholddb_central ? BEHOLDDB_DML_DEEP_CENTRAL_TAG_LISTING : BEHOLDDB_DML_DEEP_TAG_LISTING :
+		beholddb_central ? BEHOLDDB_DML_DEEP_CENTRAL_LISTING : BEHOLDDB_DML_DEEP_LISTING;
 }
 
-static int beholddb_delete_file_with_tags(const beholddb_path *bpath,
-	beholddb_tag_list *files_tags, beholddb_tag_list *dirs_tags,
-	int *ptype)
+static int beholddb_opendeep(const beholddb_path *bpath, void **phandle)
 {
-	syslog(LOG_DEBUG, "beholddb_delete_file(realpath=%s)", bpath->realpath);
-
-	if (!bpath->basename)
-	{
-		syslog(LOG_DEBUG, "beholddb_delete_file: no base name (%s)", bpath->realpath);
-		return BEHOLDDB_OK;
-	}
-
 	int rc;
 	sqlite3 *db;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_int64 id;
+	const char tagchar[] = { beholddb_tagchar, 0 };
 
-	if ((rc = beholddb_open_write(bpath, &db)))
+	if ((rc = beholddb_open_deep(bpath, &db, &id)))
+		return rc;
+
+	bpath->expr && (rc = beholddb_set_deep_expression(db, bpath, id)) ||
+	(rc = sqlite3_prepare_v2(db, beholddb_deep_listing(bpath), -1, &stmt, NULL)) ||
+	(rc = beholddb_bind_deep(stmt, bpath, id)) ||
+	!bpath->listing && (rc = sqlite3_bind_text(stmt, 2, tagchar, -1, SQLITE_TRANSIENT)) ||
+	(rc = sqlite3_bind_int64(stmt, 3, 0));
+
+	if (rc)
 	{
-		syslog(LOG_DEBUG, "beholddb_delete_file: error opening database (%d)", rc);
+		syslog(LOG_ERR, "beholddb_opendir: deep view: error %d", rc);
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
 		return rc;
 	}
 
-	beholddb_begin_transaction(db);
+	beholddb_dir *dir = (beholddb_dir*)malloc(sizeof(beholddb_dir));
 
-	beholddb_get_file_tags(db, bpath->basename, files_tags, dirs_tags, ptype);
-	beholddb_set_files_tags(db, NULL, NULL);
-	beholddb_exec_bind_text(db,
-		"delete from files "
-		"where name = ?;",
-		bpath->basename);
-	beholddb_exec(db,
-		"insert into exclude "
-		"select t.id, t.name from tags t "
-		"where not exists "
-			"(select * from files_tags ft where ft.id_tag = t.id);"
+	dir->db = db;
+	dir->stmt = stmt;
+	dir->listing = 0;
+	dir->deep = 1;
+	dir->listing_sql = dir->listing_from_sql = NULL;
+	dir->prefix = bpath->prefix ? strdup(bpath->prefix) : NULL;
+	*phandle = (void*)dir;
+	return BEHOLDDB_OK;
+}
 
-		"delete from tags "
-		"where id in "
-			"(select id from exclude);"
+// the file an entry of a deep view stands for, relative to the directory
+// of the view: an entry is named after its file, or, if other files in
+// the view share the name, tagchar id tagchar name, which no name the
+// view lists as it is can look like
+int beholddb_get_deep_target(const beholddb_path *bpath, char **ptarget)
+{
+	log_debug("beholddb_get_deep_target(realpath=%s)", bpath->realpath);
 
-		"insert into include "
-		"select id, name from tags "
-		"except "
-		"select id, name from exclude;");
+	*ptarget = NULL;
 
-	beholddb_path rpath;
+	// only the entries themselves, nothing below them
+	const char *view = bpath->deep && *bpath->deep ? strchr(bpath->deep + 1, '/') : NULL;
 
-	syslog(LOG_DEBUG, "beholddb_delete_file: checkpoint 5");
-	memcpy(&rpath, bpath, sizeof(rpath));
-	rpath.include.head = NULL;
-	rpath.exclude.head = NULL;
-	beholddb_get_files_tags(db, &rpath.tags);
+	if (!view || view + 1 != bpath->basename)
+		return BEHOLDDB_ERROR;
 
-	syslog(LOG_DEBUG, "beholddb_delete_file: checkpoint 6");
-	beholddb_mark_recursive(db, bpath);
+	int rc;
+	sqlite3 *db;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_int64 id;
+	const char *name = bpath->basename;
+	char *end;
+	long long file = 0;
 
-	syslog(LOG_DEBUG, "beholddb_delete_file: checkpoint 7");
-	beholddb_free_tag_list(&rpath.include);
-	beholddb_free_tag_list(&rpath.exclude);
+	if (beholddb_tagchar == *name)
+	{
+		file = strtoll(name + 1, &end, 10);
+		if (end != name + 1 && beholddb_tagchar == *end && end[1])
+			name = end + 1; else
+			file = 0;
+	}
 
-	syslog(LOG_DEBUG, "beholddb_delete_file: checkpoint 8");
-	beholddb_commit(db);
-	sqlite3_close(db);
+	if ((rc = beholddb_open_deep(bpath, &db, &id)))
+		return rc;
 
-	syslog(LOG_DEBUG, "beholddb_delete_file: result=%d", rc);
-	return rc; // TODO: error handling
-}
+	// the expression is tested on the files of the name, its tags bound
+	// after the parameters of the lookup
+	if (bpath->expr)
+		rc = beholddb_prepare_expression(db,
+			beholddb_central ? BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_LOOKUP : BEHOLDDB_DML_DEEP_EXPRESSION_LOOKUP,
+			bpath->expr, beholddb_central ? &BEHOLDDB_DIALECT_CENTRAL : &BEHOLDDB_DIALECT_INDEX, 4, &stmt); else
+		rc = sqlite3_prepare_v2(db,
+			beholddb_central ? BEHOLDDB_DML_DEEP_CENTRAL_LOOKUP : BEHOLDDB_DML_DEEP_LOOKUP,
+			-1, &stmt, NULL);
+
+	rc ||
+	(rc = beholddb_bind_deep(stmt, bpath, id)) ||
+	(rc = sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC)) ||
+	file && (rc = sqlite3_bind_int64(stmt, 3, file));
+
+	// a bare name has to be the only one
+	if (!rc && SQLITE_ROW == (rc = beholddb_step(stmt)))
+	{
+		*ptarget = strdup((const char*)sqlite3_column_text(stmt, 0));
+		if (SQLITE_ROW == beholddb_step(stmt))
+		{
+			free(*ptarget);
+			*ptarget = NULL;
+		}
+	}
 
-int beholddb_delete_file(const beholddb_path *bpath)
-{
-	return beholddb_delete_file_with_tags(bpath, NULL, NULL, NULL);
+	rc = *ptarget ? BEHOLDDB_OK : BEHOLDDB_ERROR;
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	log_debug("beholddb_get_deep_target: target=%s", *ptarget);
+	return rc;
 }
 
-int beholddb_rename_file(const beholddb_path *oldbpath, const beholddb_path *newbpath)
+// a tag listing; the one of the tags with a prefix takes the prefix as
+// a glob, with the characters special to glob escaped
+static int beholddb_prepare_listing(sqlite3 *db, const char *sql, const char *prefix, sqlite3_stmt **pstmt)
 {
-	int type;
-	beholddb_tag_list files_tags, dirs_tags;
+	int rc;
 
-	files_tags.head = NULL;
-	dirs_tags.head = NULL;
-	beholddb_delete_file_with_tags(oldbpath, &files_tags, &dirs_tags, &type);
-	beholddb_create_file_with_tags(newbpath, &files_tags, &dirs_tags, type);
+	if ((rc = sqlite3_prepare_v2(db, sql, -1, pstmt, NULL)) ||
+		sql != BEHOLDDB_DML_PREFIX_TAG_LISTING && sql != BEHOLDDB_DML_PREFIX_TAG_LISTING_FROM)
+		return rc;
 
-	beholddb_free_tag_list(&files_tags);
-	beholddb_free_tag_list(&dirs_tags);
-	return 0; // TODO: error handling
+	char *glob = (char*)malloc(3 * strlen(prefix) + 2);
+	char *end = glob;
+
+	for (; *prefix; ++prefix)
+		if (strchr("*?[", *prefix))
+		{
+			*end++ = '[';
+			*end++ = *prefix;
+			*end++ = ']';
+		} else
+			*end++ = *prefix;
+	*end++ = '*';
+	*end = 0;
+	return sqlite3_bind_text(*pstmt, 3, glob, -1, free);
 }
 
 int beholddb_opendir(const beholddb_path *bpath, void **phandle)
 {
-	syslog(LOG_DEBUG, "beholddb_opendir(realpath=%s)", bpath->realpath);
+	log_debug("beholddb_opendir(realpath=%s)", bpath->realpath);
 
 	*phandle = NULL;
 
-	if (!bpath->listing && !bpath->include.head && !bpath->exclude.head)
+	if (bpath->deep)
+		return beholddb_opendeep(bpath, phandle);
+
+	// parsing checked the directory holding this one
+	beholddb_check_directory(bpath->realpath, 0);
+	if (!bpath->listing && !bpath->include.head && !bpath->exclude.head && !bpath->expr)
 		return BEHOLDDB_OK;
 
 	int rc;
@@ -925,7 +3383,7 @@ int beholddb_opendir(const beholddb_path *bpath, void **phandle)
 	path[pathlen++] = '.';
 	path[pathlen++] = 0;
 
-	rc = beholddb_open_read(&db_path, &db);
+	rc = beholddb_open_listing(&db_path, &db);
 	free(path);
 
 	if (rc)
@@ -934,38 +3392,73 @@ int beholddb_opendir(const beholddb_path *bpath, void **phandle)
 		return BEHOLDDB_ERROR;
 	}
 
-	(rc = beholddb_set_files_tags(db, &bpath->include, &bpath->exclude));
-	if (beholddb_new_locate && !bpath->listing)
+	const char *listing_sql = BEHOLDDB_DML_TAG_LISTING;
+	const char *listing_from_sql = BEHOLDDB_DML_TAG_LISTING_FROM;
+
+	// the files of an expression are found once for a listing, and
+	// tested one by one otherwise
+	if (bpath->expr)
 	{
-		rc ||
-		(rc = sqlite3_exec(db, BEHOLDDB_DDL_FAST_LOCATE_START, NULL, NULL, NULL)) ||
-		(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_FAST_LOCATE, -1, &stmt, NULL));
+		listing_sql = BEHOLDDB_DML_EXPRESSION_TAG_LISTING;
+		listing_from_sql = BEHOLDDB_DML_EXPRESSION_TAG_LISTING_FROM;
+		if (bpath->listing)
+			(rc = beholddb_set_expression(db, bpath->expr, &BEHOLDDB_DIALECT_DIR)) ||
+			(rc = beholddb_prepare_listing(db, listing_sql, bpath->prefix, &stmt)); else
+		if (beholddb_new_locate)
+			(rc = beholddb_set_expression(db, bpath->expr, &BEHOLDDB_DIALECT_DIR)) ||
+			(rc = sqlite3_exec(db, BEHOLDDB_DDL_EXPRESSION_FAST_LOCATE_START, NULL, NULL, NULL)) ||
+			(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_FAST_LOCATE, -1, &stmt, NULL)); else
+			rc = beholddb_prepare_expression(db, BEHOLDDB_DML_EXPRESSION_LOCATE,
+				bpath->expr, &BEHOLDDB_DIALECT_DIR, 2, &stmt);
 	} else
 	{
-		rc ||
-		(rc = sqlite3_prepare_v2(db,
-			bpath->listing ? BEHOLDDB_DML_TAG_LISTING : BEHOLDDB_DML_LOCATE,
-			-1, &stmt, NULL));
+		(rc = beholddb_set_files_tags(db, &bpath->include, &bpath->exclude));
+		// without tags, the tags with a prefix are a range of their names
+		if (bpath->prefix && !bpath->include.head && !bpath->exclude.head)
+		{
+			listing_sql = BEHOLDDB_DML_PREFIX_TAG_LISTING;
+			listing_from_sql = BEHOLDDB_DML_PREFIX_TAG_LISTING_FROM;
+		}
+		if (bpath->listing)
+		{
+			rc ||
+			(rc = beholddb_prepare_listing(db, listing_sql, bpath->prefix, &stmt));
+		} else
+		if (beholddb_new_locate)
+		{
+			rc ||
+			(rc = sqlite3_exec(db, BEHOLDDB_DDL_FAST_LOCATE_START, NULL, NULL, NULL)) ||
+			(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_FAST_LOCATE, -1, &stmt, NULL));
+		} else
+		{
+			rc ||
+			(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_LOCATE, -1, &stmt, NULL));
+		}
 	}
 	if (rc)
-		sqlite3_close(db); else
+		beholddb_close(db); else
 	{
 		beholddb_dir *dir = (beholddb_dir*)malloc(sizeof(beholddb_dir));
 
 		dir->db = db;
 		dir->stmt = stmt;
+		dir->listing = bpath->listing;
+		dir->deep = 0;
+		dir->listing_sql = listing_sql;
+		dir->listing_from_sql = listing_from_sql;
+		dir->prefix = bpath->prefix ? strdup(bpath->prefix) : NULL;
 		*phandle = (void*)dir;
 	}
 
 	if (rc)
 		syslog(LOG_ERR, "beholddb_opendir: error %d", rc); else
-		syslog(LOG_DEBUG, "beholddb_opendir: ok, handle=%p", *phandle);
+		log_debug("beholddb_opendir: ok, handle=%p", *phandle);
 	return rc;
 }
 
 int beholddb_opentags(const beholddb_path *bpath, void **phandle)
 {
-	syslog(LOG_DEBUG, "beholddb_opentags(realpath=%s)", bpath->realpath);
+	log_debug("beholddb_opentags(realpath=%s)", bpath->realpath);
 
 	*phandle = NULL;
 
@@ -973,7 +3466,7 @@ int beholddb_opentags(const beholddb_path *bpath, void **phandle)
 	sqlite3 *db;
 	sqlite3_stmt *stmt;
 
-	rc = beholddb_open_read(bpath, &db);
+	rc = beholddb_open_listing(bpath, &db);
 	if (rc)
 	{
 		syslog(LOG_ERR, "beholddb_opentags: error opening database (%d)", rc);
@@ -984,24 +3477,50 @@ int beholddb_opentags(const beholddb_path *bpath, void **phandle)
 	(rc = sqlite3_bind_text(stmt, 1, bpath->basename, -1, SQLITE_STATIC));
 
 	if (rc)
-		sqlite3_close(db); else
+		beholddb_close(db); else
 	{
 		beholddb_dir *dir = (beholddb_dir*)malloc(sizeof(beholddb_dir));
 
 		dir->db = db;
 		dir->stmt = stmt;
+		dir->listing = 0;
+		dir->deep = 0;
+		dir->listing_sql = dir->listing_from_sql = NULL;
+		dir->prefix = NULL;
 		*phandle = (void*)dir;
 	}
 
 	if (rc)
 		syslog(LOG_ERR, "beholddb_opentags: error %d", rc); else
-		syslog(LOG_DEBUG, "beholddb_opentags: ok, handle=%p", *phandle);
+		log_debug("beholddb_opentags: ok, handle=%p", *phandle);
 	return rc;
 }
 
+// the metadata file and its journal, and the databases kept at the
+// root with theirs; other names that begin with .beholdfs are files
+static const char *const BEHOLDDB_METADATA_NAMES[] =
+{
+	".beholdfs", ".beholdfs-journal",
+	".beholdfs-intent", ".beholdfs-intent-journal",
+	".beholdfs-index", ".beholdfs-index-journal", ".beholdfs-index-wal", ".beholdfs-index-shm",
+	".beholdfs-central", ".beholdfs-central-journal", ".beholdfs-central-wal", ".beholdfs-central-shm",
+	".beholdfs-rules", ".beholdfs-rules-journal",
+	NULL
+};
+
+int beholddb_is_metadata(const char *name)
+{
+	if (strncmp(name, BEHOLDDB_NAME, sizeof(BEHOLDDB_NAME) - 1))
+		return 0;
+	for (const char *const *reserved = BEHOLDDB_METADATA_NAMES; *reserved; ++reserved)
+		if (!strcmp(name, *reserved))
+			return 1;
+	return 0;
+}
+
 static int beholddb_readdir_worker(sqlite3_stmt *stmt, const char *name)
 {
-	syslog(LOG_DEBUG, "beholddb_readdir(name=%s)", name);
+	log_debug("beholddb_readdir(name=%s)", name);
 
 	int rc;
 
@@ -1011,17 +3530,17 @@ static int beholddb_readdir_worker(sqlite3_stmt *stmt, const char *name)
 		return BEHOLDDB_ERROR;
 	}
 
-	switch ((rc = sqlite3_step(stmt)))
+	switch ((rc = beholddb_step(stmt)))
 	{
 	case SQLITE_ROW:
-		syslog(LOG_DEBUG, "beholddb_readdir: '%s' will be shown", name);
+		log_debug("beholddb_readdir: '%s' will be shown", name);
 		sqlite3_reset(stmt);
 		// filter out metadata file
-		return strcmp(name, BEHOLDDB_NAME) ? BEHOLDDB_OK : BEHOLDDB_ERROR;
+		return beholddb_is_metadata(name) ? BEHOLDDB_ERROR : BEHOLDDB_OK;
 
 	case SQLITE_OK:
 	case SQLITE_DONE:
-		syslog(LOG_DEBUG, "beholddb_readdir: '%s' was filtered out", name);
+		log_debug("beholddb_readdir: '%s' was filtered out", name);
 		sqlite3_reset(stmt);
 		// no such file
 		return BEHOLDDB_ERROR;
@@ -1038,36 +3557,95 @@ int beholddb_readdir(void *handle, const char *name)
 
 	if (dir)
 		rc = beholddb_readdir_worker(dir->stmt, name); else
-		rc = strcmp(name, BEHOLDDB_NAME) ? BEHOLDDB_OK : BEHOLDDB_ERROR;
+		rc = beholddb_is_metadata(name) ? BEHOLDDB_ERROR : BEHOLDDB_OK;
 
 	return rc;
 }
 
 int beholddb_listdir(void *handle, const char **pname)
 {
-	syslog(LOG_DEBUG, "beholddb_listdir()");
+	log_debug("beholddb_listdir()");
 
 	int rc;
 	beholddb_dir *dir = (beholddb_dir*)handle;
 
-	switch (rc = sqlite3_step(dir->stmt))
+	size_t len = dir->prefix ? strlen(dir->prefix) : 0;
+
+	// the tags without the prefix are skipped, if not already
+	while (SQLITE_ROW == (rc = beholddb_step(dir->stmt)) && len &&
+		strncmp((const char*)sqlite3_column_text(dir->stmt, 0), dir->prefix, len));
+
+	switch (rc)
 	{
 	case SQLITE_ROW:
 		*pname = sqlite3_column_text(dir->stmt, 0);
-		syslog(LOG_DEBUG, "beholddb_listdir: added '%s'", *pname);
+		log_debug("beholddb_listdir: added '%s'", *pname);
 		rc = BEHOLDDB_OK;
 		break;
 	case SQLITE_DONE:
-		sqlite3_finalize(dir->stmt);
-		dir->stmt = NULL;
+		// a deep view restarts from the same statement
+		if (!dir->deep)
+		{
+			sqlite3_finalize(dir->stmt);
+			dir->stmt = NULL;
+		}
 	default:
 		*pname = NULL;
-		syslog(LOG_DEBUG, "beholddb_listdir: no more entries");
+		log_debug("beholddb_listdir: no more entries");
 		rc = BEHOLDDB_ERROR;
 	}
 	return rc;
 }
 
+// position of the last entry returned by beholddb_listdir in a tag listing
+int64_t beholddb_telldir(void *handle)
+{
+	beholddb_dir *dir = (beholddb_dir*)handle;
+
+	if (dir && dir->deep)
+		return sqlite3_column_int64(dir->stmt, 1);
+	if (!dir || !dir->listing || !dir->stmt)
+		return 0;
+
+	return (int64_t)sqlite3_column_int(dir->stmt, 1) << 32 |
+		(uint32_t)sqlite3_column_int(dir->stmt, 2);
+}
+
+// restart a tag listing after the entry at the given position
+int beholddb_seekdir(void *handle, int64_t offset)
+{
+	log_debug("beholddb_seekdir(offset=%lld)", (long long)offset);
+
+	int rc;
+	beholddb_dir *dir = (beholddb_dir*)handle;
+
+	// entries of a deep view are positioned by the id of their file
+	if (dir && dir->deep)
+	{
+		sqlite3_reset(dir->stmt);
+		if ((rc = sqlite3_bind_int64(dir->stmt, 3, offset)))
+			syslog(LOG_ERR, "beholddb_seekdir: error %d", rc);
+		return rc;
+	}
+	if (!dir || !dir->listing)
+		return BEHOLDDB_OK;
+
+	sqlite3_finalize(dir->stmt);
+	dir->stmt = NULL;
+
+	if (!offset)
+		rc = beholddb_prepare_listing(dir->db, dir->listing_sql, dir->prefix, &dir->stmt); else
+	{
+		(rc = beholddb_prepare_listing(dir->db, dir->listing_from_sql, dir->prefix, &dir->stmt)) ||
+		(rc = sqlite3_bind_int(dir->stmt, 1, (int)(offset >> 32))) ||
+		(rc = sqlite3_bind_int64(dir->stmt, 2, (uint32_t)offset));
+	}
+
+	if (rc)
+		syslog(LOG_ERR, "beholddb_seekdir: error %d", rc);
+	return rc;
+}
+
 int beholddb_closedir(void *handle)
 {
 	if (!handle)
@@ -1075,15 +3653,125 @@ int beholddb_closedir(void *handle)
 
 	beholddb_dir *dir = (beholddb_dir*)handle;
 
-	if (beholddb_new_locate)
+	if (beholddb_new_locate && !dir->deep)
 	{
 		sqlite3_exec(dir->db, BEHOLDDB_DDL_FAST_LOCATE_STOP, NULL, NULL, NULL);
 	}
 
 	sqlite3_finalize(dir->stmt);
-	sqlite3_close(dir->db);
+	beholddb_close(dir->db);
+	free(dir->prefix);
 	free(dir);
 
 	return BEHOLDDB_OK;
 }
 
+static int beholddb_compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static char *beholddb_append_tags(char *key, char sign, const beholddb_tag_list *list)
+{
+	int count = 0;
+
+	for (beholddb_tag_list_item *item = list->head; item; item = item->next)
+		++count;
+
+	const char **names = (const char**)malloc(count * sizeof(const char*) + 1);
+
+	count = 0;
+	for (beholddb_tag_list_item *item = list->head; item; item = item->next)
+		names[count++] = item->name;
+	qsort(names, count, sizeof(const char*), beholddb_compare_names);
+
+	for (int i = 0; i < count; ++i)
+	{
+		// skip duplicates, %a%a is the same view as %a
+		if (i && !strcmp(names[i - 1], names[i]))
+			continue;
+		*key++ = sign;
+		key = stpcpy(key, names[i]);
+		*key++ = '/';
+	}
+	free(names);
+	return key;
+}
+
+// canonical name of the view: tags are sorted, so %a%b and %b/%a share it;
+// an expression goes by its normalized form
+int beholddb_get_view_key(const beholddb_path *bpath, char **pkey)
+{
+	char type = bpath->deep ? bpath->listing ? 'T' : 'D' : bpath->listing ? 'L' : 'F';
+
+	const char *prefix = bpath->prefix ? bpath->prefix : "";
+
+	if (bpath->expr)
+	{
+		*pkey = (char*)malloc(strlen(bpath->expr->key) + strlen(prefix) + 4);
+		sprintf(*pkey, "%c=%s%s%s", type, bpath->expr->key, bpath->prefix ? "*" : "", prefix);
+		return BEHOLDDB_OK;
+	}
+
+	size_t len = 3 + strlen(prefix);
+
+	for (beholddb_tag_list_item *item = bpath->include.head; item; item = item->next)
+		len += strlen(item->name) + 2;
+	for (beholddb_tag_list_item *item = bpath->exclude.head; item; item = item->next)
+		len += strlen(item->name) + 2;
+
+	char *key = (char*)malloc(len);
+	char *end = key;
+
+	*end++ = type;
+	end = beholddb_append_tags(end, '+', &bpath->include);
+	end = beholddb_append_tags(end, '-', &bpath->exclude);
+	if (bpath->prefix)
+	{
+		*end++ = '*';
+		end = stpcpy(end, prefix);
+	}
+	*end = 0;
+
+	*pkey = key;
+	return BEHOLDDB_OK;
+}
+
+// generation of the directory metadata: sqlite increments the file change
+// counter in the database header on every committed write transaction
+int beholddb_get_generation(const beholddb_path *bpath, int64_t *pgeneration)
+{
+	if (beholddb_central)
+	{
+		*pgeneration = __atomic_load_n(&beholddb_central_generation, __ATOMIC_RELAXED);
+		return BEHOLDDB_OK;
+	}
+	// a deep view depends on the whole index
+	if (bpath->deep)
+	{
+		*pgeneration = __atomic_load_n(&beholddb_index_generation, __ATOMIC_RELAXED);
+		return BEHOLDDB_OK;
+	}
+
+	int pathlen = strlen(bpath->realpath);
+	char *db_name = (char*)malloc(pathlen + 1 + sizeof(BEHOLDDB_NAME));
+	unsigned char header[4];
+	struct stat st;
+	int fd;
+
+	memcpy(db_name, bpath->realpath, pathlen);
+	db_name[pathlen] = '/';
+	memcpy(db_name + pathlen + 1, BEHOLDDB_NAME, sizeof(BEHOLDDB_NAME));
+
+	*pgeneration = -1;
+	if (-1 != (fd = open(db_name, O_RDONLY)))
+	{
+		if (!fstat(fd, &st) && sizeof(header) == pread(fd, header, sizeof(header), 24))
+			*pgeneration = (int64_t)st.st_ino << 32 |
+				(uint32_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+		close(fd);
+	}
+
+	free(db_name);
+	return BEHOLDDB_OK;
+}
@@ -20,7 +20,12 @@
 #ifndef __BEHOLDDB_H__
 #define __BEHOLDDB_H__
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sqlite3.h>
+
+#include "tagexpr.h"
+
 //#define BEHOLDDB_PARSE_INVERT 1
 
 #define BEHOLDDB_OK		0
@@ -56,6 +61,20 @@ typedef struct beholddb_path
 	};
 
 	int listing: 1;
+
+	// a view with alternatives, %(tag1|tag2), or patterns, %tag*, is the
+	// conjunction of all its tags, include and exclude too; a plain one
+	// has none, unless rules imply its tags from others (implied)
+	tagexpr *expr;
+	int implied: 1;
+
+	// a tag listing may be limited to the tags that begin with a prefix
+	char *prefix;
+
+	// a deep view (%%tag) lists the matching files anywhere below the
+	// directory realpath holds up to here; the view and the name of one
+	// of its entries may follow
+	const char *deep;
 } beholddb_path;
 
 int beholddb_parse_path(const char *path, beholddb_path **pbpath);
@@ -66,13 +85,42 @@ int beholddb_free_path(beholddb_path *bpath);
 int beholddb_create_file(const beholddb_path *bpath, int type);
 int beholddb_delete_file(const beholddb_path *bpath);
 int beholddb_rename_file(const beholddb_path *oldbpath, const beholddb_path *newbpath);
+int beholddb_tag_file(const beholddb_path *bpath, const beholddb_tag_list_set *tags, int replace);
+int beholddb_tag_batch(beholddb_path **bpaths, int count, int *status);
+int beholddb_parse_tags(const char *value, size_t size, beholddb_tag_list *list);
+int beholddb_parse_delta(const char *value, size_t size, beholddb_tag_list_set *tags);
+int beholddb_free_tags(beholddb_tag_list *list);
+int beholddb_same_directory(const beholddb_path *oldbpath, const beholddb_path *newbpath);
+int beholddb_check_path(const beholddb_path *bpath);
+int beholddb_intent_begin(const char *oldpath, const char *newpath, int64_t *pid);
+int beholddb_intent_end(int64_t id);
+int beholddb_recover();
+int beholddb_rules_init();
+int beholddb_set_rule(const char *tag, const char *implies, int alias, int remove);
+int beholddb_format_rules(char **pdata, size_t *psize);
+int beholddb_open_metadata(const char *dir, sqlite3 **pdb);
+int beholddb_open_central(sqlite3 **pdb);
+int beholddb_central_enter(sqlite3 *db, const char *dir, int create);
+int beholddb_central_leave(sqlite3 *db);
+int beholddb_is_metadata(const char *name);
+int beholddb_stamp_directory(sqlite3 *db, const char *dir);
+int beholddb_index_init();
+int beholddb_index_free();
+int beholddb_free();
+int beholddb_get_deep_target(const beholddb_path *bpath, char **ptarget);
 int beholddb_opendir(const beholddb_path *bpath, void **handle);
 int beholddb_opentags(const beholddb_path *bpath, void **handle);
 int beholddb_readdir(void *handle, const char *name);
 int beholddb_listdir(void *handle, const char **pname);
+int64_t beholddb_telldir(void *handle);
+int beholddb_seekdir(void *handle, int64_t offset);
 int beholddb_closedir(void *handle);
 
+int beholddb_get_view_key(const beholddb_path *bpath, char **pkey);
+int beholddb_get_generation(const beholddb_path *bpath, int64_t *pgeneration);
+
 int beholddb_exec(sqlite3 *db, const char *sql);
+int beholddb_exec_bind_texts(sqlite3 *db, const char *sql, int count, const char **texts);
 
 #endif // __BEHOLDDB_H__
 
@@ -32,12 +32,318 @@
 #include <dirent.h>
 #include <errno.h>
 #include <syslog.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <fuse/fuse.h>
 #include <fuse/fuse_opt.h>
 
 #include "beholdfs.h"
 #include "beholddb.h"
+#include "dircache.h"
+#include "dirstream.h"
+#include "log.h"
+#include "profile.h"
+#include "statbatch.h"
+#include "stats.h"
+
+// files served by the daemon itself, under the mount root and
+// prefixed with the tag character so they cannot clash with real files
+enum
+{
+	BEHOLDFS_SPECIAL_NONE,
+	BEHOLDFS_SPECIAL_STATS,
+	BEHOLDFS_SPECIAL_STATS_JSON,
+	BEHOLDFS_SPECIAL_TRACE,
+	BEHOLDFS_SPECIAL_BATCH,
+	BEHOLDFS_SPECIAL_RULES,
+};
+
+static int beholdfs_special(const char *path)
+{
+	if (!path || '/' != path[0] || BEHOLDFS_STATE->tagchar != path[1])
+		return BEHOLDFS_SPECIAL_NONE;
+	if (!strcmp(&path[2], ".stats"))
+		return BEHOLDFS_SPECIAL_STATS;
+	if (!strcmp(&path[2], ".stats.json"))
+		return BEHOLDFS_SPECIAL_STATS_JSON;
+	if (!strcmp(&path[2], ".trace"))
+		return BEHOLDFS_SPECIAL_TRACE;
+	if (!strcmp(&path[2], ".batch"))
+		return BEHOLDFS_SPECIAL_BATCH;
+	if (!strcmp(&path[2], ".rules"))
+		return BEHOLDFS_SPECIAL_RULES;
+	return BEHOLDFS_SPECIAL_NONE;
+}
+
+// the ones that take records
+static int beholdfs_special_writable(int special)
+{
+	return BEHOLDFS_SPECIAL_BATCH == special || BEHOLDFS_SPECIAL_RULES == special;
+}
+
+static void beholdfs_special_stat(int special, struct stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	stat->st_mode = beholdfs_special_writable(special) ?
+		S_IFREG | S_IRUSR | S_IWUSR :
+		S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+	stat->st_nlink = 1;
+	stat->st_uid = getuid();
+	stat->st_gid = getgid();
+	stat->st_mtime = stat->st_ctime = stat->st_atime = time(NULL);
+}
+
+// the contents are generated on open, so every open sees a fresh snapshot;
+// %.batch, and %.rules open for writing, start empty and collect the
+// status of the applied records
+static int beholdfs_special_open(int special, struct fuse_file_info *fi)
+{
+	beholdfs_file *file;
+	int ret = 0;
+
+	if (!beholdfs_special_writable(special) && O_RDONLY != (fi->flags & O_ACCMODE))
+		return -EACCES;
+	if (!(file = (beholdfs_file*)malloc(sizeof(beholdfs_file))))
+		return -ENOMEM;
+	file->special = special;
+	file->data = NULL;
+	file->size = 0;
+	file->input = NULL;
+	file->input_size = 0;
+	switch (special)
+	{
+	case BEHOLDFS_SPECIAL_TRACE:
+		ret = log_format(&file->data, &file->size);
+		break;
+	case BEHOLDFS_SPECIAL_STATS:
+	case BEHOLDFS_SPECIAL_STATS_JSON:
+		ret = stats_format(BEHOLDFS_SPECIAL_STATS_JSON == special, &file->data, &file->size);
+		break;
+	case BEHOLDFS_SPECIAL_RULES:
+		if (O_RDONLY == (fi->flags & O_ACCMODE) && beholddb_format_rules(&file->data, &file->size))
+			ret = -EIO;
+		break;
+	}
+	if (ret)
+	{
+		free(file);
+		return ret;
+	}
+
+	fi->fh = BEHOLDFS_FH_SPECIAL | (uint64_t)(uintptr_t)file;
+	fi->direct_io = 1;
+	return 0;
+}
+
+static int beholdfs_batch_status(int rc)
+{
+	return BEHOLDDB_OK == rc ? 0 : BEHOLDDB_ERROR == rc ? -EPERM : -EIO;
+}
+
+// apply the records written to %.batch so far, one per line:
+// path<TAB>+tag -tag ...; the records are grouped by directory, each
+// directory is one transaction, and path<TAB>status is appended to the
+// file for every record
+static int beholdfs_batch_apply(beholdfs_file *file)
+{
+	if (!file->input_size)
+		return 0;
+
+	const char *input = file->input, *end = input + file->input_size;
+	int count = 0, valid = 0, failed = 0;
+
+	for (const char *p = input; p < end; ++count)
+		p = (p = memchr(p, '\n', end - p)) ? p + 1 : end;
+
+	const char **lines = (const char**)calloc(count, sizeof(const char*));
+	int *lengths = (int*)calloc(count, sizeof(int));
+	int *status = (int*)calloc(count, sizeof(int));
+	int *dbstatus = (int*)calloc(count, sizeof(int));
+	beholddb_path **bpaths = (beholddb_path**)calloc(count, sizeof(beholddb_path*));
+	beholddb_path **dbpaths = (beholddb_path**)calloc(count, sizeof(beholddb_path*));
+	char *data;
+	size_t size = file->size;
+
+	if (!lines || !lengths || !status || !dbstatus || !bpaths || !dbpaths)
+	{
+		count = 0;
+		failed = -ENOMEM;
+	}
+
+	const char *line = input;
+
+	for (int i = 0; i < count; ++i)
+	{
+		const char *eol = memchr(line, '\n', end - line);
+		const char *tab;
+		char *path;
+		struct stat st;
+
+		if (!eol)
+			eol = end;
+		if (eol == line)
+		{
+			line = eol + 1;
+			continue;
+		}
+		lines[i] = line;
+		tab = memchr(line, '\t', eol - line);
+		lengths[i] = (tab ? tab : eol) - line;
+		line = eol + 1;
+		size += lengths[i] + 16;
+
+		if (!tab || !(path = strndup(lines[i], lengths[i])))
+		{
+			status[i] = -EINVAL;
+			continue;
+		}
+		if (beholddb_parse_path(path, &bpaths[i]))
+		{
+			bpaths[i] = NULL;
+			status[i] = -EINVAL;
+		} else
+		if (lstat(bpaths[i]->realpath, &st))
+			status[i] = -errno; else
+		{
+			// tags in the path itself select nothing here
+			beholddb_free_tags(&bpaths[i]->include);
+			beholddb_free_tags(&bpaths[i]->exclude);
+			if (beholddb_parse_delta(tab + 1, eol - tab - 1, &bpaths[i]->tags))
+				status[i] = -EINVAL; else
+				dbpaths[valid++] = bpaths[i];
+		}
+		free(path);
+	}
+
+	if (valid)
+		beholddb_tag_batch(dbpaths, valid, dbstatus);
+
+	if (count && (data = (char*)realloc(file->data, size)))
+	{
+		file->data = data;
+		for (int i = 0, j = 0; i < count; ++i)
+		{
+			if (!lines[i])
+				continue;
+			if (!status[i] && bpaths[i])
+				status[i] = beholdfs_batch_status(dbstatus[j++]);
+			if (status[i])
+				failed = -EIO;
+			file->size += sprintf(&file->data[file->size], "%.*s\t%d\n",
+				lengths[i], lines[i], status[i]);
+		}
+	}
+
+	for (int i = 0; i < count; ++i)
+		if (bpaths[i])
+			beholddb_free_path(bpaths[i]);
+	free(lines);
+	free(lengths);
+	free(status);
+	free(dbstatus);
+	free(bpaths);
+	free(dbpaths);
+
+	free(file->input);
+	file->input = NULL;
+	file->input_size = 0;
+	return failed;
+}
+
+// apply the rules written to %.rules so far, one per line: tag < other
+// for a tag that implies another, tag = other for another name of it,
+// and either one after - to take it back; line<TAB>status is appended
+// to the file for every rule
+static int beholdfs_rules_apply(beholdfs_file *file)
+{
+	const char *line = file->input, *end = line + file->input_size;
+	int failed = 0;
+	char *output, *data;
+	size_t size;
+	FILE *out;
+
+	if (!file->input_size)
+		return 0;
+	if (!(out = open_memstream(&output, &size)))
+		return -ENOMEM;
+
+	for (const char *eol; line < end; line = eol + 1)
+	{
+		const char *rule = line, *op = NULL;
+		char *tag, *implies;
+		int remove, rc, status = -EINVAL;
+
+		if (!(eol = memchr(line, '\n', end - line)))
+			eol = end;
+		if (eol == line)
+			continue;
+		if ((remove = '-' == *rule))
+			++rule;
+		for (const char *p = rule; p + 3 <= eol && !op; ++p)
+			if (' ' == p[0] && ('<' == p[1] || '=' == p[1]) && ' ' == p[2])
+				op = p;
+		if (op)
+		{
+			tag = strndup(rule, op - rule);
+			implies = strndup(op + 3, eol - op - 3);
+			rc = beholddb_set_rule(tag, implies, '=' == op[1], remove);
+			status = BEHOLDDB_OK == rc ? 0 : BEHOLDDB_ERROR == rc ? -EINVAL : -EIO;
+			free(tag);
+			free(implies);
+		}
+		if (status)
+			failed = -EIO;
+		fprintf(out, "%.*s\t%d\n", (int)(eol - line), line, status);
+	}
+	fclose(out);
+
+	if ((data = (char*)realloc(file->data, file->size + size)))
+	{
+		memcpy(&data[file->size], output, size);
+		file->data = data;
+		file->size += size;
+	} else
+		failed = -ENOMEM;
+	free(output);
+
+	free(file->input);
+	file->input = NULL;
+	file->input_size = 0;
+	return failed;
+}
+
+static int beholdfs_special_apply(beholdfs_file *file)
+{
+	return BEHOLDFS_SPECIAL_RULES == file->special ?
+		beholdfs_rules_apply(file) :
+		beholdfs_batch_apply(file);
+}
+
+// an entry of a deep view is a symlink to the file it stands for,
+// relative to the view, with the times and owner of the file
+static int beholdfs_deep_stat(const beholddb_path *bpath, struct stat *stat)
+{
+	int ret;
+	char *target, *path;
+
+	if (beholddb_get_deep_target(bpath, &target))
+		return -ENOENT;
+
+	path = (char*)malloc(bpath->deep - bpath->realpath + strlen(target) + 2);
+	sprintf(path, "%.*s/%s", (int)(bpath->deep - bpath->realpath), bpath->realpath, target);
+	if ((ret = lstat(path, stat)))
+		ret = -errno; else
+	{
+		stat->st_mode = S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO;
+		stat->st_nlink = 1;
+		stat->st_size = strlen(target) + 3;
+	}
+
+	free(path);
+	free(target);
+	return ret;
+}
 
 /** Get file attributes.
  *
@@ -47,16 +353,23 @@
  */
 int beholdfs_getattr(const char *path, struct stat *stat)
 {
-	int ret = -ENOENT;
+	int ret = -ENOENT, special;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_getattr(path=%s)", path);
+	log_debug("beholdfs_getattr(path=%s)", path);
+	if ((special = beholdfs_special(path)))
+	{
+		beholdfs_special_stat(special, stat);
+		return 0;
+	}
 	if (!(beholddb_parse_path(path, &bpath)))
 	{
 		if (bpath->listing)
 		{
-			syslog(LOG_DEBUG, "beholdfs_getattr: listing was requested");
+			log_debug("beholdfs_getattr: listing was requested");
 		}
+		if (bpath->deep && *bpath->deep)
+			ret = beholdfs_deep_stat(bpath, stat); else
 		if ((ret = lstat(bpath->realpath, stat)))
 			ret = -errno; else
 		{
@@ -64,7 +377,7 @@ int beholdfs_getattr(const char *path, struct stat *stat)
 				ret = -ENOENT;
 		}
 	}
-	syslog(LOG_DEBUG, "beholdfs_getattr: ret=%d", ret);
+	log_debug("beholdfs_getattr: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -82,17 +395,43 @@ int beholdfs_readlink(const char *path, char *buf, size_t bufsiz)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_readlink(path=%s)", path);
-	if (!(beholddb_get_file(path, &bpath)))
+	log_debug("beholdfs_readlink(path=%s)", path);
+	if (!beholddb_parse_path(path, &bpath) && bpath->deep && *bpath->deep)
+	{
+		char *target;
+
+		if (!beholddb_get_deep_target(bpath, &target))
+		{
+			snprintf(buf, bufsiz, "../%s", target);
+			free(target);
+			ret = 0;
+		}
+	} else
+	if (bpath && !beholddb_locate_file(bpath))
 	{
 		if ((ret = readlink(bpath->realpath, buf, bufsiz)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_readlink: ret=%d", ret);
+	log_debug("beholdfs_readlink: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
 
+// a file created or moved into a view takes its tags; a view with
+// alternatives does not say which, but one whose tags are only widened
+// by the implication rules does
+static int beholdfs_parse_target(const char *path, beholddb_path **pbpath)
+{
+	if (beholddb_parse_path(path, pbpath))
+		return -ENOENT;
+	if (!(*pbpath)->expr || (*pbpath)->implied)
+		return 0;
+
+	beholddb_free_path(*pbpath);
+	*pbpath = NULL;
+	return -EINVAL;
+}
+
 /** Create a file node
  *
  * This is called for creation of all non-directory, non-symlink
@@ -104,14 +443,14 @@ int beholdfs_mknod(const char *path, mode_t mode, dev_t dev)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_mknod(path=%s)", path);
-	if (!(beholddb_parse_path(path, &bpath)))
+	log_debug("beholdfs_mknod(path=%s)", path);
+	if (!(ret = beholdfs_parse_target(path, &bpath)))
 	{
 		if ((ret = mknod(bpath->realpath, mode, dev)))
 			ret = -errno; else
 			beholddb_create_file(bpath, 0);
 	}
-	syslog(LOG_DEBUG, "beholdfs_mknod: ret=%d", ret);
+	log_debug("beholdfs_mknod: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -127,14 +466,14 @@ int beholdfs_mkdir(const char *path, mode_t mode)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_mkdir(path=%s)", path);
-	if (!(beholddb_parse_path(path, &bpath)))
+	log_debug("beholdfs_mkdir(path=%s)", path);
+	if (!(ret = beholdfs_parse_target(path, &bpath)))
 	{
 		if ((ret = mkdir(bpath->realpath, mode)))
 			ret = -errno; else
 			beholddb_create_file(bpath, 1);
 	}
-	syslog(LOG_DEBUG, "beholdfs_mkdir: ret=%d", ret);
+	log_debug("beholdfs_mkdir: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -145,14 +484,14 @@ int beholdfs_unlink(const char *path)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_unlink(path=%s)", path);
+	log_debug("beholdfs_unlink(path=%s)", path);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if ((ret = unlink(bpath->realpath)))
 			ret = -errno; else
 			beholddb_delete_file(bpath);
 	}
-	syslog(LOG_DEBUG, "beholdfs_unlink: ret=%d", ret);
+	log_debug("beholdfs_unlink: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -163,14 +502,14 @@ int beholdfs_rmdir(const char *path)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_rmdir(path=%s)", path);
+	log_debug("beholdfs_rmdir(path=%s)", path);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if ((ret = rmdir(bpath->realpath)))
 			ret = -errno; else
 			beholddb_delete_file(bpath);
 	}
-	syslog(LOG_DEBUG, "beholdfs_rmdir: ret=%d", ret);
+	log_debug("beholdfs_rmdir: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -182,18 +521,18 @@ int beholdfs_symlink(const char *oldpath, const char *newpath)
 	beholddb_path *oldbpath;
 	beholddb_path *newbpath;
 
-	syslog(LOG_DEBUG, "beholdfs_symlink(oldpath=%s, newpath=%s)", oldpath, newpath);
+	log_debug("beholdfs_symlink(oldpath=%s, newpath=%s)", oldpath, newpath);
 
 	int rc1 = beholddb_get_file(oldpath, &oldbpath);
-	int rc2 = beholddb_parse_path(newpath, &newbpath);
+	int rc2 = beholdfs_parse_target(newpath, &newbpath);
 
-	if (!rc1 && !rc2)
+	if (!rc1 && !(ret = rc2))
 	{
 		if (-1 == (ret = symlink(oldbpath->realpath, newbpath->realpath)))
 			ret = -errno; else
 			beholddb_create_file(newbpath, 0); // TODO: how to deal with symlinks to directories?
 	}
-	syslog(LOG_DEBUG, "beholdfs_symlink: ret=%d", ret);
+	log_debug("beholdfs_symlink: ret=%d", ret);
 	if (!rc1)
 		beholddb_free_path(oldbpath);
 	if (!rc2)
@@ -208,22 +547,38 @@ int beholdfs_rename(const char *oldpath, const char *newpath)
 	beholddb_path *oldbpath;
 	beholddb_path *newbpath;
 
-	syslog(LOG_DEBUG, "beholdfs_rename(oldpath=%s, newpath=%s)", oldpath, newpath);
+	log_debug("beholdfs_rename(oldpath=%s, newpath=%s)", oldpath, newpath);
 
 	int rc1 = beholddb_get_file(oldpath, &oldbpath);
-	int rc2 = beholddb_parse_path(newpath, &newbpath);
+	int rc2 = beholdfs_parse_target(newpath, &newbpath);
 
-	if (!rc1 && !rc2)
+	if (!rc1 && !(ret = rc2))
 	{
+		int64_t intent = 0;
+		int rc = 0;
+
+		beholddb_check_path(oldbpath);
+		beholddb_check_path(newbpath);
+
+		// a move between directories touches two databases; record it
+		// so that a crash after rename(2) does not lose the tags
+		if (!beholddb_same_directory(oldbpath, newbpath))
+			beholddb_intent_begin(oldpath, newpath, &intent);
 		if ((ret = rename(oldbpath->realpath, newbpath->realpath)))
 			ret = -errno; else
 		{
-			syslog(LOG_DEBUG, "beholdfs_rename: rename was successful");
-			// TODO: optimize rename within the same directory
-			beholddb_rename_file(oldbpath, newbpath);
+			log_debug("beholdfs_rename: rename was successful");
+			rc = beholddb_rename_file(oldbpath, newbpath);
 		}
+
+		// the file is renamed either way; an intent whose metadata was
+		// not moved is kept for recovery to replay at the next mount
+		if (!rc)
+			beholddb_intent_end(intent); else
+			syslog(LOG_ERR, "beholdfs_rename: cannot move the metadata of %s to %s (%d)%s",
+				oldpath, newpath, rc, intent ? ", left to recovery" : "");
 	}
-	syslog(LOG_DEBUG, "beholdfs_rename: ret=%d", ret);
+	log_debug("beholdfs_rename: ret=%d", ret);
 	if (!rc1)
 		beholddb_free_path(oldbpath);
 	if (!rc2)
@@ -238,18 +593,18 @@ int beholdfs_link(const char *oldpath, const char *newpath)
 	beholddb_path *oldbpath;
 	beholddb_path *newbpath;
 
-	syslog(LOG_DEBUG, "beholdfs_link(oldpath=%s, newpath=%s)", oldpath, newpath);
+	log_debug("beholdfs_link(oldpath=%s, newpath=%s)", oldpath, newpath);
 
 	int rc1 = beholddb_get_file(oldpath, &oldbpath);
-	int rc2 = beholddb_parse_path(newpath, &newbpath);
+	int rc2 = beholdfs_parse_target(newpath, &newbpath);
 
-	if (!rc1 && !rc2)
+	if (!rc1 && !(ret = rc2))
 	{
 		if (-1 == (ret = link(oldbpath->realpath, newbpath->realpath)))
 			ret = -errno; else
 			beholddb_create_file(newbpath, 0);
 	}
-	syslog(LOG_DEBUG, "beholdfs_link: ret=%d", ret);
+	log_debug("beholdfs_link: ret=%d", ret);
 	if (!rc1)
 		beholddb_free_path(oldbpath);
 	if (!rc2)
@@ -263,13 +618,13 @@ int beholdfs_chmod(const char *path, mode_t mode)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_chmod(path=%s)", path);
+	log_debug("beholdfs_chmod(path=%s)", path);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if ((ret = chmod(bpath->realpath, mode)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_chmod: ret=%d", ret);
+	log_debug("beholdfs_chmod: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -280,13 +635,13 @@ int beholdfs_chown(const char *path, uid_t owner, gid_t group)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_chown(path=%s)", path);
+	log_debug("beholdfs_chown(path=%s)", path);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if ((ret = chown(bpath->realpath, owner, group)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_chown: ret=%d", ret);
+	log_debug("beholdfs_chown: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -297,13 +652,15 @@ int beholdfs_truncate(const char *path, off_t length)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_truncate(path=%s)", path);
+	log_debug("beholdfs_truncate(path=%s)", path);
+	if (beholdfs_special_writable(beholdfs_special(path)))
+		return 0;
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if ((ret = truncate(bpath->realpath, length)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_truncate: ret=%d", ret);
+	log_debug("beholdfs_truncate: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -329,14 +686,16 @@ int beholdfs_open(const char *path, struct fuse_file_info *fi)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_open(path=%s, flags=%2x)", path, fi->flags);
+	log_debug("beholdfs_open(path=%s, flags=%2x)", path, fi->flags);
+	if ((ret = beholdfs_special(path)))
+		return beholdfs_special_open(ret, fi);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if (-1 == (fi->fh = open(bpath->realpath, fi->flags)))
 			ret = -errno; else
 			ret = 0;
 	}
-	syslog(LOG_DEBUG, "beholdfs_open: ret=%d", ret);
+	log_debug("beholdfs_open: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -356,10 +715,21 @@ int beholdfs_read(const char *path, char *buf, size_t count, off_t offset,
 	     struct fuse_file_info *fi)
 {
 	int ret;
-	syslog(LOG_DEBUG, "beholdfs_read(path=%s...)", path);
+	log_debug("beholdfs_read(path=%s...)", path);
+	if (fi->fh & BEHOLDFS_FH_SPECIAL)
+	{
+		beholdfs_file *file = BEHOLDFS_FILE(fi->fh);
+
+		if (offset >= file->size)
+			return 0;
+		if (count > file->size - offset)
+			count = file->size - offset;
+		memcpy(buf, &file->data[offset], count);
+		return count;
+	}
 	if (-1 == (ret = pread(fi->fh, buf, count, offset)))
 		ret = -errno;
-	syslog(LOG_DEBUG, "beholdfs_read: ret=%d", ret);
+	log_debug("beholdfs_read: ret=%d", ret);
 	return ret;
 }
 
@@ -375,10 +745,25 @@ int beholdfs_write(const char *path, const char *buf, size_t count, off_t offset
 		   struct fuse_file_info *fi)
 {
 	int ret;
-	syslog(LOG_DEBUG, "beholdfs_write(path=%s...)", path);
+	log_debug("beholdfs_write(path=%s...)", path);
+	if (fi->fh & BEHOLDFS_FH_SPECIAL)
+	{
+		beholdfs_file *file = BEHOLDFS_FILE(fi->fh);
+		char *input;
+
+		// records are appended whatever the offset
+		if (!beholdfs_special_writable(file->special))
+			return -EBADF;
+		if (!(input = (char*)realloc(file->input, file->input_size + count)))
+			return -ENOMEM;
+		memcpy(&input[file->input_size], buf, count);
+		file->input = input;
+		file->input_size += count;
+		return count;
+	}
 	if (-1 == (ret = pwrite(fi->fh, buf, count, offset)))
 		ret = -errno;
-	syslog(LOG_DEBUG, "beholdfs_write: ret=%d", ret);
+	log_debug("beholdfs_write: ret=%d", ret);
 	return ret;
 }
 
@@ -394,13 +779,13 @@ int beholdfs_statfs(const char *path, struct statvfs *statv)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_statfs(path=%s)", path);
+	log_debug("beholdfs_statfs(path=%s)", path);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if ((ret = statvfs(bpath->realpath, statv)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_statfs: ret=%d", ret);
+	log_debug("beholdfs_statfs: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -431,7 +816,10 @@ int beholdfs_statfs(const char *path, struct statvfs *statv)
 int beholdfs_flush(const char *path, struct fuse_file_info *fi)
 {
 	int ret = 0;
-	// nothing to do
+	// nothing to do, except for records still pending in %.batch
+	// or %.rules
+	if (fi->fh & BEHOLDFS_FH_SPECIAL)
+		ret = beholdfs_special_apply(BEHOLDFS_FILE(fi->fh));
 	return ret;
 }
 
@@ -452,10 +840,19 @@ int beholdfs_flush(const char *path, struct fuse_file_info *fi)
 int beholdfs_release(const char *path, struct fuse_file_info *fi)
 {
 	int ret;
-	syslog(LOG_DEBUG, "beholdfs_release(path=%s...)", path);
+	log_debug("beholdfs_release(path=%s...)", path);
+	if (fi->fh & BEHOLDFS_FH_SPECIAL)
+	{
+		beholdfs_file *file = BEHOLDFS_FILE(fi->fh);
+
+		free(file->input);
+		free(file->data);
+		free(file);
+		return 0;
+	}
 	if (-1 == (ret = close(fi->fh)))
 		ret = -errno;
-	syslog(LOG_DEBUG, "beholdfs_release: ret=%d", ret);
+	log_debug("beholdfs_release: ret=%d", ret);
 	return ret;
 }
 
@@ -469,10 +866,41 @@ int beholdfs_release(const char *path, struct fuse_file_info *fi)
 int beholdfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
 	int ret;
-	syslog(LOG_DEBUG, "beholdfs_fsync(path=%s...)", path);
+	log_debug("beholdfs_fsync(path=%s...)", path);
+	if (fi->fh & BEHOLDFS_FH_SPECIAL)
+		return beholdfs_special_apply(BEHOLDFS_FILE(fi->fh));
 	if (-1 == (ret = datasync ? fdatasync(fi->fh) : fsync(fi->fh)))
 		ret = -errno;
-	syslog(LOG_DEBUG, "beholdfs_fsync: ret=%d", ret);
+	log_debug("beholdfs_fsync: ret=%d", ret);
+	return ret;
+}
+
+static const char BEHOLDFS_TAG_XATTR[] = "user.tags";
+
+// user.tags replaces the tags of a file, user.tags.add and
+// user.tags.remove change only the listed ones; the whole change is one
+// metadata transaction
+static int beholdfs_set_tags(const beholddb_path *bpath, const char *op, const char *value, size_t size)
+{
+	int replace = !*op;
+	beholddb_tag_list list;
+	beholddb_tag_list_set tags;
+
+	if (!replace && strcmp(op, ".add") && strcmp(op, ".remove"))
+		return -ENOTSUP;
+
+	if (beholddb_parse_tags(value, size, &list))
+		return -EINVAL;
+
+	tags.include.head = NULL;
+	tags.exclude.head = NULL;
+	if (strcmp(op, ".remove"))
+		tags.include.head = list.head; else
+		tags.exclude.head = list.head;
+
+	int ret = beholddb_tag_file(bpath, &tags, replace) ? -EPERM : 0;
+
+	beholddb_free_tags(&list);
 	return ret;
 }
 
@@ -482,26 +910,26 @@ int beholdfs_setxattr(const char *path, const char *name, const char *value, siz
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_setxattr(path=%s,name=%s,value=%s,size=%d)", path, name, value, size);
+	log_debug("beholdfs_setxattr(path=%s,name=%s,value=%.*s,size=%d)", path, name, (int)size, value, size);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
+		if (!strncmp(name, BEHOLDFS_TAG_XATTR, sizeof(BEHOLDFS_TAG_XATTR) - 1))
+			ret = beholdfs_set_tags(bpath, name + sizeof(BEHOLDFS_TAG_XATTR) - 1, value, size); else
 		if ((ret = lsetxattr(bpath->realpath, name, value, size, flags)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_setxattr: ret=%d", ret);
+	log_debug("beholdfs_setxattr: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
 
-static const char BEHOLDFS_TAG_XATTR[] = "user.tags";
-
 /** Get extended attributes */
 int beholdfs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_getxattr(path=%s,name=%s,size=%d)", path, name, size);
+	log_debug("beholdfs_getxattr(path=%s,name=%s,size=%d)", path, name, size);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if (!strcmp(name, BEHOLDFS_TAG_XATTR))
@@ -537,7 +965,7 @@ int beholdfs_getxattr(const char *path, const char *name, char *value, size_t si
 				ret = -errno;
 		}
 	}
-	syslog(LOG_DEBUG, "beholdfs_getxattr: ret=%d", ret);
+	log_debug("beholdfs_getxattr: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -548,7 +976,7 @@ int beholdfs_listxattr(const char *path, char *list, size_t size)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_listxattr(path=%s,size=%d)", path, size);
+	log_debug("beholdfs_listxattr(path=%s,size=%d)", path, size);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if (size && size < sizeof(BEHOLDFS_TAG_XATTR))
@@ -565,9 +993,9 @@ int beholdfs_listxattr(const char *path, char *list, size_t size)
 				ret += sizeof(BEHOLDFS_TAG_XATTR);
 		}
 	}
-	syslog(LOG_DEBUG, "beholdfs_listxattr: ret=%d", ret);
+	log_debug("beholdfs_listxattr: ret=%d", ret);
 	for (int i = 0; i < ret - sizeof(BEHOLDFS_TAG_XATTR); i += 1 + strlen(&list[i]))
-		syslog(LOG_DEBUG, "beholdfs_listxattr: list[]=%s", &list[i]);
+		log_debug("beholdfs_listxattr: list[]=%s", &list[i]);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -578,17 +1006,35 @@ int beholdfs_removexattr(const char *path, const char *name)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_removexattr(path=%s)", path);
+	log_debug("beholdfs_removexattr(path=%s)", path);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
+		// removing user.tags untags the file
+		if (!strcmp(name, BEHOLDFS_TAG_XATTR))
+			ret = beholdfs_set_tags(bpath, "", "", 0); else
 		if ((ret = lremovexattr(bpath->realpath, name)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_removexattr: ret=%d", ret);
+	log_debug("beholdfs_removexattr: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
 
+// identify the state of a directory view for the listing cache
+static int beholdfs_get_stamp(const beholddb_path *bpath, dircache_stamp *stamp)
+{
+	struct stat st;
+
+	if (stat(bpath->realpath, &st))
+		return -errno;
+
+	stamp->dev = st.st_dev;
+	stamp->ino = st.st_ino;
+	stamp->mtime = st.st_mtim;
+	stamp->ctime = st.st_ctim;
+	return beholddb_get_generation(bpath, &stamp->generation);
+}
+
 /** Open directory
  *
  * Unless the 'default_permissions' mount option is given,
@@ -604,57 +1050,113 @@ int beholdfs_opendir(const char *path, struct fuse_file_info *fi)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_opendir(path=%s)", path);
+	log_debug("beholdfs_opendir(path=%s)", path);
 	if (!beholddb_get_file(path, &bpath)) // TODO: handle errors
 	{
-		DIR *dir = NULL;
+		dirstream *stream = NULL;
 		void *handle = NULL;
-		struct dirent *entry = NULL;
-		int stage = 0;
+		statbatch *batch = NULL;
+		dircache_listing *cached = NULL;
+		dircache_listing *recording = NULL;
+		int stage = bpath->listing || bpath->deep ? 0 : BEHOLDFS_STATE->tagshow ? 2 : 1;
 
 		ret = 0;
-		if (bpath->listing)
+		if (dircache_enabled())
+		{
+			dircache_stamp stamp;
+			char *key;
+
+			beholddb_get_view_key(bpath, &key);
+			if (!beholdfs_get_stamp(bpath, &stamp) &&
+				!(cached = dircache_lookup(&stamp, key)))
+				recording = dircache_begin(&stamp, key);
+			free(key);
+		}
+
+		if (cached)
+		{
+			log_debug("beholdfs_opendir: using cached listing");
+		} else
+		if (bpath->listing || bpath->deep)
 		{
 			if (beholddb_opendir(bpath, &handle))
 				ret = -ENOENT;
 		} else
 		{
-			if (!(dir = opendir(bpath->realpath)))
-				ret = -errno; else
-			if (beholddb_opendir(bpath, &handle))
-				ret = -ENOENT; else
+			if (!(ret = dirstream_open(&stream, bpath->realpath, BEHOLDFS_STATE->dirbuf)))
 			{
-				int len = offsetof(struct dirent, d_name) +
-					pathconf(bpath->realpath, _PC_NAME_MAX) + 1;
-
-				entry = (struct dirent*)malloc(len);
-				stage = BEHOLDFS_STATE->tagshow ? 2 : 1;
+				if (beholddb_opendir(bpath, &handle))
+					ret = -ENOENT; else
+					statbatch_init(&batch, BEHOLDFS_STATE->stat_depth);
 			}
 		}
 		if (ret)
 		{
-			if (dir)
-				closedir(dir);
+			dirstream_close(stream);
+			dircache_abort(recording);
 		} else
 		{
 			beholdfs_dir *fsdir = (beholdfs_dir*)malloc(sizeof(beholdfs_dir));
 
-			fsdir->dir = dir;
+			fsdir->stream = stream;
 			fsdir->handle = handle;
-			fsdir->stage = stage;
-			fsdir->entry = entry;
+			fsdir->stage = fsdir->first_stage = stage;
+			fsdir->batch = batch;
+			fsdir->deep = bpath->deep && !bpath->listing;
+			fsdir->position = 0;
 
-			fsdir->result = NULL;
 			fsdir->dbresult = NULL;
+			fsdir->dboffset = 0;
+
+			fsdir->cached = cached;
+			fsdir->recording = recording;
+			fsdir->cursor = 0;
 
 			fi->fh = (intptr_t)fsdir;
 		}
 	}
-	syslog(LOG_DEBUG, "beholdfs_opendir: ret=%d", ret);
+	log_debug("beholdfs_opendir: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
 
+// move the cursors of an open directory to the given readdir offset
+static int beholdfs_seekdir(beholdfs_dir *fsdir, off_t offset)
+{
+	log_debug("beholdfs_seekdir(offset=%lld, position=%lld)",
+		(long long)offset, (long long)fsdir->position);
+
+	int ret = 0;
+
+	// the listing does not run from start to end, do not cache it
+	dircache_abort(fsdir->recording);
+	fsdir->recording = NULL;
+	fsdir->dbresult = NULL;
+
+	if (!offset)
+		fsdir->stage = fsdir->first_stage; else
+	if (fsdir->stage)
+		fsdir->stage = 1;
+
+	if (fsdir->cached)
+	{
+		fsdir->cursor = !offset || BEHOLDFS_OFF_TAGDIR == offset ? 0 :
+			dircache_find(fsdir->cached, offset);
+	} else
+	if (fsdir->stage)
+	{
+		statbatch_reset(fsdir->batch);
+		ret = dirstream_seek(fsdir->stream, BEHOLDFS_OFF_TAGDIR == offset ? 0 : offset);
+	} else
+	{
+		if (beholddb_seekdir(fsdir->handle, offset))
+			ret = -EIO;
+	}
+
+	fsdir->position = offset;
+	return ret;
+}
+
 /** Read directory
  *
  * This supersedes the old getdir() interface.  New applications
@@ -679,55 +1181,109 @@ int beholdfs_opendir(const char *path, struct fuse_file_info *fi)
 int beholdfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset,
 		struct fuse_file_info *fi)
 {
-	syslog(LOG_DEBUG, "beholdfs_readdir(path=%s, offset=%d)", path, (int)offset);
+	log_debug("beholdfs_readdir(path=%s, offset=%lld)", path, (long long)offset);
 
 	beholdfs_dir *fsdir = (beholdfs_dir*)(intptr_t)fi->fh;
 	struct stat stat;
 	int ret;
 
-	if (fsdir->stage)
+	// offsets are positions in the real directory stream (d_off) or in
+	// the tag listing, so a listing can continue from any of them
+	if (offset != fsdir->position && (ret = beholdfs_seekdir(fsdir, offset)))
+	{
+		syslog(LOG_ERR, "beholdfs_readdir: cannot seek to %lld (%d)", (long long)offset, ret);
+		return ret;
+	}
+
+	if (2 == fsdir->stage) // show tag character
 	{
-		if (2 == fsdir->stage) // show tag character
+		const char LISTING_DIR[] = { BEHOLDFS_STATE->tagchar, 0 };
+
+		memset(&stat, 0, sizeof(stat));
+		stat.st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+		stat.st_nlink = 1;
+
+		if (filler(buffer, LISTING_DIR, &stat, BEHOLDFS_OFF_TAGDIR))
 		{
-			const char LISTING_DIR[] = { BEHOLDFS_STATE->tagchar, 0 };
+			syslog(LOG_ERR, "beholdfs_readdir: could not add listing dir");
+			return 0; // buffer is full (should not happen)
+		}
 
-			memset(&stat, 0, sizeof(stat));
-			stat.st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-			stat.st_nlink = 1;
+		fsdir->position = BEHOLDFS_OFF_TAGDIR;
+		--fsdir->stage;
+	}
+
+	if (fsdir->cached)
+	{
+		const dircache_entry *entry;
 
-			if (filler(buffer, LISTING_DIR, &stat, ++offset))
+		while ((entry = dircache_get(fsdir->cached, fsdir->cursor)))
+		{
+			if (filler(buffer, entry->name, &entry->stat, entry->offset))
 			{
-				syslog(LOG_ERR, "beholdfs_readdir: could not add listing dir");
-				return 0; // buffer is full (should not happen)
+				log_debug("beholdfs_readdir: buffer is full, offset=%lld", (long long)fsdir->position);
+				return 0; // buffer is full
 			}
-
-			--fsdir->stage;
+			fsdir->position = entry->offset;
+			++fsdir->cursor;
 		}
+		return 0;
+	}
 
+	if (fsdir->stage)
+	{
 		// stage 1
 		while (1)
 		{
-			if (!fsdir->result)
+			statbatch_entry *entry;
+			int rc;
+
+			// pass entries on as soon as their attributes are known
+			while (!(rc = statbatch_peek(fsdir->batch, &entry)) || STATBATCH_ERROR == rc)
 			{
-				// read the directory and test each entry with database layer
-				while (!(ret = -readdir_r(fsdir->dir, fsdir->entry, &fsdir->result)) && fsdir->result &&
-					beholddb_readdir(fsdir->handle, fsdir->result->d_name));
-				syslog(LOG_DEBUG, "beholdfs_readdir: ret=%d, result=%p", ret, fsdir->result);
-				if (ret || !fsdir->result) // error or end of listing
-					break;
+				if (rc)
+				{
+					// the ring lost the entry; stat it here, and do not
+					// cache a listing that may have lost others
+					dircache_abort(fsdir->recording);
+					fsdir->recording = NULL;
+					entry->ret = fstatat(dirstream_fd(fsdir->stream), entry->name,
+						&entry->stat, AT_SYMLINK_NOFOLLOW) ? -errno : 0;
+				}
+				if (filler(buffer, entry->name, entry->ret ? NULL : &entry->stat, entry->offset))
+				{
+					log_debug("beholdfs_readdir: buffer is full, offset=%lld", (long long)fsdir->position);
+					return 0; // buffer is full
+				}
+				log_debug("beholdfs_readdir: added '%s'", entry->name);
+				dircache_append(fsdir->recording, entry->name, entry->offset, entry->ret ? NULL : &entry->stat);
+				fsdir->position = entry->offset;
+				statbatch_pop(fsdir->batch);
 			}
 
-			char *name = fsdir->result->d_name;
-			int fd = dirfd(fsdir->dir);
+			// read the directory and test each entry with database layer,
+			// then stat the whole batch of surviving entries at once
+			const dirstream_entry *dentry = NULL;
 
-			ret = fstatat(fd, name, &stat, AT_SYMLINK_NOFOLLOW);
-			if (filler(buffer, name, ret ? NULL : &stat, ++offset))
+			while (!statbatch_full(fsdir->batch) &&
+				!(ret = dirstream_peek(fsdir->stream, &dentry)))
 			{
-				syslog(LOG_DEBUG, "beholdfs_readdir: buffer is full, offset=%d", (int)offset);
-				return 0; // buffer is full
+				if (!beholddb_readdir(fsdir->handle, dentry->d_name))
+					statbatch_add(fsdir->batch, dentry->d_name, dentry->d_off);
+				dirstream_next(fsdir->stream);
+			}
+			log_debug("beholdfs_readdir: ret=%d, result=%p", ret, dentry);
+			if (!statbatch_submit(fsdir->batch, dirstream_fd(fsdir->stream))) // error or end of listing
+			{
+				if (DIRSTREAM_END == ret)
+					ret = 0;
+				break;
 			}
-			syslog(LOG_DEBUG, "beholdfs_readdir: added '%s'", name);
-			fsdir->result = NULL;
+		}
+		if (!ret)
+		{
+			dircache_commit(fsdir->recording);
+			fsdir->recording = NULL;
 		}
 	} else
 	{
@@ -739,7 +1295,8 @@ int beholdfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off
 		ret = 0;
 
 		memset(&stat, 0, sizeof(stat));
-		stat.st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+		stat.st_mode = fsdir->deep ? S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO :
+			S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
 		stat.st_nlink = 1;
 
 		// stage 0
@@ -749,17 +1306,22 @@ int beholdfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off
 			{
 				if (beholddb_listdir(fsdir->handle, &fsdir->dbresult) || !fsdir->dbresult)
 					break;
-				syslog(LOG_DEBUG, "beholdfs_readdir: ret=%d, result=%p", ret, fsdir->dbresult);
+				fsdir->dboffset = beholddb_telldir(fsdir->handle);
+				log_debug("beholdfs_readdir: ret=%d, result=%p", ret, fsdir->dbresult);
 			}
 
-			if (filler(buffer, fsdir->dbresult, &stat, ++offset))
+			if (filler(buffer, fsdir->dbresult, &stat, fsdir->dboffset))
 			{
-				syslog(LOG_DEBUG, "beholdfs_readdir: buffer is full, offset=%d", (int)offset);
+				log_debug("beholdfs_readdir: buffer is full, offset=%lld", (long long)fsdir->position);
 				return 0; // buffer is full
 			}
-			syslog(LOG_DEBUG, "beholdfs_readdir: added '%s'", fsdir->dbresult);
+			log_debug("beholdfs_readdir: added '%s'", fsdir->dbresult);
+			dircache_append(fsdir->recording, fsdir->dbresult, fsdir->dboffset, &stat);
+			fsdir->position = fsdir->dboffset;
 			fsdir->dbresult = NULL;
 		}
+		dircache_commit(fsdir->recording);
+		fsdir->recording = NULL;
 	}
 	return ret;
 }
@@ -772,12 +1334,14 @@ int beholdfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
 	beholdfs_dir *fsdir = (beholdfs_dir*)(intptr_t)fi->fh;
 
-	syslog(LOG_DEBUG, "beholdfs_releasedir(path=%s)", path);
+	log_debug("beholdfs_releasedir(path=%s)", path);
 	beholddb_closedir(fsdir->handle);
-	closedir(fsdir->dir);
-	free(fsdir->entry);
+	dirstream_close(fsdir->stream);
+	statbatch_free(fsdir->batch);
+	dircache_release(fsdir->cached);
+	dircache_abort(fsdir->recording);
 	free(fsdir);
-	syslog(LOG_DEBUG, "beholdfs_releasedir");
+	log_debug("beholdfs_releasedir");
 	return 0;
 }
 
@@ -790,14 +1354,14 @@ int beholdfs_releasedir(const char *path, struct fuse_file_info *fi)
  */
 int beholdfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 {
-	syslog(LOG_DEBUG, "beholdfs_fsyncdir(path=%s)", path);
+	log_debug("beholdfs_fsyncdir(path=%s)", path);
 	beholdfs_dir *fsdir = (beholdfs_dir*)(intptr_t)fi->fh;
-	int fd = dirfd(fsdir->dir);
+	int fd = dirstream_fd(fsdir->stream);
 	int ret;
 
 	if (fd < 0 || (ret = datasync ? fdatasync(fd) : fsync(fd)))
 		ret = -errno;
-	syslog(LOG_DEBUG, "beholdfs_fsyncdir: ret=%d)", ret);
+	log_debug("beholdfs_fsyncdir: ret=%d)", ret);
 	return ret;
 }
 
@@ -813,14 +1377,21 @@ int beholdfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
  */
 void *beholdfs_init(struct fuse_conn_info *conn)
 {
-	syslog(LOG_DEBUG, "beholdfs_init()");
+	log_debug("beholdfs_init()");
 
 	beholdfs_state *state = BEHOLDFS_STATE;
 	extern char beholddb_tagchar;
 	extern int beholddb_new_locate;
+	extern int beholddb_central;
+	extern int beholddb_index;
 
 	beholddb_tagchar = state->tagchar;
 	beholddb_new_locate = state->new_locate;
+	beholddb_central = state->central;
+	beholddb_index = state->index;
+	dircache_init((size_t)state->listcache * 1024);
+	profile_init(state->profile, state->slow_query);
+	stats_init();
 
 	if (fchdir(state->rootdir))
 	{
@@ -828,6 +1399,9 @@ void *beholdfs_init(struct fuse_conn_info *conn)
 		// TODO: how to handle this?
 	}
 	close(state->rootdir);
+	beholddb_index_init();
+	beholddb_recover();
+	beholddb_rules_init();
 
 	return state;
 }
@@ -841,9 +1415,15 @@ void *beholdfs_init(struct fuse_conn_info *conn)
  */
 void beholdfs_destroy(void *private_data)
 {
-	syslog(LOG_DEBUG, "beholdfs_destroy()");
+	log_debug("beholdfs_destroy()");
 	beholdfs_state *state = (beholdfs_state*)private_data;
 
+	beholddb_index_free();
+	beholddb_free();
+	stats_free();
+	log_free();
+	profile_free();
+	dircache_free();
 	free(state);
 }
 
@@ -860,16 +1440,18 @@ void beholdfs_destroy(void *private_data)
  */
 int beholdfs_access(const char *path, int mode)
 {
-	int ret = -ENOENT;
+	int ret = -ENOENT, special;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_access(path=%s)", path);
+	log_debug("beholdfs_access(path=%s)", path);
+	if ((special = beholdfs_special(path)))
+		return mode & X_OK || (mode & W_OK && !beholdfs_special_writable(special)) ? -EACCES : 0;
 	if (!beholddb_get_file(path, &bpath))
 	{
 		if ((ret = access(bpath->realpath, mode)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_access: ret=%d", ret);
+	log_debug("beholdfs_access: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -891,8 +1473,8 @@ int beholdfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_create(path=%s)", path);
-	if (!beholddb_parse_path(path, &bpath))
+	log_debug("beholdfs_create(path=%s)", path);
+	if (!(ret = beholdfs_parse_target(path, &bpath)))
 	{
 		if (-1 == (fi->fh = creat(bpath->realpath, mode)))
 			ret = -errno; else
@@ -901,7 +1483,7 @@ int beholdfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 			beholddb_create_file(bpath, 0);
 		}
 	}
-	syslog(LOG_DEBUG, "beholdfs_create: ret=%d", ret);
+	log_debug("beholdfs_create: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -922,10 +1504,12 @@ int beholdfs_ftruncate(const char *path, off_t length, struct fuse_file_info *fi
 {
 	int ret;
 
-	syslog(LOG_DEBUG, "beholdfs_ftruncate(path=%s)", path);
+	log_debug("beholdfs_ftruncate(path=%s)", path);
+	if (fi->fh & BEHOLDFS_FH_SPECIAL)
+		return beholdfs_special_writable(BEHOLDFS_FILE(fi->fh)->special) ? 0 : -EBADF;
 	if ((ret = ftruncate(fi->fh, length)))
 		ret = -errno;
-	syslog(LOG_DEBUG, "beholdfs_ftruncate: ret=%d", ret);
+	log_debug("beholdfs_ftruncate: ret=%d", ret);
 	return ret;
 }
 
@@ -945,10 +1529,15 @@ int beholdfs_fgetattr(const char *path, struct stat *stat, struct fuse_file_info
 {
 	int ret;
 
-	syslog(LOG_DEBUG, "beholdfs_fgetattr(path=%s)", path);
+	log_debug("beholdfs_fgetattr(path=%s)", path);
+	if (fi->fh & BEHOLDFS_FH_SPECIAL)
+	{
+		beholdfs_special_stat(BEHOLDFS_FILE(fi->fh)->special, stat);
+		return 0;
+	}
 	if ((ret = fstat(fi->fh, stat)))
 		ret = -errno;
-	syslog(LOG_DEBUG, "beholdfs_fgetattr: ret=%d", ret);
+	log_debug("beholdfs_fgetattr: ret=%d", ret);
 	return ret;
 }
 
@@ -987,7 +1576,7 @@ int beholdfs_fgetattr(const char *path, struct stat *stat, struct fuse_file_info
 int beholdfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
 	     struct flock *lock)
 {
-	syslog(LOG_DEBUG, "beholdfs_lock(path=%s)", path);
+	log_debug("beholdfs_lock(path=%s)", path);
 	return 0;
 }
 
@@ -1002,13 +1591,13 @@ int beholdfs_utimens(const char *path, const struct timespec times[2])
 	int ret = -ENOENT;
 	beholddb_path *bpath;
 
-	syslog(LOG_DEBUG, "beholdfs_utimens(path=%s)", path);
+	log_debug("beholdfs_utimens(path=%s)", path);
 	if (!(beholddb_get_file(path, &bpath)))
 	{
 		if ((ret = utimensat(AT_FDCWD, bpath->realpath, times, AT_SYMLINK_NOFOLLOW)))
 			ret = -errno;
 	}
-	syslog(LOG_DEBUG, "beholdfs_utimens: ret=%d", ret);
+	log_debug("beholdfs_utimens: ret=%d", ret);
 	beholddb_free_path(bpath);
 	return ret;
 }
@@ -1023,7 +1612,7 @@ int beholdfs_utimens(const char *path, const struct timespec times[2])
  */
 int beholdfs_bmap(const char *path, size_t blocksize, uint64_t *idx)
 {
-	syslog(LOG_DEBUG, "beholdfs_bmap(path=%s)", path);
+	log_debug("beholdfs_bmap(path=%s)", path);
 	return 0;
 }
 
@@ -1066,43 +1655,89 @@ int beholdfs_poll(const char *path, struct fuse_file_info *fi,
 {
 }
 
+// time every operation; wrapping keeps the early returns in the
+// operations themselves out of the picture
+#define BEHOLDFS_TIMED(op, ID, params, args) \
+static int beholdfs_timed_##op params \
+{ \
+	uint64_t start = stats_now(); \
+	LOG_PROBE1(op__entry, STATS_##ID); \
+	int ret = beholdfs_##op args; \
+	LOG_PROBE2(op__return, STATS_##ID, ret); \
+	stats_record(STATS_##ID, start, ret); \
+	return ret; \
+}
+
+BEHOLDFS_TIMED(getattr, GETATTR, (const char *path, struct stat *stat), (path, stat))
+BEHOLDFS_TIMED(readlink, READLINK, (const char *path, char *buf, size_t bufsiz), (path, buf, bufsiz))
+BEHOLDFS_TIMED(mknod, MKNOD, (const char *path, mode_t mode, dev_t dev), (path, mode, dev))
+BEHOLDFS_TIMED(mkdir, MKDIR, (const char *path, mode_t mode), (path, mode))
+BEHOLDFS_TIMED(unlink, UNLINK, (const char *path), (path))
+BEHOLDFS_TIMED(rmdir, RMDIR, (const char *path), (path))
+BEHOLDFS_TIMED(symlink, SYMLINK, (const char *oldpath, const char *newpath), (oldpath, newpath))
+BEHOLDFS_TIMED(rename, RENAME, (const char *oldpath, const char *newpath), (oldpath, newpath))
+BEHOLDFS_TIMED(link, LINK, (const char *oldpath, const char *newpath), (oldpath, newpath))
+BEHOLDFS_TIMED(chmod, CHMOD, (const char *path, mode_t mode), (path, mode))
+BEHOLDFS_TIMED(chown, CHOWN, (const char *path, uid_t owner, gid_t group), (path, owner, group))
+BEHOLDFS_TIMED(truncate, TRUNCATE, (const char *path, off_t length), (path, length))
+BEHOLDFS_TIMED(open, OPEN, (const char *path, struct fuse_file_info *fi), (path, fi))
+BEHOLDFS_TIMED(read, READ, (const char *path, char *buf, size_t count, off_t offset, struct fuse_file_info *fi), (path, buf, count, offset, fi))
+BEHOLDFS_TIMED(write, WRITE, (const char *path, const char *buf, size_t count, off_t offset, struct fuse_file_info *fi), (path, buf, count, offset, fi))
+BEHOLDFS_TIMED(statfs, STATFS, (const char *path, struct statvfs *statv), (path, statv))
+BEHOLDFS_TIMED(flush, FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi))
+BEHOLDFS_TIMED(release, RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi))
+BEHOLDFS_TIMED(fsync, FSYNC, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+BEHOLDFS_TIMED(setxattr, SETXATTR, (const char *path, const char *name, const char *value, size_t size, int flags), (path, name, value, size, flags))
+BEHOLDFS_TIMED(getxattr, GETXATTR, (const char *path, const char *name, char *value, size_t size), (path, name, value, size))
+BEHOLDFS_TIMED(listxattr, LISTXATTR, (const char *path, char *list, size_t size), (path, list, size))
+BEHOLDFS_TIMED(removexattr, REMOVEXATTR, (const char *path, const char *name), (path, name))
+BEHOLDFS_TIMED(opendir, OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi))
+BEHOLDFS_TIMED(readdir, READDIR, (const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buffer, filler, offset, fi))
+BEHOLDFS_TIMED(releasedir, RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi))
+BEHOLDFS_TIMED(fsyncdir, FSYNCDIR, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+BEHOLDFS_TIMED(access, ACCESS, (const char *path, int mode), (path, mode))
+BEHOLDFS_TIMED(create, CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+BEHOLDFS_TIMED(ftruncate, FTRUNCATE, (const char *path, off_t length, struct fuse_file_info *fi), (path, length, fi))
+BEHOLDFS_TIMED(fgetattr, FGETATTR, (const char *path, struct stat *stat, struct fuse_file_info *fi), (path, stat, fi))
+BEHOLDFS_TIMED(utimens, UTIMENS, (const char *path, const struct timespec times[2]), (path, times))
+
 struct fuse_operations beholdfs_operations =
 {
-	.getattr =	beholdfs_getattr,
-	.readlink =	beholdfs_readlink,
-	.mknod =	beholdfs_mknod,
-	.mkdir =	beholdfs_mkdir,
-	.unlink =	beholdfs_unlink,
-	.rmdir =	beholdfs_rmdir,
-	.symlink =	beholdfs_symlink,
-	.rename =	beholdfs_rename,
-	.link =		beholdfs_link,
-	.chmod =	beholdfs_chmod,
-	.chown =	beholdfs_chown,
-	.truncate =	beholdfs_truncate,
-	.open =		beholdfs_open,
-	.read =		beholdfs_read,
-	.write =	beholdfs_write,
-	.statfs =	beholdfs_statfs,
-	.flush =	beholdfs_flush,
-	.release =	beholdfs_release,
-	.fsync =	beholdfs_fsync,
-	.setxattr =	beholdfs_setxattr,
-	.getxattr =	beholdfs_getxattr,
-	.listxattr =	beholdfs_listxattr,
-	.removexattr =	beholdfs_removexattr,
-	.opendir =	beholdfs_opendir,
-	.readdir =	beholdfs_readdir,
-	.releasedir =	beholdfs_releasedir,
-	.fsyncdir =	beholdfs_fsyncdir,
+	.getattr =	beholdfs_timed_getattr,
+	.readlink =	beholdfs_timed_readlink,
+	.mknod =	beholdfs_timed_mknod,
+	.mkdir =	beholdfs_timed_mkdir,
+	.unlink =	beholdfs_timed_unlink,
+	.rmdir =	beholdfs_timed_rmdir,
+	.symlink =	beholdfs_timed_symlink,
+	.rename =	beholdfs_timed_rename,
+	.link =		beholdfs_timed_link,
+	.chmod =	beholdfs_timed_chmod,
+	.chown =	beholdfs_timed_chown,
+	.truncate =	beholdfs_timed_truncate,
+	.open =		beholdfs_timed_open,
+	.read =		beholdfs_timed_read,
+	.write =	beholdfs_timed_write,
+	.statfs =	beholdfs_timed_statfs,
+	.flush =	beholdfs_timed_flush,
+	.release =	beholdfs_timed_release,
+	.fsync =	beholdfs_timed_fsync,
+	.setxattr =	beholdfs_timed_setxattr,
+	.getxattr =	beholdfs_timed_getxattr,
+	.listxattr =	beholdfs_timed_listxattr,
+	.removexattr =	beholdfs_timed_removexattr,
+	.opendir =	beholdfs_timed_opendir,
+	.readdir =	beholdfs_timed_readdir,
+	.releasedir =	beholdfs_timed_releasedir,
+	.fsyncdir =	beholdfs_timed_fsyncdir,
 	.init =		beholdfs_init,
 	.destroy =	beholdfs_destroy,
-	.access = 	beholdfs_access,
-	.create =	beholdfs_create,
-	.ftruncate =	beholdfs_ftruncate,
-	.fgetattr =	beholdfs_fgetattr,
+	.access = 	beholdfs_timed_access,
+	.create =	beholdfs_timed_create,
+	.ftruncate =	beholdfs_timed_ftruncate,
+	.fgetattr =	beholdfs_timed_fgetattr,
 	//.lock =		beholdfs_lock,
-	.utimens =	beholdfs_utimens,
+	.utimens =	beholdfs_timed_utimens,
 	//.bmap =		beholdfs_bmap,
 	//.ioctl =	beholdfs_ioctl,
 	//.poll =		beholdfs_poll,
@@ -1116,6 +1751,14 @@ static struct fuse_opt beholdfs_opts[] =
 	BEHOLDFS_OPT("list",		tagshow,	1),
 	BEHOLDFS_OPT("nolist",		tagshow,	0),
 	BEHOLDFS_OPT("new_locate",	new_locate,	1),
+	BEHOLDFS_OPT("stat_depth=%i",	stat_depth,	0),
+	BEHOLDFS_OPT("dirbuf=%i",	dirbuf,		0),
+	BEHOLDFS_OPT("listcache=%i",	listcache,	0),
+	BEHOLDFS_OPT("tracebuf=%i",	tracebuf,	0),
+	BEHOLDFS_OPT("profile",		profile,	1),
+	BEHOLDFS_OPT("slow_query=%i",	slow_query,	0),
+	BEHOLDFS_OPT("central",	central,	1),
+	BEHOLDFS_OPT("index",		index,		1),
 	//FUSE_OPT("--help",		BEHOLDFS_KEY_HELP),
 	//FUSE_OPT("-h",		BEHOLDFS_KEY_HELP),
 	//FUSE_OPT("--version",		BEHOLDFS_KEY_VERSION),
@@ -1146,8 +1789,26 @@ int main(int argc, char **argv)
 	memset(&config, 0, sizeof(config));
 	config.tagchar = BEHOLDFS_TAG_CHAR;
 	config.tagshow = BEHOLDFS_TAG_SHOW;
+	config.stat_depth = BEHOLDFS_STAT_DEPTH;
+	config.dirbuf = BEHOLDFS_DIRBUF;
+	config.listcache = BEHOLDFS_LISTCACHE;
+	config.tracebuf = BEHOLDFS_TRACEBUF;
+	config.slow_query = BEHOLDFS_SLOW_QUERY;
 	fuse_opt_parse(&args, &config, beholdfs_opts, beholdfs_opt_proc);
 
+	if (config.stat_depth < 1 || config.stat_depth > STATBATCH_MAX_DEPTH)
+	{
+		fprintf(stderr, "stat_depth must be between 1 and %d, using %d\n",
+			STATBATCH_MAX_DEPTH, BEHOLDFS_STAT_DEPTH);
+		config.stat_depth = BEHOLDFS_STAT_DEPTH;
+	}
+	if (config.dirbuf < DIRSTREAM_MIN_BUFSIZE || config.dirbuf > DIRSTREAM_MAX_BUFSIZE)
+	{
+		fprintf(stderr, "dirbuf must be between %d and %d, using %d\n",
+			DIRSTREAM_MIN_BUFSIZE, DIRSTREAM_MAX_BUFSIZE, BEHOLDFS_DIRBUF);
+		config.dirbuf = BEHOLDFS_DIRBUF;
+	}
+
 	if (!config.rootdir)
 	{
 		fprintf(stderr, "Usage: beholdfs -o[options] <fsroot> <mountpoint>\n");
@@ -1163,6 +1824,8 @@ int main(int argc, char **argv)
 	}
 
 	setlogmask(LOG_UPTO(config.loglevel <= LOG_DEBUG ? config.loglevel : LOG_DEBUG));
+	// debug events go to the per-thread trace rings (see /%.trace)
+	log_init(config.loglevel, (size_t)config.tracebuf * 1024);
 
 	beholdfs_state *state = (beholdfs_state*)malloc(sizeof(beholdfs_state));
 
@@ -1170,6 +1833,16 @@ int main(int argc, char **argv)
 	state->tagchar = config.tagchar;
 	state->tagshow = config.tagshow;
 	state->new_locate = config.new_locate;
+	state->stat_depth = config.stat_depth;
+	state->dirbuf = config.dirbuf;
+	state->listcache = config.listcache;
+	state->profile = config.profile;
+	state->slow_query = config.slow_query;
+	state->central = config.central;
+	state->index = config.index;
+
+	// let the stats thread be the only one to receive SIGUSR1
+	stats_block_signals();
 
 	int ret = fuse_main(args.argc, args.argv, &beholdfs_operations, state);
 
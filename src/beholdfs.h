@@ -29,6 +29,14 @@ typedef struct beholdfs_config
 	char tagchar;
 	int tagshow;
 	int new_locate;
+	int stat_depth;
+	int dirbuf;
+	int listcache;
+	int tracebuf;
+	int profile;
+	int slow_query;
+	int central;
+	int index;
 } beholdfs_config;
 
 typedef struct beholdfs_state
@@ -38,23 +46,62 @@ typedef struct beholdfs_state
 	char tagchar;
 	char tagshow;
 	int new_locate;
+	int stat_depth;
+	int dirbuf;
+	int listcache;
+	int profile;
+	int slow_query;
+	int central;
+	int index;
 } beholdfs_state;
 
 typedef struct beholdfs_dir
 {
-	int stage;
-	DIR *dir;
+	int stage, first_stage;
+	off_t position;
+	struct dirstream *stream;
 	void *handle;
-	struct dirent *entry;
-	struct dirent *result;
 	const char *dbresult;
+	int64_t dboffset;
+	struct statbatch *batch;
+	int deep;
+
+	// listing served from (or being recorded into) the listing cache
+	struct dircache_listing *cached;
+	struct dircache_listing *recording;
+	size_t cursor;
 } beholdfs_dir;
 
+// open file served by the daemon itself (see beholdfs_special);
+// its fuse handle has the top bit set, which no descriptor can have
+typedef struct beholdfs_file
+{
+	int special;
+	char *data;
+	size_t size;
+
+	// records written to %.batch and not applied yet
+	char *input;
+	size_t input_size;
+} beholdfs_file;
+
+#define BEHOLDFS_FH_SPECIAL	(1ULL << 63)
+#define BEHOLDFS_FILE(fh)	((beholdfs_file*)(uintptr_t)((fh) & ~BEHOLDFS_FH_SPECIAL))
+
 #define BEHOLDFS_STATE ((beholdfs_state*)fuse_get_context()->private_data)
 #define BEHOLDFS_OPT(t, p, v) { t, offsetof(beholdfs_config, p), v }
 
 #define BEHOLDFS_TAG_CHAR	'%'
 #define BEHOLDFS_TAG_SHOW	1
+#define BEHOLDFS_STAT_DEPTH	STATBATCH_DEPTH
+#define BEHOLDFS_DIRBUF		DIRSTREAM_BUFSIZE
+#define BEHOLDFS_LISTCACHE	16384 // KiB
+#define BEHOLDFS_TRACEBUF	LOG_RINGSIZE // KiB
+#define BEHOLDFS_SLOW_QUERY	PROFILE_SLOW_QUERY // ms
+
+// readdir offset of the tag listing entry; d_off values handed out by
+// the kernel and tag listing positions are never negative
+#define BEHOLDFS_OFF_TAGDIR	INT64_MIN
 
 #endif // __BEHOLDFS_H__
 
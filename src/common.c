@@ -71,7 +71,8 @@ int beholddb_set_param(sqlite3 *db, const char *param, const char *value)
 	(rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) ||
 	(rc = sqlite3_bind_text(stmt, 1, param, -1, SQLITE_STATIC)) ||
 	(rc = sqlite3_bind_text(stmt, 2, value, -1, SQLITE_STATIC)) ||
-	(rc = sqlite3_step(stmt));
+	SQLITE_DONE != (rc = sqlite3_step(stmt)) ||
+	(rc = SQLITE_OK);
 
 	sqlite3_finalize(stmt);
 	return rc ? BEHOLDDB_ERROR : BEHOLDDB_OK;
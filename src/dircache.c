@@ -0,0 +1,344 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "dircache.h"
+#include "log.h"
+
+#define DIRCACHE_BUCKETS	1024
+
+struct dircache_listing
+{
+	dircache_stamp stamp;
+	char *tags;
+	unsigned hash;
+
+	dircache_entry *entries;
+	size_t count, capacity;
+	// entry indexes in offset order, for seeks
+	size_t *order;
+	char *names;
+	size_t names_used, names_size;
+
+	size_t size;
+	int refs;
+	int cached;
+	int overflow;
+
+	dircache_listing *next;
+	dircache_listing *lru_prev, *lru_next;
+};
+
+static pthread_mutex_t dircache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dircache_listing *dircache_buckets[DIRCACHE_BUCKETS];
+static dircache_listing *dircache_lru_head, *dircache_lru_tail;
+static size_t dircache_limit, dircache_size;
+
+void dircache_init(size_t limit)
+{
+	dircache_limit = limit;
+	log_debug("dircache_init(limit=%lu)", (unsigned long)limit);
+}
+
+int dircache_enabled()
+{
+	return !!dircache_limit;
+}
+
+static unsigned dircache_hash(const dircache_stamp *stamp, const char *tags)
+{
+	// FNV-1a over the directory identity and the tag set
+	unsigned hash = 2166136261u;
+	uint64_t id[2] = { stamp->dev, stamp->ino };
+	const unsigned char *p = (const unsigned char*)id;
+
+	for (size_t i = 0; i < sizeof(id); ++i)
+		hash = (hash ^ p[i]) * 16777619u;
+	for (p = (const unsigned char*)tags; *p; ++p)
+		hash = (hash ^ *p) * 16777619u;
+	return hash;
+}
+
+static int dircache_same_key(const dircache_listing *listing,
+	const dircache_stamp *stamp, const char *tags, unsigned hash)
+{
+	return listing->hash == hash &&
+		listing->stamp.dev == stamp->dev &&
+		listing->stamp.ino == stamp->ino &&
+		!strcmp(listing->tags, tags);
+}
+
+static int dircache_same_stamp(const dircache_stamp *a, const dircache_stamp *b)
+{
+	return a->mtime.tv_sec == b->mtime.tv_sec &&
+		a->mtime.tv_nsec == b->mtime.tv_nsec &&
+		a->ctime.tv_sec == b->ctime.tv_sec &&
+		a->ctime.tv_nsec == b->ctime.tv_nsec &&
+		a->generation == b->generation;
+}
+
+static void dircache_destroy(dircache_listing *listing)
+{
+	free(listing->tags);
+	free(listing->entries);
+	free(listing->order);
+	free(listing->names);
+	free(listing);
+}
+
+static void dircache_lru_unlink(dircache_listing *listing)
+{
+	if (listing->lru_prev)
+		listing->lru_prev->lru_next = listing->lru_next; else
+		dircache_lru_head = listing->lru_next;
+	if (listing->lru_next)
+		listing->lru_next->lru_prev = listing->lru_prev; else
+		dircache_lru_tail = listing->lru_prev;
+	listing->lru_prev = listing->lru_next = NULL;
+}
+
+static void dircache_lru_push(dircache_listing *listing)
+{
+	listing->lru_prev = NULL;
+	listing->lru_next = dircache_lru_head;
+	if (dircache_lru_head)
+		dircache_lru_head->lru_prev = listing; else
+		dircache_lru_tail = listing;
+	dircache_lru_head = listing;
+}
+
+// called with the mutex held
+static void dircache_remove(dircache_listing *listing)
+{
+	dircache_listing **plink = &dircache_buckets[listing->hash % DIRCACHE_BUCKETS];
+
+	while (*plink != listing)
+		plink = &(*plink)->next;
+	*plink = listing->next;
+	dircache_lru_unlink(listing);
+	dircache_size -= listing->size;
+	listing->cached = 0;
+
+	if (!--listing->refs)
+		dircache_destroy(listing);
+}
+
+void dircache_free()
+{
+	pthread_mutex_lock(&dircache_mutex);
+	while (dircache_lru_tail)
+		dircache_remove(dircache_lru_tail);
+	pthread_mutex_unlock(&dircache_mutex);
+}
+
+dircache_listing *dircache_lookup(const dircache_stamp *stamp, const char *tags)
+{
+	if (!dircache_limit)
+		return NULL;
+
+	unsigned hash = dircache_hash(stamp, tags);
+	dircache_listing *listing;
+
+	pthread_mutex_lock(&dircache_mutex);
+	for (listing = dircache_buckets[hash % DIRCACHE_BUCKETS]; listing; listing = listing->next)
+		if (dircache_same_key(listing, stamp, tags, hash))
+			break;
+	if (listing)
+	{
+		if (dircache_same_stamp(&listing->stamp, stamp))
+		{
+			++listing->refs;
+			dircache_lru_unlink(listing);
+			dircache_lru_push(listing);
+		} else
+		{
+			log_debug("dircache_lookup: stale listing '%s'", tags);
+			dircache_remove(listing);
+			listing = NULL;
+		}
+	}
+	pthread_mutex_unlock(&dircache_mutex);
+	return listing;
+}
+
+void dircache_release(dircache_listing *listing)
+{
+	if (!listing)
+		return;
+
+	pthread_mutex_lock(&dircache_mutex);
+	if (!--listing->refs)
+		dircache_destroy(listing);
+	pthread_mutex_unlock(&dircache_mutex);
+}
+
+size_t dircache_count(const dircache_listing *listing)
+{
+	return listing->count;
+}
+
+const dircache_entry *dircache_get(const dircache_listing *listing, size_t index)
+{
+	return index < listing->count ? &listing->entries[index] : NULL;
+}
+
+// index of the entry following the one with the given offset; offsets
+// come in directory order, which need not be sorted, so they are looked
+// up through the order the listing keeps
+size_t dircache_find(const dircache_listing *listing, int64_t offset)
+{
+	size_t low = 0, high = listing->count;
+
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+
+		if (listing->entries[listing->order[middle]].offset < offset)
+			low = middle + 1; else
+			high = middle;
+	}
+	if (low < listing->count && listing->entries[listing->order[low]].offset == offset)
+		return listing->order[low] + 1;
+	return listing->count;
+}
+
+dircache_listing *dircache_begin(const dircache_stamp *stamp, const char *tags)
+{
+	if (!dircache_limit)
+		return NULL;
+
+	dircache_listing *listing = (dircache_listing*)calloc(1, sizeof(dircache_listing));
+
+	listing->stamp = *stamp;
+	listing->tags = strdup(tags);
+	listing->hash = dircache_hash(stamp, tags);
+	listing->refs = 1;
+	listing->size = sizeof(dircache_listing) + strlen(tags) + 1;
+	return listing;
+}
+
+void dircache_append(dircache_listing *listing, const char *name, int64_t offset, const struct stat *stat)
+{
+	if (!listing || listing->overflow)
+		return;
+
+	size_t len = strlen(name) + 1;
+
+	listing->size += sizeof(dircache_entry) + sizeof(size_t) + len;
+	if (listing->size > dircache_limit)
+	{
+		// would not fit anyway, do not waste memory on it
+		listing->overflow = 1;
+		return;
+	}
+
+	if (listing->count == listing->capacity)
+	{
+		listing->capacity = listing->capacity ? 2 * listing->capacity : 64;
+		listing->entries = (dircache_entry*)realloc(listing->entries,
+			listing->capacity * sizeof(dircache_entry));
+	}
+	if (listing->names_used + len > listing->names_size)
+	{
+		listing->names_size = listing->names_size ? 2 * listing->names_size : 1024;
+		while (listing->names_used + len > listing->names_size)
+			listing->names_size *= 2;
+		listing->names = (char*)realloc(listing->names, listing->names_size);
+	}
+
+	dircache_entry *entry = &listing->entries[listing->count++];
+
+	// names move while the arena grows, keep offsets until commit
+	entry->name = (const char*)(uintptr_t)listing->names_used;
+	entry->offset = offset;
+	if (stat)
+		entry->stat = *stat; else
+		memset(&entry->stat, 0, sizeof(entry->stat));
+	memcpy(listing->names + listing->names_used, name, len);
+	listing->names_used += len;
+}
+
+static __thread const dircache_entry *dircache_sorted;
+
+static int dircache_compare_offsets(const void *a, const void *b)
+{
+	int64_t x = dircache_sorted[*(const size_t*)a].offset;
+	int64_t y = dircache_sorted[*(const size_t*)b].offset;
+
+	return x < y ? -1 : x > y;
+}
+
+void dircache_abort(dircache_listing *listing)
+{
+	if (listing)
+		dircache_destroy(listing);
+}
+
+void dircache_commit(dircache_listing *listing)
+{
+	if (!listing)
+		return;
+	if (listing->overflow)
+	{
+		log_debug("dircache_commit: listing '%s' is too large", listing->tags);
+		dircache_destroy(listing);
+		return;
+	}
+
+	for (size_t i = 0; i < listing->count; ++i)
+		listing->entries[i].name = listing->names + (uintptr_t)listing->entries[i].name;
+
+	listing->order = (size_t*)malloc((listing->count + 1) * sizeof(size_t));
+	for (size_t i = 0; i < listing->count; ++i)
+		listing->order[i] = i;
+	dircache_sorted = listing->entries;
+	qsort(listing->order, listing->count, sizeof(size_t), dircache_compare_offsets);
+
+	dircache_listing **pbucket = &dircache_buckets[listing->hash % DIRCACHE_BUCKETS];
+
+	pthread_mutex_lock(&dircache_mutex);
+
+	// replace an older listing of the same view
+	for (dircache_listing *old = *pbucket; old; old = old->next)
+		if (dircache_same_key(old, &listing->stamp, listing->tags, listing->hash))
+		{
+			dircache_remove(old);
+			break;
+		}
+
+	listing->next = *pbucket;
+	*pbucket = listing;
+	listing->cached = 1;
+	dircache_lru_push(listing);
+	dircache_size += listing->size;
+
+	while (dircache_size > dircache_limit && dircache_lru_tail != listing)
+		dircache_remove(dircache_lru_tail);
+
+	pthread_mutex_unlock(&dircache_mutex);
+	log_debug("dircache_commit: '%s', %lu entries, cache size %lu",
+		listing->tags, (unsigned long)listing->count, (unsigned long)dircache_size);
+}
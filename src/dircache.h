@@ -0,0 +1,65 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DIRCACHE_H__
+#define __DIRCACHE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+// identifies a real directory and the state its listing was built from
+typedef struct dircache_stamp
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	int64_t generation;
+} dircache_stamp;
+
+typedef struct dircache_entry
+{
+	const char *name;
+	int64_t offset;
+	struct stat stat;
+} dircache_entry;
+
+typedef struct dircache_listing dircache_listing;
+
+// limit is the memory budget in bytes, 0 disables the cache
+void dircache_init(size_t limit);
+void dircache_free();
+int dircache_enabled();
+
+// returns a referenced listing or NULL if there is no valid one
+dircache_listing *dircache_lookup(const dircache_stamp *stamp, const char *tags);
+void dircache_release(dircache_listing *listing);
+size_t dircache_count(const dircache_listing *listing);
+const dircache_entry *dircache_get(const dircache_listing *listing, size_t index);
+size_t dircache_find(const dircache_listing *listing, int64_t offset);
+
+// build a listing while the directory is read; the stamp must be taken
+// before reading so that concurrent changes invalidate the result
+dircache_listing *dircache_begin(const dircache_stamp *stamp, const char *tags);
+void dircache_append(dircache_listing *listing, const char *name, int64_t offset, const struct stat *stat);
+void dircache_commit(dircache_listing *listing);
+void dircache_abort(dircache_listing *listing);
+
+#endif // __DIRCACHE_H__
@@ -0,0 +1,131 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "dirstream.h"
+
+struct dirstream
+{
+	int fd;
+	char *buf;
+	size_t size;
+	size_t pos, end;
+	int eof;
+};
+
+int dirstream_openat(dirstream **pstream, int dirfd, const char *path, size_t bufsize)
+{
+	int fd;
+
+	*pstream = NULL;
+	if (-1 == (fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+		return -errno;
+
+	if (!bufsize)
+		bufsize = DIRSTREAM_BUFSIZE;
+
+	dirstream *stream = (dirstream*)malloc(sizeof(dirstream));
+
+	stream->fd = fd;
+	stream->size = bufsize;
+	stream->buf = (char*)malloc(bufsize);
+	stream->pos = stream->end = 0;
+	stream->eof = 0;
+
+	*pstream = stream;
+	return DIRSTREAM_OK;
+}
+
+int dirstream_open(dirstream **pstream, const char *path, size_t bufsize)
+{
+	return dirstream_openat(pstream, AT_FDCWD, path, bufsize);
+}
+
+void dirstream_close(dirstream *stream)
+{
+	if (!stream)
+		return;
+
+	close(stream->fd);
+	free(stream->buf);
+	free(stream);
+}
+
+int dirstream_fd(const dirstream *stream)
+{
+	return stream ? stream->fd : -1;
+}
+
+static int dirstream_fill(dirstream *stream)
+{
+	long len = syscall(SYS_getdents64, stream->fd, stream->buf, stream->size);
+
+	if (len < 0)
+	{
+		syslog(LOG_ERR, "dirstream: getdents64 failed (%d)", errno);
+		return -errno;
+	}
+
+	stream->pos = 0;
+	stream->end = len;
+	stream->eof = !len;
+	return stream->eof ? DIRSTREAM_END : DIRSTREAM_OK;
+}
+
+int dirstream_peek(dirstream *stream, const dirstream_entry **pentry)
+{
+	int rc;
+
+	*pentry = NULL;
+	if (stream->eof)
+		return DIRSTREAM_END;
+	if (stream->pos >= stream->end && (rc = dirstream_fill(stream)))
+		return rc;
+
+	*pentry = (const dirstream_entry*)(stream->buf + stream->pos);
+	return DIRSTREAM_OK;
+}
+
+void dirstream_next(dirstream *stream)
+{
+	if (stream->pos < stream->end)
+		stream->pos += ((const dirstream_entry*)(stream->buf + stream->pos))->d_reclen;
+}
+
+int dirstream_seek(dirstream *stream, int64_t offset)
+{
+	if (-1 == lseek(stream->fd, offset, SEEK_SET))
+		return -errno;
+
+	stream->pos = stream->end = 0;
+	stream->eof = 0;
+	return DIRSTREAM_OK;
+}
+
+int dirstream_rewind(dirstream *stream)
+{
+	return dirstream_seek(stream, 0);
+}
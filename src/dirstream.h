@@ -0,0 +1,61 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DIRSTREAM_H__
+#define __DIRSTREAM_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define DIRSTREAM_OK		0
+#define DIRSTREAM_END		1
+
+#define DIRSTREAM_BUFSIZE	(256 * 1024)
+// the buffer has to hold the longest entry getdents64 can return
+#define DIRSTREAM_MIN_BUFSIZE	4096
+#define DIRSTREAM_MAX_BUFSIZE	(64 * 1024 * 1024)
+
+// layout of struct linux_dirent64 as returned by getdents64
+typedef struct dirstream_entry
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} dirstream_entry;
+
+typedef struct dirstream dirstream;
+
+// bufsize of 0 selects DIRSTREAM_BUFSIZE
+int dirstream_open(dirstream **pstream, const char *path, size_t bufsize);
+int dirstream_openat(dirstream **pstream, int dirfd, const char *path, size_t bufsize);
+void dirstream_close(dirstream *stream);
+int dirstream_fd(const dirstream *stream);
+
+// the entry stays valid until the next call to dirstream_next;
+// returns DIRSTREAM_OK, DIRSTREAM_END or -errno
+int dirstream_peek(dirstream *stream, const dirstream_entry **pentry);
+void dirstream_next(dirstream *stream);
+int dirstream_rewind(dirstream *stream);
+
+// continue after the entry whose d_off is offset
+int dirstream_seek(dirstream *stream, int64_t offset);
+
+#endif // __DIRSTREAM_H__
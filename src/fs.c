@@ -1,14 +1,44 @@
-
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
 #include <stddef.h>
 #include <unistd.h>
-#include <sqlite3.h>
-//extern const sqlite3_api_routines *sqlite3_api;
+#include "sqlitefs.h"
 
+#include "dirstream.h"
 #include "fs.h"
 
+// listings below the top level get a smaller buffer each, since a deep
+// traversal keeps one open per level
+#define FS_NESTED_BUFSIZE	(32 * 1024)
+
+// plans chosen by fs_best_index, as bits of idxNum; the arguments of
+// xFilter come in the same order
+#define FS_PLAN_PATH		1	// path = ?
+#define FS_PLAN_NAME		2	// name = ?, one fstatat
+#define FS_PLAN_DEPTH		4	// depth = ?, depth < ?, depth <= ?
+#define FS_PLAN_RECURSIVE	8	// depth > ?, depth >= ?: no limit
+#define FS_PLAN_DEPTH_LT	16	// the depth bound is exclusive
+
+#define FS_ROWS_PER_LEVEL	1000
+
+enum
+{
+	FS_COLUMN_NAME,
+	FS_COLUMN_TYPE,
+	FS_COLUMN_DIR,
+	FS_COLUMN_DEPTH,
+	FS_COLUMN_SIZE,
+	FS_COLUMN_MTIME,
+	FS_COLUMN_INODE,
+	FS_COLUMN_NLINK,
+	FS_COLUMN_PATH,
+};
+
 typedef struct fs_vtab
 {
 	sqlite3_vtab base;
@@ -16,19 +46,46 @@ typedef struct fs_vtab
 	char *path;
 } fs_vtab;
 
+// one directory being listed; dir is relative to the start of the scan
+typedef struct fs_level
+{
+	dirstream *stream;
+	char *dir;
+} fs_level;
+
 typedef struct fs_cursor
 {
 	sqlite3_vtab_cursor base;
-	DIR *dir;
-	struct dirent *entry;
-	struct dirent *result;
+	char *path;
+	char *start;
+	int maxdepth;
+
+	fs_level *levels;
+	int depth;
+	int capacity;
+	const dirstream_entry *entry;
+
+	// lookup of a single name
+	char *name;
+	int found;
+
+	struct stat stat;
+	int have_stat;
+	int stat_rc;
 } fs_cursor;
 
 static const char *fs_ddl =
 	"create table sqlitefs"
 	"("
 		"name text,"
-		"type integer"
+		"type integer,"
+		"dir text,"
+		"depth integer,"
+		"size integer,"
+		"mtime integer,"
+		"inode integer,"
+		"nlink integer,"
+		"path hidden"
 	")";
 
 int fs_create(sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVTab, char **pzErr)
@@ -55,42 +112,203 @@ int fs_destroy(sqlite3_vtab *pVTab)
 
 int fs_open(sqlite3_vtab *pVTab, sqlite3_vtab_cursor **ppCursor)
 {
-	fs_vtab *pvtab = (fs_vtab*)pVTab;
 	fs_cursor *pcur = (fs_cursor*)sqlite3_malloc(sizeof(fs_cursor));
 	if (!pcur)
 		return SQLITE_NOMEM;
 
-	int len = offsetof(struct dirent, d_name) +
-		pathconf(pvtab->path, _PC_NAME_MAX) + 1;
-	pcur->dir = NULL;
-	pcur->entry = (struct dirent*)sqlite3_malloc(len);
+	memset(pcur, 0, sizeof(fs_cursor));
 
 	*ppCursor = &pcur->base;
 	return SQLITE_OK;
 }
 
+static void fs_reset(fs_cursor *pcur)
+{
+	while (pcur->depth)
+	{
+		fs_level *level = &pcur->levels[--pcur->depth];
+
+		dirstream_close(level->stream);
+		sqlite3_free(level->dir);
+	}
+	sqlite3_free(pcur->path);
+	sqlite3_free(pcur->start);
+	sqlite3_free(pcur->name);
+	pcur->path = NULL;
+	pcur->start = NULL;
+	pcur->name = NULL;
+	pcur->entry = NULL;
+	pcur->found = 0;
+	pcur->have_stat = 0;
+}
+
 int fs_close(sqlite3_vtab_cursor* pCursor)
 {
 	fs_cursor *pcur = (fs_cursor*)pCursor;
 
-	if (pcur->dir)
-		closedir(pcur->dir);
-	sqlite3_free(pcur->entry);
+	fs_reset(pcur);
+	sqlite3_free(pcur->levels);
 	sqlite3_free(pcur);
 	return SQLITE_OK;
 }
 
 int fs_best_index(sqlite3_vtab *pVTab, sqlite3_index_info *pIndex)
 {
-	fs_vtab *pvtab = (fs_vtab*)pVTab;
+	int path = -1, name = -1, depth = -1, exclusive = 0, recursive = 0;
+
+	for (int i = 0; i < pIndex->nConstraint; ++i)
+	{
+		const struct sqlite3_index_constraint *constraint = &pIndex->aConstraint[i];
+
+		if (!constraint->usable)
+			continue;
+		switch (constraint->iColumn)
+		{
+		case FS_COLUMN_PATH:
+			if (SQLITE_INDEX_CONSTRAINT_EQ == constraint->op)
+				path = i;
+			break;
+		case FS_COLUMN_NAME:
+			if (SQLITE_INDEX_CONSTRAINT_EQ == constraint->op)
+				name = i;
+			break;
+		case FS_COLUMN_DEPTH:
+			switch (constraint->op)
+			{
+			case SQLITE_INDEX_CONSTRAINT_EQ:
+			case SQLITE_INDEX_CONSTRAINT_LT:
+			case SQLITE_INDEX_CONSTRAINT_LE:
+				depth = i;
+				exclusive = SQLITE_INDEX_CONSTRAINT_LT == constraint->op;
+				break;
+			case SQLITE_INDEX_CONSTRAINT_GT:
+			case SQLITE_INDEX_CONSTRAINT_GE:
+				recursive = 1;
+				break;
+			}
+			break;
+		}
+	}
+
+	// a name is only looked up at the top level
+	if (-1 != depth || recursive)
+		name = -1;
+
+	int argc = 0;
+	double rows = FS_ROWS_PER_LEVEL;
+
+	pIndex->idxNum = 0;
+	if (-1 != path)
+	{
+		pIndex->idxNum |= FS_PLAN_PATH;
+		pIndex->aConstraintUsage[path].argvIndex = ++argc;
+		pIndex->aConstraintUsage[path].omit = 1;
+	}
+	if (-1 != name)
+	{
+		pIndex->idxNum |= FS_PLAN_NAME;
+		pIndex->aConstraintUsage[name].argvIndex = ++argc;
+		pIndex->aConstraintUsage[name].omit = 1;
+		rows = 1;
+	} else if (-1 != depth)
+	{
+		// depth is checked again by sqlite, which keeps depth = ? exact
+		pIndex->idxNum |= FS_PLAN_DEPTH | (exclusive ? FS_PLAN_DEPTH_LT : 0);
+		pIndex->aConstraintUsage[depth].argvIndex = ++argc;
+		rows = FS_ROWS_PER_LEVEL * 10.0;
+	} else if (recursive)
+	{
+		pIndex->idxNum |= FS_PLAN_RECURSIVE;
+		rows = FS_ROWS_PER_LEVEL * 1000.0;
+	}
+
+	pIndex->estimatedCost = rows;
+	pIndex->estimatedRows = (sqlite3_int64)rows;
+	if (-1 != name)
+		pIndex->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+	return SQLITE_OK;
+}
+
+// stat of the current entry, taken once and only if a column needs it
+static int fs_stat(fs_cursor *pcur)
+{
+	if (pcur->have_stat)
+		return pcur->stat_rc;
+
+	pcur->have_stat = 1;
+	if (pcur->name)
+		pcur->stat_rc = SQLITE_OK; else
+		pcur->stat_rc = fstatat(dirstream_fd(pcur->levels[pcur->depth - 1].stream),
+			pcur->entry->d_name, &pcur->stat, AT_SYMLINK_NOFOLLOW) ? SQLITE_IOERR : SQLITE_OK;
+	return pcur->stat_rc;
+}
+
+static int fs_is_directory(fs_cursor *pcur)
+{
+	if (pcur->name)
+		return S_ISDIR(pcur->stat.st_mode);
+	if (DT_UNKNOWN != pcur->entry->d_type)
+		return DT_DIR == pcur->entry->d_type;
+
+	// some filesystems leave the type to stat
+	return !fs_stat(pcur) && S_ISDIR(pcur->stat.st_mode);
+}
+
+static int fs_push(fs_cursor *pcur, int dirfd, const char *name, char *dir)
+{
+	if (pcur->depth == pcur->capacity)
+	{
+		int capacity = pcur->capacity ? 2 * pcur->capacity : 4;
+		fs_level *levels = (fs_level*)sqlite3_realloc(pcur->levels, capacity * sizeof(fs_level));
+
+		if (!levels)
+		{
+			sqlite3_free(dir);
+			return SQLITE_NOMEM;
+		}
+		pcur->levels = levels;
+		pcur->capacity = capacity;
+	}
 
+	fs_level *level = &pcur->levels[pcur->depth];
+
+	// a directory that cannot be listed has nothing to list
+	if (dirstream_openat(&level->stream, dirfd, name, pcur->depth ? FS_NESTED_BUFSIZE : 0))
+	{
+		sqlite3_free(dir);
+		return SQLITE_OK;
+	}
+	level->dir = dir;
+	++pcur->depth;
 	return SQLITE_OK;
 }
 
-int read_fs(fs_cursor *pcur)
+// move to the next entry that is not . or .., leaving finished levels
+static int read_fs(fs_cursor *pcur)
 {
-	if (readdir_r(pcur->dir, pcur->entry, &pcur->result))
-		return SQLITE_IOERR;
+	pcur->have_stat = 0;
+	while (pcur->depth)
+	{
+		fs_level *level = &pcur->levels[pcur->depth - 1];
+		int rc = dirstream_peek(level->stream, &pcur->entry);
+
+		if (0 > rc)
+			return SQLITE_IOERR;
+		if (DIRSTREAM_END == rc)
+		{
+			dirstream_close(level->stream);
+			sqlite3_free(level->dir);
+			--pcur->depth;
+			continue;
+		}
+
+		const char *name = pcur->entry->d_name;
+
+		if (strcmp(name, ".") && strcmp(name, ".."))
+			return SQLITE_OK;
+		dirstream_next(level->stream);
+	}
+	pcur->entry = NULL;
 	return SQLITE_OK;
 }
 
@@ -98,8 +316,59 @@ int fs_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr, int
 {
 	fs_cursor *pcur = (fs_cursor*)pCursor;
 	fs_vtab *pvtab = (fs_vtab*)pcur->base.pVtab;
+	int rc, arg = 0;
+
+	fs_reset(pcur);
+
+	// relative paths are taken from the path of the table
+	if (idxNum & FS_PLAN_PATH)
+	{
+		const char *path = (const char*)sqlite3_value_text(argv[arg++]);
+
+		if (!path)
+			return SQLITE_OK;
+		pcur->start = sqlite3_mprintf("%s", path);
+		pcur->path = '/' == *path ?
+			sqlite3_mprintf("%s", path) :
+			sqlite3_mprintf("%s/%s", pvtab->path, path);
+	} else
+	{
+		pcur->start = sqlite3_mprintf("%s", pvtab->path);
+		pcur->path = sqlite3_mprintf("%s", pvtab->path);
+	}
+	if (!pcur->start || !pcur->path)
+		return SQLITE_NOMEM;
+
+	if (idxNum & FS_PLAN_NAME)
+	{
+		const char *name = (const char*)sqlite3_value_text(argv[arg++]);
+		char *path;
+
+		if (!name || !*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+			return SQLITE_OK;
+		if (!(pcur->name = sqlite3_mprintf("%s", name)) ||
+			!(path = sqlite3_mprintf("%s/%s", pcur->path, name)))
+			return SQLITE_NOMEM;
+		pcur->found = !fstatat(AT_FDCWD, path, &pcur->stat, AT_SYMLINK_NOFOLLOW);
+		pcur->have_stat = 1;
+		pcur->stat_rc = SQLITE_OK;
+		sqlite3_free(path);
+		return SQLITE_OK;
+	}
+
+	pcur->maxdepth = 0;
+	if (idxNum & FS_PLAN_DEPTH)
+	{
+		sqlite3_int64 depth = sqlite3_value_int64(argv[arg++]) - !!(idxNum & FS_PLAN_DEPTH_LT);
+
+		pcur->maxdepth = depth < 0 ? -1 : depth > INT_MAX ? INT_MAX : (int)depth;
+	} else if (idxNum & FS_PLAN_RECURSIVE)
+		pcur->maxdepth = INT_MAX;
+	if (0 > pcur->maxdepth)
+		return SQLITE_OK;
 
-	pcur->dir = opendir(pvtab->path);
+	if ((rc = fs_push(pcur, AT_FDCWD, pcur->path, sqlite3_mprintf(""))))
+		return rc;
 	return read_fs(pcur);
 }
 
@@ -107,6 +376,31 @@ int fs_next(sqlite3_vtab_cursor *pCursor)
 {
 	fs_cursor *pcur = (fs_cursor*)pCursor;
 
+	if (pcur->name)
+	{
+		pcur->found = 0;
+		return SQLITE_OK;
+	}
+
+	// descend into a directory right after it was returned; the parent
+	// moves on now and carries on when the child is done
+	int rc, top = pcur->depth - 1;
+
+	if (top < pcur->maxdepth && fs_is_directory(pcur))
+	{
+		fs_level *level = &pcur->levels[top];
+		const char *name = pcur->entry->d_name;
+		char *dir = *level->dir ?
+			sqlite3_mprintf("%s/%s", level->dir, name) :
+			sqlite3_mprintf("%s", name);
+
+		if (!dir)
+			return SQLITE_NOMEM;
+		if ((rc = fs_push(pcur, dirstream_fd(level->stream), name, dir)))
+			return rc;
+	}
+
+	dirstream_next(pcur->levels[top].stream);
 	return read_fs(pcur);
 }
 
@@ -114,20 +408,62 @@ int fs_eof(sqlite3_vtab_cursor *pCursor)
 {
 	fs_cursor *pcur = (fs_cursor*)pCursor;
 
-	return !pcur->result;
+	return pcur->name ? !pcur->found : !pcur->entry;
 }
 
 int fs_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *pContext, int iCol)
 {
 	fs_cursor *pcur = (fs_cursor*)pCursor;
+	fs_level *level = pcur->name ? NULL : &pcur->levels[pcur->depth - 1];
 
 	switch (iCol)
 	{
-	case 0: // name
-		sqlite3_result_text(pContext, pcur->result->d_name, -1, SQLITE_STATIC);
+	case FS_COLUMN_NAME:
+		sqlite3_result_text(pContext, pcur->name ? pcur->name : pcur->entry->d_name, -1, SQLITE_TRANSIENT);
+		break;
+	case FS_COLUMN_TYPE:
+		sqlite3_result_int(pContext, fs_is_directory(pcur));
+		break;
+	case FS_COLUMN_DIR:
+		sqlite3_result_text(pContext, level ? level->dir : "", -1, SQLITE_TRANSIENT);
+		break;
+	case FS_COLUMN_DEPTH:
+		sqlite3_result_int(pContext, level ? pcur->depth - 1 : 0);
 		break;
-	case 1: // type
-		sqlite3_result_int(pContext, DT_DIR == pcur->result->d_type);
+	case FS_COLUMN_INODE:
+		if (level)
+		{
+			sqlite3_result_int64(pContext, pcur->entry->d_ino);
+			break;
+		}
+		// fall through
+	case FS_COLUMN_SIZE:
+	case FS_COLUMN_MTIME:
+	case FS_COLUMN_NLINK:
+		if (fs_stat(pcur))
+		{
+			// gone since it was listed
+			sqlite3_result_null(pContext);
+			break;
+		}
+		switch (iCol)
+		{
+		case FS_COLUMN_SIZE:
+			sqlite3_result_int64(pContext, pcur->stat.st_size);
+			break;
+		case FS_COLUMN_MTIME:
+			sqlite3_result_int64(pContext, pcur->stat.st_mtime);
+			break;
+		case FS_COLUMN_INODE:
+			sqlite3_result_int64(pContext, pcur->stat.st_ino);
+			break;
+		case FS_COLUMN_NLINK:
+			sqlite3_result_int64(pContext, pcur->stat.st_nlink);
+			break;
+		}
+		break;
+	case FS_COLUMN_PATH:
+		sqlite3_result_text(pContext, pcur->start, -1, SQLITE_TRANSIENT);
 		break;
 	default:
 		return SQLITE_INTERNAL;
@@ -139,17 +475,10 @@ int fs_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid)
 {
 	fs_cursor *pcur = (fs_cursor*)pCursor;
 
-	*pRowid = pcur->result->d_ino;
+	*pRowid = pcur->name ? pcur->stat.st_ino : pcur->entry->d_ino;
 	return SQLITE_OK;
 }
 
-int fs_find_function(sqlite3_vtab *pVtab, int nArg, const char *zName,
-	void (**pxFunc)(sqlite3_context*,int,sqlite3_value**),
-	void **ppArg)
-{
-	return 0;
-}
-
 static sqlite3_module fs_module =
 {
 	.iVersion	= 1,
@@ -170,7 +499,7 @@ static sqlite3_module fs_module =
 	.xSync		= NULL,
 	.xCommit	= NULL,
 	.xRollback	= NULL,
-	.xFindFunction	= NULL,//fs_find_function,
+	.xFindFunction	= NULL,
 	.xRename	= NULL,
 };
 
@@ -179,4 +508,3 @@ int fs_create_module(sqlite3 *db, const char *path)
 	char *root = sqlite3_mprintf("%s", path);
 	return sqlite3_create_module_v2(db, "sqlitefs", &fs_module, root, sqlite3_free);
 }
-
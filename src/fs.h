@@ -1,2 +1,10 @@
+// the sqlitefs module lists the directory at path, or at the hidden
+// column path (relative to the first): name, type (1 for directories),
+// dir and depth (where below the start an entry is), and size, mtime,
+// inode and nlink, which are only stat'ed when asked for
+//
+// name = ? is one fstatat; only the top level is listed unless depth is
+// bounded (depth = ?, depth < ?, depth <= ?) or asked to be >= or > ?,
+// which lists everything below
 int fs_create_module(sqlite3 *db, const char *path);
 
@@ -0,0 +1,641 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// beholdfs-fsck: bring the metadata of an unmounted tree back in line
+// with the directories
+//
+// Every directory is one task. A task lists the directory and queues its
+// subdirectories on the deque of the thread that runs it; idle threads
+// steal from the other end of the other deques. A directory is checked
+// once all of its subdirectories are: its rows are diffed against the
+// entries listed by the sqlitefs module, then the tags of its
+// subdirectory entries are recomputed from what the subdirectories hold,
+// and the counters the triggers maintain are recounted. With -n all of
+// this happens in a transaction that is rolled back.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "beholddb.h"
+#include "dirstream.h"
+#include "fs.h"
+#include "schema.h"
+
+#define FSCK_THREADS		4
+#define FSCK_IDLE_NSEC		1000000
+
+// fsck(8) exit codes
+#define FSCK_EXIT_OK		0
+#define FSCK_EXIT_CORRECTED	1
+#define FSCK_EXIT_UNCORRECTED	4
+#define FSCK_EXIT_ERROR		8
+
+typedef struct fsck_tags
+{
+	char **names;
+	int count;
+} fsck_tags;
+
+typedef struct fsck_dir
+{
+	char *path;
+	char *name;
+	struct fsck_dir *parent;
+	struct fsck_dir *children;
+	struct fsck_dir *sibling;
+
+	// subdirectories not checked yet
+	int pending;
+
+	// every tag under the directory, and the tags every entry has
+	fsck_tags weak;
+	fsck_tags strong;
+} fsck_dir;
+
+typedef struct fsck_counts
+{
+	long dirs;
+	long entries;
+	long missing;
+	long orphans;
+	long untracked;
+	long stale;
+	long counters;
+	long unused;
+	long errors;
+} fsck_counts;
+
+// tasks of one thread: popped at the tail, stolen at the head
+typedef struct fsck_worker
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	fsck_dir **tasks;
+	int head;
+	int tail;
+	int capacity;
+	fsck_counts counts;
+} fsck_worker;
+
+static struct
+{
+	int threads;
+	int dry_run;
+	int verbose;
+	fsck_worker *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int idle;
+	long outstanding;
+} fsck;
+
+static void fsck_push(fsck_worker *worker, fsck_dir *dir)
+{
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail == worker->capacity)
+	{
+		if (worker->head)
+		{
+			memmove(worker->tasks, &worker->tasks[worker->head], (worker->tail - worker->head) * sizeof(fsck_dir*));
+			worker->tail -= worker->head;
+			worker->head = 0;
+		} else
+		{
+			worker->capacity = worker->capacity ? 2 * worker->capacity : 64;
+			worker->tasks = (fsck_dir**)realloc(worker->tasks, worker->capacity * sizeof(fsck_dir*));
+		}
+	}
+	worker->tasks[worker->tail++] = dir;
+	pthread_mutex_unlock(&worker->lock);
+
+	// idle threads wake up on their own as well, so a racy look is enough
+	if (fsck.idle)
+	{
+		pthread_mutex_lock(&fsck.lock);
+		pthread_cond_signal(&fsck.wake);
+		pthread_mutex_unlock(&fsck.lock);
+	}
+}
+
+static fsck_dir *fsck_pop(fsck_worker *worker)
+{
+	fsck_dir *dir = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->head < worker->tail)
+		dir = worker->tasks[--worker->tail];
+	if (worker->head == worker->tail)
+		worker->head = worker->tail = 0;
+	pthread_mutex_unlock(&worker->lock);
+	return dir;
+}
+
+static fsck_dir *fsck_steal(fsck_worker *worker)
+{
+	int self = worker - fsck.workers;
+
+	for (int i = 1; i < fsck.threads; ++i)
+	{
+		fsck_worker *victim = &fsck.workers[(self + i) % fsck.threads];
+		fsck_dir *dir = NULL;
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail)
+			dir = victim->tasks[victim->head++];
+		pthread_mutex_unlock(&victim->lock);
+		if (dir)
+			return dir;
+	}
+	return NULL;
+}
+
+static char *fsck_join(const char *dir, const char *name)
+{
+	char *path = (char*)malloc(strlen(dir) + strlen(name) + 2);
+
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+static void fsck_tags_free(fsck_tags *tags)
+{
+	for (int i = 0; i < tags->count; ++i)
+		free(tags->names[i]);
+	free(tags->names);
+	tags->names = NULL;
+	tags->count = 0;
+}
+
+// the names a statement returns, in order
+static int fsck_tags_load(sqlite3_stmt *stmt, fsck_tags *tags)
+{
+	int rc, capacity = 0;
+
+	tags->names = NULL;
+	tags->count = 0;
+	while (SQLITE_ROW == (rc = sqlite3_step(stmt)))
+	{
+		if (tags->count == capacity)
+		{
+			capacity = capacity ? 2 * capacity : 8;
+			tags->names = (char**)realloc(tags->names, capacity * sizeof(char*));
+		}
+		tags->names[tags->count++] = strdup((const char*)sqlite3_column_text(stmt, 0));
+	}
+	return SQLITE_DONE == rc ? SQLITE_OK : rc;
+}
+
+static int fsck_tags_equal(const fsck_tags *a, const fsck_tags *b)
+{
+	if (a->count != b->count)
+		return 0;
+	for (int i = 0; i < a->count; ++i)
+		if (strcmp(a->names[i], b->names[i]))
+			return 0;
+	return 1;
+}
+
+// do the tags of a file row match the list
+static int fsck_tags_match(sqlite3 *db, const char *sql, sqlite3_int64 id, const fsck_tags *tags, int *pmatch)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	fsck_tags current = { NULL, 0 };
+
+	(rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) ||
+	(rc = sqlite3_bind_int64(stmt, 1, id)) ||
+	(rc = fsck_tags_load(stmt, &current));
+
+	*pmatch = !rc && fsck_tags_equal(&current, tags);
+	fsck_tags_free(&current);
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+static int fsck_tags_insert(sqlite3 *db, const char *sql, sqlite3_int64 id, const fsck_tags *tags)
+{
+	int rc;
+	sqlite3_stmt *tag = NULL, *link = NULL;
+
+	(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_IMPORT_TAG, -1, &tag, NULL)) ||
+	(rc = sqlite3_prepare_v2(db, sql, -1, &link, NULL));
+
+	for (int i = 0; !rc && i < tags->count; ++i)
+	{
+		(rc = sqlite3_reset(tag)) ||
+		(rc = sqlite3_bind_text(tag, 1, tags->names[i], -1, SQLITE_STATIC)) ||
+		SQLITE_DONE != (rc = sqlite3_step(tag)) ||
+		(rc = sqlite3_reset(link)) ||
+		(rc = sqlite3_bind_int64(link, 1, id)) ||
+		(rc = sqlite3_bind_text(link, 2, tags->names[i], -1, SQLITE_STATIC)) ||
+		SQLITE_DONE != (rc = sqlite3_step(link)) ||
+		(rc = SQLITE_OK);
+	}
+
+	sqlite3_finalize(tag);
+	sqlite3_finalize(link);
+	return rc;
+}
+
+static int fsck_exec_id(sqlite3 *db, const char *sql, sqlite3_int64 id)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+
+	(rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) ||
+	(rc = sqlite3_bind_int64(stmt, 1, id)) ||
+	SQLITE_DONE != (rc = sqlite3_step(stmt)) ||
+	(rc = SQLITE_OK);
+
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+// bring the entry of a subdirectory in line with what it holds
+static int fsck_check_child(sqlite3 *db, fsck_dir *child, long *pstale)
+{
+	int rc, weak = 1, strong = 1;
+	sqlite3_int64 id = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_FSCK_DIR, -1, &stmt, NULL)) ||
+	(rc = sqlite3_bind_text(stmt, 1, child->name, -1, SQLITE_STATIC)) ||
+	SQLITE_ROW != (rc = sqlite3_step(stmt)) ||
+	(rc = SQLITE_OK);
+	if (!rc)
+		id = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	// gone since it was listed
+	if (SQLITE_DONE == rc)
+		return SQLITE_OK;
+
+	rc ||
+	(rc = fsck_tags_match(db, BEHOLDDB_DML_FSCK_FILES_TAGS, id, &child->weak, &weak)) ||
+	(rc = fsck_tags_match(db, BEHOLDDB_DML_FSCK_DIRS_TAGS, id, &child->strong, &strong));
+	if (rc || (weak && strong))
+		return rc;
+
+	++*pstale;
+	(rc = fsck_exec_id(db, BEHOLDDB_DML_FSCK_CLEAR_FILES_TAGS, id)) ||
+	(rc = fsck_exec_id(db, BEHOLDDB_DML_FSCK_CLEAR_DIRS_TAGS, id)) ||
+	(rc = fsck_tags_insert(db, BEHOLDDB_DML_IMPORT_FILES_TAG, id, &child->weak)) ||
+	(rc = fsck_tags_insert(db, BEHOLDDB_DML_IMPORT_DIRS_TAG, id, &child->strong));
+	return rc;
+}
+
+static int fsck_load(sqlite3 *db, const char *sql, fsck_tags *tags)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+
+	(rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) ||
+	(rc = fsck_tags_load(stmt, tags));
+
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+// the metadata of the directory, or a scratch copy of the schema when it
+// has none and nothing may be written
+static int fsck_open(fsck_dir *dir, sqlite3 **pdb, int *pmissing)
+{
+	int rc;
+	char *name = fsck_join(dir->path, ".beholdfs");
+
+	*pmissing = access(name, F_OK) && ENOENT == errno;
+	if (!fsck.dry_run)
+	{
+		(rc = beholddb_open_metadata(dir->path, pdb)) ||
+		(rc = beholddb_exec(*pdb, "pragma synchronous = off;"));
+	} else if (!*pmissing)
+	{
+		(rc = sqlite3_open_v2(name, pdb, SQLITE_OPEN_READWRITE, NULL)) ||
+		(rc = beholddb_exec(*pdb, "pragma foreign_keys = on;"));
+	} else
+	{
+		(rc = sqlite3_open_v2(":memory:", pdb, SQLITE_OPEN_READWRITE, NULL)) ||
+		(rc = beholddb_exec(*pdb, "pragma foreign_keys = on;")) ||
+		(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CREATE_TABLES)) ||
+		(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CREATE_INDEXES)) ||
+		(rc = beholddb_exec(*pdb, BEHOLDDB_DDL_CREATE_TRIGGERS));
+	}
+
+	free(name);
+	return rc;
+}
+
+static int fsck_check(fsck_worker *worker, fsck_dir *dir)
+{
+	int rc, missing;
+	sqlite3 *db = NULL;
+	fsck_counts counts;
+
+	memset(&counts, 0, sizeof(counts));
+	if ((rc = fsck_open(dir, &db, &missing)))
+	{
+		fprintf(stderr, "%s: cannot open metadata (%d)\n", dir->path, rc);
+		sqlite3_close(db);
+		++worker->counts.errors;
+		return rc;
+	}
+	counts.missing = missing;
+
+	(rc = fs_create_module(db, dir->path)) ||
+	(rc = beholddb_exec(db, "begin transaction;")) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_FSCK_START)) ||
+	(counts.entries = sqlite3_changes(db), rc = beholddb_exec(db, BEHOLDDB_DML_FSCK_ORPHANS)) ||
+	(counts.orphans = sqlite3_changes(db), rc = beholddb_exec(db, BEHOLDDB_DML_FSCK_UNTRACKED)) ||
+	(counts.untracked = sqlite3_changes(db), rc = SQLITE_OK);
+
+	for (fsck_dir *child = dir->children; !rc && child; child = child->sibling)
+		rc = fsck_check_child(db, child, &counts.stale);
+
+	rc ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_FSCK_COUNTERS)) ||
+	(counts.counters = sqlite3_changes(db), rc = beholddb_exec(db, BEHOLDDB_DML_FSCK_SUMMARY)) ||
+	(counts.counters += sqlite3_changes(db), rc = beholddb_exec(db, BEHOLDDB_DML_FSCK_UNUSED_TAGS)) ||
+	(counts.unused = sqlite3_changes(db), rc = fsck_load(db, BEHOLDDB_DML_FSCK_WEAK, &dir->weak)) ||
+	(rc = fsck_load(db, BEHOLDDB_DML_FSCK_STRONG, &dir->strong)) ||
+	(!fsck.dry_run && (rc = beholddb_stamp_directory(db, dir->path))) ||
+	(rc = beholddb_exec(db, fsck.dry_run ? "rollback;" : "commit;"));
+
+	if (rc)
+	{
+		fprintf(stderr, "%s: %s\n", dir->path, sqlite3_errmsg(db));
+		beholddb_exec(db, "rollback;");
+		sqlite3_close(db);
+		++worker->counts.errors;
+		return rc;
+	}
+	sqlite3_close(db);
+
+	if (fsck.verbose && (counts.missing || counts.orphans || counts.untracked ||
+		counts.stale || counts.counters || counts.unused))
+		printf("%s:%s %ld orphaned, %ld untracked, %ld stale directories, %ld counters, %ld unused tags\n",
+			dir->path, counts.missing ? " no metadata," : "",
+			counts.orphans, counts.untracked, counts.stale, counts.counters, counts.unused);
+
+	++worker->counts.dirs;
+	worker->counts.entries += counts.entries;
+	worker->counts.missing += counts.missing;
+	worker->counts.orphans += counts.orphans;
+	worker->counts.untracked += counts.untracked;
+	worker->counts.stale += counts.stale;
+	worker->counts.counters += counts.counters;
+	worker->counts.unused += counts.unused;
+	return rc;
+}
+
+static void fsck_free_dir(fsck_dir *dir)
+{
+	fsck_tags_free(&dir->weak);
+	fsck_tags_free(&dir->strong);
+	free(dir->path);
+	free(dir);
+}
+
+// check the directory and then every parent it was the last one to wait for
+static void fsck_finish(fsck_worker *worker, fsck_dir *dir)
+{
+	for (;;)
+	{
+		fsck_check(worker, dir);
+		for (fsck_dir *child = dir->children, *next; child; child = next)
+		{
+			next = child->sibling;
+			fsck_free_dir(child);
+		}
+		dir->children = NULL;
+
+		pthread_mutex_lock(&fsck.lock);
+		if (!--fsck.outstanding)
+			pthread_cond_broadcast(&fsck.wake);
+		pthread_mutex_unlock(&fsck.lock);
+
+		if (!(dir = dir->parent) || __sync_sub_and_fetch(&dir->pending, 1))
+			break;
+	}
+}
+
+static void fsck_visit(fsck_worker *worker, fsck_dir *dir)
+{
+	int rc, count = 0;
+	dirstream *stream;
+	const dirstream_entry *entry;
+
+	if (!(rc = dirstream_open(&stream, dir->path, 0)))
+	{
+		while (DIRSTREAM_OK == (rc = dirstream_peek(stream, &entry)))
+		{
+			struct stat st;
+			const char *name = entry->d_name;
+
+			if (strcmp(name, ".") && strcmp(name, "..") && !beholddb_is_metadata(name) &&
+				(DT_DIR == entry->d_type || (DT_UNKNOWN == entry->d_type &&
+				!fstatat(dirstream_fd(stream), name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode))))
+			{
+				fsck_dir *child = (fsck_dir*)calloc(1, sizeof(fsck_dir));
+
+				child->path = fsck_join(dir->path, name);
+				child->name = strrchr(child->path, '/') + 1;
+				child->parent = dir;
+				child->sibling = dir->children;
+				dir->children = child;
+				++count;
+			}
+			dirstream_next(stream);
+		}
+		dirstream_close(stream);
+	}
+	if (0 > rc)
+	{
+		fprintf(stderr, "%s: %s\n", dir->path, strerror(-rc));
+		++worker->counts.errors;
+	}
+
+	if (!count)
+	{
+		fsck_finish(worker, dir);
+		return;
+	}
+
+	pthread_mutex_lock(&fsck.lock);
+	fsck.outstanding += count;
+	pthread_mutex_unlock(&fsck.lock);
+
+	dir->pending = count;
+	for (fsck_dir *child = dir->children; child; child = child->sibling)
+		fsck_push(worker, child);
+}
+
+static void *fsck_thread(void *arg)
+{
+	fsck_worker *worker = (fsck_worker*)arg;
+
+	for (;;)
+	{
+		fsck_dir *dir;
+
+		if ((dir = fsck_pop(worker)) || (dir = fsck_steal(worker)))
+		{
+			fsck_visit(worker, dir);
+			continue;
+		}
+
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		if (1000000000 <= (deadline.tv_nsec += FSCK_IDLE_NSEC))
+		{
+			deadline.tv_nsec -= 1000000000;
+			++deadline.tv_sec;
+		}
+
+		pthread_mutex_lock(&fsck.lock);
+		if (!fsck.outstanding)
+		{
+			pthread_mutex_unlock(&fsck.lock);
+			break;
+		}
+		++fsck.idle;
+		pthread_cond_timedwait(&fsck.wake, &fsck.lock, &deadline);
+		--fsck.idle;
+		pthread_mutex_unlock(&fsck.lock);
+	}
+	return NULL;
+}
+
+static void fsck_usage()
+{
+	fprintf(stderr,
+		"Usage: beholdfs-fsck [options] <fsroot>\n"
+		"Checks the metadata of an unmounted BeholdFS tree against its files\n"
+		"and repairs it.\n"
+		"\n"
+		"  -n        report only, change nothing\n"
+		"  -v        report every directory that needs repairs\n"
+		"  -j N      check N directories at a time (%d)\n",
+		FSCK_THREADS);
+	exit(FSCK_EXIT_ERROR);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	fsck.threads = FSCK_THREADS;
+	while (-1 != (opt = getopt(argc, argv, "nvj:h")))
+	{
+		switch (opt)
+		{
+		case 'n':
+			fsck.dry_run = 1;
+			break;
+		case 'v':
+			fsck.verbose = 1;
+			break;
+		case 'j':
+			if (0 >= (fsck.threads = atoi(optarg)))
+				fsck_usage();
+			break;
+		default:
+			fsck_usage();
+		}
+	}
+	if (optind + 1 != argc)
+		fsck_usage();
+
+	if (chdir(argv[optind]))
+	{
+		perror(argv[optind]);
+		exit(FSCK_EXIT_ERROR);
+	}
+
+	struct timespec start, stop;
+	fsck_dir *root = (fsck_dir*)calloc(1, sizeof(fsck_dir));
+	fsck_counts total;
+
+	root->path = strdup(".");
+	root->name = root->path;
+	fsck.outstanding = 1;
+	fsck.workers = (fsck_worker*)calloc(fsck.threads, sizeof(fsck_worker));
+	pthread_mutex_init(&fsck.lock, NULL);
+	pthread_cond_init(&fsck.wake, NULL);
+	for (int i = 0; i < fsck.threads; ++i)
+		pthread_mutex_init(&fsck.workers[i].lock, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fsck_push(&fsck.workers[0], root);
+	for (int i = 0; i < fsck.threads; ++i)
+		pthread_create(&fsck.workers[i].thread, NULL, fsck_thread, &fsck.workers[i]);
+	for (int i = 0; i < fsck.threads; ++i)
+		pthread_join(fsck.workers[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	memset(&total, 0, sizeof(total));
+	for (int i = 0; i < fsck.threads; ++i)
+	{
+		fsck_counts *counts = &fsck.workers[i].counts;
+
+		total.dirs += counts->dirs;
+		total.entries += counts->entries;
+		total.missing += counts->missing;
+		total.orphans += counts->orphans;
+		total.untracked += counts->untracked;
+		total.stale += counts->stale;
+		total.counters += counts->counters;
+		total.unused += counts->unused;
+		total.errors += counts->errors;
+		free(fsck.workers[i].tasks);
+	}
+
+	long drift = total.missing + total.orphans + total.untracked +
+		total.stale + total.counters + total.unused;
+
+	printf("%ld directories, %ld entries checked in %.1f s\n",
+		total.dirs, total.entries,
+		stop.tv_sec - start.tv_sec + (stop.tv_nsec - start.tv_nsec) / 1e9);
+	printf("%s: %ld directories without metadata, %ld orphaned rows, %ld untracked entries,\n"
+		"%ld stale directory entries, %ld wrong counters, %ld unused tags; %ld errors\n",
+		fsck.dry_run ? "found" : "repaired",
+		total.missing, total.orphans, total.untracked,
+		total.stale, total.counters, total.unused, total.errors);
+
+	fsck_free_dir(root);
+	free(fsck.workers);
+
+	if (total.errors)
+		return FSCK_EXIT_ERROR;
+	if (drift)
+		return fsck.dry_run ? FSCK_EXIT_UNCORRECTED : FSCK_EXIT_CORRECTED;
+	return FSCK_EXIT_OK;
+}
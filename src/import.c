@@ -0,0 +1,842 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// beholdfs-import: tag an unmounted tree in bulk
+//
+// The tree is scanned once; then every directory is imported by a pool
+// of threads as soon as all of its subdirectories are done, so that the
+// tags of a subdirectory (every tag under it, and the tags every file
+// under it has) are known when its entry is written to the parent. Each
+// directory is rewritten in one transaction, keeping the tags its files
+// already have.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <attr/xattr.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "beholddb.h"
+#include "schema.h"
+
+#define IMPORT_THREADS		4
+#define IMPORT_MAX_XATTRS	8
+#define IMPORT_XATTR_SIZE	65536
+
+// sorted set of tag names
+typedef struct import_tags
+{
+	char **names;
+	int count;
+	int capacity;
+} import_tags;
+
+struct import_dir;
+
+typedef struct import_entry
+{
+	char *name;
+	int type;
+	import_tags tags;
+	struct import_dir *dir;
+} import_entry;
+
+typedef struct import_dir
+{
+	char *path;
+	char *relpath;
+	struct import_dir *parent;
+	import_entry *entries;
+	int count;
+	int capacity;
+
+	// subdirectories not imported yet
+	int pending;
+
+	// every tag under the directory, and the tags every entry has
+	import_tags weak;
+	import_tags strong;
+
+	struct import_dir *next;
+} import_dir;
+
+// tags by path relative to the root, from csv/tsv input
+typedef struct import_record
+{
+	char *path;
+	import_tags tags;
+	struct import_record *next;
+} import_record;
+
+static struct
+{
+	int threads;
+	const char *xattrs[IMPORT_MAX_XATTRS];
+	int nxattrs;
+	int sidecars;
+
+	import_record **records;
+	size_t nbuckets;
+	size_t nrecords;
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	import_dir *queue;
+	int remaining;
+
+	int dirs;
+	int files;
+	int tagged;
+	int errors;
+} import;
+
+static void import_tags_add(import_tags *tags, const char *name, size_t len)
+{
+	if (!len || memchr(name, '/', len))
+		return;
+	if (tags->count == tags->capacity)
+	{
+		tags->capacity = tags->capacity ? 2 * tags->capacity : 8;
+		tags->names = (char**)realloc(tags->names, tags->capacity * sizeof(char*));
+	}
+	tags->names[tags->count++] = strndup(name, len);
+}
+
+static int import_compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// sort and drop duplicates
+static void import_tags_finish(import_tags *tags)
+{
+	int n = 0;
+
+	if (!tags->count)
+		return;
+	qsort(tags->names, tags->count, sizeof(char*), import_compare_names);
+	for (int i = 0; i < tags->count; ++i)
+	{
+		if (n && !strcmp(tags->names[n - 1], tags->names[i]))
+			free(tags->names[i]); else
+			tags->names[n++] = tags->names[i];
+	}
+	tags->count = n;
+}
+
+static void import_tags_free(import_tags *tags)
+{
+	for (int i = 0; i < tags->count; ++i)
+		free(tags->names[i]);
+	free(tags->names);
+	memset(tags, 0, sizeof(*tags));
+}
+
+// split a list of tags on any of the separators, trimming blanks
+static void import_tags_split(import_tags *tags, const char *value, size_t size, const char *separators)
+{
+	const char *end = value + size;
+
+	while (value < end)
+	{
+		const char *sep = value;
+
+		while (sep < end && !strchr(separators, *sep))
+			++sep;
+
+		const char *first = value, *last = sep;
+
+		while (first < last && (' ' == *first || '\t' == *first))
+			++first;
+		while (last > first && (' ' == last[-1] || '\t' == last[-1] || '\r' == last[-1]))
+			--last;
+		import_tags_add(tags, first, last - first);
+		value = sep + 1;
+	}
+}
+
+// union of two sorted sets into the first
+static void import_tags_union(import_tags *tags, const import_tags *other)
+{
+	for (int i = 0; i < other->count; ++i)
+		import_tags_add(tags, other->names[i], strlen(other->names[i]));
+	import_tags_finish(tags);
+}
+
+// intersection of two sorted sets into the first
+static void import_tags_intersect(import_tags *tags, const import_tags *other)
+{
+	int n = 0;
+
+	for (int i = 0, j = 0; i < tags->count; ++i)
+	{
+		int rc = 1;
+
+		while (j < other->count && (rc = strcmp(other->names[j], tags->names[i])) < 0)
+			++j;
+		if (j < other->count && !rc)
+			tags->names[n++] = tags->names[i]; else
+			free(tags->names[i]);
+	}
+	tags->count = n;
+}
+
+static size_t import_hash(const char *path)
+{
+	size_t hash = 2166136261u;
+
+	while (*path)
+		hash = (hash ^ (unsigned char)*path++) * 16777619u;
+	return hash;
+}
+
+static import_record *import_find_record(const char *path, int create)
+{
+	if (!import.nbuckets)
+	{
+		if (!create)
+			return NULL;
+		import.nbuckets = 1024;
+		import.records = (import_record**)calloc(import.nbuckets, sizeof(import_record*));
+	}
+
+	import_record **bucket = &import.records[import_hash(path) & (import.nbuckets - 1)];
+
+	for (import_record *record = *bucket; record; record = record->next)
+		if (!strcmp(record->path, path))
+			return record;
+	if (!create)
+		return NULL;
+
+	if (import.nrecords >= import.nbuckets)
+	{
+		size_t nbuckets = 2 * import.nbuckets;
+		import_record **records = (import_record**)calloc(nbuckets, sizeof(import_record*));
+
+		for (size_t i = 0; i < import.nbuckets; ++i)
+			for (import_record *record = import.records[i], *next; record; record = next)
+			{
+				import_record **to = &records[import_hash(record->path) & (nbuckets - 1)];
+
+				next = record->next;
+				record->next = *to;
+				*to = record;
+			}
+		free(import.records);
+		import.records = records;
+		import.nbuckets = nbuckets;
+		bucket = &import.records[import_hash(path) & (import.nbuckets - 1)];
+	}
+
+	import_record *record = (import_record*)calloc(1, sizeof(import_record));
+
+	record->path = strdup(path);
+	record->next = *bucket;
+	*bucket = record;
+	++import.nrecords;
+	return record;
+}
+
+// split one csv line in place: fields are separated by commas and may be
+// quoted, with "" for a quote; returns the number of fields
+static int import_split_csv(char *line, char **fields, int max)
+{
+	int n = 0;
+	char *in = line, *out = line;
+
+	while (n < max)
+	{
+		fields[n++] = out;
+		if ('"' == *in)
+		{
+			for (++in; *in; ++in)
+			{
+				if ('"' == *in && '"' != *++in)
+					break;
+				*out++ = *in;
+			}
+		}
+		while (*in && ',' != *in)
+			*out++ = *in++;
+		if (!*in)
+		{
+			*out = 0;
+			break;
+		}
+		*out++ = 0;
+		++in;
+	}
+	return n;
+}
+
+static int import_split_tsv(char *line, char **fields, int max)
+{
+	int n = 0;
+
+	while (n < max)
+	{
+		fields[n++] = line;
+		if (!(line = strchr(line, '\t')))
+			break;
+		*line++ = 0;
+	}
+	return n;
+}
+
+// path then tags, one record per line; a field may hold several tags
+// separated by semicolons
+static int import_read_table(const char *name, int csv)
+{
+	FILE *in = strcmp(name, "-") ? fopen(name, "r") : stdin;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	char *fields[256];
+
+	if (!in)
+	{
+		perror(name);
+		return -1;
+	}
+
+	while (-1 != (len = getline(&line, &size, in)))
+	{
+		while (len && ('\n' == line[len - 1] || '\r' == line[len - 1]))
+			line[--len] = 0;
+		if (!len || '#' == *line)
+			continue;
+
+		int n = csv ?
+			import_split_csv(line, fields, sizeof(fields) / sizeof(*fields)) :
+			import_split_tsv(line, fields, sizeof(fields) / sizeof(*fields));
+		const char *path = fields[0];
+
+		while ('.' == path[0] && '/' == path[1])
+			path += 2;
+		while ('/' == *path)
+			++path;
+
+		import_record *record = import_find_record(path, 1);
+
+		for (int i = 1; i < n; ++i)
+			import_tags_split(&record->tags, fields[i], strlen(fields[i]), ";");
+	}
+
+	free(line);
+	if (stdin != in)
+		fclose(in);
+	return 0;
+}
+
+static void import_read_xattrs(const char *path, import_tags *tags)
+{
+	char *value = (char*)malloc(IMPORT_XATTR_SIZE);
+	ssize_t size;
+
+	for (int i = 0; i < import.nxattrs; ++i)
+		if (0 < (size = lgetxattr(path, import.xattrs[i], value, IMPORT_XATTR_SIZE)))
+			import_tags_split(tags, value, size, ",;\n");
+	free(value);
+}
+
+// keywords of an xmp sidecar: the rdf:li items of dc:subject
+static void import_read_xmp(const char *name, import_tags *tags)
+{
+	FILE *in = fopen(name, "r");
+	char *data = NULL;
+	size_t size = 0;
+
+	if (!in)
+		return;
+
+	char buf[65536];
+	size_t len;
+
+	while ((len = fread(buf, 1, sizeof(buf), in)))
+	{
+		data = (char*)realloc(data, size + len + 1);
+		memcpy(&data[size], buf, len);
+		size += len;
+	}
+	fclose(in);
+	if (!data)
+		return;
+	data[size] = 0;
+
+	char *subject = strstr(data, "<dc:subject");
+	char *end = subject ? strstr(subject, "</dc:subject>") : NULL;
+
+	for (char *item = subject; end && (item = strstr(item, "<rdf:li")) && item < end; )
+	{
+		char *text = strchr(item, '>');
+		char *close = text ? strstr(text, "</rdf:li>") : NULL;
+
+		if (!close)
+			break;
+
+		// decode the entities xmp writers use
+		char *out = ++text;
+
+		for (char *in = text; in < close; )
+		{
+			static const struct { const char *name; char c; } entities[] =
+			{
+				{ "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+				{ "&quot;", '"' }, { "&apos;", '\'' },
+			};
+			int i;
+
+			for (i = 0; i < sizeof(entities) / sizeof(*entities); ++i)
+				if (!strncmp(in, entities[i].name, strlen(entities[i].name)))
+					break;
+			if (i < sizeof(entities) / sizeof(*entities))
+			{
+				*out++ = entities[i].c;
+				in += strlen(entities[i].name);
+			} else
+				*out++ = *in++;
+		}
+		import_tags_add(tags, text, out - text);
+		item = close + 1;
+	}
+
+	free(data);
+}
+
+// file.jpg.xmp, or file.xmp
+static void import_read_sidecar(const char *path, import_tags *tags)
+{
+	size_t len = strlen(path);
+	char *name = (char*)malloc(len + 5);
+	char *dot;
+
+	memcpy(name, path, len);
+	strcpy(&name[len], ".xmp");
+	if (access(name, F_OK))
+	{
+		name[len] = 0;
+		if ((dot = strrchr(name, '.')) && !strchr(dot, '/'))
+			strcpy(dot, ".xmp"); else
+			strcpy(&name[len], ".xmp");
+	}
+	import_read_xmp(name, tags);
+	free(name);
+}
+
+static import_dir *import_new_dir(const char *path, const char *relpath, import_dir *parent)
+{
+	import_dir *dir = (import_dir*)calloc(1, sizeof(import_dir));
+
+	dir->path = strdup(path);
+	dir->relpath = strdup(relpath);
+	dir->parent = parent;
+	return dir;
+}
+
+static int import_compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const import_entry*)a)->name, ((const import_entry*)b)->name);
+}
+
+static char *import_join(const char *dir, const char *name)
+{
+	char *path = (char*)malloc(strlen(dir) + strlen(name) + 2);
+
+	sprintf(path, "%s%s%s", dir, *dir ? "/" : "", name);
+	return path;
+}
+
+// build the directory tree; directories with no subdirectories are
+// queued for import right away
+static void import_scan(import_dir *dir)
+{
+	DIR *d;
+	struct dirent *de;
+
+	if (!(d = opendir(dir->path)))
+	{
+		fprintf(stderr, "%s: %s\n", dir->path, strerror(errno));
+		++import.errors;
+		return;
+	}
+
+	while ((de = readdir(d)))
+	{
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+			beholddb_is_metadata(de->d_name))
+			continue;
+
+		int type = DT_DIR == de->d_type;
+
+		if (DT_UNKNOWN == de->d_type)
+		{
+			char *path = import_join(dir->path, de->d_name);
+			struct stat st;
+
+			type = !lstat(path, &st) && S_ISDIR(st.st_mode);
+			free(path);
+		}
+
+		if (dir->count == dir->capacity)
+		{
+			dir->capacity = dir->capacity ? 2 * dir->capacity : 16;
+			dir->entries = (import_entry*)realloc(dir->entries, dir->capacity * sizeof(import_entry));
+		}
+
+		import_entry *entry = &dir->entries[dir->count++];
+
+		memset(entry, 0, sizeof(*entry));
+		entry->name = strdup(de->d_name);
+		entry->type = type;
+	}
+	closedir(d);
+
+	qsort(dir->entries, dir->count, sizeof(import_entry), import_compare_entries);
+	++import.dirs;
+
+	for (int i = 0; i < dir->count; ++i)
+	{
+		import_entry *entry = &dir->entries[i];
+
+		if (!entry->type)
+		{
+			++import.files;
+			continue;
+		}
+
+		char *path = import_join(dir->path, entry->name);
+		char *relpath = import_join(dir->relpath, entry->name);
+
+		entry->dir = import_new_dir(path, relpath, dir);
+		++dir->pending;
+		free(path);
+		free(relpath);
+		import_scan(entry->dir);
+	}
+
+	if (!dir->pending)
+	{
+		dir->next = import.queue;
+		import.queue = dir;
+	}
+}
+
+static import_entry *import_find_entry(import_dir *dir, const char *name)
+{
+	import_entry key;
+
+	key.name = (char*)name;
+	return (import_entry*)bsearch(&key, dir->entries, dir->count, sizeof(import_entry), import_compare_entries);
+}
+
+static int import_prepare(sqlite3 *db, const char *sql, sqlite3_stmt **pstmt)
+{
+	return sqlite3_prepare_v2(db, sql, -1, pstmt, NULL);
+}
+
+static int import_insert_tags(sqlite3_stmt *tag, sqlite3_stmt *link, sqlite3_int64 file, const import_tags *tags)
+{
+	int rc = SQLITE_OK;
+
+	for (int i = 0; !rc && i < tags->count; ++i)
+	{
+		(rc = sqlite3_reset(tag)) ||
+		(rc = sqlite3_bind_text(tag, 1, tags->names[i], -1, SQLITE_STATIC)) ||
+		SQLITE_DONE != (rc = sqlite3_step(tag)) ||
+		(rc = sqlite3_reset(link)) ||
+		(rc = sqlite3_bind_int64(link, 1, file)) ||
+		(rc = sqlite3_bind_text(link, 2, tags->names[i], -1, SQLITE_STATIC)) ||
+		SQLITE_DONE != (rc = sqlite3_step(link)) ||
+		(rc = SQLITE_OK);
+	}
+	return rc;
+}
+
+// rewrite the metadata of one directory in one transaction
+static int import_write(import_dir *dir, sqlite3 *db)
+{
+	int rc;
+	sqlite3_stmt *file = NULL, *tag = NULL, *files_tag = NULL, *dirs_tag = NULL;
+
+	(rc = beholddb_exec(db, "pragma synchronous = off;")) ||
+	(rc = beholddb_exec(db, "begin transaction;")) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DML_IMPORT_CLEAR)) ||
+	(rc = import_prepare(db, BEHOLDDB_DML_IMPORT_FILE, &file)) ||
+	(rc = import_prepare(db, BEHOLDDB_DML_IMPORT_TAG, &tag)) ||
+	(rc = import_prepare(db, BEHOLDDB_DML_IMPORT_FILES_TAG, &files_tag)) ||
+	(rc = import_prepare(db, BEHOLDDB_DML_IMPORT_DIRS_TAG, &dirs_tag));
+
+	for (int i = 0; !rc && i < dir->count; ++i)
+	{
+		import_entry *entry = &dir->entries[i];
+		sqlite3_int64 id;
+
+		(rc = sqlite3_reset(file)) ||
+		(rc = sqlite3_bind_int(file, 1, entry->type)) ||
+		(rc = sqlite3_bind_text(file, 2, entry->name, -1, SQLITE_STATIC)) ||
+		SQLITE_DONE != (rc = sqlite3_step(file)) ||
+		(rc = SQLITE_OK);
+		if (rc)
+			break;
+
+		id = sqlite3_last_insert_rowid(db);
+		if (entry->dir)
+		{
+			(rc = import_insert_tags(tag, files_tag, id, &entry->dir->weak)) ||
+			(rc = import_insert_tags(tag, dirs_tag, id, &entry->dir->strong));
+		} else
+			rc = import_insert_tags(tag, files_tag, id, &entry->tags);
+	}
+
+	sqlite3_finalize(file);
+	sqlite3_finalize(tag);
+	sqlite3_finalize(files_tag);
+	sqlite3_finalize(dirs_tag);
+
+	if (rc || (rc = beholddb_stamp_directory(db, dir->path)) ||
+		(rc = beholddb_exec(db, "commit;")))
+		beholddb_exec(db, "rollback;");
+	return rc;
+}
+
+// tags the files of the directory have already
+static int import_read_existing(import_dir *dir, sqlite3 *db)
+{
+	int rc;
+	sqlite3_stmt *stmt;
+
+	if ((rc = import_prepare(db, BEHOLDDB_DML_IMPORT_EXISTING, &stmt)))
+		return rc;
+
+	while (SQLITE_ROW == (rc = sqlite3_step(stmt)))
+	{
+		import_entry *entry = import_find_entry(dir, (const char*)sqlite3_column_text(stmt, 0));
+		const char *name = (const char*)sqlite3_column_text(stmt, 1);
+
+		if (entry && !entry->type && name)
+			import_tags_add(&entry->tags, name, strlen(name));
+	}
+
+	sqlite3_finalize(stmt);
+	return SQLITE_DONE == rc ? SQLITE_OK : rc;
+}
+
+static int import_dir_worker(import_dir *dir)
+{
+	int rc, tagged = 0;
+	sqlite3 *db;
+
+	if ((rc = beholddb_open_metadata(dir->path, &db)))
+	{
+		fprintf(stderr, "%s: cannot open metadata (%d)\n", dir->path, rc);
+		return rc;
+	}
+
+	rc = import_read_existing(dir, db);
+
+	for (int i = 0; !rc && i < dir->count; ++i)
+	{
+		import_entry *entry = &dir->entries[i];
+		const import_tags *tags = &entry->tags;
+
+		if (entry->dir)
+			tags = &entry->dir->strong; else
+		{
+			char *path = import_join(dir->path, entry->name);
+			char *relpath = import_join(dir->relpath, entry->name);
+			import_record *record = import_find_record(relpath, 0);
+
+			if (record)
+				import_tags_union(&entry->tags, &record->tags);
+			if (import.nxattrs)
+				import_read_xattrs(path, &entry->tags);
+			if (import.sidecars)
+				import_read_sidecar(path, &entry->tags);
+			import_tags_finish(&entry->tags);
+			tagged += !!entry->tags.count;
+			free(path);
+			free(relpath);
+		}
+
+		import_tags_union(&dir->weak, entry->dir ? &entry->dir->weak : &entry->tags);
+		if (i)
+			import_tags_intersect(&dir->strong, tags); else
+			import_tags_union(&dir->strong, tags);
+	}
+
+	if (rc || (rc = import_write(dir, db)))
+		fprintf(stderr, "%s: import failed (%d: %s)\n", dir->path, rc, sqlite3_errmsg(db));
+	sqlite3_close(db);
+
+	pthread_mutex_lock(&import.lock);
+	import.tagged += tagged;
+	pthread_mutex_unlock(&import.lock);
+	return rc;
+}
+
+static void *import_thread(void *arg)
+{
+	pthread_mutex_lock(&import.lock);
+	for (;;)
+	{
+		while (!import.queue && import.remaining)
+			pthread_cond_wait(&import.ready, &import.lock);
+		if (!import.queue)
+			break;
+
+		import_dir *dir = import.queue;
+
+		import.queue = dir->next;
+		pthread_mutex_unlock(&import.lock);
+
+		int rc = import_dir_worker(dir);
+
+		// the aggregates of the subdirectories are not needed any more
+		for (int i = 0; i < dir->count; ++i)
+		{
+			import_tags_free(&dir->entries[i].tags);
+			if (dir->entries[i].dir)
+			{
+				import_tags_free(&dir->entries[i].dir->weak);
+				import_tags_free(&dir->entries[i].dir->strong);
+			}
+		}
+
+		pthread_mutex_lock(&import.lock);
+		import.errors += !!rc;
+		--import.remaining;
+		if (dir->parent && !--dir->parent->pending)
+		{
+			dir->parent->next = import.queue;
+			import.queue = dir->parent;
+		}
+		pthread_cond_broadcast(&import.ready);
+	}
+	pthread_mutex_unlock(&import.lock);
+	return NULL;
+}
+
+static void import_free_dir(import_dir *dir)
+{
+	for (int i = 0; i < dir->count; ++i)
+	{
+		if (dir->entries[i].dir)
+			import_free_dir(dir->entries[i].dir);
+		import_tags_free(&dir->entries[i].tags);
+		free(dir->entries[i].name);
+	}
+	import_tags_free(&dir->weak);
+	import_tags_free(&dir->strong);
+	free(dir->entries);
+	free(dir->path);
+	free(dir->relpath);
+	free(dir);
+}
+
+static void import_usage()
+{
+	fprintf(stderr,
+		"Usage: beholdfs-import [options] <fsroot>\n"
+		"Tags files of an unmounted BeholdFS tree in bulk; tags the files\n"
+		"already have are kept.\n"
+		"\n"
+		"  -c FILE   csv records: path,tag,tag;tag,... (- for stdin)\n"
+		"  -t FILE   tsv records: path<TAB>tag<TAB>tag;tag...\n"
+		"  -x NAME   tags from the extended attribute NAME (comma separated),\n"
+		"            e.g. user.xdg.tags; may be repeated\n"
+		"  -s        tags from xmp sidecars (file.jpg.xmp or file.xmp)\n"
+		"  -j N      import N directories at a time (%d)\n"
+		"\n"
+		"Paths in records are relative to <fsroot>.\n",
+		IMPORT_THREADS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	import.threads = IMPORT_THREADS;
+	while (-1 != (opt = getopt(argc, argv, "c:t:x:sj:h")))
+	{
+		switch (opt)
+		{
+		case 'c':
+		case 't':
+			if (import_read_table(optarg, 'c' == opt))
+				exit(2);
+			break;
+		case 'x':
+			if (IMPORT_MAX_XATTRS == import.nxattrs)
+				import_usage();
+			import.xattrs[import.nxattrs++] = optarg;
+			break;
+		case 's':
+			import.sidecars = 1;
+			break;
+		case 'j':
+			if (0 >= (import.threads = atoi(optarg)))
+				import_usage();
+			break;
+		default:
+			import_usage();
+		}
+	}
+	if (optind + 1 != argc)
+		import_usage();
+
+	if (chdir(argv[optind]))
+	{
+		perror(argv[optind]);
+		exit(2);
+	}
+
+	struct timespec start, stop;
+	import_dir *root = import_new_dir(".", "", NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	import_scan(root);
+	import.remaining = import.dirs;
+
+	pthread_t *threads = (pthread_t*)calloc(import.threads, sizeof(pthread_t));
+
+	pthread_mutex_init(&import.lock, NULL);
+	pthread_cond_init(&import.ready, NULL);
+	for (int i = 0; i < import.threads; ++i)
+		pthread_create(&threads[i], NULL, import_thread, NULL);
+	for (int i = 0; i < import.threads; ++i)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	fprintf(stderr, "%d directories, %d files, %d tagged, %d errors in %.1f s\n",
+		import.dirs, import.files, import.tagged, import.errors,
+		stop.tv_sec - start.tv_sec + (stop.tv_nsec - start.tv_nsec) / 1e9);
+
+	import_free_dir(root);
+	free(threads);
+	return import.errors ? 3 : 0;
+}
@@ -0,0 +1,247 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// beholdfs-index: build the tag index of -o index (.beholdfs-index) of an
+// unmounted tree again from the directory databases
+//
+// The directories with metadata are listed through the sqlitefs module.
+// A pool of threads reads each one into a temporary table of its own
+// connection; only the copy into the index has to wait for it, one
+// directory at a time.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "beholddb.h"
+#include "fs.h"
+#include "schema.h"
+
+#define INDEX_THREADS		4
+#define INDEX_BUSY_TIMEOUT	5000
+
+static const char INDEX_NAME[] = ".beholdfs-index";
+static const char INDEX_WAL[] = ".beholdfs-index-wal";
+static const char INDEX_SHM[] = ".beholdfs-index-shm";
+static const char INDEX_CENTRAL[] = ".beholdfs-central";
+static const char INDEX_METADATA[] = ".beholdfs";
+
+static struct
+{
+	int threads;
+	int verbose;
+
+	char **paths;
+	int count;
+	int capacity;
+
+	pthread_mutex_t lock;	// the next directory and the counters
+	pthread_mutex_t write;	// the index
+	int next;
+	long errors;
+} index_state;
+
+// every directory that has metadata, as "." or "./a/b"
+static int index_walk()
+{
+	int rc;
+	sqlite3 *walk = NULL;
+	sqlite3_stmt *dirs = NULL;
+
+	(rc = sqlite3_open_v2(":memory:", &walk, SQLITE_OPEN_READWRITE, NULL)) ||
+	(rc = fs_create_module(walk, ".")) ||
+	(rc = sqlite3_prepare_v2(walk, BEHOLDDB_DML_INDEX_WALK, -1, &dirs, NULL));
+
+	while (!rc && SQLITE_ROW == (rc = sqlite3_step(dirs)))
+	{
+		const char *dir = (const char*)sqlite3_column_text(dirs, 0);
+
+		if (index_state.count == index_state.capacity)
+		{
+			index_state.capacity = index_state.capacity ? 2 * index_state.capacity : 64;
+			index_state.paths = (char**)realloc(index_state.paths, index_state.capacity * sizeof(char*));
+		}
+		index_state.paths[index_state.count] = (char*)malloc(strlen(dir) + 3);
+		sprintf(index_state.paths[index_state.count++], *dir ? "./%s" : ".", dir);
+		rc = SQLITE_OK;
+	}
+	if (SQLITE_DONE == rc)
+		rc = SQLITE_OK;
+
+	if (rc)
+		fprintf(stderr, "cannot list the tree (%d: %s)\n", rc, sqlite3_errmsg(walk));
+	sqlite3_finalize(dirs);
+	sqlite3_close(walk);
+	return rc;
+}
+
+static int index_dir(const char *dir)
+{
+	int rc;
+	sqlite3 *db = NULL;
+	char *db_name = (char*)malloc(strlen(dir) + sizeof(INDEX_METADATA) + 1);
+	const char *name[] = { INDEX_NAME };
+	const char *texts[] = { dir };
+
+	sprintf(db_name, "%s/%s", dir, INDEX_METADATA);
+
+	// read only, but the index is attached with the flags of main
+	(rc = sqlite3_open_v2(db_name, &db, SQLITE_OPEN_READWRITE, NULL)) ||
+	(rc = sqlite3_busy_timeout(db, INDEX_BUSY_TIMEOUT)) ||
+	(rc = beholddb_exec_bind_texts(db, BEHOLDDB_DML_ATTACH_INDEX, 1, name)) ||
+	(rc = beholddb_exec(db, "pragma idx.synchronous = off;")) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_INDEX_LOAD));
+
+	if (!rc)
+	{
+		pthread_mutex_lock(&index_state.write);
+		(rc = beholddb_exec(db, "begin transaction;")) ||
+		(rc = beholddb_exec_bind_texts(db, BEHOLDDB_DML_INDEX_STORE, 1, texts)) ||
+		(rc = beholddb_exec(db, "commit;"));
+		if (rc)
+			beholddb_exec(db, "rollback;");
+		pthread_mutex_unlock(&index_state.write);
+	}
+
+	if (rc)
+		fprintf(stderr, "%s: cannot index (%d: %s)\n", dir, rc, sqlite3_errmsg(db)); else
+	if (index_state.verbose)
+		printf("%s\n", dir);
+
+	sqlite3_close(db);
+	free(db_name);
+	return rc;
+}
+
+static void *index_thread(void *arg)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&index_state.lock);
+
+		int i = index_state.next++;
+
+		pthread_mutex_unlock(&index_state.lock);
+		if (i >= index_state.count)
+			break;
+
+		int rc = index_dir(index_state.paths[i]);
+
+		pthread_mutex_lock(&index_state.lock);
+		index_state.errors += !!rc;
+		pthread_mutex_unlock(&index_state.lock);
+	}
+	return NULL;
+}
+
+static void index_usage()
+{
+	fprintf(stderr,
+		"Usage: beholdfs-index [options] <fsroot>\n"
+		"Builds the tag index of an unmounted BeholdFS tree (-o index) again\n"
+		"from the metadata of every directory.\n"
+		"\n"
+		"  -v        list every directory indexed\n"
+		"  -j N      read N directories at a time (%d)\n",
+		INDEX_THREADS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, rc;
+
+	index_state.threads = INDEX_THREADS;
+	while (-1 != (opt = getopt(argc, argv, "vj:h")))
+	{
+		switch (opt)
+		{
+		case 'v':
+			index_state.verbose = 1;
+			break;
+		case 'j':
+			if (0 >= (index_state.threads = atoi(optarg)))
+				index_usage();
+			break;
+		default:
+			index_usage();
+		}
+	}
+	if (optind + 1 != argc)
+		index_usage();
+
+	if (chdir(argv[optind]))
+	{
+		perror(argv[optind]);
+		exit(1);
+	}
+	if (!access(INDEX_CENTRAL, F_OK))
+	{
+		fprintf(stderr, "%s: the central layout needs no index\n", argv[optind]);
+		exit(1);
+	}
+
+	// the index is held open until the end, so that its wal stays
+	sqlite3 *db = NULL;
+	struct timespec start, stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unlink(INDEX_NAME);
+	unlink(INDEX_WAL);
+	unlink(INDEX_SHM);
+	(rc = sqlite3_open_v2(INDEX_NAME, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) ||
+	(rc = beholddb_exec(db, "pragma journal_mode = wal;")) ||
+	(rc = beholddb_exec(db, BEHOLDDB_DDL_INDEX_CREATE));
+	if (rc)
+	{
+		fprintf(stderr, "%s: cannot create (%d: %s)\n", INDEX_NAME, rc, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		exit(1);
+	}
+	if (index_walk())
+		exit(1);
+
+	pthread_t *threads = (pthread_t*)calloc(index_state.threads, sizeof(pthread_t));
+
+	pthread_mutex_init(&index_state.lock, NULL);
+	pthread_mutex_init(&index_state.write, NULL);
+	for (int i = 0; i < index_state.threads; ++i)
+		pthread_create(&threads[i], NULL, index_thread, NULL);
+	for (int i = 0; i < index_state.threads; ++i)
+		pthread_join(threads[i], NULL);
+
+	sqlite3_close(db);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	printf("%d directories indexed in %.1f s\n",
+		index_state.count,
+		stop.tv_sec - start.tv_sec + (stop.tv_nsec - start.tv_nsec) / 1e9);
+	if (index_state.errors)
+		fprintf(stderr, "%ld errors\n", index_state.errors);
+
+	for (int i = 0; i < index_state.count; ++i)
+		free(index_state.paths[i]);
+	free(index_state.paths);
+	free(threads);
+	return index_state.errors ? 1 : 0;
+}
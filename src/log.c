@@ -1,32 +1,442 @@
+/*
+ Copyright 2011 Roman Vorobets
 
-#include <stdio.h>
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/syscall.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include "log.h"
 
-static FILE *logfile;
+#define LOG_RECORD_MAX		512
+#define LOG_STRING_MAX		128
+#define LOG_PADDING		0xff
+
+// records are 8-byte aligned and never wrap around the end of the
+// ring; the space left at the end is filled with a padding record
+typedef struct log_header
+{
+	uint32_t size;
+	uint8_t level;
+	uint8_t reserved[3];
+	uint64_t time;
+	const char *format;
+	// encoded arguments follow
+} log_header;
+
+// ring of one thread; head and tail grow monotonically, the writer
+// moves tail past the records it is about to overwrite
+typedef struct log_ring
+{
+	struct log_ring *next;
+	int used;
+	pid_t tid;
+	uint64_t head;
+	uint64_t tail;
+	size_t size;
+	char data[];
+} log_ring;
+
+int log_level = -1;
+
+static size_t log_ringsize;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static log_ring *log_rings;
+static __thread log_ring *log_self;
+
+static void log_release_ring(void *ring)
+{
+	__atomic_store_n(&((log_ring*)ring)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void log_create_key(void)
+{
+	pthread_key_create(&log_key, log_release_ring);
+}
+
+static log_ring *log_get_ring(void)
+{
+	if (log_self)
+		return log_self;
+
+	log_ring *ring;
+
+	pthread_once(&log_once, log_create_key);
+	pthread_mutex_lock(&log_mutex);
+	for (ring = log_rings; ring; ring = ring->next)
+		if (!__atomic_load_n(&ring->used, __ATOMIC_ACQUIRE))
+			break;
+	if (!ring && (ring = (log_ring*)calloc(1, sizeof(log_ring) + log_ringsize)))
+	{
+		ring->size = log_ringsize;
+		ring->next = log_rings;
+		log_rings = ring;
+	}
+	if (ring)
+	{
+		ring->used = 1;
+		ring->tid = syscall(SYS_gettid);
+	}
+	pthread_mutex_unlock(&log_mutex);
+
+	if (ring)
+		pthread_setspecific(log_key, ring);
+	return log_self = ring;
+}
+
+static void log_write(log_ring *ring, const void *record, size_t size)
+{
+	uint64_t head = ring->head, tail = ring->tail;
+	size_t offset = head % ring->size;
+	size_t pad = offset + size > ring->size ? ring->size - offset : 0;
+
+	// free up the space for the padding and the record
+	while (head + pad + size - tail > ring->size)
+		tail += ((log_header*)&ring->data[tail % ring->size])->size;
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (pad)
+	{
+		log_header *header = (log_header*)&ring->data[offset];
+
+		header->size = pad;
+		header->level = LOG_PADDING;
+		head += pad;
+		offset = 0;
+	}
+	memcpy(&ring->data[offset], record, size);
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+// arguments are stored as 64-bit words; strings are copied
+// (truncated) as a 16-bit length followed by the bytes
+static size_t log_encode(char *buf, const char *format, va_list args)
+{
+	size_t size = sizeof(log_header);
+
+	for (const char *p = format; *p; ++p)
+	{
+		if ('%' != *p || '%' == *++p)
+			continue;
+
+		int longs = 0;
+
+		for (; *p && strchr("-+ #0123456789.*", *p); ++p)
+		{
+			if ('*' != *p || size + 8 > LOG_RECORD_MAX)
+				continue;
+			*(int64_t*)&buf[size] = va_arg(args, int);
+			size += 8;
+		}
+		for (; *p && strchr("hlqjztL", *p); ++p)
+			longs += 'l' == *p || 'q' == *p ? ('q' == *p ? 2 : 1) : strchr("jzt", *p) ? 2 : 0;
+		if (!*p)
+			break;
+
+		if ('s' == *p)
+		{
+			const char *s = va_arg(args, const char*);
+
+			if (!s)
+				s = "(null)";
 
-void log_init(const char *filename)
+			size_t len = strnlen(s, LOG_STRING_MAX);
+
+			if (size + 2 + len + 1 > LOG_RECORD_MAX)
+				break;
+			*(uint16_t*)&buf[size] = len;
+			memcpy(&buf[size + 2], s, len);
+			buf[size + 2 + len] = 0;
+			size = (size + 2 + len + 1 + 7) & ~7;
+			continue;
+		}
+
+		if (size + 8 > LOG_RECORD_MAX)
+			break;
+		if (strchr("eEfFgGaA", *p))
+			*(double*)&buf[size] = va_arg(args, double); else
+		if ('p' == *p)
+			*(uint64_t*)&buf[size] = (uintptr_t)va_arg(args, void*); else
+		if (longs >= 2)
+			*(int64_t*)&buf[size] = va_arg(args, long long); else
+		if (longs)
+			*(int64_t*)&buf[size] = va_arg(args, long); else
+			*(int64_t*)&buf[size] = strchr("ouxXc", *p) ?
+				(int64_t)va_arg(args, unsigned) : va_arg(args, int);
+		size += 8;
+	}
+	return size;
+}
+
+void log_record(int level, const char *format, ...)
 {
-	logfile = fopen(filename, "a");
+	log_ring *ring;
+	uint64_t buf[LOG_RECORD_MAX / 8];
+	log_header *header = (log_header*)buf;
+	struct timespec ts;
+	va_list args;
+
+	if (!log_ringsize || !(ring = log_get_ring()))
+		return;
+
+	va_start(args, format);
+	header->size = log_encode((char*)buf, format, args);
+	va_end(args);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header->level = level;
+	header->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	header->format = format;
+	log_write(ring, buf, header->size);
 }
 
-void log_free()
+// replays the format with the stored arguments, one conversion at a time
+static void log_decode(FILE *out, const log_header *header)
 {
-	fclose(logfile);
+	const char *data = (const char*)header, *end = data + header->size;
+	const char *p = header->format;
+	size_t pos = sizeof(log_header);
+
+	while (*p)
+	{
+		if ('%' != *p)
+		{
+			const char *next = strchr(p, '%');
+
+			if (!next)
+				next = p + strlen(p);
+
+			fwrite(p, 1, next - p, out);
+			p = next;
+			continue;
+		}
+		if ('%' == *++p)
+		{
+			fputc('%', out);
+			++p;
+			continue;
+		}
+
+		char fmt[32];
+		size_t len = 0;
+
+		fmt[len++] = '%';
+		for (; *p && strchr("-+ #0123456789.*", *p); ++p)
+		{
+			if ('*' != *p)
+			{
+				if (len < sizeof(fmt) - 8)
+					fmt[len++] = *p;
+				continue;
+			}
+			if (data + pos + 8 > end)
+				goto truncated;
+			len += snprintf(&fmt[len], sizeof(fmt) - 8 - len, "%d", (int)*(int64_t*)&data[pos]);
+			pos += 8;
+		}
+		for (; *p && strchr("hlqjztL", *p); ++p);
+		if (!*p)
+			break;
+
+		if ('s' == *p)
+		{
+			if (data + pos + 2 > end)
+				goto truncated;
+			fmt[len++] = 's';
+			fmt[len] = 0;
+			fprintf(out, fmt, &data[pos + 2]);
+			pos = (pos + 2 + *(uint16_t*)&data[pos] + 1 + 7) & ~7;
+		} else
+		{
+			if (data + pos + 8 > end)
+				goto truncated;
+			if (strchr("eEfFgGaA", *p))
+			{
+				fmt[len++] = *p;
+				fmt[len] = 0;
+				fprintf(out, fmt, *(double*)&data[pos]);
+			} else
+			if ('p' == *p)
+			{
+				fmt[len++] = 'p';
+				fmt[len] = 0;
+				fprintf(out, fmt, (void*)(uintptr_t)*(uint64_t*)&data[pos]);
+			} else
+			if ('c' == *p)
+			{
+				fmt[len++] = 'c';
+				fmt[len] = 0;
+				fprintf(out, fmt, (int)*(int64_t*)&data[pos]);
+			} else
+			{
+				fmt[len++] = 'l';
+				fmt[len++] = 'l';
+				fmt[len++] = *p;
+				fmt[len] = 0;
+				fprintf(out, fmt, *(long long*)&data[pos]);
+			}
+			pos += 8;
+		}
+		++p;
+	}
+	fputc('\n', out);
+	return;
+
+truncated:
+	fputs("...\n", out);
 }
 
-void log(const char *format, ...)
+typedef struct log_event
 {
-	va_list ap;
-	va_start(ap, format);
-	log(format, ap);
-	va_end(ap);
+	const log_header *header;
+	pid_t tid;
+} log_event;
+
+static int log_compare_events(const void *a, const void *b)
+{
+	uint64_t ta = ((const log_event*)a)->header->time, tb = ((const log_event*)b)->header->time;
+
+	return ta < tb ? -1 : ta > tb;
 }
 
-void vlog(const char *format, va_list args)
+// copies the valid part of a ring; records that may have been
+// overwritten while copying are dropped
+static char *log_snapshot(log_ring *ring, uint64_t *pfrom, uint64_t *pto)
 {
-	if (logfile)
-		vfprintf(logfile, format, args);
+	char *copy = (char*)malloc(ring->size);
+
+	if (!copy)
+		return NULL;
+
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	memcpy(copy, ring->data, ring->size);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	*pfrom = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	*pto = head;
+	return copy;
+}
+
+int log_format(char **pdata, size_t *psize)
+{
+	FILE *out;
+	log_event *events = NULL;
+	size_t count = 0, capacity = 0, nrings = 0;
+	char **copies = NULL;
+	int ret = 0;
+
+	*pdata = NULL;
+	*psize = 0;
+	if (!(out = open_memstream(pdata, psize)))
+		return -ENOMEM;
+
+	pthread_mutex_lock(&log_mutex);
+	for (log_ring *ring = log_rings; ring; ring = ring->next)
+	{
+		uint64_t from, to;
+		char *copy, **more;
+
+		if (!(more = (char**)realloc(copies, sizeof(char*) * (nrings + 1))) ||
+			!(copy = log_snapshot(ring, &from, &to)))
+		{
+			if (more)
+				copies = more;
+			ret = -ENOMEM;
+			break;
+		}
+		copies = more;
+		copies[nrings++] = copy;
+
+		while (from < to)
+		{
+			const log_header *header = (const log_header*)&copy[from % ring->size];
+
+			from += header->size;
+			if (LOG_PADDING == header->level)
+				continue;
+			if (count == capacity)
+			{
+				log_event *grown = (log_event*)realloc(events, sizeof(log_event) * (capacity = capacity ? 2 * capacity : 1024));
+
+				if (!grown)
+				{
+					ret = -ENOMEM;
+					break;
+				}
+				events = grown;
+			}
+			events[count].header = header;
+			events[count].tid = ring->tid;
+			++count;
+		}
+		if (ret)
+			break;
+	}
+	pthread_mutex_unlock(&log_mutex);
+
+	if (count)
+		qsort(events, count, sizeof(log_event), log_compare_events);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const log_header *header = events[i].header;
+
+		fprintf(out, "%llu.%06llu %d %d ",
+			(unsigned long long)(header->time / 1000000000),
+			(unsigned long long)(header->time % 1000000000 / 1000),
+			(int)events[i].tid, header->level);
+		log_decode(out, header);
+	}
+
+	fclose(out);
+	for (size_t i = 0; i < nrings; ++i)
+		free(copies[i]);
+	free(copies);
+	free(events);
+	if (ret)
+	{
+		free(*pdata);
+		*pdata = NULL;
+		*psize = 0;
+	}
+	return ret;
 }
 
+void log_init(int level, size_t ringsize)
+{
+	// rings hold at least a few of the largest records
+	if (ringsize && ringsize < 4 * LOG_RECORD_MAX)
+		ringsize = 4 * LOG_RECORD_MAX;
+	log_ringsize = ringsize & ~(size_t)7;
+	log_level = level;
+}
+
+// rings stay allocated since other threads may still be running
+void log_free(void)
+{
+	log_level = -1;
+}
@@ -1,11 +1,70 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
 #ifndef __LOG_H__
 #define __LOG_H__
 
-#include <stdarg.h>
+#include <stddef.h>
+#include <syslog.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+// events above this level are compiled out entirely
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL	LOG_DEBUG
+#endif
+
+#define LOG_RINGSIZE		256 // KiB per thread
+
+// events up to this level are recorded; set from the debug= option
+extern int log_level;
+
+// trace events are stored in binary form (format pointer and raw
+// arguments) in a ring buffer owned by the calling thread and only
+// formatted when the trace is read; the format must be a literal
+#define log_trace(level, ...) \
+	do { \
+		if ((level) <= LOG_COMPILED_LEVEL && (level) <= log_level) \
+			log_record(level, __VA_ARGS__); \
+	} while (0)
+
+#define log_debug(...)		log_trace(LOG_DEBUG, __VA_ARGS__)
+
+void log_init(int level, size_t ringsize);
+void log_free(void);
+void log_record(int level, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+// decodes the events of all threads, oldest first, into a buffer
+// that must be released with free()
+int log_format(char **pdata, size_t *psize);
 
-void log_init(const char *filename);
-void log_free();
-void log(const char *format, ...);
-void vlog(const char *format, va_list args);
+// static probes for bpftrace/systemtap, provider "beholdfs"
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define LOG_PROBE1(name, a)		DTRACE_PROBE1(beholdfs, name, a)
+#define LOG_PROBE2(name, a, b)		DTRACE_PROBE2(beholdfs, name, a, b)
+#else
+#define LOG_PROBE1(name, a)		do { } while (0)
+#define LOG_PROBE2(name, a, b)		do { } while (0)
+#endif
 
 #endif // __LOG_H__
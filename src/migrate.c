@@ -0,0 +1,383 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// beholdfs-migrate: move the metadata of an unmounted tree between a
+// database in every directory and the one central database that
+// -o central mounts
+//
+// Each directory is copied in a transaction of its own, since databases
+// cannot be attached or detached inside one; tag ids are not kept, the
+// rows are matched up by name. The old metadata is removed only after
+// every directory was copied, and the directories are stamped last, so
+// that the first access after mount does not find them changed.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "beholddb.h"
+#include "dirstream.h"
+#include "schema.h"
+
+static const char MIGRATE_METADATA[] = ".beholdfs";
+static const char MIGRATE_JOURNAL[] = ".beholdfs-journal";
+static const char MIGRATE_CENTRAL[] = ".beholdfs-central";
+static const char MIGRATE_CENTRAL_WAL[] = ".beholdfs-central-wal";
+static const char MIGRATE_CENTRAL_SHM[] = ".beholdfs-central-shm";
+
+typedef struct migrate_dirs
+{
+	char **paths;
+	int count;
+	int capacity;
+} migrate_dirs;
+
+static struct
+{
+	int central;
+	int keep;
+	int verbose;
+	long errors;
+} migrate;
+
+static char *migrate_join(const char *dir, const char *name)
+{
+	char *path = (char*)malloc(strlen(dir) + strlen(name) + 2);
+
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+static void migrate_add(migrate_dirs *dirs, char *path)
+{
+	if (dirs->count == dirs->capacity)
+	{
+		dirs->capacity = dirs->capacity ? 2 * dirs->capacity : 64;
+		dirs->paths = (char**)realloc(dirs->paths, dirs->capacity * sizeof(char*));
+	}
+	dirs->paths[dirs->count++] = path;
+}
+
+static void migrate_free(migrate_dirs *dirs)
+{
+	for (int i = 0; i < dirs->count; ++i)
+		free(dirs->paths[i]);
+	free(dirs->paths);
+}
+
+static void migrate_unlink(const char *dir, const char *name)
+{
+	char *path = migrate_join(dir, name);
+
+	if (unlink(path) && ENOENT != errno)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		++migrate.errors;
+	}
+	free(path);
+}
+
+// every directory of the tree, parents first
+static void migrate_walk(const char *path, migrate_dirs *dirs)
+{
+	int rc;
+	dirstream *stream;
+	const dirstream_entry *entry;
+	migrate_dirs children = { NULL, 0, 0 };
+
+	migrate_add(dirs, strdup(path));
+	if (!(rc = dirstream_open(&stream, path, 0)))
+	{
+		while (DIRSTREAM_OK == (rc = dirstream_peek(stream, &entry)))
+		{
+			struct stat st;
+			const char *name = entry->d_name;
+
+			if (strcmp(name, ".") && strcmp(name, "..") && !beholddb_is_metadata(name) &&
+				(DT_DIR == entry->d_type || (DT_UNKNOWN == entry->d_type &&
+				!fstatat(dirstream_fd(stream), name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode))))
+				migrate_add(&children, migrate_join(path, name));
+			dirstream_next(stream);
+		}
+		dirstream_close(stream);
+	}
+	if (0 > rc)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(-rc));
+		++migrate.errors;
+	}
+
+	for (int i = 0; i < children.count; ++i)
+		migrate_walk(children.paths[i], dirs);
+	migrate_free(&children);
+}
+
+// copy the metadata of a directory between the databases, with the
+// central one as main and the other attached as alias
+static int migrate_copy(sqlite3 *db, const char *dir, const char *alias, const char *sql)
+{
+	int rc;
+	char *name = migrate_join(dir, MIGRATE_METADATA);
+	char *attach = sqlite3_mprintf("attach database %Q as %s;", name, alias);
+	char *detach = sqlite3_mprintf("detach database %s;", alias);
+
+	if (!(rc = beholddb_exec(db, attach)))
+	{
+		(rc = beholddb_exec(db, "begin transaction;")) ||
+		(rc = beholddb_central_enter(db, dir, migrate.central)) ||
+		(rc = beholddb_exec(db, sql)) ||
+		(rc = beholddb_central_leave(db)) ||
+		(rc = beholddb_exec(db, "commit;"));
+		if (rc)
+		{
+			fprintf(stderr, "%s: %s\n", dir, sqlite3_errmsg(db));
+			beholddb_exec(db, "rollback;");
+		}
+		beholddb_exec(db, detach);
+	} else
+		fprintf(stderr, "%s: %s\n", name, sqlite3_errmsg(db));
+
+	if (!rc && migrate.verbose)
+		printf("%s\n", dir);
+
+	sqlite3_free(attach);
+	sqlite3_free(detach);
+	free(name);
+	return rc;
+}
+
+static int migrate_to_central(const migrate_dirs *dirs)
+{
+	int rc;
+	long count = 0;
+	sqlite3 *db = NULL;
+
+	if (!access(MIGRATE_CENTRAL, F_OK))
+	{
+		fprintf(stderr, "%s: already exists\n", MIGRATE_CENTRAL);
+		return BEHOLDDB_ERROR;
+	}
+
+	(rc = beholddb_open_central(&db)) ||
+	(rc = beholddb_exec(db, "pragma synchronous = off;"));
+
+	for (int i = 0; !rc && i < dirs->count; ++i)
+	{
+		char *name = migrate_join(dirs->paths[i], MIGRATE_METADATA);
+
+		if (!access(name, F_OK))
+		{
+			rc = migrate_copy(db, dirs->paths[i], "src", BEHOLDDB_DML_MIGRATE_IN);
+			++count;
+		}
+		free(name);
+	}
+
+	// nothing was removed yet, so the tree is left as it was
+	if (rc)
+	{
+		sqlite3_close(db);
+		unlink(MIGRATE_CENTRAL);
+		unlink(MIGRATE_CENTRAL_WAL);
+		unlink(MIGRATE_CENTRAL_SHM);
+		return rc;
+	}
+
+	for (int i = 0; !migrate.keep && i < dirs->count; ++i)
+	{
+		migrate_unlink(dirs->paths[i], MIGRATE_METADATA);
+		migrate_unlink(dirs->paths[i], MIGRATE_JOURNAL);
+	}
+
+	beholddb_exec(db, "begin transaction;");
+	for (int i = 0; i < dirs->count; ++i)
+	{
+		int stamped;
+
+		(stamped = beholddb_central_enter(db, dirs->paths[i], 1)) ||
+		(stamped = beholddb_stamp_directory(db, dirs->paths[i])) ||
+		(stamped = beholddb_central_leave(db));
+		if (stamped)
+		{
+			fprintf(stderr, "%s: cannot stamp (%d)\n", dirs->paths[i], stamped);
+			++migrate.errors;
+		}
+	}
+	beholddb_exec(db, "commit;");
+
+	sqlite3_close(db);
+	printf("%ld directories moved to %s\n", count, MIGRATE_CENTRAL);
+	return rc;
+}
+
+static int migrate_to_directories()
+{
+	int rc;
+	long count = 0;
+	sqlite3 *db = NULL, *dst;
+	sqlite3_stmt *stmt = NULL;
+	migrate_dirs dirs = { NULL, 0, 0 };
+
+	if (access(MIGRATE_CENTRAL, F_OK))
+	{
+		perror(MIGRATE_CENTRAL);
+		return BEHOLDDB_ERROR;
+	}
+
+	if (!(rc = beholddb_open_central(&db)) &&
+		!(rc = sqlite3_prepare_v2(db, BEHOLDDB_DML_CENTRAL_TREE, -1, &stmt, NULL)))
+	{
+		while (SQLITE_ROW == (rc = sqlite3_step(stmt)))
+			migrate_add(&dirs, strdup((const char*)sqlite3_column_text(stmt, 1)));
+		if (SQLITE_DONE == rc)
+			rc = SQLITE_OK; else
+			fprintf(stderr, "%s: %s\n", MIGRATE_CENTRAL, sqlite3_errmsg(db));
+	}
+	sqlite3_finalize(stmt);
+
+	for (int i = 0; !rc && i < dirs.count; ++i)
+	{
+		struct stat st;
+		const char *dir = dirs.paths[i];
+
+		// entries of directories removed since; left for beholdfs-fsck
+		// to find in the parent
+		if (stat(dir, &st) || !S_ISDIR(st.st_mode))
+		{
+			fprintf(stderr, "%s: not a directory, skipped\n", dir);
+			free(dirs.paths[i]);
+			dirs.paths[i] = NULL;
+			continue;
+		}
+
+		// whatever is there was left behind by beholdfs-migrate -k
+		migrate_unlink(dir, MIGRATE_METADATA);
+		migrate_unlink(dir, MIGRATE_JOURNAL);
+
+		dst = NULL;
+		if ((rc = beholddb_open_metadata(dir, &dst)))
+			fprintf(stderr, "%s: cannot create metadata (%d)\n", dir, rc);
+		sqlite3_close(dst);
+
+		rc ||
+		(rc = migrate_copy(db, dir, "dst", BEHOLDDB_DML_MIGRATE_OUT));
+		++count;
+	}
+	sqlite3_close(db);
+
+	if (!rc && !migrate.keep)
+	{
+		migrate_unlink(".", MIGRATE_CENTRAL);
+		migrate_unlink(".", MIGRATE_CENTRAL_WAL);
+		migrate_unlink(".", MIGRATE_CENTRAL_SHM);
+	}
+
+	for (int i = 0; !rc && i < dirs.count; ++i)
+	{
+		int stamped;
+
+		if (!dirs.paths[i])
+			continue;
+
+		dst = NULL;
+		(stamped = beholddb_open_metadata(dirs.paths[i], &dst)) ||
+		(stamped = beholddb_stamp_directory(dst, dirs.paths[i]));
+		sqlite3_close(dst);
+		if (stamped)
+		{
+			fprintf(stderr, "%s: cannot stamp (%d)\n", dirs.paths[i], stamped);
+			++migrate.errors;
+		}
+	}
+
+	migrate_free(&dirs);
+	if (!rc)
+		printf("%ld directories moved out of %s\n", count, MIGRATE_CENTRAL);
+	return rc;
+}
+
+static void migrate_usage()
+{
+	fprintf(stderr,
+		"Usage: beholdfs-migrate -c|-d [options] <fsroot>\n"
+		"Moves the metadata of an unmounted BeholdFS tree between a database\n"
+		"in every directory and the central database of -o central.\n"
+		"\n"
+		"  -c        to the central database\n"
+		"  -d        to a database in every directory\n"
+		"  -k        keep the old metadata\n"
+		"  -v        list every directory moved\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, rc;
+
+	migrate.central = -1;
+	while (-1 != (opt = getopt(argc, argv, "cdkvh")))
+	{
+		switch (opt)
+		{
+		case 'c':
+			migrate.central = 1;
+			break;
+		case 'd':
+			migrate.central = 0;
+			break;
+		case 'k':
+			migrate.keep = 1;
+			break;
+		case 'v':
+			migrate.verbose = 1;
+			break;
+		default:
+			migrate_usage();
+		}
+	}
+	if (optind + 1 != argc || 0 > migrate.central)
+		migrate_usage();
+
+	if (chdir(argv[optind]))
+	{
+		perror(argv[optind]);
+		exit(1);
+	}
+
+	if (migrate.central)
+	{
+		migrate_dirs dirs = { NULL, 0, 0 };
+
+		migrate_walk(".", &dirs);
+		rc = migrate_to_central(&dirs);
+		migrate_free(&dirs);
+	} else
+		rc = migrate_to_directories();
+
+	if (migrate.errors)
+		fprintf(stderr, "%ld errors\n", migrate.errors);
+	return rc || migrate.errors ? 1 : 0;
+}
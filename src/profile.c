@@ -0,0 +1,308 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <sqlite3.h>
+
+#include "profile.h"
+
+#define PROFILE_BUCKETS		256
+#define PROFILE_TOP		50
+
+// statements are told apart by their text, so every prepare of the
+// same statement adds to the same entry
+typedef struct profile_entry
+{
+	struct profile_entry *next;
+	char *sql;
+	uint64_t calls;
+	uint64_t total; // ns
+	uint64_t max; // ns
+	uint64_t steps;
+	uint64_t fullscans;
+	uint64_t sorts;
+	uint64_t autoindexes;
+	int explained;
+} profile_entry;
+
+static int profile_enabled;
+static uint64_t profile_threshold; // ns
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static profile_entry *profile_table[PROFILE_BUCKETS];
+static size_t profile_count;
+
+// set while the profiler runs its own statements
+static __thread int profile_busy;
+
+static unsigned profile_hash(const char *sql)
+{
+	unsigned hash = 2166136261u;
+
+	while (*sql)
+		hash = (hash ^ (unsigned char)*sql++) * 16777619u;
+	return hash % PROFILE_BUCKETS;
+}
+
+// the caller holds profile_mutex
+static profile_entry *profile_get_entry(const char *sql)
+{
+	unsigned hash = profile_hash(sql);
+	profile_entry *entry;
+
+	for (entry = profile_table[hash]; entry; entry = entry->next)
+		if (!strcmp(entry->sql, sql))
+			return entry;
+
+	if (!(entry = (profile_entry*)calloc(1, sizeof(profile_entry))))
+		return NULL;
+	if (!(entry->sql = strdup(sql)))
+	{
+		free(entry);
+		return NULL;
+	}
+	entry->next = profile_table[hash];
+	profile_table[hash] = entry;
+	++profile_count;
+	return entry;
+}
+
+static void profile_explain(sqlite3 *db, const char *sql, uint64_t elapsed)
+{
+	char *eqp = sqlite3_mprintf("explain query plan %s", sql);
+	sqlite3_stmt *stmt;
+
+	syslog(LOG_NOTICE, "profile: slow query (%llu ms): %s",
+		(unsigned long long)(elapsed / 1000000), sql);
+	if (eqp && !sqlite3_prepare_v2(db, eqp, -1, &stmt, NULL))
+	{
+		while (SQLITE_ROW == sqlite3_step(stmt))
+			syslog(LOG_NOTICE, "profile:   %d %d %s",
+				sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1),
+				(const char*)sqlite3_column_text(stmt, 3));
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_free(eqp);
+}
+
+static int profile_callback(unsigned type, void *context, void *p, void *x)
+{
+	if (SQLITE_TRACE_PROFILE != type || !profile_enabled || profile_busy)
+		return 0;
+
+	sqlite3_stmt *stmt = (sqlite3_stmt*)p;
+	uint64_t elapsed = *(sqlite3_int64*)x;
+	const char *sql = sqlite3_sql(stmt);
+	int explain = 0;
+
+	if (!sql)
+		return 0;
+
+	// counters are reset so that a reused statement is not counted twice
+	int steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+	int fullscans = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+	int sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+	int autoindexes = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+
+	pthread_mutex_lock(&profile_mutex);
+	profile_entry *entry = profile_get_entry(sql);
+
+	if (entry)
+	{
+		++entry->calls;
+		entry->total += elapsed;
+		if (elapsed > entry->max)
+			entry->max = elapsed;
+		entry->steps += steps;
+		entry->fullscans += fullscans;
+		entry->sorts += sorts;
+		entry->autoindexes += autoindexes;
+
+		// each statement gets its plan logged once
+		if (elapsed >= profile_threshold && !entry->explained)
+			explain = entry->explained = 1;
+	}
+	pthread_mutex_unlock(&profile_mutex);
+
+	if (explain)
+	{
+		profile_busy = 1;
+		profile_explain(sqlite3_db_handle(stmt), sql, elapsed);
+		profile_busy = 0;
+	}
+	return 0;
+}
+
+void profile_attach(sqlite3 *db)
+{
+	if (profile_enabled)
+		sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, profile_callback, NULL);
+}
+
+static int profile_compare_entries(const void *a, const void *b)
+{
+	uint64_t ta = (*(profile_entry* const*)a)->total, tb = (*(profile_entry* const*)b)->total;
+
+	return ta > tb ? -1 : ta < tb;
+}
+
+// copies of the most expensive entries, taken under the lock
+static size_t profile_snapshot(profile_entry **pentries)
+{
+	profile_entry **all, *top;
+	size_t count = 0;
+
+	*pentries = NULL;
+	pthread_mutex_lock(&profile_mutex);
+	if (!profile_count || !(all = (profile_entry**)malloc(sizeof(profile_entry*) * profile_count)))
+	{
+		pthread_mutex_unlock(&profile_mutex);
+		return 0;
+	}
+	for (int i = 0; i < PROFILE_BUCKETS; ++i)
+		for (profile_entry *entry = profile_table[i]; entry; entry = entry->next)
+			all[count++] = entry;
+	qsort(all, count, sizeof(profile_entry*), profile_compare_entries);
+	if (count > PROFILE_TOP)
+		count = PROFILE_TOP;
+	if ((top = (profile_entry*)malloc(sizeof(profile_entry) * count)))
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			top[i] = *all[i];
+			top[i].sql = strdup(all[i]->sql);
+		}
+	} else
+		count = 0;
+	pthread_mutex_unlock(&profile_mutex);
+
+	free(all);
+	*pentries = top;
+	return count;
+}
+
+static void profile_free_snapshot(profile_entry *entries, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		free(entries[i].sql);
+	free(entries);
+}
+
+void profile_format_text(FILE *out)
+{
+	profile_entry *entries;
+	size_t count;
+
+	if (!profile_enabled)
+		return;
+
+	count = profile_snapshot(&entries);
+	fprintf(out, "# query calls total_us max_us steps fullscans sorts autoindexes sql\n");
+	for (size_t i = 0; i < count; ++i)
+	{
+		const profile_entry *entry = &entries[i];
+
+		fprintf(out, "query %llu %llu %llu %llu %llu %llu %llu %s\n",
+			(unsigned long long)entry->calls,
+			(unsigned long long)(entry->total / 1000),
+			(unsigned long long)(entry->max / 1000),
+			(unsigned long long)entry->steps,
+			(unsigned long long)entry->fullscans,
+			(unsigned long long)entry->sorts,
+			(unsigned long long)entry->autoindexes,
+			entry->sql ? entry->sql : "");
+	}
+	profile_free_snapshot(entries, count);
+}
+
+static void profile_json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; s && *s; ++s)
+	{
+		if ('"' == *s || '\\' == *s)
+			fprintf(out, "\\%c", *s); else
+		if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", *s); else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+void profile_format_json(FILE *out)
+{
+	profile_entry *entries;
+	size_t count;
+
+	if (!profile_enabled)
+		return;
+
+	count = profile_snapshot(&entries);
+	fputs(",\"queries\":[", out);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const profile_entry *entry = &entries[i];
+
+		fprintf(out, "%s{\"calls\":%llu,\"total\":%llu,\"max\":%llu,\"steps\":%llu,"
+			"\"fullscans\":%llu,\"sorts\":%llu,\"autoindexes\":%llu,\"sql\":",
+			i ? "," : "",
+			(unsigned long long)entry->calls,
+			(unsigned long long)(entry->total / 1000),
+			(unsigned long long)(entry->max / 1000),
+			(unsigned long long)entry->steps,
+			(unsigned long long)entry->fullscans,
+			(unsigned long long)entry->sorts,
+			(unsigned long long)entry->autoindexes);
+		profile_json_string(out, entry->sql);
+		fputc('}', out);
+	}
+	fputc(']', out);
+	profile_free_snapshot(entries, count);
+}
+
+void profile_init(int enabled, int slow_query)
+{
+	profile_enabled = enabled;
+	profile_threshold = (uint64_t)slow_query * 1000000;
+}
+
+void profile_free(void)
+{
+	profile_enabled = 0;
+
+	pthread_mutex_lock(&profile_mutex);
+	for (int i = 0; i < PROFILE_BUCKETS; ++i)
+	{
+		profile_entry *entry = profile_table[i], *next;
+
+		for (; entry; entry = next)
+		{
+			next = entry->next;
+			free(entry->sql);
+			free(entry);
+		}
+		profile_table[i] = NULL;
+	}
+	profile_count = 0;
+	pthread_mutex_unlock(&profile_mutex);
+}
@@ -0,0 +1,40 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdio.h>
+#include <sqlite3.h>
+
+// statements slower than the threshold get their query plan logged
+#define PROFILE_SLOW_QUERY	50 // ms
+
+// profiling is off unless enabled before any connection is opened
+void profile_init(int enabled, int slow_query);
+void profile_free(void);
+
+// hooks the connection into the profiler (no-op when disabled)
+void profile_attach(sqlite3 *db);
+
+// writes the per-statement summary (most expensive first)
+void profile_format_text(FILE *out);
+void profile_format_json(FILE *out);
+
+#endif // __PROFILE_H__
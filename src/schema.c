@@ -21,6 +21,131 @@
 
 #include "beholddb.h"
 #include "schema.h"
+#include "tagexpr.h"
+
+const char *BEHOLDDB_DDL_CREATE_TABLES =
+	"create table if not exists files "
+	"("
+		"id integer primary key,"
+		"type integer not null,"
+		"name text unique on conflict ignore"
+	");"
+	"create table if not exists tags"
+	"("
+		"id integer primary key,"
+		"name text unique on conflict ignore,"
+		"refs integer not null default 0,"	// files_tags rows
+		"strong integer not null default 0"	// strong_tags rows
+	");"
+	"create table if not exists files_tags"
+	"("
+		//"id integer primary key,"
+		"id_file integer not null references files(id) on delete cascade,"
+		"id_tag integer not null references tags(id),"// on delete cascade,"
+		"unique ( id_file, id_tag ) on conflict ignore"
+	");"
+	"create table if not exists dirs_tags"
+	"("
+		//"id integer primary key,"
+		"id_file integer not null references files(id) on delete cascade,"
+		"id_tag integer not null references tags(id),"// on delete cascade,"
+		"unique ( id_file, id_tag ) on conflict ignore"
+	");"
+	"create view if not exists strong_tags as "
+		"select dt.*, 1 type from dirs_tags dt "
+		"union "
+		"select ft.*, 0 type from files_tags ft "
+		"join files f on f.id = ft.id_file "
+		"where not f.type;"
+	"create table if not exists summary"
+	"("
+		"files integer not null"
+	");"
+	"insert into summary "
+		"select 0 where not exists ( select * from summary );";
+
+// files_tags and dirs_tags are looked up by tag when tags are
+// propagated and cleaned up; the unique constraints only cover
+// lookups by file
+const char *BEHOLDDB_DDL_CREATE_INDEXES =
+	"create index if not exists files_tags_tag on files_tags ( id_tag );"
+	"create index if not exists dirs_tags_tag on dirs_tags ( id_tag );"
+	"create index if not exists tags_unused on tags ( id ) where refs = 0;"
+	"create index if not exists tags_strong on tags ( strong );";
+
+// keep tags.refs, tags.strong and summary.files up to date; when a file
+// is deleted its files_tags rows go away by cascade after the file row
+// itself, so its strong tags are released before the delete
+const char *BEHOLDDB_DDL_CREATE_TRIGGERS =
+	"create trigger if not exists files_insert after insert on files "
+	"begin "
+		"update summary set files = files + 1; "
+	"end;"
+	"create trigger if not exists files_delete before delete on files "
+	"begin "
+		"update summary set files = files - 1; "
+		"update tags set strong = strong - 1 "
+		"where not old.type "
+		"and id in ( select id_tag from files_tags where id_file = old.id ); "
+	"end;"
+	"create trigger if not exists files_tags_insert after insert on files_tags "
+	"begin "
+		"update tags set refs = refs + 1, "
+		"strong = strong + exists ( select * from files where id = new.id_file and not type ) "
+		"where id = new.id_tag; "
+	"end;"
+	"create trigger if not exists files_tags_delete after delete on files_tags "
+	"begin "
+		"update tags set refs = refs - 1, "
+		"strong = strong - exists ( select * from files where id = old.id_file and not type ) "
+		"where id = old.id_tag; "
+	"end;"
+	"create trigger if not exists dirs_tags_insert after insert on dirs_tags "
+	"begin "
+		"update tags set strong = strong + 1 where id = new.id_tag; "
+	"end;"
+	"create trigger if not exists dirs_tags_delete after delete on dirs_tags "
+	"begin "
+		"update tags set strong = strong - 1 where id = old.id_tag; "
+	"end;";
+
+// metadata 1.0 had no reference counts
+const char *BEHOLDDB_DDL_UPGRADE_1_1 =
+	"alter table tags add column refs integer not null default 0;"
+	"alter table tags add column strong integer not null default 0;"
+	"create table if not exists summary"
+	"("
+		"files integer not null"
+	");"
+	"delete from summary;"
+	"insert into summary select count(*) from files;"
+	"update tags set "
+		"refs = ( select count(*) from files_tags ft where ft.id_tag = tags.id ), "
+		"strong = ( select count(*) from strong_tags st where st.id_tag = tags.id );";
+
+const char *BEHOLDDB_DDL_FILES_TAGS =
+	"create temp table if not exists include"
+	"("
+		"id integer primary key on conflict ignore,"
+		"name text"
+	");"
+	"create temp table if not exists exclude"
+	"("
+		"id integer primary key on conflict ignore,"
+		"name text"
+	");";
+
+const char *BEHOLDDB_DDL_DIRS_TAGS =
+	"create temp table if not exists dirs_include"
+	"("
+		"id integer primary key on conflict ignore,"
+		"name text"
+	");"
+	"create temp table if not exists dirs_exclude"
+	"("
+		"id integer primary key on conflict ignore,"
+		"name text"
+	");";
 
 const char *BEHOLDDB_DML_LOCATE =
 	"select 1 from ( select ? name ) fs "
@@ -70,32 +195,140 @@ const char *BEHOLDDB_DML_FAST_LOCATE =
 const char *BEHOLDDB_DDL_FAST_LOCATE_STOP =
 	"drop table fast_files;";
 
+// tags are listed by popularity; the count and the id of each row form
+// a key the listing can be resumed from (see BEHOLDDB_DML_TAG_LISTING_FROM)
+#define BEHOLDDB_TAG_LISTING_OF(tags) \
+	"select t.name, count(*), tt.id from ( " \
+	tags \
+	") tt " \
+	"join tags t on t.id = tt.id " \
+	"join files_tags ft on ft.id_tag = tt.id " \
+	"group by tt.id "
+
+#define BEHOLDDB_TAG_LISTING \
+	BEHOLDDB_TAG_LISTING_OF( \
+	"select distinct ft.id_tag id from files f " \
+	"join files_tags ft on ft.id_file = f.id " \
+	"where not exists ( " \
+		"select t.id from include t " \
+		"except " \
+		"select t.id from include t " \
+		"join files_tags ft on ft.id_tag = t.id " \
+		"where ft.id_file = f.id ) " \
+	"and case when f.type = 0 " \
+	"then not exists ( " \
+		"select t.id from exclude t " \
+		"join files_tags ft on ft.id_tag = t.id " \
+		"where ft.id_file = f.id ) " \
+	"else not exists ( " \
+		"select t.id from exclude t " \
+		"join dirs_tags dt on dt.id_tag = t.id " \
+		"where dt.id_file = f.id ) " \
+	"end " \
+	"except select id from include " \
+	"except select id from exclude ")
+
 const char *BEHOLDDB_DML_TAG_LISTING =
-	"select t.name from ( "
-	"select distinct ft.id_tag id from files f "
-	"join files_tags ft on ft.id_file = f.id "
-	"where not exists ( "
-		"select t.id from include t "
-		"except "
-		"select t.id from include t "
+	BEHOLDDB_TAG_LISTING
+	"order by count(*) desc, tt.id ";
+
+const char *BEHOLDDB_DML_TAG_LISTING_FROM =
+	BEHOLDDB_TAG_LISTING
+	"having count(*) < ?1 or count(*) = ?1 and tt.id > ?2 "
+	"order by count(*) desc, tt.id ";
+
+// a view with alternatives, %(tag1|tag2)%-tag3, is answered by a plan
+// compiled from it (see tagexpr.h): either the set of the files it
+// selects, put in expression_files, or a test of the file f, appended
+// to the statements that end in "and "
+const tagexpr_dialect BEHOLDDB_DIALECT_DIR =
+{
+	'F',
+	"select id from files",
+	"select ft.id_file from tags t "
+	"join files_tags ft on ft.id_tag = t.id "
+	"where t.name %2$s ?%1$d",
+	"select id_file from "
+	"( "
+		"select ft.id_file from tags t "
 		"join files_tags ft on ft.id_tag = t.id "
-		"where ft.id_file = f.id ) "
-	"and case when f.type = 0 "
-	"then not exists ( "
-		"select t.id from exclude t "
+		"join files f on f.id = ft.id_file "
+		"where t.name %2$s ?%1$d and not f.type "
+		"union all "
+		"select dt.id_file from tags t "
+		"join dirs_tags dt on dt.id_tag = t.id "
+		"where t.name %2$s ?%1$d "
+	")",
+	"exists ( "
+		"select 1 from tags t "
 		"join files_tags ft on ft.id_tag = t.id "
-		"where ft.id_file = f.id ) "
-	"else not exists ( "
-		"select t.id from exclude t "
+		"where t.name %2$s ?%1$d and ft.id_file = f.id )",
+	"case when f.type = 0 "
+	"then exists ( "
+		"select 1 from tags t "
+		"join files_tags ft on ft.id_tag = t.id "
+		"where t.name %2$s ?%1$d and ft.id_file = f.id ) "
+	"else exists ( "
+		"select 1 from tags t "
 		"join dirs_tags dt on dt.id_tag = t.id "
-		"where dt.id_file = f.id ) "
-	"end "
-	"except select id from include "
-	"except select id from exclude ) tt "
-	"join tags t on t.id = tt.id "
-	"join files_tags ft on ft.id_tag = tt.id "
-	"group by tt.id "
-	"order by count(*) desc ";
+		"where t.name %2$s ?%1$d and dt.id_file = f.id ) "
+	"end"
+};
+
+// the tags named by the expression are left out of its tag listing
+const char *BEHOLDDB_DDL_EXPRESSION =
+	"create temp table if not exists expression_files ( id integer primary key on conflict ignore );"
+	"create temp table if not exists expression_tags ( name text primary key on conflict ignore );"
+	"delete from expression_files;"
+	"delete from expression_tags;";
+
+const char *BEHOLDDB_DML_EXPRESSION_FILES =
+	"insert into expression_files ";
+
+const char *BEHOLDDB_DML_EXPRESSION_TAG =
+	"insert into expression_tags ( name ) values ( ? )";
+
+const char *BEHOLDDB_DML_EXPRESSION_LOCATE =
+	"select 1 from files f "
+	"where f.name = ?1 and ";
+
+const char *BEHOLDDB_DDL_EXPRESSION_FAST_LOCATE_START =
+	"create temp table fast_files ( id integer primary key, name text unique );"
+	"insert into fast_files "
+	"select f.id, f.name from expression_files e "
+	"join files f on f.id = e.id ";
+
+#define BEHOLDDB_EXPRESSION_TAG_LISTING \
+	BEHOLDDB_TAG_LISTING_OF( \
+	"select distinct ft.id_tag id from expression_files e " \
+	"join files_tags ft on ft.id_file = e.id " \
+	"except select t.id from expression_tags et " \
+	"join tags t on t.name = et.name ")
+
+const char *BEHOLDDB_DML_EXPRESSION_TAG_LISTING =
+	BEHOLDDB_EXPRESSION_TAG_LISTING
+	"order by count(*) desc, tt.id ";
+
+const char *BEHOLDDB_DML_EXPRESSION_TAG_LISTING_FROM =
+	BEHOLDDB_EXPRESSION_TAG_LISTING
+	"having count(*) < ?1 or count(*) = ?1 and tt.id > ?2 "
+	"order by count(*) desc, tt.id ";
+
+// the tags of a view without tags that begin with a prefix, ?3 being
+// its escaped glob: a range of the unique index on the tag names, with
+// the counts kept in refs
+#define BEHOLDDB_PREFIX_TAG_LISTING \
+	"select name, refs, id from tags " \
+	"where name glob ?3 and refs > 0 "
+
+const char *BEHOLDDB_DML_PREFIX_TAG_LISTING =
+	BEHOLDDB_PREFIX_TAG_LISTING
+	"order by refs desc, id ";
+
+const char *BEHOLDDB_DML_PREFIX_TAG_LISTING_FROM =
+	BEHOLDDB_PREFIX_TAG_LISTING
+	"and ( refs < ?1 or refs = ?1 and id > ?2 ) "
+	"order by refs desc, id ";
 
 const char *BEHOLDDB_DML_FILE_TAG_LISTING =
 	"select t.name "
@@ -104,6 +337,1364 @@ const char *BEHOLDDB_DML_FILE_TAG_LISTING =
 	"join tags t on t.id = ft.id_tag "
 	"where f.name = ?";
 
+const char *BEHOLDDB_DML_MARK_INCLUDE =
+	"insert into files_tags ( id_file, id_tag ) "
+	"select f.id, t.id "
+	"from files f "
+	"join include t "
+	"where f.name = ?";
+
+const char *BEHOLDDB_DML_MARK_EXCLUDE =
+	"delete from files_tags "
+	"where id_file = "
+		"( select id from files where name = ? ) "
+	"and id_tag in "
+		"( select id from exclude )";
+
+const char *BEHOLDDB_DML_MARK_DIRS_INCLUDE =
+	"insert into dirs_tags ( id_file, id_tag ) "
+	"select f.id, t.id "
+	"from files f "
+	"join dirs_include t "
+	"where f.name = ?";
+
+const char *BEHOLDDB_DML_MARK_DIRS_EXCLUDE =
+	"delete from dirs_tags "
+	"where id_file = "
+		"( select id from files where name = ? ) "
+	"and id_tag in "
+		"( select id from dirs_exclude )";
+
+// excluded tags no file in the directory has any more
+const char *BEHOLDDB_DML_UNUSED_TAGS =
+	"select t.name from exclude t "
+	"where not exists "
+		"(select * from tags tt "
+		"where tt.id = t.id and tt.refs)";
+
+// included tags every file in the directory has
+const char *BEHOLDDB_DML_UNIVERSAL_TAGS =
+	"select t.name from include t "
+	"join tags tt on tt.id = t.id "
+	"where tt.strong = ( select files from summary )";
+
+const char *BEHOLDDB_DML_CREATE_INCLUDE =
+	"delete from include "
+	"where id in "
+	"(select id from exclude);";
+
+// run after the new file is marked: the tags every file but the new one
+// has; universal ones among them are no longer universal, the rest were
+// not universal before either
+const char *BEHOLDDB_DML_CREATE_EXCLUDE =
+	"delete from exclude;"
+
+	"insert into exclude "
+	"select id, name from tags "
+	"where strong = ( select files from summary ) - 1;";
+
+// every tag of the file that is not included
+const char *BEHOLDDB_DML_RETAG_REPLACE =
+	"insert into exclude "
+	"select t.id, t.name from files f "
+	"join files_tags ft on ft.id_file = f.id "
+	"join tags t on t.id = ft.id_tag "
+	"where f.name = ? "
+	"and t.id not in ( select id from include )";
+
+// leaves the tags the renamed file does not have yet in include and the
+// ones it has in exclude
+const char *BEHOLDDB_DML_RETAG_INCLUDE =
+	"delete from include "
+	"where id in "
+		"( select ft.id_tag from files_tags ft "
+		"join files f on f.id = ft.id_file "
+		"where f.name = ? )";
+
+const char *BEHOLDDB_DML_RETAG_EXCLUDE =
+	"delete from exclude "
+	"where id not in "
+		"( select ft.id_tag from files_tags ft "
+		"join files f on f.id = ft.id_file "
+		"where f.name = ? )";
+
+// after marking: whether a tag became used or unused in the directory,
+// or universal or not universal
+const char *BEHOLDDB_DML_RETAG_CHANGED =
+	"select 1 where exists "
+		"( select * from include t "
+		"join tags tt on tt.id = t.id "
+		"where tt.refs = 1 "
+		"or tt.strong = ( select files from summary ) ) "
+	"or exists "
+		"( select * from exclude t "
+		"join tags tt on tt.id = t.id "
+		"where tt.refs = 0 "
+		"or tt.strong = ( select files from summary ) - 1 )";
+
+// added tags no other file in the directory has
+const char *BEHOLDDB_DML_RETAG_USED =
+	"select t.name from include t "
+	"join tags tt on tt.id = t.id "
+	"where tt.refs = 1";
+
+// removed tags every other file in the directory has
+const char *BEHOLDDB_DML_RETAG_NOT_UNIVERSAL =
+	"select t.name from exclude t "
+	"join tags tt on tt.id = t.id "
+	"where tt.strong = ( select files from summary ) - 1";
+
+const char *BEHOLDDB_DML_RETAG_UNUSED_TAGS =
+	"delete from tags "
+	"where refs = 0 "
+	"and id in ( select id from exclude )";
+
+const char *BEHOLDDB_DML_DELETE_FILE =
+	"delete from files "
+	"where name = ?;";
+
+// collects the tags the deleted file was the last one to have and the
+// tags every remaining file has, for propagation to the parent
+const char *BEHOLDDB_DML_DELETE_UNUSED_TAGS =
+	"insert into exclude "
+	"select id, name from tags "
+	"where refs = 0;"
+
+	"delete from tags "
+	"where refs = 0;"
+
+	"insert into include "
+	"select id, name from tags "
+	"where strong = ( select files from summary );";
+
+const char *BEHOLDDB_DML_RESET_FILES_TAGS =
+	"delete from include;"
+	"delete from exclude;";
+
+// tags touched by a batch of tag edits in one directory, starting with
+// the universal ones, which a file new to the database may take away
+const char *BEHOLDDB_DDL_BATCH =
+	"create temp table if not exists touched"
+	"("
+		"id integer primary key on conflict ignore,"
+		"name text"
+	");"
+	"delete from touched;"
+	"insert into touched "
+	"select id, name from tags "
+	"where strong = ( select files from summary );";
+
+// each record of a batch is undone on its own when one of its
+// statements fails
+const char *BEHOLDDB_DML_BATCH_BEGIN =
+	"savepoint batch;";
+
+const char *BEHOLDDB_DML_BATCH_RELEASE =
+	"release batch;";
+
+const char *BEHOLDDB_DML_BATCH_UNDO =
+	"rollback to batch; release batch;";
+
+const char *BEHOLDDB_DML_BATCH_TOUCH =
+	"insert into touched "
+	"select id, name from include "
+	"union "
+	"select id, name from exclude;";
+
+const char *BEHOLDDB_DML_BATCH_USED =
+	"select t.name from touched t "
+	"join tags tt on tt.id = t.id "
+	"where tt.refs";
+
+const char *BEHOLDDB_DML_BATCH_UNUSED =
+	"select t.name from touched t "
+	"where not exists "
+		"(select * from tags tt "
+		"where tt.id = t.id and tt.refs)";
+
+const char *BEHOLDDB_DML_BATCH_UNIVERSAL =
+	"select t.name from touched t "
+	"join tags tt on tt.id = t.id "
+	"where tt.strong = ( select files from summary )";
+
+const char *BEHOLDDB_DML_BATCH_NOT_UNIVERSAL =
+	"select t.name from touched t "
+	"where not exists "
+		"(select * from tags tt "
+		"where tt.id = t.id "
+		"and tt.strong = ( select files from summary ))";
+
+// moving a file between directories: the destination database is main
+// and the source one is attached as src
+const char *BEHOLDDB_DML_ATTACH_SOURCE =
+	"attach database ? as src";
+
+const char *BEHOLDDB_DML_DETACH_SOURCE =
+	"detach database src;";
+
+const char *BEHOLDDB_DML_MOVE_TAGS =
+	"insert into main.tags ( name ) "
+	"select t.name from src.tags t "
+	"where t.id in "
+		"( select ft.id_tag from src.files_tags ft "
+		"join src.files f on f.id = ft.id_file "
+		"where f.name = ?1 "
+		"union "
+		"select dt.id_tag from src.dirs_tags dt "
+		"join src.files f on f.id = dt.id_file "
+		"where f.name = ?1 )";
+
+const char *BEHOLDDB_DML_MOVE_INCLUDE =
+	"insert into include "
+	"select t.id, t.name from src.files f "
+	"join src.files_tags ft on ft.id_file = f.id "
+	"join src.tags st on st.id = ft.id_tag "
+	"join main.tags t on t.name = st.name "
+	"where f.name = ?";
+
+const char *BEHOLDDB_DML_MOVE_DIRS_INCLUDE =
+	"insert into dirs_include "
+	"select t.id, t.name from src.files f "
+	"join src.dirs_tags dt on dt.id_file = f.id "
+	"join src.tags st on st.id = dt.id_tag "
+	"join main.tags t on t.name = st.name "
+	"where f.name = ?";
+
+const char *BEHOLDDB_DML_MOVE_DELETE =
+	"delete from src.files "
+	"where name = ?";
+
+const char *BEHOLDDB_DML_MOVE_UNUSED_TAGS =
+	"select name from src.tags "
+	"where refs = 0";
+
+const char *BEHOLDDB_DML_MOVE_UNIVERSAL_TAGS =
+	"select name from src.tags "
+	"where strong = ( select files from src.summary )";
+
+const char *BEHOLDDB_DML_MOVE_DELETE_UNUSED_TAGS =
+	"delete from src.tags "
+	"where refs = 0;";
+
+const char *BEHOLDDB_DML_MOVE_STAMP =
+	"insert into src.config ( param, value ) "
+	"values ( 'stamp', ? )";
+
+// renames between directories in flight, kept in the root directory;
+// marks holds the tags a committed move still has to give the ancestors
+// of the old (chain 0) and the new (chain 1) directory: list is include,
+// exclude, dirs include or dirs exclude
+const char *BEHOLDDB_DDL_CREATE_INTENTS =
+	"create table if not exists intents"
+	"("
+		"id integer primary key,"
+		"oldpath text not null,"
+		"newpath text not null"
+	");"
+	"create table if not exists marks"
+	"("
+		"id_intent integer not null,"
+		"chain integer not null,"
+		"list integer not null,"
+		"tag text not null"
+	");";
+
+const char *BEHOLDDB_DML_INTENT_BEGIN =
+	"insert into intents ( oldpath, newpath ) "
+	"values ( ?, ? )";
+
+const char *BEHOLDDB_DML_INTENT_END =
+	"delete from marks "
+	"where id_intent = %lld;"
+	"delete from intents "
+	"where id = %lld;";
+
+const char *BEHOLDDB_DML_INTENT_LIST =
+	"select id, oldpath, newpath from intents "
+	"order by id";
+
+const char *BEHOLDDB_DML_INTENT_CLEAR =
+	"delete from marks;"
+	"delete from intents;";
+
+// the move attaches the intent log and records the marks in its
+// transaction
+const char *BEHOLDDB_DML_ATTACH_INTENTS =
+	"attach database ? as intent";
+
+const char *BEHOLDDB_DML_DETACH_INTENTS =
+	"detach database intent;";
+
+const char *BEHOLDDB_DML_INTENT_MARK =
+	"insert into intent.marks ( id_intent, chain, list, tag ) "
+	"values ( %lld, %d, %d, ? )";
+
+const char *BEHOLDDB_DML_INTENT_MARKS =
+	"select tag from marks "
+	"where id_intent = %lld and chain = %d and list = %d";
+
+// tag implication rules of the whole tree, kept in the root directory:
+// tag implies another, cat < animal, or is an alias of it, both ways;
+// closure holds every pair a chain of rules leads to, so a view of a tag
+// takes in the tags below it without the implied rows being stored
+const char *BEHOLDDB_DDL_CREATE_RULES =
+	"create table if not exists rules"
+	"("
+		"tag text not null,"
+		"implies text not null,"
+		"alias integer not null default 0,"
+		"primary key ( tag, implies )"
+	");"
+	"create index if not exists rules_alias on rules ( implies ) where alias;"
+	"create table if not exists closure"
+	"("
+		"tag text not null,"
+		"implies text not null,"
+		"primary key ( tag, implies ) on conflict ignore"
+	") without rowid;"
+	"create index if not exists closure_implies on closure ( implies, tag );"
+	"create view if not exists rule_edges as "
+		"select tag, implies from rules "
+		"union "
+		"select implies, tag from rules where alias;"
+	"create temp table if not exists rules_affected ( tag text primary key on conflict ignore );";
+
+// a new rule ?1 < ?2 (?3 if an alias) joins everything below ?1 to
+// everything above ?2
+#define BEHOLDDB_RULE_CLOSURE_ADD(tag, implies) \
+	"insert into closure ( tag, implies ) " \
+	"select x.tag, y.implies from " \
+	"( select " tag " tag union select tag from closure where implies = " tag " ) x, " \
+	"( select " implies " implies union select implies from closure where tag = " implies " ) y " \
+	"where x.tag <> y.implies "
+
+const char *BEHOLDDB_DML_RULE_ADD =
+	"insert or replace into rules ( tag, implies, alias ) "
+	"values ( ?1, ?2, ?3 );"
+	BEHOLDDB_RULE_CLOSURE_ADD("?1", "?2") ";"
+	BEHOLDDB_RULE_CLOSURE_ADD("?2", "?1") "and ?3;";
+
+// a rule that goes away only changes what lies below its tags: their
+// pairs are found again from the rules that are left
+const char *BEHOLDDB_DML_RULE_REMOVE =
+	"delete from rules_affected;"
+	"insert into rules_affected "
+		"select ?1 union select ?2 "
+		"union select tag from closure where implies in ( ?1, ?2 );"
+	"delete from rules "
+	"where tag = ?1 and implies = ?2 "
+	"or ?3 and alias and tag = ?2 and implies = ?1;"
+	"delete from closure "
+	"where tag in ( select tag from rules_affected );"
+	"with recursive reach ( tag, implies ) as ( "
+		"select e.tag, e.implies from rules_affected a "
+		"join rule_edges e on e.tag = a.tag "
+		"union "
+		"select r.tag, e.implies from reach r "
+		"join rule_edges e on e.tag = r.implies ) "
+	"insert into closure ( tag, implies ) "
+	"select tag, implies from reach "
+	"where tag <> implies;";
+
+const char *BEHOLDDB_DML_RULE_LIST =
+	"select tag, implies, alias from rules "
+	"order by implies, tag";
+
+const char *BEHOLDDB_DML_RULE_CLOSURE =
+	"select implies, tag from closure "
+	"order by implies, tag";
+
+// offline import: a directory is rewritten from scratch
+const char *BEHOLDDB_DML_IMPORT_EXISTING =
+	"select f.name, t.name from files f "
+	"join files_tags ft on ft.id_file = f.id "
+	"join tags t on t.id = ft.id_tag "
+	"where not f.type";
+
+const char *BEHOLDDB_DML_IMPORT_CLEAR =
+	"delete from files; "
+	"delete from tags;";
+
+const char *BEHOLDDB_DML_IMPORT_FILE =
+	"insert into files ( type, name ) "
+	"values ( ?, ? )";
+
+const char *BEHOLDDB_DML_IMPORT_TAG =
+	"insert into tags ( name ) "
+	"values ( ? )";
+
+const char *BEHOLDDB_DML_IMPORT_FILES_TAG =
+	"insert into files_tags ( id_file, id_tag ) "
+	"select ?, id from tags where name = ?";
+
+const char *BEHOLDDB_DML_IMPORT_DIRS_TAG =
+	"insert into dirs_tags ( id_file, id_tag ) "
+	"select ?, id from tags where name = ?";
+
+// the names beholddb_is_metadata keeps out of listings
+#define BEHOLDDB_METADATA_NAMES \
+	"'.beholdfs', '.beholdfs-journal', " \
+	"'.beholdfs-intent', '.beholdfs-intent-journal', " \
+	"'.beholdfs-index', '.beholdfs-index-journal', '.beholdfs-index-wal', '.beholdfs-index-shm', " \
+	"'.beholdfs-central', '.beholdfs-central-journal', '.beholdfs-central-wal', '.beholdfs-central-shm', " \
+	"'.beholdfs-rules', '.beholdfs-rules-journal'"
+
+// consistency check: the real entries of the directory, as listed by
+// the sqlitefs module, against the files table
+const char *BEHOLDDB_DDL_FSCK_START =
+	"create virtual table if not exists temp.fsck_fs using sqlitefs;"
+	"create temp table if not exists fsck_entries"
+	"("
+		"name text primary key,"
+		"type integer not null"
+	");"
+	"delete from fsck_entries;"
+	"insert into fsck_entries "
+	"select name, type from fsck_fs "
+	"where name not in ( " BEHOLDDB_METADATA_NAMES " );";
+
+// rows with no entry behind them, or with an entry of the other type
+const char *BEHOLDDB_DML_FSCK_ORPHANS =
+	"delete from files "
+	"where not exists "
+		"(select * from fsck_entries e "
+		"where e.name = files.name and e.type = files.type)";
+
+const char *BEHOLDDB_DML_FSCK_UNTRACKED =
+	"insert into files ( type, name ) "
+	"select type, name from fsck_entries e "
+	"where not exists "
+		"(select * from files f "
+		"where f.name = e.name)";
+
+const char *BEHOLDDB_DML_FSCK_DIR =
+	"select id from files "
+	"where name = ? and type = 1";
+
+const char *BEHOLDDB_DML_FSCK_FILES_TAGS =
+	"select t.name from files_tags ft "
+	"join tags t on t.id = ft.id_tag "
+	"where ft.id_file = ? "
+	"order by t.name";
+
+const char *BEHOLDDB_DML_FSCK_DIRS_TAGS =
+	"select t.name from dirs_tags dt "
+	"join tags t on t.id = dt.id_tag "
+	"where dt.id_file = ? "
+	"order by t.name";
+
+const char *BEHOLDDB_DML_FSCK_CLEAR_FILES_TAGS =
+	"delete from files_tags "
+	"where id_file = ?";
+
+const char *BEHOLDDB_DML_FSCK_CLEAR_DIRS_TAGS =
+	"delete from dirs_tags "
+	"where id_file = ?";
+
+// strong_tags is a union and would be built once per tag
+const char *BEHOLDDB_DML_FSCK_COUNTERS =
+	"update tags set "
+		"refs = ( select count(*) from files_tags ft where ft.id_tag = tags.id ), "
+		"strong = "
+			"( select count(*) from dirs_tags dt where dt.id_tag = tags.id ) + "
+			"( select count(*) from files_tags ft "
+			"join files f on f.id = ft.id_file "
+			"where ft.id_tag = tags.id and not f.type ) "
+	"where refs <> ( select count(*) from files_tags ft where ft.id_tag = tags.id ) "
+	"or strong <> "
+		"( select count(*) from dirs_tags dt where dt.id_tag = tags.id ) + "
+		"( select count(*) from files_tags ft "
+		"join files f on f.id = ft.id_file "
+		"where ft.id_tag = tags.id and not f.type )";
+
+const char *BEHOLDDB_DML_FSCK_SUMMARY =
+	"update summary "
+	"set files = ( select count(*) from files ) "
+	"where files <> ( select count(*) from files )";
+
+const char *BEHOLDDB_DML_FSCK_UNUSED_TAGS =
+	"delete from tags "
+	"where refs = 0";
+
+// what the parent directory keeps for this one
+const char *BEHOLDDB_DML_FSCK_WEAK =
+	"select name from tags "
+	"where refs > 0 "
+	"order by name";
+
+const char *BEHOLDDB_DML_FSCK_STRONG =
+	"select name from tags "
+	"where strong = ( select files from summary ) "
+	"order by name";
+
+// first access after mount to a directory changed behind our back; the
+// fsck statements do the diff
+const char *BEHOLDDB_DML_RECONCILE_UNUSED =
+	"select name from tags "
+	"where refs = 0";
+
+const char *BEHOLDDB_DML_RECONCILE_NOT_UNIVERSAL =
+	"select name from tags "
+	"where strong <> ( select files from summary )";
+
+// central mode keeps every directory in one database at the root; the
+// rows of a directory are those with its id_dir
+const char *BEHOLDDB_DDL_CENTRAL_CREATE_TABLES =
+	"create table if not exists dirs "
+	"("
+		"id integer primary key,"
+		"parent integer references dirs(id) on delete cascade,"
+		"name text not null,"
+		"unique ( parent, name )"
+	");"
+	"create table if not exists all_files "
+	"("
+		"id integer primary key,"
+		"id_dir integer not null references dirs(id) on delete cascade,"
+		"type integer not null,"
+		"name text,"
+		"unique ( id_dir, name ) on conflict ignore"
+	");"
+	"create table if not exists all_tags"
+	"("
+		"id integer primary key,"
+		"id_dir integer not null references dirs(id) on delete cascade,"
+		"name text,"
+		"refs integer not null default 0,"
+		"strong integer not null default 0,"
+		"unique ( id_dir, name ) on conflict ignore"
+	");"
+	"create table if not exists all_files_tags"
+	"("
+		"id_file integer not null references all_files(id) on delete cascade,"
+		"id_tag integer not null references all_tags(id),"
+		"unique ( id_file, id_tag ) on conflict ignore"
+	");"
+	"create table if not exists all_dirs_tags"
+	"("
+		"id_file integer not null references all_files(id) on delete cascade,"
+		"id_tag integer not null references all_tags(id),"
+		"unique ( id_file, id_tag ) on conflict ignore"
+	");"
+	"create table if not exists all_summary"
+	"("
+		"id_dir integer primary key references dirs(id) on delete cascade,"
+		"files integer not null default 0"
+	");"
+	"create table if not exists all_config "
+	"( "
+		"id integer primary key, "
+		"id_dir integer not null references dirs(id) on delete cascade, "
+		"param text, "
+		"value text, "
+		"unique ( id_dir, param ) on conflict replace "
+	") ";
+
+const char *BEHOLDDB_DDL_CENTRAL_CREATE_INDEXES =
+	"create index if not exists all_files_tags_tag on all_files_tags ( id_tag );"
+	"create index if not exists all_dirs_tags_tag on all_dirs_tags ( id_tag );"
+	"create index if not exists all_tags_unused on all_tags ( id_dir ) where refs = 0;"
+	"create index if not exists all_tags_strong on all_tags ( id_dir, strong );"
+	"create index if not exists all_files_name on all_files ( name );";
+
+// the counters as kept by BEHOLDDB_DDL_CREATE_TRIGGERS, per directory;
+// the root goes in last, so that it gets its summary row
+const char *BEHOLDDB_DDL_CENTRAL_CREATE_TRIGGERS =
+	"create trigger if not exists dirs_insert after insert on dirs "
+	"begin "
+		"insert into all_summary ( id_dir ) values ( new.id ); "
+	"end;"
+	"create trigger if not exists all_files_insert after insert on all_files "
+	"begin "
+		"update all_summary set files = files + 1 where id_dir = new.id_dir; "
+	"end;"
+	"create trigger if not exists all_files_delete before delete on all_files "
+	"begin "
+		"update all_summary set files = files - 1 where id_dir = old.id_dir; "
+		"update all_tags set strong = strong - 1 "
+		"where not old.type "
+		"and id in ( select id_tag from all_files_tags where id_file = old.id ); "
+	"end;"
+	"create trigger if not exists all_files_tags_insert after insert on all_files_tags "
+	"begin "
+		"update all_tags set refs = refs + 1, "
+		"strong = strong + exists ( select * from all_files where id = new.id_file and not type ) "
+		"where id = new.id_tag; "
+	"end;"
+	"create trigger if not exists all_files_tags_delete after delete on all_files_tags "
+	"begin "
+		"update all_tags set refs = refs - 1, "
+		"strong = strong - exists ( select * from all_files where id = old.id_file and not type ) "
+		"where id = old.id_tag; "
+	"end;"
+	"create trigger if not exists all_dirs_tags_insert after insert on all_dirs_tags "
+	"begin "
+		"update all_tags set strong = strong + 1 where id = new.id_tag; "
+	"end;"
+	"create trigger if not exists all_dirs_tags_delete after delete on all_dirs_tags "
+	"begin "
+		"update all_tags set strong = strong - 1 where id = old.id_tag; "
+	"end;"
+	"insert into dirs ( id, parent, name ) "
+		"select 1, null, '' where not exists ( select * from dirs where id = 1 );";
+
+// the tables of a directory database as temp views of the directory on
+// top of levels, so that the statements above run unchanged; the scratch
+// tables are created up front to be cleared between levels
+const char *BEHOLDDB_DDL_CENTRAL_VIEWS =
+	"create temp table if not exists levels"
+	"("
+		"depth integer primary key,"
+		"id_dir integer not null"
+	");"
+	"create temp view if not exists current_dir as "
+		"select id_dir id from levels order by depth desc limit 1;"
+
+	"create temp view if not exists files as "
+		"select id, type, name from all_files "
+		"where id_dir = ( select id from current_dir );"
+	"create temp trigger if not exists files_view_insert instead of insert on files "
+	"begin "
+		"insert into all_files ( id, id_dir, type, name ) "
+		"values ( new.id, ( select id from current_dir ), new.type, new.name ); "
+	"end;"
+	"create temp trigger if not exists files_view_update instead of update on files "
+	"begin "
+		"update all_files set type = new.type, name = new.name where id = old.id; "
+	"end;"
+	"create temp trigger if not exists files_view_delete instead of delete on files "
+	"begin "
+		"delete from all_files where id = old.id; "
+	"end;"
+
+	"create temp view if not exists tags as "
+		"select id, name, refs, strong from all_tags "
+		"where id_dir = ( select id from current_dir );"
+	"create temp trigger if not exists tags_view_insert instead of insert on tags "
+	"begin "
+		"insert into all_tags ( id, id_dir, name, refs, strong ) "
+		"values ( new.id, ( select id from current_dir ), new.name, "
+			"coalesce ( new.refs, 0 ), coalesce ( new.strong, 0 ) ); "
+	"end;"
+	"create temp trigger if not exists tags_view_update instead of update on tags "
+	"begin "
+		"update all_tags set name = new.name, refs = new.refs, strong = new.strong "
+		"where id = old.id; "
+	"end;"
+	"create temp trigger if not exists tags_view_delete instead of delete on tags "
+	"begin "
+		"delete from all_tags where id = old.id; "
+	"end;"
+
+	"create temp view if not exists files_tags as "
+		"select ft.id_file, ft.id_tag from all_files_tags ft "
+		"join all_files f on f.id = ft.id_file "
+		"where f.id_dir = ( select id from current_dir );"
+	"create temp trigger if not exists files_tags_view_insert instead of insert on files_tags "
+	"begin "
+		"insert into all_files_tags ( id_file, id_tag ) values ( new.id_file, new.id_tag ); "
+	"end;"
+	"create temp trigger if not exists files_tags_view_delete instead of delete on files_tags "
+	"begin "
+		"delete from all_files_tags where id_file = old.id_file and id_tag = old.id_tag; "
+	"end;"
+
+	"create temp view if not exists dirs_tags as "
+		"select dt.id_file, dt.id_tag from all_dirs_tags dt "
+		"join all_files f on f.id = dt.id_file "
+		"where f.id_dir = ( select id from current_dir );"
+	"create temp trigger if not exists dirs_tags_view_insert instead of insert on dirs_tags "
+	"begin "
+		"insert into all_dirs_tags ( id_file, id_tag ) values ( new.id_file, new.id_tag ); "
+	"end;"
+	"create temp trigger if not exists dirs_tags_view_delete instead of delete on dirs_tags "
+	"begin "
+		"delete from all_dirs_tags where id_file = old.id_file and id_tag = old.id_tag; "
+	"end;"
+
+	"create temp view if not exists strong_tags as "
+		"select dt.*, 1 type from dirs_tags dt "
+		"union "
+		"select ft.*, 0 type from files_tags ft "
+		"join files f on f.id = ft.id_file "
+		"where not f.type;"
+
+	"create temp view if not exists summary as "
+		"select files from all_summary "
+		"where id_dir = ( select id from current_dir );"
+	"create temp trigger if not exists summary_view_update instead of update on summary "
+	"begin "
+		"update all_summary set files = new.files "
+		"where id_dir = ( select id from current_dir ); "
+	"end;"
+
+	"create temp view if not exists config as "
+		"select id, param, value from all_config "
+		"where id_dir = ( select id from current_dir );"
+	"create temp trigger if not exists config_view_insert instead of insert on config "
+	"begin "
+		"insert into all_config ( id_dir, param, value ) "
+		"values ( ( select id from current_dir ), new.param, new.value ); "
+	"end;"
+	"create temp trigger if not exists config_view_update instead of update on config "
+	"begin "
+		"update all_config set param = new.param, value = new.value where id = old.id; "
+	"end;"
+	"create temp trigger if not exists config_view_delete instead of delete on config "
+	"begin "
+		"delete from all_config where id = old.id; "
+	"end;";
+
+const char *BEHOLDDB_DML_CENTRAL_LOOKUP =
+	"select id from dirs "
+	"where parent = ? and name = ?";
+
+const char *BEHOLDDB_DML_CENTRAL_MKDIR =
+	"insert into dirs ( parent, name ) "
+	"values ( ?, ? )";
+
+const char *BEHOLDDB_DML_CENTRAL_ENTER =
+	"insert into levels ( id_dir ) "
+	"values ( ? )";
+
+const char *BEHOLDDB_DML_CENTRAL_LEAVE =
+	"delete from levels "
+	"where depth = ( select max(depth) from levels )";
+
+// scratch rows of one level mean nothing to the next
+const char *BEHOLDDB_DML_CENTRAL_CLEAR =
+	"delete from include;"
+	"delete from exclude;"
+	"delete from dirs_include;"
+	"delete from dirs_exclude;";
+
+// a connection is kept between operations: start over, and drop the
+// listing of the last directory reconciled
+const char *BEHOLDDB_DML_CENTRAL_RESET =
+	"delete from levels;"
+	"drop table if exists temp.fsck_fs;";
+
+// the entry of a directory renamed or moved takes its metadata along;
+// ?1, ?2: new parent and name, ?3, ?4: old ones
+const char *BEHOLDDB_DML_CENTRAL_MOVE_DIR =
+	"update or replace dirs set parent = ?1, name = ?2 "
+	"where parent = ?3 and name = ?4";
+
+const char *BEHOLDDB_DML_CENTRAL_DELETE_DIR =
+	"delete from dirs "
+	"where parent = ( select id from current_dir ) and name = ?";
+
+// every directory with its real path
+const char *BEHOLDDB_DML_CENTRAL_TREE =
+	"with recursive tree ( id, path ) as "
+	"( "
+		"select id, '.' from dirs where id = 1 "
+		"union all "
+		"select d.id, t.path || '/' || d.name from dirs d "
+		"join tree t on t.id = d.parent "
+	") "
+	"select id, path from tree";
+
+// migration between the two layouts, always with the central database
+// as main and the directory on top of levels; the other database is
+// attached as src or dst; tag ids differ, names do not
+const char *BEHOLDDB_DML_MIGRATE_IN =
+	"insert into files ( type, name ) "
+	"select type, name from src.files;"
+	"insert into tags ( name ) "
+	"select name from src.tags;"
+	"insert into files_tags ( id_file, id_tag ) "
+	"select f.id, t.id from src.files_tags sft "
+	"join src.files sf on sf.id = sft.id_file "
+	"join src.tags st on st.id = sft.id_tag "
+	"join files f on f.name = sf.name "
+	"join tags t on t.name = st.name;"
+	"insert into dirs_tags ( id_file, id_tag ) "
+	"select f.id, t.id from src.dirs_tags sdt "
+	"join src.files sf on sf.id = sdt.id_file "
+	"join src.tags st on st.id = sdt.id_tag "
+	"join files f on f.name = sf.name "
+	"join tags t on t.name = st.name;"
+	"insert into config ( param, value ) "
+	"select param, value from src.config "
+	"where param <> 'version';";
+
+const char *BEHOLDDB_DML_MIGRATE_OUT =
+	"insert into dst.files ( type, name ) "
+	"select type, name from files;"
+	"insert into dst.tags ( name ) "
+	"select name from tags;"
+	"insert into dst.files_tags ( id_file, id_tag ) "
+	"select df.id, dt.id from files_tags ft "
+	"join files f on f.id = ft.id_file "
+	"join tags t on t.id = ft.id_tag "
+	"join dst.files df on df.name = f.name "
+	"join dst.tags dt on dt.name = t.name;"
+	"insert into dst.dirs_tags ( id_file, id_tag ) "
+	"select df.id, dt.id from dirs_tags ddt "
+	"join files f on f.id = ddt.id_file "
+	"join tags t on t.id = ddt.id_tag "
+	"join dst.files df on df.name = f.name "
+	"join dst.tags dt on dt.name = t.name;"
+	"insert into dst.config ( param, value ) "
+	"select param, value from config "
+	"where param not in ( 'version', 'stamp' );";
+
+// the tree index of -o index: every file of the tree under the path of
+// its directory ("." or "./a/b"), with its own tags; directories are
+// only paths, and their entries are not indexed. index_dir_tags counts
+// the files of each directory by tag, so that whole subtrees without a
+// tag can be skipped; the triggers keep it along with the postings
+const char *BEHOLDDB_DDL_INDEX_CREATE =
+	"create table if not exists index_dirs "
+	"( "
+		"id integer primary key, "
+		"path text not null unique on conflict ignore "
+	");"
+	"create table if not exists index_files "
+	"( "
+		"id integer primary key, "
+		"id_dir integer not null references index_dirs ( id ) on delete cascade, "
+		"name text not null, "
+		"unique ( id_dir, name ) on conflict ignore "
+	");"
+	"create index if not exists index_files_name on index_files ( name );"
+	"create table if not exists index_tags "
+	"( "
+		"id integer primary key, "
+		"name text not null unique on conflict ignore, "
+		"refs integer not null default 0 "
+	");"
+	"create table if not exists index_postings "
+	"( "
+		"id_tag integer not null references index_tags ( id ), "
+		"id_file integer not null references index_files ( id ) on delete cascade, "
+		"primary key ( id_tag, id_file ) on conflict ignore "
+	") without rowid;"
+	"create index if not exists index_postings_file on index_postings ( id_file );"
+	"create table if not exists index_dir_tags "
+	"( "
+		"id_tag integer not null references index_tags ( id ), "
+		"id_dir integer not null references index_dirs ( id ) on delete cascade, "
+		"count integer not null, "
+		"primary key ( id_tag, id_dir ) "
+	") without rowid;"
+	"create index if not exists index_dir_tags_dir on index_dir_tags ( id_dir );"
+	// a row while mounted, see BEHOLDDB_DML_INDEX_DIRTY
+	"create table if not exists index_dirty "
+	"( "
+		"mounted integer not null "
+	");"
+	// the postings go first, while the file still tells the directory
+	"create trigger if not exists index_files_delete before delete on index_files "
+	"begin "
+		"delete from index_postings where id_file = old.id; "
+	"end;"
+	"create trigger if not exists index_postings_insert after insert on index_postings "
+	"begin "
+		"update index_tags set refs = refs + 1 where id = new.id_tag; "
+		"insert or ignore into index_dir_tags ( id_tag, id_dir, count ) "
+		"select new.id_tag, id_dir, 0 from index_files where id = new.id_file; "
+		"update index_dir_tags set count = count + 1 "
+		"where id_tag = new.id_tag "
+		"and id_dir = ( select id_dir from index_files where id = new.id_file ); "
+	"end;"
+	"create trigger if not exists index_postings_delete after delete on index_postings "
+	"begin "
+		"update index_tags set refs = refs - 1 where id = old.id_tag; "
+		"update index_dir_tags set count = count - 1 "
+		"where id_tag = old.id_tag "
+		"and id_dir = ( select id_dir from index_files where id = old.id_file ); "
+		"delete from index_dir_tags where id_tag = old.id_tag and count = 0; "
+	"end;"
+	"pragma user_version = 2;";
+
+// an index written by an older version is built again
+const char *BEHOLDDB_DML_INDEX_CURRENT =
+	"select 1 from pragma_user_version where user_version = 2";
+
+// the index is committed apart from the directory databases, so it is
+// marked dirty at mount and clean at unmount; one still dirty at mount
+// may have missed a change and is built again
+const char *BEHOLDDB_DML_INDEX_DIRTY =
+	"insert into index_dirty ( mounted ) "
+	"values ( strftime('%s', 'now') );";
+
+const char *BEHOLDDB_DML_INDEX_CLEAN =
+	"delete from index_dirty;";
+
+const char *BEHOLDDB_DML_INDEX_IS_DIRTY =
+	"select 1 from index_dirty";
+
+// keeping the index, attached as idx to a directory database, up to date
+// with one of its files: ?1 is the directory, ?2 the name
+const char *BEHOLDDB_DML_INDEX_FILE =
+	"insert into idx.index_dirs ( path ) values ( ?1 );"
+	"delete from idx.index_files "
+	"where name = ?2 "
+	"and id_dir = ( select id from idx.index_dirs where path = ?1 ) "
+	"and not exists ( select 1 from main.files where name = ?2 and not type );"
+	"insert into idx.index_files ( id_dir, name ) "
+	"select d.id, f.name from main.files f "
+	"join idx.index_dirs d on d.path = ?1 "
+	"where f.name = ?2 and not f.type;"
+	"insert into idx.index_tags ( name ) "
+	"select t.name from main.files f "
+	"join main.files_tags ft on ft.id_file = f.id "
+	"join main.tags t on t.id = ft.id_tag "
+	"where f.name = ?2 and not f.type;"
+	"delete from idx.index_postings "
+	"where id_file = "
+	"( "
+		"select x.id from idx.index_files x "
+		"join idx.index_dirs d on d.id = x.id_dir "
+		"where d.path = ?1 and x.name = ?2 "
+	");"
+	"insert into idx.index_postings ( id_tag, id_file ) "
+	"select it.id, x.id from main.files f "
+	"join main.files_tags ft on ft.id_file = f.id "
+	"join main.tags t on t.id = ft.id_tag "
+	"join idx.index_tags it on it.name = t.name "
+	"join idx.index_dirs d on d.path = ?1 "
+	"join idx.index_files x on x.id_dir = d.id and x.name = f.name "
+	"where f.name = ?2 and not f.type;";
+
+// the same for every file of the directory ?1
+const char *BEHOLDDB_DML_INDEX_DIR =
+	"insert into idx.index_dirs ( path ) values ( ?1 );"
+	"delete from idx.index_files "
+	"where id_dir = ( select id from idx.index_dirs where path = ?1 ) "
+	"and name not in ( select name from main.files where not type );"
+	"insert into idx.index_files ( id_dir, name ) "
+	"select d.id, f.name from main.files f "
+	"join idx.index_dirs d on d.path = ?1 "
+	"where not f.type;"
+	"insert into idx.index_tags ( name ) "
+	"select name from main.tags;"
+	"delete from idx.index_postings "
+	"where id_file in "
+	"( "
+		"select x.id from idx.index_files x "
+		"join idx.index_dirs d on d.id = x.id_dir "
+		"where d.path = ?1 "
+	");"
+	"insert into idx.index_postings ( id_tag, id_file ) "
+	"select it.id, x.id from main.files f "
+	"join main.files_tags ft on ft.id_file = f.id "
+	"join main.tags t on t.id = ft.id_tag "
+	"join idx.index_tags it on it.name = t.name "
+	"join idx.index_dirs d on d.path = ?1 "
+	"join idx.index_files x on x.id_dir = d.id and x.name = f.name "
+	"where not f.type;";
+
+// a file renamed in place keeps its id, and so the name of its entry in
+// deep views; ?3 is the new name
+const char *BEHOLDDB_DML_INDEX_RENAME =
+	"update idx.index_files set name = ?3 "
+	"where name = ?2 "
+	"and id_dir = ( select id from idx.index_dirs where path = ?1 );";
+
+// a file or directory ?2 of the directory ?1 is gone, with everything
+// below it
+const char *BEHOLDDB_DML_INDEX_REMOVE =
+	"delete from idx.index_files "
+	"where name = ?2 "
+	"and id_dir = ( select id from idx.index_dirs where path = ?1 );"
+	"delete from idx.index_dirs "
+	"where path = ?1 || '/' || ?2 "
+	"or path > ?1 || '/' || ?2 || '/' and path < ?1 || '/' || ?2 || '0';";
+
+// a directory moved from ?1 to ?2, on the index itself ('0' follows '/')
+const char *BEHOLDDB_DML_INDEX_MOVE =
+	"update or replace index_dirs set path = ?2 || substr ( path, length ( ?1 ) + 1 ) "
+	"where path = ?1 "
+	"or path > ?1 || '/' and path < ?1 || '0';";
+
+// a directory read into a table of its own connection, so that only
+// BEHOLDDB_DML_INDEX_STORE has to wait for the index (beholdfs-index)
+const char *BEHOLDDB_DDL_INDEX_LOAD =
+	"create temp table index_load as "
+	"select f.name file, t.name tag from main.files f "
+	"left join main.files_tags ft on ft.id_file = f.id "
+	"left join main.tags t on t.id = ft.id_tag "
+	"where not f.type;";
+
+// the table into a new index, as the directory ?1
+const char *BEHOLDDB_DML_INDEX_STORE =
+	"insert into idx.index_dirs ( path ) values ( ?1 );"
+	"insert into idx.index_files ( id_dir, name ) "
+	"select distinct d.id, l.file from temp.index_load l "
+	"join idx.index_dirs d on d.path = ?1;"
+	"insert into idx.index_tags ( name ) "
+	"select distinct tag from temp.index_load where tag is not null;"
+	"insert into idx.index_postings ( id_tag, id_file ) "
+	"select t.id, f.id from temp.index_load l "
+	"join idx.index_tags t on t.name = l.tag "
+	"join idx.index_dirs d on d.path = ?1 "
+	"join idx.index_files f on f.id_dir = d.id and f.name = l.file;"
+	"drop table temp.index_load;";
+
+const char *BEHOLDDB_DML_ATTACH_INDEX =
+	"attach database ? as idx";
+
+// the directories with metadata below the current one, for the first
+// build of the index
+const char *BEHOLDDB_DML_INDEX_WALK =
+	"select dir from sqlitefs "
+	"where path = '.' and depth >= 0 and name = '.beholdfs' and not type";
+
+// the tags of a deep view, by name
+const char *BEHOLDDB_DDL_DEEP =
+	"create temp table if not exists deep_include ( name text primary key on conflict ignore );"
+	"create temp table if not exists deep_exclude ( name text primary key on conflict ignore );"
+	"delete from deep_include;"
+	"delete from deep_exclude;";
+
+const char *BEHOLDDB_DML_DEEP_INCLUDE =
+	"insert into deep_include ( name ) values ( ? )";
+
+const char *BEHOLDDB_DML_DEEP_EXCLUDE =
+	"insert into deep_exclude ( name ) values ( ? )";
+
+// the files of a deep view of the directory ?1 (as matches): the tag of
+// the view with the fewest files below ?1 is looked up, and only the
+// directories that have files with it are visited
+#define BEHOLDDB_DEEP_BELOW(path) \
+	"( " path " = ?1 or " path " > ?1 || '/' and " path " < ?1 || '0' ) "
+
+#define BEHOLDDB_DEEP_MATCHES \
+	"with seed ( id ) as " \
+	"( " \
+		"select t.id from deep_include i " \
+		"left join index_tags t on t.name = i.name " \
+		"order by coalesce ( " \
+		"( " \
+			"select sum ( dt.count ) from index_dir_tags dt " \
+			"join index_dirs d on d.id = dt.id_dir " \
+			"where dt.id_tag = t.id and " BEHOLDDB_DEEP_BELOW("d.path") \
+		"), 0 ) " \
+		"limit 1 " \
+	"), " \
+	"dirs ( id ) as " \
+	"( " \
+		"select d.id from seed " \
+		"join index_dir_tags dt on dt.id_tag = seed.id " \
+		"join index_dirs d on d.id = dt.id_dir " \
+		"where " BEHOLDDB_DEEP_BELOW("d.path") \
+		"union all " \
+		"select d.id from index_dirs d " \
+		"where not exists ( select 1 from deep_include ) " \
+		"and " BEHOLDDB_DEEP_BELOW("d.path") \
+	"), " \
+	"matches ( id, name ) as " \
+	"( " \
+		"select f.id, f.name from dirs " \
+		"join index_files f on f.id_dir = dirs.id " \
+		"where not exists " \
+		"( " \
+			"select 1 from deep_include i " \
+			"where not exists " \
+			"( " \
+				"select 1 from index_tags t " \
+				"join index_postings p on p.id_tag = t.id " \
+				"where t.name = i.name and p.id_file = f.id " \
+			") " \
+		") " \
+		"and not exists " \
+		"( " \
+			"select 1 from deep_exclude e " \
+			"join index_tags t on t.name = e.name " \
+			"join index_postings p on p.id_tag = t.id " \
+			"where p.id_file = f.id " \
+		") " \
+	") "
+
+// the entries of a deep view, after the file with id ?3: a file goes by
+// its name unless another one in the view has it too, then by ?2 (the
+// tag character), its id, ?2 and the name
+#define BEHOLDDB_DEEP_ENTRIES \
+	"select entry, id from " \
+	"( " \
+		"select case when count(*) over ( partition by name ) > 1 " \
+			"then ?2 || id || ?2 || name else name end entry, id " \
+		"from matches " \
+	") " \
+	"where id > ?3 " \
+	"order by id"
+
+const char *BEHOLDDB_DML_DEEP_LISTING =
+	BEHOLDDB_DEEP_MATCHES
+	BEHOLDDB_DEEP_ENTRIES;
+
+// the other tags of the files of a deep view, after the tag with id ?3;
+// with no tags in the view, the counts by directory are enough
+const char *BEHOLDDB_DML_DEEP_TAG_LISTING =
+	BEHOLDDB_DEEP_MATCHES
+	"select t.name, t.id from index_tags t "
+	"where t.id > ?3 "
+	"and t.name not in ( select name from deep_include ) "
+	"and t.name not in ( select name from deep_exclude ) "
+	"and t.id in "
+	"( "
+		"select dt.id_tag from index_dirs d "
+		"join index_dir_tags dt on dt.id_dir = d.id "
+		"where not exists ( select 1 from deep_include ) "
+		"and not exists ( select 1 from deep_exclude ) "
+		"and " BEHOLDDB_DEEP_BELOW("d.path")
+		"union all "
+		"select p.id_tag from matches m "
+		"join index_postings p on p.id_file = m.id "
+		"where exists ( select 1 from deep_include ) "
+		"or exists ( select 1 from deep_exclude ) "
+	") "
+	"order by t.id";
+
+// where the file ?2 (with the id ?3, if given) of a deep view of ?1
+// is, relative to ?1
+const char *BEHOLDDB_DML_DEEP_LOOKUP =
+	"select substr ( d.path || '/', length ( ?1 ) + 2 ) || f.name "
+	"from index_files f "
+	"join index_dirs d on d.id = f.id_dir "
+	"where f.name = ?2 and ( ?3 is null or f.id = ?3 ) "
+	"and " BEHOLDDB_DEEP_BELOW("d.path")
+	"and not exists "
+	"( "
+		"select 1 from deep_include i "
+		"where not exists "
+		"( "
+			"select 1 from index_tags t "
+			"join index_postings p on p.id_tag = t.id "
+			"where t.name = i.name and p.id_file = f.id "
+		") "
+	") "
+	"and not exists "
+	"( "
+		"select 1 from deep_exclude e "
+		"join index_tags t on t.name = e.name "
+		"join index_postings p on p.id_tag = t.id "
+		"where p.id_file = f.id "
+	") "
+	"limit 2";
+
+// the same on the central database, where the directories below ?1 (an
+// id) are found through dirs; tag ids are per directory, so all_tags
+// tells the directories that have the first tag of the view
+#define BEHOLDDB_DEEP_CENTRAL_MATCHES \
+	"with recursive below ( id ) as " \
+	"( " \
+		"select ?1 " \
+		"union all " \
+		"select d.id from dirs d " \
+		"join below b on d.parent = b.id " \
+	"), " \
+	"candidates ( id ) as " \
+	"( " \
+		"select ft.id_file from below b " \
+		"join all_tags t on t.id_dir = b.id " \
+		"and t.name = ( select name from deep_include limit 1 ) " \
+		"join all_files_tags ft on ft.id_tag = t.id " \
+		"union all " \
+		"select f.id from below b " \
+		"join all_files f on f.id_dir = b.id " \
+		"where not exists ( select 1 from deep_include ) " \
+	"), " \
+	"matches ( id, name ) as " \
+	"( " \
+		"select f.id, f.name from candidates c " \
+		"join all_files f on f.id = c.id " \
+		"where not f.type " \
+		"and not exists " \
+		"( " \
+			"select 1 from deep_include i " \
+			"where not exists " \
+			"( " \
+				"select 1 from all_files_tags ft " \
+				"join all_tags t on t.id = ft.id_tag " \
+				"where ft.id_file = f.id and t.name = i.name " \
+			") " \
+		") " \
+		"and not exists " \
+		"( " \
+			"select 1 from deep_exclude e " \
+			"join all_tags t on t.id_dir = f.id_dir and t.name = e.name " \
+			"join all_files_tags ft on ft.id_tag = t.id " \
+			"where ft.id_file = f.id " \
+		") " \
+	") "
+
+const char *BEHOLDDB_DML_DEEP_CENTRAL_LISTING =
+	BEHOLDDB_DEEP_CENTRAL_MATCHES
+	BEHOLDDB_DEEP_ENTRIES;
+
+// tag ids are not shared between directories; the listing goes by the
+// smallest of each name
+const char *BEHOLDDB_DML_DEEP_CENTRAL_TAG_LISTING =
+	BEHOLDDB_DEEP_CENTRAL_MATCHES
+	"select t.name, min ( t.id ) id from matches m "
+	"join all_files_tags ft on ft.id_file = m.id "
+	"join all_tags t on t.id = ft.id_tag "
+	"where t.name not in ( select name from deep_include ) "
+	"and t.name not in ( select name from deep_exclude ) "
+	"group by t.name "
+	"having min ( t.id ) > ?3 "
+	"order by id";
+
+// the path is put together walking up from the file to ?1
+#define BEHOLDDB_DEEP_CENTRAL_UP \
+	"with recursive up ( id_file, id, path ) as " \
+	"( " \
+		"select f.id, f.id_dir, f.name from all_files f " \
+		"where f.name = ?2 and ( ?3 is null or f.id = ?3 ) and not f.type " \
+		"union all " \
+		"select u.id_file, d.parent, d.name || '/' || u.path from up u " \
+		"join dirs d on d.id = u.id " \
+		"where u.id <> ?1 and d.parent is not null " \
+	") "
+
+const char *BEHOLDDB_DML_DEEP_CENTRAL_LOOKUP =
+	BEHOLDDB_DEEP_CENTRAL_UP
+	"select u.path from up u "
+	"where u.id = ?1 "
+	"and not exists "
+	"( "
+		"select 1 from deep_include i "
+		"where not exists "
+		"( "
+			"select 1 from all_files_tags ft "
+			"join all_tags t on t.id = ft.id_tag "
+			"where ft.id_file = u.id_file and t.name = i.name "
+		") "
+	") "
+	"and not exists "
+	"( "
+		"select 1 from deep_exclude e "
+		"join all_files_tags ft on ft.id_file = u.id_file "
+		"join all_tags t on t.id = ft.id_tag and t.name = e.name "
+	") "
+	"limit 2";
+
+// deep views with alternatives; the plan runs on the whole index, the
+// directory is applied to what it selects
+const tagexpr_dialect BEHOLDDB_DIALECT_INDEX =
+{
+	'I',
+	"select id from index_files",
+	"select p.id_file from index_tags t "
+	"join index_postings p on p.id_tag = t.id "
+	"where t.name %2$s ?%1$d",
+	"select p.id_file from index_tags t "
+	"join index_postings p on p.id_tag = t.id "
+	"where t.name %2$s ?%1$d",
+	"exists ( "
+		"select 1 from index_tags t "
+		"join index_postings p on p.id_tag = t.id "
+		"where t.name %2$s ?%1$d and p.id_file = f.id )",
+	"exists ( "
+		"select 1 from index_tags t "
+		"join index_postings p on p.id_tag = t.id "
+		"where t.name %2$s ?%1$d and p.id_file = f.id )"
+};
+
+#define BEHOLDDB_DEEP_EXPRESSION_MATCHES \
+	"with matches ( id, name ) as " \
+	"( " \
+		"select f.id, f.name from expression_files e " \
+		"join index_files f on f.id = e.id " \
+		"join index_dirs d on d.id = f.id_dir " \
+		"where " BEHOLDDB_DEEP_BELOW("d.path") \
+	") "
+
+const char *BEHOLDDB_DML_DEEP_EXPRESSION_LISTING =
+	BEHOLDDB_DEEP_EXPRESSION_MATCHES
+	BEHOLDDB_DEEP_ENTRIES;
+
+const char *BEHOLDDB_DML_DEEP_EXPRESSION_TAG_LISTING =
+	BEHOLDDB_DEEP_EXPRESSION_MATCHES
+	"select t.name, t.id from index_tags t "
+	"where t.id > ?3 "
+	"and t.name not in ( select name from expression_tags ) "
+	"and t.id in "
+	"( "
+		"select p.id_tag from matches m "
+		"join index_postings p on p.id_file = m.id "
+	") "
+	"order by t.id";
+
+const char *BEHOLDDB_DML_DEEP_EXPRESSION_LOOKUP =
+	"select substr ( d.path || '/', length ( ?1 ) + 2 ) || f.name "
+	"from index_files f "
+	"join index_dirs d on d.id = f.id_dir "
+	"where f.name = ?2 and ( ?3 is null or f.id = ?3 ) "
+	"and " BEHOLDDB_DEEP_BELOW("d.path")
+	"and ";
+
+// in central mode the plan is limited to the files below ?1 from the
+// start, tags being looked up by directory
+const tagexpr_dialect BEHOLDDB_DIALECT_CENTRAL =
+{
+	'C',
+	"select f.id from expression_below b "
+	"join all_files f on f.id_dir = b.id "
+	"where not f.type",
+	"select ft.id_file from expression_below b "
+	"join all_tags t on t.id_dir = b.id and t.name %2$s ?%1$d "
+	"join all_files_tags ft on ft.id_tag = t.id",
+	"select ft.id_file from expression_below b "
+	"join all_tags t on t.id_dir = b.id and t.name %2$s ?%1$d "
+	"join all_files_tags ft on ft.id_tag = t.id",
+	"exists ( "
+		"select 1 from all_tags t "
+		"join all_files_tags ft on ft.id_tag = t.id "
+		"where t.id_dir = f.id_dir and t.name %2$s ?%1$d and ft.id_file = f.id )",
+	"exists ( "
+		"select 1 from all_tags t "
+		"join all_files_tags ft on ft.id_tag = t.id "
+		"where t.id_dir = f.id_dir and t.name %2$s ?%1$d and ft.id_file = f.id )"
+};
+
+const char *BEHOLDDB_DDL_EXPRESSION_BELOW =
+	"create temp table if not exists expression_below ( id integer primary key );"
+	"delete from expression_below;";
+
+const char *BEHOLDDB_DML_EXPRESSION_BELOW =
+	"with recursive below ( id ) as "
+	"( "
+		"select ?1 "
+		"union all "
+		"select d.id from dirs d "
+		"join below b on d.parent = b.id "
+	") "
+	"insert into expression_below "
+	"select id from below";
+
+#define BEHOLDDB_DEEP_CENTRAL_EXPRESSION_MATCHES \
+	"with matches ( id, name ) as " \
+	"( " \
+		"select f.id, f.name from expression_files e " \
+		"join all_files f on f.id = e.id " \
+		"where not f.type " \
+	") "
+
+const char *BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_LISTING =
+	BEHOLDDB_DEEP_CENTRAL_EXPRESSION_MATCHES
+	BEHOLDDB_DEEP_ENTRIES;
+
+const char *BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_TAG_LISTING =
+	BEHOLDDB_DEEP_CENTRAL_EXPRESSION_MATCHES
+	"select t.name, min ( t.id ) id from matches m "
+	"join all_files_tags ft on ft.id_file = m.id "
+	"join all_tags t on t.id = ft.id_tag "
+	"where t.name not in ( select name from expression_tags ) "
+	"group by t.name "
+	"having min ( t.id ) > ?3 "
+	"order by id";
+
+const char *BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_LOOKUP =
+	BEHOLDDB_DEEP_CENTRAL_UP
+	"select u.path from up u "
+	"join all_files f on f.id = u.id_file "
+	"where u.id = ?1 and ";
+
 const char *BEHOLDDB_DDL_CREATE_CONFIG =
 	"create table if not exists config "
 	"( "
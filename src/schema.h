@@ -20,12 +20,155 @@
 #ifndef __SCHEMA_H__
 #define __SCHEMA_H__
 
+#include <sqlite3.h>
+
+#include "tagexpr.h"
+
+extern const char *BEHOLDDB_DDL_CREATE_TABLES;
+extern const char *BEHOLDDB_DDL_CREATE_INDEXES;
+extern const char *BEHOLDDB_DDL_CREATE_TRIGGERS;
+extern const char *BEHOLDDB_DDL_UPGRADE_1_1;
+extern const char *BEHOLDDB_DDL_FILES_TAGS;
+extern const char *BEHOLDDB_DDL_DIRS_TAGS;
 extern const char *BEHOLDDB_DML_LOCATE;
 extern const char *BEHOLDDB_DDL_FAST_LOCATE_START;
 extern const char *BEHOLDDB_DML_FAST_LOCATE;
 extern const char *BEHOLDDB_DDL_FAST_LOCATE_STOP;
 extern const char *BEHOLDDB_DML_TAG_LISTING;
+extern const char *BEHOLDDB_DML_TAG_LISTING_FROM;
+extern const char *BEHOLDDB_DML_PREFIX_TAG_LISTING;
+extern const char *BEHOLDDB_DML_PREFIX_TAG_LISTING_FROM;
 extern const char *BEHOLDDB_DML_FILE_TAG_LISTING;
+extern const char *BEHOLDDB_DML_MARK_INCLUDE;
+extern const char *BEHOLDDB_DML_MARK_EXCLUDE;
+extern const char *BEHOLDDB_DML_MARK_DIRS_INCLUDE;
+extern const char *BEHOLDDB_DML_MARK_DIRS_EXCLUDE;
+extern const char *BEHOLDDB_DML_UNUSED_TAGS;
+extern const char *BEHOLDDB_DML_UNIVERSAL_TAGS;
+extern const char *BEHOLDDB_DML_CREATE_INCLUDE;
+extern const char *BEHOLDDB_DML_CREATE_EXCLUDE;
+extern const char *BEHOLDDB_DML_RETAG_REPLACE;
+extern const char *BEHOLDDB_DML_RETAG_INCLUDE;
+extern const char *BEHOLDDB_DML_RETAG_EXCLUDE;
+extern const char *BEHOLDDB_DML_RETAG_CHANGED;
+extern const char *BEHOLDDB_DML_RETAG_USED;
+extern const char *BEHOLDDB_DML_RETAG_NOT_UNIVERSAL;
+extern const char *BEHOLDDB_DML_RETAG_UNUSED_TAGS;
+extern const char *BEHOLDDB_DML_DELETE_FILE;
+extern const char *BEHOLDDB_DML_DELETE_UNUSED_TAGS;
+extern const char *BEHOLDDB_DML_RESET_FILES_TAGS;
+extern const char *BEHOLDDB_DDL_BATCH;
+extern const char *BEHOLDDB_DML_BATCH_BEGIN;
+extern const char *BEHOLDDB_DML_BATCH_RELEASE;
+extern const char *BEHOLDDB_DML_BATCH_UNDO;
+extern const char *BEHOLDDB_DML_BATCH_TOUCH;
+extern const char *BEHOLDDB_DML_BATCH_USED;
+extern const char *BEHOLDDB_DML_BATCH_UNUSED;
+extern const char *BEHOLDDB_DML_BATCH_UNIVERSAL;
+extern const char *BEHOLDDB_DML_BATCH_NOT_UNIVERSAL;
+extern const char *BEHOLDDB_DML_ATTACH_SOURCE;
+extern const char *BEHOLDDB_DML_DETACH_SOURCE;
+extern const char *BEHOLDDB_DML_MOVE_TAGS;
+extern const char *BEHOLDDB_DML_MOVE_INCLUDE;
+extern const char *BEHOLDDB_DML_MOVE_DIRS_INCLUDE;
+extern const char *BEHOLDDB_DML_MOVE_DELETE;
+extern const char *BEHOLDDB_DML_MOVE_UNUSED_TAGS;
+extern const char *BEHOLDDB_DML_MOVE_UNIVERSAL_TAGS;
+extern const char *BEHOLDDB_DML_MOVE_DELETE_UNUSED_TAGS;
+extern const char *BEHOLDDB_DML_MOVE_STAMP;
+extern const char *BEHOLDDB_DDL_CREATE_INTENTS;
+extern const char *BEHOLDDB_DML_INTENT_BEGIN;
+extern const char *BEHOLDDB_DML_INTENT_END;
+extern const char *BEHOLDDB_DML_INTENT_LIST;
+extern const char *BEHOLDDB_DML_INTENT_CLEAR;
+extern const char *BEHOLDDB_DML_ATTACH_INTENTS;
+extern const char *BEHOLDDB_DML_DETACH_INTENTS;
+extern const char *BEHOLDDB_DML_INTENT_MARK;
+extern const char *BEHOLDDB_DML_INTENT_MARKS;
+extern const char *BEHOLDDB_DDL_CREATE_RULES;
+extern const char *BEHOLDDB_DML_RULE_ADD;
+extern const char *BEHOLDDB_DML_RULE_REMOVE;
+extern const char *BEHOLDDB_DML_RULE_LIST;
+extern const char *BEHOLDDB_DML_RULE_CLOSURE;
+extern const char *BEHOLDDB_DML_IMPORT_EXISTING;
+extern const char *BEHOLDDB_DML_IMPORT_CLEAR;
+extern const char *BEHOLDDB_DML_IMPORT_FILE;
+extern const char *BEHOLDDB_DML_IMPORT_TAG;
+extern const char *BEHOLDDB_DML_IMPORT_FILES_TAG;
+extern const char *BEHOLDDB_DML_IMPORT_DIRS_TAG;
+extern const char *BEHOLDDB_DDL_FSCK_START;
+extern const char *BEHOLDDB_DML_FSCK_ORPHANS;
+extern const char *BEHOLDDB_DML_FSCK_UNTRACKED;
+extern const char *BEHOLDDB_DML_FSCK_DIR;
+extern const char *BEHOLDDB_DML_FSCK_FILES_TAGS;
+extern const char *BEHOLDDB_DML_FSCK_DIRS_TAGS;
+extern const char *BEHOLDDB_DML_FSCK_CLEAR_FILES_TAGS;
+extern const char *BEHOLDDB_DML_FSCK_CLEAR_DIRS_TAGS;
+extern const char *BEHOLDDB_DML_FSCK_COUNTERS;
+extern const char *BEHOLDDB_DML_FSCK_SUMMARY;
+extern const char *BEHOLDDB_DML_FSCK_UNUSED_TAGS;
+extern const char *BEHOLDDB_DML_FSCK_WEAK;
+extern const char *BEHOLDDB_DML_FSCK_STRONG;
+extern const char *BEHOLDDB_DML_RECONCILE_UNUSED;
+extern const char *BEHOLDDB_DML_RECONCILE_NOT_UNIVERSAL;
+extern const char *BEHOLDDB_DDL_CENTRAL_CREATE_TABLES;
+extern const char *BEHOLDDB_DDL_CENTRAL_CREATE_INDEXES;
+extern const char *BEHOLDDB_DDL_CENTRAL_CREATE_TRIGGERS;
+extern const char *BEHOLDDB_DDL_CENTRAL_VIEWS;
+extern const char *BEHOLDDB_DML_CENTRAL_LOOKUP;
+extern const char *BEHOLDDB_DML_CENTRAL_MKDIR;
+extern const char *BEHOLDDB_DML_CENTRAL_ENTER;
+extern const char *BEHOLDDB_DML_CENTRAL_LEAVE;
+extern const char *BEHOLDDB_DML_CENTRAL_CLEAR;
+extern const char *BEHOLDDB_DML_CENTRAL_RESET;
+extern const char *BEHOLDDB_DML_CENTRAL_MOVE_DIR;
+extern const char *BEHOLDDB_DML_CENTRAL_DELETE_DIR;
+extern const char *BEHOLDDB_DML_CENTRAL_TREE;
+extern const char *BEHOLDDB_DDL_INDEX_CREATE;
+extern const char *BEHOLDDB_DML_INDEX_CURRENT;
+extern const char *BEHOLDDB_DML_INDEX_DIRTY;
+extern const char *BEHOLDDB_DML_INDEX_CLEAN;
+extern const char *BEHOLDDB_DML_INDEX_IS_DIRTY;
+extern const char *BEHOLDDB_DML_INDEX_FILE;
+extern const char *BEHOLDDB_DML_INDEX_DIR;
+extern const char *BEHOLDDB_DML_INDEX_RENAME;
+extern const char *BEHOLDDB_DML_INDEX_REMOVE;
+extern const char *BEHOLDDB_DML_INDEX_MOVE;
+extern const char *BEHOLDDB_DDL_INDEX_LOAD;
+extern const char *BEHOLDDB_DML_INDEX_STORE;
+extern const char *BEHOLDDB_DML_ATTACH_INDEX;
+extern const char *BEHOLDDB_DML_INDEX_WALK;
+extern const char *BEHOLDDB_DDL_DEEP;
+extern const char *BEHOLDDB_DML_DEEP_INCLUDE;
+extern const char *BEHOLDDB_DML_DEEP_EXCLUDE;
+extern const char *BEHOLDDB_DML_DEEP_LISTING;
+extern const char *BEHOLDDB_DML_DEEP_TAG_LISTING;
+extern const char *BEHOLDDB_DML_DEEP_LOOKUP;
+extern const char *BEHOLDDB_DML_DEEP_CENTRAL_LISTING;
+extern const char *BEHOLDDB_DML_DEEP_CENTRAL_TAG_LISTING;
+extern const char *BEHOLDDB_DML_DEEP_CENTRAL_LOOKUP;
+extern const tagexpr_dialect BEHOLDDB_DIALECT_DIR;
+extern const tagexpr_dialect BEHOLDDB_DIALECT_INDEX;
+extern const tagexpr_dialect BEHOLDDB_DIALECT_CENTRAL;
+extern const char *BEHOLDDB_DDL_EXPRESSION;
+extern const char *BEHOLDDB_DML_EXPRESSION_FILES;
+extern const char *BEHOLDDB_DML_EXPRESSION_TAG;
+extern const char *BEHOLDDB_DML_EXPRESSION_LOCATE;
+extern const char *BEHOLDDB_DDL_EXPRESSION_FAST_LOCATE_START;
+extern const char *BEHOLDDB_DML_EXPRESSION_TAG_LISTING;
+extern const char *BEHOLDDB_DML_EXPRESSION_TAG_LISTING_FROM;
+extern const char *BEHOLDDB_DML_DEEP_EXPRESSION_LISTING;
+extern const char *BEHOLDDB_DML_DEEP_EXPRESSION_TAG_LISTING;
+extern const char *BEHOLDDB_DML_DEEP_EXPRESSION_LOOKUP;
+extern const char *BEHOLDDB_DDL_EXPRESSION_BELOW;
+extern const char *BEHOLDDB_DML_EXPRESSION_BELOW;
+extern const char *BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_LISTING;
+extern const char *BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_TAG_LISTING;
+extern const char *BEHOLDDB_DML_DEEP_CENTRAL_EXPRESSION_LOOKUP;
+extern const char *BEHOLDDB_DML_MIGRATE_IN;
+extern const char *BEHOLDDB_DML_MIGRATE_OUT;
+
+int schema_version_init(sqlite3 *db);
 
 #endif // __SCHEMA_H__
 
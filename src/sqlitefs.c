@@ -2,6 +2,7 @@
 SQLITE_EXTENSION_INIT1
 
 #include "fs.h"
+#include "tree.h"
 
 /*
  * SQLite invokes this routine once when it loads the extension.
@@ -14,8 +15,10 @@ int sqlite3_extension_init(
 	char **pzErrMsg,
 	const sqlite3_api_routines *pApi)
 {
+	int rc;
+
 	SQLITE_EXTENSION_INIT2(pApi)
-	fs_create_module(db, "/");
-	return 0;
+	(rc = fs_create_module(db, "/")) ||
+	(rc = tree_create_module(db));
+	return rc;
 }
-
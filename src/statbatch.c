@@ -0,0 +1,302 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "log.h"
+#include "statbatch.h"
+
+struct statbatch
+{
+	unsigned depth;
+
+	// entries of the current batch in directory order
+	statbatch_entry *entries;
+	size_t *names;
+	char *done;
+	unsigned count, submitted, head;
+	unsigned inflight;
+
+	// names of the current batch
+	char *arena;
+	size_t arena_size, arena_used;
+
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	struct statx *stx;
+	int uring; // 1 - ring is ready, 0 - not yet, -1 - unavailable
+#endif
+};
+
+int statbatch_init(statbatch **pbatch, unsigned depth)
+{
+	statbatch *batch = (statbatch*)malloc(sizeof(statbatch));
+
+	if (!depth)
+		depth = 1;
+	memset(batch, 0, sizeof(statbatch));
+	batch->depth = depth;
+	batch->entries = (statbatch_entry*)malloc(depth * sizeof(statbatch_entry));
+	batch->names = (size_t*)malloc(depth * sizeof(size_t));
+	batch->done = (char*)malloc(depth);
+	batch->arena_size = depth * 32;
+	batch->arena = (char*)malloc(batch->arena_size);
+
+#ifdef HAVE_LIBURING
+	// the ring is set up on the first batch that needs it
+	batch->uring = depth > 1 ? 0 : -1;
+	batch->stx = NULL;
+#endif
+
+	*pbatch = batch;
+	return STATBATCH_OK;
+}
+
+#ifdef HAVE_LIBURING
+
+static int statbatch_uring(statbatch *batch)
+{
+	int rc;
+
+	if (batch->uring)
+		return batch->uring > 0;
+
+	if ((rc = io_uring_queue_init(batch->depth, &batch->ring, 0)))
+	{
+		syslog(LOG_INFO, "statbatch: io_uring is not available (%d), using fstatat", rc);
+		batch->uring = -1;
+		return 0;
+	}
+	batch->stx = (struct statx*)malloc(batch->depth * sizeof(struct statx));
+	batch->uring = 1;
+	return 1;
+}
+
+static void statbatch_statx(struct stat *st, const struct statx *stx)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static int statbatch_reap(statbatch *batch, int wait)
+{
+	struct io_uring_cqe *cqe;
+	int rc;
+
+	if (wait)
+		rc = io_uring_wait_cqe(&batch->ring, &cqe); else
+		rc = io_uring_peek_cqe(&batch->ring, &cqe);
+
+	while (!rc && cqe)
+	{
+		unsigned i = (unsigned)(uintptr_t)io_uring_cqe_get_data(cqe);
+		statbatch_entry *entry = &batch->entries[i];
+
+		if ((entry->ret = cqe->res < 0 ? cqe->res : 0))
+			log_debug("statbatch: statx(%s) failed (%d)", entry->name, entry->ret); else
+			statbatch_statx(&entry->stat, &batch->stx[i]);
+		io_uring_cqe_seen(&batch->ring, cqe);
+		--batch->inflight;
+		batch->done[i] = 1;
+
+		rc = io_uring_peek_cqe(&batch->ring, &cqe);
+	}
+	return -EAGAIN == rc ? 0 : rc;
+}
+
+#endif
+
+void statbatch_reset(statbatch *batch)
+{
+#ifdef HAVE_LIBURING
+	// do not let the kernel write into memory that is reused or freed
+	while (batch->inflight && !statbatch_reap(batch, 1))
+		;
+#endif
+
+	batch->count = batch->submitted = batch->head = 0;
+	batch->arena_used = 0;
+}
+
+void statbatch_free(statbatch *batch)
+{
+	if (!batch)
+		return;
+
+	statbatch_reset(batch);
+
+#ifdef HAVE_LIBURING
+	if (batch->uring > 0)
+		io_uring_queue_exit(&batch->ring);
+	free(batch->stx);
+#endif
+
+	free(batch->entries);
+	free(batch->names);
+	free(batch->done);
+	free(batch->arena);
+	free(batch);
+}
+
+int statbatch_full(const statbatch *batch)
+{
+	return batch->submitted || batch->count >= batch->depth;
+}
+
+int statbatch_add(statbatch *batch, const char *name, int64_t offset)
+{
+	if (statbatch_full(batch))
+		return STATBATCH_EMPTY;
+
+	size_t len = strlen(name) + 1;
+
+	if (batch->arena_used + len > batch->arena_size)
+	{
+		while (batch->arena_used + len > batch->arena_size)
+			batch->arena_size *= 2;
+		batch->arena = (char*)realloc(batch->arena, batch->arena_size);
+	}
+	memcpy(batch->arena + batch->arena_used, name, len);
+	batch->entries[batch->count].offset = offset;
+	batch->done[batch->count] = 0;
+	batch->names[batch->count++] = batch->arena_used;
+	batch->arena_used += len;
+	return STATBATCH_OK;
+}
+
+static void statbatch_submit_sync(statbatch *batch, int dirfd, unsigned first)
+{
+	for (unsigned i = first; i < batch->count; ++i)
+	{
+		statbatch_entry *entry = &batch->entries[i];
+
+		entry->ret = fstatat(dirfd, entry->name, &entry->stat, AT_SYMLINK_NOFOLLOW) ? -errno : 0;
+		batch->done[i] = 1;
+	}
+}
+
+int statbatch_submit(statbatch *batch, int dirfd)
+{
+	if (batch->submitted || !batch->count)
+		return 0;
+
+	for (unsigned i = 0; i < batch->count; ++i)
+		batch->entries[i].name = batch->arena + batch->names[i];
+	batch->submitted = batch->count;
+
+#ifdef HAVE_LIBURING
+	// a single entry is not worth a round trip through the ring
+	if (batch->count > 1 && statbatch_uring(batch))
+	{
+		unsigned i;
+
+		for (i = 0; i < batch->count; ++i)
+		{
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&batch->ring);
+
+			if (!sqe)
+				break;
+			io_uring_prep_statx(sqe, dirfd, batch->entries[i].name,
+				AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &batch->stx[i]);
+			io_uring_sqe_set_data(sqe, (void*)(uintptr_t)i);
+		}
+
+		int rc = io_uring_submit(&batch->ring);
+
+		if (rc > 0)
+		{
+			batch->inflight = rc;
+			// anything the ring did not take is done synchronously
+			statbatch_submit_sync(batch, dirfd, rc);
+			return batch->count;
+		}
+		syslog(LOG_INFO, "statbatch: io_uring_submit failed (%d), using fstatat", rc);
+	}
+#endif
+
+	statbatch_submit_sync(batch, dirfd, 0);
+	return batch->count;
+}
+
+int statbatch_peek(statbatch *batch, statbatch_entry **pentry)
+{
+	*pentry = NULL;
+	if (batch->head >= batch->submitted)
+		return STATBATCH_EMPTY;
+
+#ifdef HAVE_LIBURING
+	// entries are handed out in directory order, so that their offsets
+	// stay meaningful; wait for the next one if it is still in flight
+	while (!batch->done[batch->head])
+	{
+		int rc = batch->inflight ? statbatch_reap(batch, 1) : -EIO;
+
+		if (rc)
+		{
+			syslog(LOG_ERR, "statbatch: io_uring_wait_cqe failed (%d)", rc);
+			*pentry = &batch->entries[batch->head];
+			return STATBATCH_ERROR;
+		}
+	}
+#endif
+
+	*pentry = &batch->entries[batch->head];
+	return STATBATCH_OK;
+}
+
+void statbatch_pop(statbatch *batch)
+{
+	if (batch->head < batch->submitted)
+		++batch->head;
+
+	// start a new batch once the previous one was consumed
+	if (batch->head == batch->count)
+		statbatch_reset(batch);
+}
@@ -0,0 +1,58 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STATBATCH_H__
+#define __STATBATCH_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#define STATBATCH_OK		0
+#define STATBATCH_EMPTY		-1
+#define STATBATCH_ERROR		-2
+
+#define STATBATCH_DEPTH		64
+#define STATBATCH_MAX_DEPTH	4096
+
+typedef struct statbatch_entry
+{
+	const char *name;
+	int64_t offset;
+	struct stat stat;
+	int ret;
+} statbatch_entry;
+
+typedef struct statbatch statbatch;
+
+// depth is the number of entries stat'ed at once
+// (and the io_uring queue depth); depth <= 1 means synchronous fstatat
+int statbatch_init(statbatch **pbatch, unsigned depth);
+void statbatch_free(statbatch *batch);
+
+// entries are returned by peek in the order they were added; on
+// STATBATCH_ERROR the entry is returned without its attributes
+int statbatch_full(const statbatch *batch);
+int statbatch_add(statbatch *batch, const char *name, int64_t offset);
+int statbatch_submit(statbatch *batch, int dirfd);
+int statbatch_peek(statbatch *batch, statbatch_entry **pentry);
+void statbatch_pop(statbatch *batch);
+void statbatch_reset(statbatch *batch);
+
+#endif // __STATBATCH_H__
@@ -0,0 +1,350 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "profile.h"
+#include "stats.h"
+
+typedef struct stats_counter
+{
+	uint64_t count;
+	uint64_t errors;
+	uint64_t total;
+	uint64_t max;
+	uint64_t hist[STATS_BUCKETS];
+} stats_counter;
+
+// counters of one thread; the slot outlives its thread and is handed
+// over to the next one, so nothing recorded is ever lost
+typedef struct stats_slot
+{
+	struct stats_slot *next;
+	int used;
+	stats_counter counters[STATS_COUNT];
+} stats_slot;
+
+static const char *stats_names[STATS_COUNT] =
+{
+	[STATS_GETATTR] =	"getattr",
+	[STATS_READLINK] =	"readlink",
+	[STATS_MKNOD] =		"mknod",
+	[STATS_MKDIR] =		"mkdir",
+	[STATS_UNLINK] =	"unlink",
+	[STATS_RMDIR] =		"rmdir",
+	[STATS_SYMLINK] =	"symlink",
+	[STATS_RENAME] =	"rename",
+	[STATS_LINK] =		"link",
+	[STATS_CHMOD] =		"chmod",
+	[STATS_CHOWN] =		"chown",
+	[STATS_TRUNCATE] =	"truncate",
+	[STATS_OPEN] =		"open",
+	[STATS_READ] =		"read",
+	[STATS_WRITE] =		"write",
+	[STATS_STATFS] =	"statfs",
+	[STATS_FLUSH] =		"flush",
+	[STATS_RELEASE] =	"release",
+	[STATS_FSYNC] =		"fsync",
+	[STATS_SETXATTR] =	"setxattr",
+	[STATS_GETXATTR] =	"getxattr",
+	[STATS_LISTXATTR] =	"listxattr",
+	[STATS_REMOVEXATTR] =	"removexattr",
+	[STATS_OPENDIR] =	"opendir",
+	[STATS_READDIR] =	"readdir",
+	[STATS_RELEASEDIR] =	"releasedir",
+	[STATS_FSYNCDIR] =	"fsyncdir",
+	[STATS_ACCESS] =	"access",
+	[STATS_CREATE] =	"create",
+	[STATS_FTRUNCATE] =	"ftruncate",
+	[STATS_FGETATTR] =	"fgetattr",
+	[STATS_UTIMENS] =	"utimens",
+	[STATS_DB_OPEN] =	"db_open",
+	[STATS_DB_BIND] =	"db_bind",
+	[STATS_DB_STEP] =	"db_step",
+	[STATS_DB_COMMIT] =	"db_commit",
+	[STATS_DB_PROPAGATE] =	"db_propagate",
+};
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static stats_slot *stats_slots;
+static __thread stats_slot *stats_self;
+
+static uint64_t stats_started;
+static pthread_t stats_thread;
+static int stats_running;
+static volatile sig_atomic_t stats_stopping;
+
+static void stats_release_slot(void *slot)
+{
+	__atomic_store_n(&((stats_slot*)slot)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_create_key(void)
+{
+	pthread_key_create(&stats_key, stats_release_slot);
+}
+
+static stats_slot *stats_get_slot(void)
+{
+	if (stats_self)
+		return stats_self;
+
+	stats_slot *slot;
+
+	pthread_once(&stats_once, stats_create_key);
+	pthread_mutex_lock(&stats_mutex);
+	for (slot = stats_slots; slot; slot = slot->next)
+		if (!__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE))
+			break;
+	if (!slot && (slot = (stats_slot*)calloc(1, sizeof(stats_slot))))
+	{
+		slot->next = stats_slots;
+		stats_slots = slot;
+	}
+	if (slot)
+		slot->used = 1;
+	pthread_mutex_unlock(&stats_mutex);
+
+	if (slot)
+		pthread_setspecific(stats_key, slot);
+	return stats_self = slot;
+}
+
+static int stats_bucket(uint64_t value)
+{
+	int bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+	return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// only the owning thread writes to a slot; relaxed atomics keep the
+// readers from seeing torn values
+#define STATS_ADD(field, value) \
+	__atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+
+static void stats_add(stats_id id, uint64_t value, int error)
+{
+	stats_slot *slot = stats_get_slot();
+
+	if (!slot)
+		return;
+
+	stats_counter *counter = &slot->counters[id];
+
+	STATS_ADD(counter->count, 1);
+	STATS_ADD(counter->errors, !!error);
+	STATS_ADD(counter->total, value);
+	STATS_ADD(counter->hist[stats_bucket(value)], 1);
+	if (value > counter->max)
+		__atomic_store_n(&counter->max, value, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(stats_id id, uint64_t start, int ret)
+{
+	stats_add(id, (stats_now() - start) / 1000, ret < 0);
+}
+
+void stats_value(stats_id id, uint64_t value)
+{
+	stats_add(id, value, 0);
+}
+
+static void stats_collect(stats_counter *counters)
+{
+	memset(counters, 0, sizeof(stats_counter) * STATS_COUNT);
+
+	pthread_mutex_lock(&stats_mutex);
+	for (stats_slot *slot = stats_slots; slot; slot = slot->next)
+	{
+		for (int id = 0; id < STATS_COUNT; ++id)
+		{
+			stats_counter *src = &slot->counters[id], *dst = &counters[id];
+			uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+
+			dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+			dst->errors += __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+			dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+			if (max > dst->max)
+				dst->max = max;
+			for (int b = 0; b < STATS_BUCKETS; ++b)
+				dst->hist[b] += __atomic_load_n(&src->hist[b], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+static const char *stats_unit(int id)
+{
+	return STATS_DB_PROPAGATE == id ? "levels" : "us";
+}
+
+static void stats_format_text(FILE *out, const stats_counter *counters)
+{
+	fprintf(out, "# uptime %llu s\n", (unsigned long long)((stats_now() - stats_started) / 1000000000));
+	fprintf(out, "# name count errors total max unit [<bound:count...]\n");
+	for (int id = 0; id < STATS_COUNT; ++id)
+	{
+		const stats_counter *counter = &counters[id];
+
+		if (!counter->count)
+			continue;
+
+		fprintf(out, "%s %llu %llu %llu %llu %s", stats_names[id],
+			(unsigned long long)counter->count, (unsigned long long)counter->errors,
+			(unsigned long long)counter->total, (unsigned long long)counter->max,
+			stats_unit(id));
+		for (int b = 0; b < STATS_BUCKETS; ++b)
+			if (counter->hist[b])
+				fprintf(out, " <%llu:%llu", 1ULL << b, (unsigned long long)counter->hist[b]);
+		fputc('\n', out);
+	}
+	profile_format_text(out);
+}
+
+static void stats_format_json(FILE *out, const stats_counter *counters)
+{
+	const char *sep = "";
+
+	fprintf(out, "{\"uptime\":%llu,\"counters\":{",
+		(unsigned long long)((stats_now() - stats_started) / 1000000000));
+	for (int id = 0; id < STATS_COUNT; ++id)
+	{
+		const stats_counter *counter = &counters[id];
+		const char *bsep = "";
+
+		fprintf(out, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"total\":%llu,\"max\":%llu,"
+			"\"unit\":\"%s\",\"buckets\":[", sep, stats_names[id],
+			(unsigned long long)counter->count, (unsigned long long)counter->errors,
+			(unsigned long long)counter->total, (unsigned long long)counter->max,
+			stats_unit(id));
+		for (int b = 0; b < STATS_BUCKETS; ++b)
+		{
+			if (!counter->hist[b])
+				continue;
+			fprintf(out, "%s[%llu,%llu]", bsep, 1ULL << b, (unsigned long long)counter->hist[b]);
+			bsep = ",";
+		}
+		fputs("]}", out);
+		sep = ",";
+	}
+	fputc('}', out);
+	profile_format_json(out);
+	fputs("}\n", out);
+}
+
+int stats_format(int json, char **pdata, size_t *psize)
+{
+	stats_counter *counters;
+	FILE *out;
+
+	*pdata = NULL;
+	*psize = 0;
+	if (!(counters = (stats_counter*)malloc(sizeof(stats_counter) * STATS_COUNT)))
+		return -ENOMEM;
+	if (!(out = open_memstream(pdata, psize)))
+	{
+		free(counters);
+		return -ENOMEM;
+	}
+
+	stats_collect(counters);
+	if (json)
+		stats_format_json(out, counters); else
+		stats_format_text(out, counters);
+
+	fclose(out);
+	free(counters);
+	return 0;
+}
+
+static void stats_dump(void)
+{
+	char *data, *line, *next;
+	size_t size;
+
+	if (stats_format(0, &data, &size))
+		return;
+
+	for (line = data; *line; line = next)
+	{
+		if ((next = strchr(line, '\n')))
+			*next++ = 0; else
+			next = line + strlen(line);
+		syslog(LOG_NOTICE, "stats: %s", line);
+	}
+	free(data);
+}
+
+static void *stats_dump_worker(void *arg)
+{
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (!sigwait(&set, &sig) && !stats_stopping)
+		stats_dump();
+	return NULL;
+}
+
+void stats_block_signals(void)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+void stats_init(void)
+{
+	stats_started = stats_now();
+	stats_stopping = 0;
+	if (!(stats_running = !pthread_create(&stats_thread, NULL, stats_dump_worker, NULL)))
+		syslog(LOG_ERR, "stats_init: cannot start dump thread");
+}
+
+void stats_free(void)
+{
+	if (!stats_running)
+		return;
+
+	stats_stopping = 1;
+	pthread_kill(stats_thread, SIGUSR1);
+	pthread_join(stats_thread, NULL);
+	stats_running = 0;
+}
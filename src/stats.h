@@ -0,0 +1,93 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// latency histograms are bucketed by powers of two of microseconds;
+// bucket b counts values below 2^b (bucket 0 counts values below 1)
+#define STATS_BUCKETS		32
+
+typedef enum stats_id
+{
+	// fuse operations
+	STATS_GETATTR,
+	STATS_READLINK,
+	STATS_MKNOD,
+	STATS_MKDIR,
+	STATS_UNLINK,
+	STATS_RMDIR,
+	STATS_SYMLINK,
+	STATS_RENAME,
+	STATS_LINK,
+	STATS_CHMOD,
+	STATS_CHOWN,
+	STATS_TRUNCATE,
+	STATS_OPEN,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_STATFS,
+	STATS_FLUSH,
+	STATS_RELEASE,
+	STATS_FSYNC,
+	STATS_SETXATTR,
+	STATS_GETXATTR,
+	STATS_LISTXATTR,
+	STATS_REMOVEXATTR,
+	STATS_OPENDIR,
+	STATS_READDIR,
+	STATS_RELEASEDIR,
+	STATS_FSYNCDIR,
+	STATS_ACCESS,
+	STATS_CREATE,
+	STATS_FTRUNCATE,
+	STATS_FGETATTR,
+	STATS_UTIMENS,
+
+	// database stages
+	STATS_DB_OPEN,
+	STATS_DB_BIND,
+	STATS_DB_STEP,
+	STATS_DB_COMMIT,
+	STATS_DB_PROPAGATE, // value is the number of ancestors updated
+
+	STATS_COUNT
+} stats_id;
+
+// counters are kept per thread and summed up when read, so
+// recording never takes a lock
+void stats_init(void);
+void stats_free(void);
+
+// SIGUSR1 dumps the counters to syslog; call before any thread is
+// started so that only the dump thread receives the signal
+void stats_block_signals(void);
+
+uint64_t stats_now(void);
+void stats_record(stats_id id, uint64_t start, int ret);
+void stats_value(stats_id id, uint64_t value);
+
+// formats a snapshot of all counters as text or json into a buffer
+// that must be released with free()
+int stats_format(int json, char **pdata, size_t *psize);
+
+#endif // __STATS_H__
@@ -0,0 +1,452 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tagexpr.h"
+#include "log.h"
+
+#define TAGEXPR_PLANS	64
+
+typedef struct tagexpr_plan
+{
+	char *key;
+	char *sql;
+	unsigned long used;
+} tagexpr_plan;
+
+static pthread_mutex_t tagexpr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static tagexpr_plan tagexpr_plans[TAGEXPR_PLANS];
+static unsigned long tagexpr_clock;
+
+tagexpr *tagexpr_new(int op, int negate, const char *name, size_t len, tagexpr *child)
+{
+	tagexpr *expr = (tagexpr*)malloc(sizeof(tagexpr));
+
+	expr->op = op;
+	expr->negate = negate;
+	expr->name = name ? strndup(name, len) : NULL;
+	expr->pattern = expr->name && strpbrk(expr->name, "*?");
+	expr->key = NULL;
+	expr->child = child;
+	expr->next = NULL;
+	return expr;
+}
+
+void tagexpr_free(tagexpr *expr)
+{
+	while (expr)
+	{
+		tagexpr *next = expr->next;
+
+		tagexpr_free(expr->child);
+		free(expr->name);
+		free(expr->key);
+		free(expr);
+		expr = next;
+	}
+}
+
+static tagexpr *tagexpr_parse_list(const char **ppath, char tagchar, char separator);
+
+// -name, (...) or -(...)
+static tagexpr *tagexpr_parse_term(const char **ppath, char tagchar)
+{
+	const char *path = *ppath;
+	const char delimiters[] = { '/', '|', '(', ')', tagchar, 0 };
+	int negate = '-' == *path;
+	tagexpr *term;
+
+	if (negate)
+		++path;
+	if ('(' == *path)
+	{
+		++path;
+		if (!(term = tagexpr_parse_list(&path, tagchar, '|')))
+			return NULL;
+		if (')' != *path++)
+		{
+			tagexpr_free(term);
+			return NULL;
+		}
+		term->negate ^= negate;
+	} else
+	{
+		size_t len = strcspn(path, delimiters);
+
+		if (!len)
+			return NULL;
+		term = tagexpr_new(TAGEXPR_TAG, negate, path, len, NULL);
+		path += len;
+	}
+
+	*ppath = path;
+	return term;
+}
+
+// terms joined by the tag character are a conjunction, conjunctions
+// joined by '|' an alternative
+static tagexpr *tagexpr_parse_list(const char **ppath, char tagchar, char separator)
+{
+	const char *path = *ppath;
+	tagexpr *head = NULL, **ptail = &head;
+
+	do
+	{
+		if (head)
+			++path;
+		*ptail = '|' == separator ?
+			tagexpr_parse_list(&path, tagchar, tagchar) :
+			tagexpr_parse_term(&path, tagchar);
+		if (!*ptail)
+		{
+			tagexpr_free(head);
+			return NULL;
+		}
+		ptail = &(*ptail)->next;
+	} while (separator == *path);
+
+	*ppath = path;
+	if (!head->next)
+		return head;
+	return tagexpr_new('|' == separator ? TAGEXPR_OR : TAGEXPR_AND, 0, NULL, 0, head);
+}
+
+int tagexpr_parse(const char **ppath, char tagchar, tagexpr **pexpr)
+{
+	*pexpr = '(' == **ppath ? tagexpr_parse_term(ppath, tagchar) : NULL;
+	return *pexpr ? 0 : -1;
+}
+
+static int tagexpr_compare(const void *a, const void *b)
+{
+	return strcmp((*(const tagexpr**)a)->key, (*(const tagexpr**)b)->key);
+}
+
+// the key tells tags from groups by the slash a name cannot have:
+// +name/ and -name/, (&...) and (|...)
+static tagexpr *tagexpr_push(tagexpr *expr, int negate)
+{
+	negate ^= expr->negate;
+	expr->negate = 0;
+	free(expr->key);
+
+	if (TAGEXPR_TAG == expr->op)
+	{
+		expr->negate = negate;
+		expr->key = (char*)malloc(strlen(expr->name) + 3);
+		sprintf(expr->key, "%c%s/", negate ? '-' : '+', expr->name);
+		return expr;
+	}
+	if (negate)
+		expr->op = TAGEXPR_AND == expr->op ? TAGEXPR_OR : TAGEXPR_AND;
+
+	// operands of the same kind are taken in
+	tagexpr *operands = NULL, **ptail = &operands;
+	int count = 0;
+
+	for (tagexpr *child = expr->child, *next; child; child = next)
+	{
+		next = child->next;
+		child->next = NULL;
+		child = tagexpr_push(child, negate);
+		if (child->op == expr->op)
+		{
+			*ptail = child->child;
+			child->child = NULL;
+			tagexpr_free(child);
+		} else
+			*ptail = child;
+		for (; *ptail; ptail = &(*ptail)->next)
+			++count;
+	}
+
+	tagexpr **sorted = (tagexpr**)malloc(count * sizeof(tagexpr*));
+	size_t len = 3;
+
+	count = 0;
+	for (tagexpr *child = operands; child; child = child->next)
+		sorted[count++] = child;
+	qsort(sorted, count, sizeof(tagexpr*), tagexpr_compare);
+
+	expr->child = NULL;
+	ptail = &expr->child;
+	for (int i = 0; i < count; ++i)
+	{
+		sorted[i]->next = NULL;
+		if (i && !strcmp(sorted[i - 1]->key, sorted[i]->key))
+		{
+			tagexpr_free(sorted[i]);
+			continue;
+		}
+		len += strlen(sorted[i]->key);
+		*ptail = sorted[i];
+		ptail = &sorted[i]->next;
+	}
+	free(sorted);
+
+	if (!expr->child->next)
+	{
+		tagexpr *only = expr->child;
+
+		expr->child = NULL;
+		tagexpr_free(expr);
+		return only;
+	}
+
+	char *key = expr->key = (char*)malloc(len);
+
+	*key++ = '(';
+	*key++ = TAGEXPR_AND == expr->op ? '&' : '|';
+	for (tagexpr *child = expr->child; child; child = child->next)
+		key = stpcpy(key, child->key);
+	*key++ = ')';
+	*key = 0;
+	return expr;
+}
+
+tagexpr *tagexpr_normalize(tagexpr *expr)
+{
+	return tagexpr_push(expr, 0);
+}
+
+// how the name of a tag is compared
+static const char *tagexpr_operator(const tagexpr *expr)
+{
+	return expr->pattern ? "glob" : "=";
+}
+
+// the number of the parameter a tag is bound to
+static int tagexpr_param(const tagexpr *expr, const char **names, int count, int first)
+{
+	for (int i = 0; i < count; ++i)
+		if (!strcmp(names[i], expr->name))
+			return first + i;
+	return first + count;
+}
+
+// the key of a plan: the expression with the tags numbered by their
+// first appearance
+static void tagexpr_write_shape(FILE *out, const tagexpr *expr,
+	const char **names, int *pcount, int first)
+{
+	if (TAGEXPR_TAG == expr->op)
+	{
+		int param = tagexpr_param(expr, names, *pcount, first);
+
+		if (param == first + *pcount)
+			names[(*pcount)++] = expr->name;
+		fprintf(out, "%c%d%s/", expr->negate ? '-' : '+', param, expr->pattern ? "*" : "");
+		return;
+	}
+
+	fprintf(out, "(%c", TAGEXPR_AND == expr->op ? '&' : '|');
+	for (const tagexpr *child = expr->child; child; child = child->next)
+		tagexpr_write_shape(out, child, names, pcount, first);
+	fputc(')', out);
+}
+
+static void tagexpr_write_set(FILE *out, const tagexpr *expr, const tagexpr_dialect *dialect,
+	const char **names, int count, int first);
+
+// a compound select is an operand of another one only as a subquery
+static void tagexpr_write_operand(FILE *out, const tagexpr *expr, const tagexpr_dialect *dialect,
+	const char **names, int count, int first)
+{
+	if (TAGEXPR_TAG == expr->op && !expr->negate)
+	{
+		tagexpr_write_set(out, expr, dialect, names, count, first);
+		return;
+	}
+	fputs("select * from ( ", out);
+	tagexpr_write_set(out, expr, dialect, names, count, first);
+	fputs(" )", out);
+}
+
+// -tags of a conjunction are taken out of what the rest leaves
+static void tagexpr_write_set(FILE *out, const tagexpr *expr, const tagexpr_dialect *dialect,
+	const char **names, int count, int first)
+{
+	const tagexpr *child;
+	int any = 0;
+
+	switch (expr->op)
+	{
+	case TAGEXPR_TAG:
+		if (!expr->negate)
+		{
+			fprintf(out, dialect->tagged, tagexpr_param(expr, names, count, first), tagexpr_operator(expr));
+			break;
+		}
+		fputs(dialect->all, out);
+		fputs(" except ", out);
+		fprintf(out, dialect->strong, tagexpr_param(expr, names, count, first), tagexpr_operator(expr));
+		break;
+
+	case TAGEXPR_AND:
+		for (child = expr->child; child; child = child->next)
+		{
+			if (TAGEXPR_TAG == child->op && child->negate)
+				continue;
+			if (any++)
+				fputs(" intersect ", out);
+			tagexpr_write_operand(out, child, dialect, names, count, first);
+		}
+		if (!any)
+			fputs(dialect->all, out);
+		for (child = expr->child; child; child = child->next)
+		{
+			if (TAGEXPR_TAG != child->op || !child->negate)
+				continue;
+			fputs(" except ", out);
+			fprintf(out, dialect->strong, tagexpr_param(child, names, count, first), tagexpr_operator(child));
+		}
+		break;
+
+	case TAGEXPR_OR:
+		for (child = expr->child; child; child = child->next)
+		{
+			if (any++)
+				fputs(" union ", out);
+			tagexpr_write_operand(out, child, dialect, names, count, first);
+		}
+		break;
+	}
+}
+
+static void tagexpr_write_test(FILE *out, const tagexpr *expr, const tagexpr_dialect *dialect,
+	const char **names, int count, int first)
+{
+	if (TAGEXPR_TAG == expr->op)
+	{
+		if (expr->negate)
+			fputs("not ", out);
+		fprintf(out, expr->negate ? dialect->strong_test : dialect->tagged_test,
+			tagexpr_param(expr, names, count, first), tagexpr_operator(expr));
+		return;
+	}
+
+	for (const tagexpr *child = expr->child; child; child = child->next)
+	{
+		if (child != expr->child)
+			fputs(TAGEXPR_AND == expr->op ? " and " : " or ", out);
+		if (TAGEXPR_TAG != child->op)
+			fputs("( ", out);
+		tagexpr_write_test(out, child, dialect, names, count, first);
+		if (TAGEXPR_TAG != child->op)
+			fputs(" )", out);
+	}
+}
+
+static int tagexpr_count(const tagexpr *expr)
+{
+	int count = TAGEXPR_TAG == expr->op;
+
+	for (const tagexpr *child = expr->child; child; child = child->next)
+		count += tagexpr_count(child);
+	return count;
+}
+
+static char *tagexpr_lookup(const char *key)
+{
+	char *sql = NULL;
+
+	pthread_mutex_lock(&tagexpr_mutex);
+	for (int i = 0; i < TAGEXPR_PLANS; ++i)
+	{
+		if (tagexpr_plans[i].key && !strcmp(tagexpr_plans[i].key, key))
+		{
+			tagexpr_plans[i].used = ++tagexpr_clock;
+			sql = strdup(tagexpr_plans[i].sql);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tagexpr_mutex);
+	return sql;
+}
+
+// the least recently used plan makes room
+static void tagexpr_store(const char *key, const char *sql)
+{
+	tagexpr_plan *plan = tagexpr_plans;
+
+	pthread_mutex_lock(&tagexpr_mutex);
+	for (int i = 1; i < TAGEXPR_PLANS && plan->key; ++i)
+	{
+		if (!tagexpr_plans[i].key || tagexpr_plans[i].used < plan->used)
+			plan = &tagexpr_plans[i];
+	}
+	free(plan->key);
+	free(plan->sql);
+	plan->key = strdup(key);
+	plan->sql = strdup(sql);
+	plan->used = ++tagexpr_clock;
+	pthread_mutex_unlock(&tagexpr_mutex);
+}
+
+int tagexpr_compile(const tagexpr *expr, const tagexpr_dialect *dialect,
+	int test, int first, char **psql, const char ***pnames, int *pcount)
+{
+	const char **names = (const char**)malloc(tagexpr_count(expr) * sizeof(const char*));
+	char *key = NULL, *sql = NULL;
+	size_t size;
+	int count = 0;
+	FILE *out;
+
+	*psql = NULL;
+	*pnames = NULL;
+	*pcount = 0;
+
+	if (!(out = open_memstream(&key, &size)))
+	{
+		free(names);
+		return -1;
+	}
+	fprintf(out, "%c%c%d", dialect->id, test ? 'T' : 'S', first);
+	tagexpr_write_shape(out, expr, names, &count, first);
+	fclose(out);
+
+	if (!(sql = tagexpr_lookup(key)))
+	{
+		if ((out = open_memstream(&sql, &size)))
+		{
+			if (test)
+				tagexpr_write_test(out, expr, dialect, names, count, first); else
+				tagexpr_write_set(out, expr, dialect, names, count, first);
+			fclose(out);
+			tagexpr_store(key, sql);
+		}
+		log_debug("tagexpr_compile: %s: %s", key, sql);
+	}
+
+	free(key);
+	if (!sql)
+	{
+		free(names);
+		return -1;
+	}
+
+	*psql = sql;
+	*pnames = names;
+	*pcount = count;
+	return 0;
+}
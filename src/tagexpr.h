@@ -0,0 +1,77 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TAGEXPR_H__
+#define __TAGEXPR_H__
+
+#include <stddef.h>
+
+// a tag expression: %tag1%tag2 is a conjunction, %(tag1|tag2) an
+// alternative, and -tag or -(...) its negation; a tag with * or ? in
+// its name is a glob pattern that stands for any tag it matches
+#define TAGEXPR_TAG	0
+#define TAGEXPR_AND	1
+#define TAGEXPR_OR	2
+
+typedef struct tagexpr
+{
+	int op;
+	int negate;
+	int pattern;
+	char *name;
+
+	// normalized form, set by tagexpr_normalize
+	char *key;
+
+	struct tagexpr *child;
+	struct tagexpr *next;
+} tagexpr;
+
+// how an expression is answered on one kind of database: as a set of
+// file ids (all, tagged, strong) or as a test of the file f (the _test
+// ones); tagged and strong take the number of the parameter holding the
+// tag name and the operator it is compared with, = or glob, and strong
+// is what rules a file out for -tag
+typedef struct tagexpr_dialect
+{
+	char id;
+	const char *all;
+	const char *tagged;
+	const char *strong;
+	const char *tagged_test;
+	const char *strong_test;
+} tagexpr_dialect;
+
+tagexpr *tagexpr_new(int op, int negate, const char *name, size_t len, tagexpr *child);
+void tagexpr_free(tagexpr *expr);
+
+// parses the group at *ppath, which starts with '(', and moves past it
+int tagexpr_parse(const char **ppath, char tagchar, tagexpr **pexpr);
+
+// negations are pushed down to the tags, nested conjunctions and
+// alternatives are flattened, and operands are sorted and made unique
+tagexpr *tagexpr_normalize(tagexpr *expr);
+
+// the sql of a normalized expression, a compound select of file ids or
+// a test; *pnames are the tag names to bind, from parameter first on.
+// Plans are cached by the shape of the expression
+int tagexpr_compile(const tagexpr *expr, const tagexpr_dialect *dialect,
+	int test, int first, char **psql, const char ***pnames, int *pcount);
+
+#endif // __TAGEXPR_H__
@@ -0,0 +1,401 @@
+/*
+ Copyright 2011 Roman Vorobets
+
+ This file is part of BeholdFS.
+
+ BeholdFS is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ BeholdFS is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with BeholdFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "sqlitefs.h"
+
+#include "fs.h"
+#include "tree.h"
+
+// plans chosen by tree_best_index, as bits of idxNum; the arguments of
+// xFilter come in the same order
+#define TREE_PLAN_ROOT		1	// root = ?
+#define TREE_PLAN_PATH		2	// path = ?, one directory
+
+#define TREE_ROWS_PER_DIR	1000
+#define TREE_DIRS		10000
+
+// how long to wait for a directory the daemon is writing to
+#define TREE_BUSY_TIMEOUT	1000
+
+enum
+{
+	TREE_COLUMN_PATH,
+	TREE_COLUMN_FILE,
+	TREE_COLUMN_TYPE,
+	TREE_COLUMN_TAG,
+	TREE_COLUMN_STRONG,
+	TREE_COLUMN_ROOT,
+};
+
+typedef struct tree_cursor
+{
+	sqlite3_vtab_cursor base;
+
+	// the walk lists metadata through the sqlitefs module; each one
+	// found is attached to the other connection in turn
+	sqlite3 *walk;
+	sqlite3 *meta;
+	sqlite3_stmt *dirs;
+	sqlite3_stmt *rows;
+
+	char *root;
+	char *dir;
+	int single;
+	sqlite3_int64 rowid;
+} tree_cursor;
+
+static const char *tree_ddl =
+	"create table beholdfs_tree"
+	"("
+		"path text,"
+		"file text,"
+		"type integer,"
+		"tag text,"
+		"strong integer,"
+		"root hidden"
+	")";
+
+static const char *tree_dirs =
+	"select dir from sqlitefs "
+	"where path = ?1 and depth >= 0 and name = '.beholdfs' and not type";
+
+static const char *tree_rows =
+	"select f.name, f.type, t.name, "
+		"case when t.id is null then null "
+		"else not f.type or dt.id_tag is not null end "
+	"from tree.files f "
+	"left join tree.files_tags ft on ft.id_file = f.id "
+	"left join tree.tags t on t.id = ft.id_tag "
+	"left join tree.dirs_tags dt on dt.id_file = f.id and dt.id_tag = ft.id_tag";
+
+int tree_connect(sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVTab, char **pzErr)
+{
+	sqlite3_vtab *pvtab = (sqlite3_vtab*)sqlite3_malloc(sizeof(sqlite3_vtab));
+	if (!pvtab)
+		return SQLITE_NOMEM;
+	memset(pvtab, 0, sizeof(sqlite3_vtab));
+
+	*ppVTab = pvtab;
+	return sqlite3_declare_vtab(db, tree_ddl);
+}
+
+int tree_disconnect(sqlite3_vtab *pVTab)
+{
+	sqlite3_free(pVTab);
+	return SQLITE_OK;
+}
+
+int tree_open(sqlite3_vtab *pVTab, sqlite3_vtab_cursor **ppCursor)
+{
+	tree_cursor *pcur = (tree_cursor*)sqlite3_malloc(sizeof(tree_cursor));
+	if (!pcur)
+		return SQLITE_NOMEM;
+
+	memset(pcur, 0, sizeof(tree_cursor));
+
+	*ppCursor = &pcur->base;
+	return SQLITE_OK;
+}
+
+// let go of the directory being read
+static void tree_detach(tree_cursor *pcur)
+{
+	if (!pcur->rows)
+		return;
+	sqlite3_finalize(pcur->rows);
+	pcur->rows = NULL;
+	sqlite3_exec(pcur->meta, "detach database tree", NULL, NULL, NULL);
+}
+
+static void tree_reset(tree_cursor *pcur)
+{
+	tree_detach(pcur);
+	if (pcur->dirs)
+		sqlite3_reset(pcur->dirs);
+	sqlite3_free(pcur->root);
+	sqlite3_free(pcur->dir);
+	pcur->root = NULL;
+	pcur->dir = NULL;
+	pcur->single = 0;
+	pcur->rowid = 0;
+}
+
+int tree_close(sqlite3_vtab_cursor *pCursor)
+{
+	tree_cursor *pcur = (tree_cursor*)pCursor;
+
+	tree_reset(pcur);
+	sqlite3_finalize(pcur->dirs);
+	sqlite3_close(pcur->walk);
+	sqlite3_close(pcur->meta);
+	sqlite3_free(pcur);
+	return SQLITE_OK;
+}
+
+int tree_best_index(sqlite3_vtab *pVTab, sqlite3_index_info *pIndex)
+{
+	int root = -1, path = -1;
+
+	for (int i = 0; i < pIndex->nConstraint; ++i)
+	{
+		const struct sqlite3_index_constraint *constraint = &pIndex->aConstraint[i];
+
+		if (!constraint->usable || SQLITE_INDEX_CONSTRAINT_EQ != constraint->op)
+			continue;
+		switch (constraint->iColumn)
+		{
+		case TREE_COLUMN_ROOT:
+			root = i;
+			break;
+		case TREE_COLUMN_PATH:
+			path = i;
+			break;
+		}
+	}
+
+	int argc = 0;
+	double rows = TREE_ROWS_PER_DIR * TREE_DIRS;
+
+	pIndex->idxNum = 0;
+	if (-1 != root)
+	{
+		pIndex->idxNum |= TREE_PLAN_ROOT;
+		pIndex->aConstraintUsage[root].argvIndex = ++argc;
+		pIndex->aConstraintUsage[root].omit = 1;
+	}
+	if (-1 != path)
+	{
+		pIndex->idxNum |= TREE_PLAN_PATH;
+		pIndex->aConstraintUsage[path].argvIndex = ++argc;
+		pIndex->aConstraintUsage[path].omit = 1;
+		rows = TREE_ROWS_PER_DIR;
+	}
+
+	// the walk is the expensive part, whatever the root
+	pIndex->estimatedCost = rows;
+	return SQLITE_OK;
+}
+
+// both connections stay open for as long as the cursor
+static int tree_prepare(tree_cursor *pcur)
+{
+	int rc;
+
+	if (pcur->dirs)
+		return SQLITE_OK;
+
+	// relative roots are taken from the current directory
+	(rc = sqlite3_open_v2(":memory:", &pcur->walk, SQLITE_OPEN_READWRITE, NULL)) ||
+	(rc = fs_create_module(pcur->walk, ".")) ||
+	(rc = sqlite3_prepare_v2(pcur->walk, tree_dirs, -1, &pcur->dirs, NULL)) ||
+	(rc = sqlite3_open_v2(":memory:", &pcur->meta, SQLITE_OPEN_READONLY, NULL)) ||
+	(rc = sqlite3_busy_timeout(pcur->meta, TREE_BUSY_TIMEOUT));
+
+	return rc;
+}
+
+// metadata that cannot be read has nothing to list, like a directory
+// that cannot be listed
+static int tree_attach(tree_cursor *pcur)
+{
+	char *path = *pcur->dir ?
+		sqlite3_mprintf("%s/%s/.beholdfs", pcur->root, pcur->dir) :
+		sqlite3_mprintf("%s/.beholdfs", pcur->root);
+	char *sql = path ? sqlite3_mprintf("attach database %Q as tree", path) : NULL;
+	int rc;
+
+	if (!sql)
+	{
+		sqlite3_free(path);
+		return SQLITE_NOMEM;
+	}
+
+	rc = sqlite3_exec(pcur->meta, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+	sqlite3_free(path);
+	if (SQLITE_OK != rc)
+		return SQLITE_NOMEM == rc ? rc : SQLITE_OK;
+
+	rc = sqlite3_prepare_v2(pcur->meta, tree_rows, -1, &pcur->rows, NULL);
+	if (SQLITE_OK != rc)
+	{
+		sqlite3_exec(pcur->meta, "detach database tree", NULL, NULL, NULL);
+		return SQLITE_NOMEM == rc ? rc : SQLITE_OK;
+	}
+	return SQLITE_OK;
+}
+
+// step to the next row, attaching the next directory when the one
+// being read is done
+static int read_tree(tree_cursor *pcur)
+{
+	int rc;
+
+	for (;;)
+	{
+		if (pcur->rows)
+		{
+			rc = sqlite3_step(pcur->rows);
+			if (SQLITE_ROW == rc)
+			{
+				++pcur->rowid;
+				return SQLITE_OK;
+			}
+			tree_detach(pcur);
+			if (SQLITE_NOMEM == rc)
+				return rc;
+		}
+
+		if (pcur->single)
+		{
+			sqlite3_free(pcur->dir);
+			pcur->dir = NULL;
+			return SQLITE_OK;
+		}
+
+		rc = sqlite3_step(pcur->dirs);
+		if (SQLITE_ROW != rc)
+		{
+			sqlite3_free(pcur->dir);
+			pcur->dir = NULL;
+			return SQLITE_DONE == rc ? SQLITE_OK : rc;
+		}
+
+		sqlite3_free(pcur->dir);
+		if (!(pcur->dir = sqlite3_mprintf("%s", sqlite3_column_text(pcur->dirs, 0))))
+			return SQLITE_NOMEM;
+		if ((rc = tree_attach(pcur)))
+			return rc;
+	}
+}
+
+int tree_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv)
+{
+	tree_cursor *pcur = (tree_cursor*)pCursor;
+	int rc, arg = 0;
+
+	tree_reset(pcur);
+	if ((rc = tree_prepare(pcur)))
+	{
+		sqlite3_free(pcur->base.pVtab->zErrMsg);
+		pcur->base.pVtab->zErrMsg = sqlite3_mprintf("%s",
+			sqlite3_errmsg(pcur->dirs ? pcur->meta : pcur->walk));
+		return rc;
+	}
+
+	const char *root = idxNum & TREE_PLAN_ROOT ?
+		(const char*)sqlite3_value_text(argv[arg++]) : ".";
+
+	if (!root)
+		return SQLITE_OK;
+	if (!(pcur->root = sqlite3_mprintf("%s", root)))
+		return SQLITE_NOMEM;
+
+	if (idxNum & TREE_PLAN_PATH)
+	{
+		const char *path = (const char*)sqlite3_value_text(argv[arg++]);
+
+		if (!path)
+			return SQLITE_OK;
+		if (!(pcur->dir = sqlite3_mprintf("%s", path)))
+			return SQLITE_NOMEM;
+		pcur->single = 1;
+		if ((rc = tree_attach(pcur)))
+			return rc;
+		return read_tree(pcur);
+	}
+
+	if ((rc = sqlite3_bind_text(pcur->dirs, 1, pcur->root, -1, SQLITE_STATIC)))
+		return rc;
+	return read_tree(pcur);
+}
+
+int tree_next(sqlite3_vtab_cursor *pCursor)
+{
+	return read_tree((tree_cursor*)pCursor);
+}
+
+int tree_eof(sqlite3_vtab_cursor *pCursor)
+{
+	tree_cursor *pcur = (tree_cursor*)pCursor;
+
+	return !pcur->dir;
+}
+
+int tree_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *pContext, int iCol)
+{
+	tree_cursor *pcur = (tree_cursor*)pCursor;
+
+	switch (iCol)
+	{
+	case TREE_COLUMN_PATH:
+		sqlite3_result_text(pContext, pcur->dir, -1, SQLITE_TRANSIENT);
+		break;
+	case TREE_COLUMN_FILE:
+	case TREE_COLUMN_TYPE:
+	case TREE_COLUMN_TAG:
+	case TREE_COLUMN_STRONG:
+		sqlite3_result_value(pContext, sqlite3_column_value(pcur->rows, iCol - TREE_COLUMN_FILE));
+		break;
+	case TREE_COLUMN_ROOT:
+		sqlite3_result_text(pContext, pcur->root, -1, SQLITE_TRANSIENT);
+		break;
+	default:
+		return SQLITE_INTERNAL;
+	}
+	return SQLITE_OK;
+}
+
+int tree_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid)
+{
+	tree_cursor *pcur = (tree_cursor*)pCursor;
+
+	*pRowid = pcur->rowid;
+	return SQLITE_OK;
+}
+
+static sqlite3_module tree_module =
+{
+	.iVersion	= 1,
+	.xCreate	= tree_connect,
+	.xConnect	= tree_connect,
+	.xBestIndex	= tree_best_index,
+	.xDisconnect	= tree_disconnect,
+	.xDestroy	= tree_disconnect,
+	.xOpen		= tree_open,
+	.xClose		= tree_close,
+	.xFilter	= tree_filter,
+	.xNext		= tree_next,
+	.xEof		= tree_eof,
+	.xColumn	= tree_column,
+	.xRowid		= tree_rowid,
+	.xUpdate	= NULL,
+	.xBegin		= NULL,
+	.xSync		= NULL,
+	.xCommit	= NULL,
+	.xRollback	= NULL,
+	.xFindFunction	= NULL,
+	.xRename	= NULL,
+};
+
+int tree_create_module(sqlite3 *db)
+{
+	return sqlite3_create_module_v2(db, "beholdfs_tree", &tree_module, NULL, NULL);
+}
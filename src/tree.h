@@ -0,0 +1,9 @@
+// the beholdfs_tree module walks everything below the hidden column
+// root (relative to the current directory) and lists what the metadata
+// of each directory holds: path (the directory, relative to root),
+// file, type, and one row per tag with strong set when the tag is the
+// file's own or held by everything in a directory; untagged files come
+// with a null tag
+//
+// path = ? reads the metadata of that one directory and walks nothing
+int tree_create_module(sqlite3 *db);
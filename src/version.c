@@ -26,9 +26,10 @@
 #include "version.h"
 #include "common.h"
 #include "beholddb.h"
+#include "schema.h"
 
 #define BEHOLDDB_VERSION_MAJOR	1
-#define BEHOLDDB_VERSION_MINOR	0
+#define BEHOLDDB_VERSION_MINOR	1
 
 static int beholddb_decode_version(const char *version, int *pmajor, int *pminor)
 {
@@ -43,22 +44,65 @@ static int beholddb_decode_version(const char *version, int *pmajor, int *pminor
 	return BEHOLDDB_ERROR;
 }
 
-int version_init(sqlite3 *db)
+// metadata written before versioning have tables but no version
+static int beholddb_has_tables(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int found = 0;
+
+	if (!sqlite3_prepare_v2(db,
+		"select 1 from sqlite_master where type = 'table' and name = 'tags'",
+		-1, &stmt, NULL))
+	{
+		found = SQLITE_ROW == sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+	}
+	return found;
+}
+
+static int beholddb_upgrade(sqlite3 *db, int major, int minor)
+{
+	int rc = BEHOLDDB_OK;
+
+	syslog(LOG_INFO, "Upgrading metadata from %d.%d to %d.%d",
+		major, minor, BEHOLDDB_VERSION_MAJOR, BEHOLDDB_VERSION_MINOR);
+
+	(rc = beholddb_exec(db, "begin transaction;")) ||
+	minor < 1 && (rc = beholddb_exec(db, BEHOLDDB_DDL_UPGRADE_1_1)) ||
+	(rc = beholddb_set_fparam(db, "version", "%d.%d",
+		BEHOLDDB_VERSION_MAJOR, BEHOLDDB_VERSION_MINOR)) ||
+	(rc = beholddb_exec(db, "commit;"));
+
+	if (rc)
+	{
+		syslog(LOG_ERR, "Cannot upgrade metadata: %d", rc);
+		beholddb_exec(db, "rollback;");
+	}
+	return rc;
+}
+
+int beholddb_init_version(sqlite3 *db)
 {
 	int rc;
 
 	const char *version;
 	int major, minor;
 
+	(rc = schema_version_init(db)) ||
 	(rc = beholddb_get_param(db, "version", &version)) ||
 	(rc = beholddb_decode_version(version, &major, &minor));
-	free(version);
+	free((void*)version);
 
 	if (rc)
 	{
 		// error reading configuration
 		return BEHOLDDB_ERROR;
 	}
+	if (-1 == major && beholddb_has_tables(db))
+	{
+		major = 1;
+		minor = 0;
+	}
 	if (BEHOLDDB_VERSION_MAJOR < major)
 	{
 		// metadata format is too new
@@ -70,27 +114,27 @@ int version_init(sqlite3 *db)
 	{
 		// notice: database version is newer
 		syslog(LOG_NOTICE, "Metadata format is newer than the current");
-	} else
-	{
-		syslog(LOG_INFO, "Set version to %d.%d",
-			BEHOLDDB_VERSION_MAJOR, BEHOLDDB_VERSION_MINOR);
-		beholddb_set_fparam(db, "version", "%d.%d",
-			BEHOLDDB_VERSION_MAJOR, BEHOLDDB_VERSION_MINOR);
+		return BEHOLDDB_OK;
 	}
 
-
 	switch (major)
 	{
-	case 0:
-		;
+	case -1:
+		// new metadata, tables are created by the caller
+		syslog(LOG_INFO, "Set version to %d.%d",
+			BEHOLDDB_VERSION_MAJOR, BEHOLDDB_VERSION_MINOR);
+		rc = beholddb_set_fparam(db, "version", "%d.%d",
+			BEHOLDDB_VERSION_MAJOR, BEHOLDDB_VERSION_MINOR);
+		break;
 	case BEHOLDDB_VERSION_MAJOR:
-		// database version currently supported, nothing to do
+		if (minor < BEHOLDDB_VERSION_MINOR)
+			rc = beholddb_upgrade(db, major, minor);
 		break;
-	//case 1:
+	default:
 		// some old version, probably convert to the new format
+		syslog(LOG_ERR, "Metadata format %d.%d is not supported", major, minor);
+		rc = BEHOLDDB_ERROR;
 	}
 
-	return BEHOLDDB_OK;
+	return rc;
 }
-
-